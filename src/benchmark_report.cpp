@@ -0,0 +1,149 @@
+#include "pch.h"
+#include "benchmark_report.h"
+#include "util.h"
+
+BenchmarkReport::BenchmarkReport() = default;
+
+BenchmarkReport::~BenchmarkReport() = default;
+
+void BenchmarkReport::SetGPUTime(u32 frame_index, float gpu_ms)
+{
+  if (frame_index < m_frames.size())
+    m_frames[frame_index].gpu_ms = gpu_ms;
+}
+
+BenchmarkReport::Summary BenchmarkReport::Summarize(float FrameRecord::*column) const
+{
+  std::vector<float> values;
+  values.reserve(m_frames.size());
+  for (const FrameRecord& frame : m_frames)
+  {
+    if (frame.*column >= 0.0f)
+      values.push_back(frame.*column);
+  }
+
+  Summary summary = {};
+  summary.count = u32(values.size());
+  if (values.empty())
+    return summary;
+
+  std::sort(values.begin(), values.end());
+  double total = 0.0;
+  for (float value : values)
+    total += value;
+
+  auto Percentile = [&values](u32 percent) {
+    const size_t rank = (values.size() * percent + 99) / 100;
+    return values[std::max<size_t>(rank, 1) - 1];
+  };
+
+  summary.avg = float(total / double(values.size()));
+  summary.p50 = Percentile(50);
+  summary.p95 = Percentile(95);
+  summary.p99 = Percentile(99);
+  summary.max = values.back();
+  return summary;
+}
+
+void BenchmarkReport::PrintSummary() const
+{
+  static constexpr std::pair<const char*, float FrameRecord::*> columns[] = {
+    {"frame", &FrameRecord::frame_ms}, {"cpu", &FrameRecord::cpu_ms}, {"gpu", &FrameRecord::gpu_ms}};
+
+  std::printf("%u frames      avg      p50      p95      p99      max (ms)\n", u32(m_frames.size()));
+  for (const auto& [name, column] : columns)
+  {
+    const Summary summary = Summarize(column);
+    if (summary.count == 0)
+      std::printf("  %-6s   (no samples)\n", name);
+    else
+      std::printf("  %-6s %8.3f %8.3f %8.3f %8.3f %8.3f\n", name, summary.avg, summary.p50, summary.p95, summary.p99,
+                  summary.max);
+  }
+}
+
+bool BenchmarkReport::Write(const char* filename) const
+{
+  auto fp = Util::FOpenUniquePtr(filename, "w");
+  if (!fp)
+  {
+    std::fprintf(stderr, "Failed to open '%s' for writing\n", filename);
+    return false;
+  }
+
+  const char* extension = std::strrchr(filename, '.');
+  std::string lower_extension = extension ? extension : "";
+  std::transform(lower_extension.begin(), lower_extension.end(), lower_extension.begin(),
+                 [](char ch) { return char(std::tolower(static_cast<unsigned char>(ch))); });
+  if (lower_extension == ".csv")
+    WriteCSV(fp.get());
+  else
+    WriteJSON(fp.get());
+
+  if (std::ferror(fp.get()))
+  {
+    std::fprintf(stderr, "Failed to write '%s'\n", filename);
+    return false;
+  }
+
+  return true;
+}
+
+void BenchmarkReport::WriteJSON(std::FILE* fp) const
+{
+  auto WriteSummary = [this, fp](const char* name, float FrameRecord::*column, bool last) {
+    const Summary summary = Summarize(column);
+    if (summary.count == 0)
+    {
+      std::fprintf(fp, "    \"%s\": null%s\n", name, last ? "" : ",");
+      return;
+    }
+
+    std::fprintf(fp, "    \"%s\": {\"count\": %u, \"avg\": %.4f, \"p50\": %.4f, ", name, summary.count, summary.avg,
+                 summary.p50);
+    std::fprintf(fp, "\"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f}%s\n", summary.p95, summary.p99, summary.max,
+                 last ? "" : ",");
+  };
+
+  std::fprintf(fp, "{\n  \"summary\": {\n");
+  WriteSummary("frame_ms", &FrameRecord::frame_ms, false);
+  WriteSummary("cpu_ms", &FrameRecord::cpu_ms, false);
+  WriteSummary("gpu_ms", &FrameRecord::gpu_ms, true);
+  std::fprintf(fp, "  },\n  \"frames\": [\n");
+  for (size_t i = 0; i < m_frames.size(); i++)
+  {
+    const FrameRecord& frame = m_frames[i];
+    std::fprintf(fp, "    {\"time\": %.4f, \"frame_ms\": %.4f, \"cpu_ms\": %.4f, ", frame.time, frame.frame_ms,
+                 frame.cpu_ms);
+    if (frame.gpu_ms >= 0.0f)
+      std::fprintf(fp, "\"gpu_ms\": %.4f, ", frame.gpu_ms);
+    else
+      std::fprintf(fp, "\"gpu_ms\": null, ");
+    std::fprintf(fp, "\"draws\": %u, \"visible_leaves\": %u, \"triangles\": %u}%s\n", frame.draws,
+                 frame.visible_leaves, frame.triangles, (i + 1) < m_frames.size() ? "," : "");
+  }
+  std::fprintf(fp, "  ]\n}\n");
+}
+
+void BenchmarkReport::WriteCSV(std::FILE* fp) const
+{
+  // Summary rows go first, commented out, so the file still loads as a single table.
+  static constexpr std::pair<const char*, float FrameRecord::*> columns[] = {
+    {"frame_ms", &FrameRecord::frame_ms}, {"cpu_ms", &FrameRecord::cpu_ms}, {"gpu_ms", &FrameRecord::gpu_ms}};
+  for (const auto& [name, column] : columns)
+  {
+    const Summary summary = Summarize(column);
+    std::fprintf(fp, "# %s: count=%u avg=%.4f p50=%.4f p95=%.4f p99=%.4f max=%.4f\n", name, summary.count,
+                 summary.avg, summary.p50, summary.p95, summary.p99, summary.max);
+  }
+
+  std::fprintf(fp, "frame,time,frame_ms,cpu_ms,gpu_ms,draws,visible_leaves,triangles\n");
+  for (size_t i = 0; i < m_frames.size(); i++)
+  {
+    const FrameRecord& frame = m_frames[i];
+    std::fprintf(fp, "%u,%.4f,%.4f,%.4f,", u32(i), frame.time, frame.frame_ms, frame.cpu_ms);
+    if (frame.gpu_ms >= 0.0f)
+      std::fprintf(fp, "%.4f", frame.gpu_ms);
+    std::fprintf(fp, ",%u,%u,%u\n", frame.draws, frame.visible_leaves, frame.triangles);
+  }
+}
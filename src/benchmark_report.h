@@ -0,0 +1,58 @@
+#pragma once
+#include "common.h"
+#include <vector>
+
+// Per-frame measurements from a benchmark run, with summary statistics, written as JSON or CSV.
+class BenchmarkReport
+{
+public:
+  struct FrameRecord
+  {
+    // Position along the camera path, in seconds.
+    float time;
+
+    // Wall time of the whole frame, and CPU time spent culling, sorting and submitting.
+    float frame_ms;
+    float cpu_ms;
+
+    // Negative until the GPU timer result arrives, or if there is no GPU timer.
+    float gpu_ms;
+
+    u32 draws;
+    u32 visible_leaves;
+    u32 triangles;
+  };
+
+  // Summary of one column. Percentiles use the nearest rank.
+  struct Summary
+  {
+    u32 count;
+    float avg;
+    float p50;
+    float p95;
+    float p99;
+    float max;
+  };
+
+  BenchmarkReport();
+  ~BenchmarkReport();
+
+  const std::vector<FrameRecord>& GetFrames() const { return m_frames; }
+
+  void AddFrame(const FrameRecord& frame) { m_frames.push_back(frame); }
+  void SetGPUTime(u32 frame_index, float gpu_ms);
+
+  // Values below zero are skipped.
+  Summary Summarize(float FrameRecord::*column) const;
+
+  void PrintSummary() const;
+
+  // CSV if the filename ends in .csv, otherwise JSON.
+  bool Write(const char* filename) const;
+
+private:
+  void WriteJSON(std::FILE* fp) const;
+  void WriteCSV(std::FILE* fp) const;
+
+  std::vector<FrameRecord> m_frames;
+};
@@ -1,85 +1,13 @@
 #include "pch.h"
 #include "bsp.h"
+#include "bsp_file.h"
 #include "common.h"
+#include <cctype>
 #include <cstdio>
-
-#pragma pack(push, 1)
-struct BSP_LUMP
-{
-  int offset;
-  int length;
-};
-
-struct BSP_HEADER
-{
-  char magic[4];
-  int version;
-  BSP_LUMP lumps[17];
-};
-
-struct BSP_TEXTURE_LUMP
-{
-  char name[64];
-  int surface_flags;
-  int contents_flags;
-};
-
-struct BSP_PLANE_LUMP
-{
-  float normal[3];
-  float distance;
-};
-
-struct BSP_NODE_LUMP
-{
-  int plane;
-  int children[2];
-  int bbox_min[3];
-  int bbox_max[3];
-};
-
-struct BSP_LEAF_LUMP
-{
-  int cluster;
-  int area;
-  int bbox_min[3];
-  int bbox_max[3];
-  int first_leaf_face;
-  int num_leaf_faces;
-  int first_leaf_brush;
-  int num_leaf_brushes;
-};
-
-struct BSP_VERTEX_LUMP
-{
-  float position[3];
-  float texcoords[2][2];
-  float normal[3];
-  unsigned char color[4];
-};
-
-struct BSP_FACE_LUMP
-{
-  int texture_index;
-  int effect_index;
-  int type;
-  int first_vertex;
-  int num_vertices;
-  int first_mesh_vertex;
-  int num_mesh_vertices;
-  int lightmap_index;
-  int lightmap_corner[2];
-  int lightmap_size[2];
-  float lightmap_origin[3];
-  float lightmap_vecs[2][3];
-  float normal[3];
-  int patch_size[2];
-};
-
-struct BSP_LIGHTMAP_LUMP
-{
-  unsigned char data[128][128][3];
-};
+#include <limits>
+#ifdef HAS_SSE2
+#include <emmintrin.h>
+#endif
 
 template<typename T, std::size_t N>
 std::string GetArrayString(T const (&A)[N])
@@ -100,10 +28,9 @@ BSP::BSP() {}
 
 BSP::~BSP() {}
 
-std::unique_ptr<BSP> BSP::Load(std::FILE* fp)
+bool BSP::ReadHeader(std::FILE* fp, IntermediateData* idata)
 {
-  IntermediateData idata;
-  idata.fp = fp;
+  idata->fp = fp;
 
   unsigned file_size;
   BSP_HEADER header;
@@ -111,7 +38,7 @@ std::unique_ptr<BSP> BSP::Load(std::FILE* fp)
       std::fread(&header, sizeof(header), 1, fp) != 1)
   {
     std::fprintf(stdout, "Failed to read BSP header\n");
-    return nullptr;
+    return false;
   }
 
   // check all lump offsets
@@ -121,36 +48,135 @@ std::unique_ptr<BSP> BSP::Load(std::FILE* fp)
         unsigned(header.lumps[i].offset + header.lumps[i].length) > file_size)
     {
       std::fprintf(stdout, "Lump %d is out-of-range\n", i);
-      return nullptr;
+      return false;
     }
 
-    idata.lumps[i].offset = header.lumps[i].offset;
-    idata.lumps[i].length = header.lumps[i].length;
+    idata->lumps[i].offset = header.lumps[i].offset;
+    idata->lumps[i].length = header.lumps[i].length;
   }
 
-  std::unique_ptr<BSP> bsp(new BSP());
+  return true;
+}
 
-  if (!bsp->LoadIntermediateData(&idata))
+#define LUMP_BIT(lump) (1u << (lump))
+
+const BSP::LoadStep BSP::s_load_steps[NUM_LOAD_STEPS] = {
+  {"LoadIntermediateData", LUMP_BIT(LUMP_PLANES) | LUMP_BIT(LUMP_LEAF_FACES) | LUMP_BIT(LUMP_LEAF_BRUSHES),
+   [](BSP* bsp, IntermediateData* idata) { bsp->LoadIntermediateData(idata); }},
+  {"LoadTextures", LUMP_BIT(LUMP_TEXTURES), [](BSP* bsp, IntermediateData* idata) { bsp->LoadTextures(idata); }},
+  {"LoadVertices", LUMP_BIT(LUMP_VERTICES), [](BSP* bsp, IntermediateData* idata) { bsp->LoadVertices(idata); }},
+  {"LoadIndices", LUMP_BIT(LUMP_MESH_VERTICES), [](BSP* bsp, IntermediateData* idata) { bsp->LoadIndices(idata); }},
+  {"LoadLightMaps", LUMP_BIT(LUMP_LIGHTMAPS), [](BSP* bsp, IntermediateData* idata) { bsp->LoadLightMaps(idata); }},
+  {"LoadFaces", LUMP_BIT(LUMP_FACES), [](BSP* bsp, IntermediateData* idata) { bsp->LoadFaces(idata); }},
+  {"LoadBrushes", LUMP_BIT(LUMP_BRUSHES) | LUMP_BIT(LUMP_BRUSH_SIDES),
+   [](BSP* bsp, IntermediateData* idata) { bsp->LoadBrushes(idata); }},
+  {"LoadLeaves", LUMP_BIT(LUMP_LEAVES), [](BSP* bsp, IntermediateData* idata) { bsp->LoadLeaves(idata); }},
+  {"LoadNodes", LUMP_BIT(LUMP_NODES), [](BSP* bsp, IntermediateData* idata) { bsp->LoadNodes(idata); }},
+  {"LoadVisData", LUMP_BIT(LUMP_VISDATA), [](BSP* bsp, IntermediateData* idata) { bsp->LoadVisData(idata); }},
+  {"LoadModels", LUMP_BIT(LUMP_MODELS), [](BSP* bsp, IntermediateData* idata) { bsp->LoadModels(idata); }},
+  {"LoadEntities", LUMP_BIT(LUMP_ENTITIES), [](BSP* bsp, IntermediateData* idata) { bsp->LoadEntities(idata); }},
+  {"TesselatePatches", 0, [](BSP* bsp, IntermediateData*) { bsp->TesselatePatches(); }},
+  {"CalculateFaceBounds", 0, [](BSP* bsp, IntermediateData*) { bsp->CalculateFaceBounds(); }},
+  {"CreateQueryNodes", 0, [](BSP* bsp, IntermediateData*) { bsp->CreateQueryNodes(); }},
+  {"FindAreaPortals", 0, [](BSP* bsp, IntermediateData*) { bsp->FindAreaPortals(); }},
+};
+
+#undef LUMP_BIT
+
+std::unique_ptr<BSP> BSP::Load(std::FILE* fp, std::vector<LoadPhase>* phases /* = nullptr */)
+{
+  using ClockSource = std::chrono::steady_clock;
+  ClockSource::time_point phase_start = ClockSource::now();
+  auto EndPhase = [phases, &phase_start](const char* name) {
+    if (!phases)
+      return;
+
+    const ClockSource::time_point now = ClockSource::now();
+    phases->push_back({name, std::chrono::duration<float, std::milli>(now - phase_start).count()});
+    phase_start = now;
+  };
+
+  IntermediateData idata;
+  if (!ReadHeader(fp, &idata))
     return nullptr;
 
-  bsp->LoadTextures(&idata);
-  bsp->LoadVertices(&idata);
-  bsp->LoadIndices(&idata);
-  bsp->LoadLightMaps(&idata);
-  bsp->LoadFaces(&idata);
-  bsp->LoadLeaves(&idata);
-  bsp->LoadNodes(&idata);
-  bsp->LoadVisData(&idata);
+  std::unique_ptr<BSP> bsp(new BSP());
+  for (const LoadStep& step : s_load_steps)
+  {
+    step.func(bsp.get(), &idata);
+    if (idata.load_error)
+    {
+      std::fprintf(stderr, "Failed to load BSP file\n");
+      return nullptr;
+    }
+
+    EndPhase(step.name);
+  }
+
+  return std::move(bsp);
+}
 
-  if (idata.load_error)
+bool BSP::CopyWithReplacedLump(std::FILE* src_fp, std::FILE* dst_fp, LUMP lump, const void* data, u32 size)
+{
+  const LumpReplacement replacement = {lump, data, size};
+  return CopyWithReplacedLumps(src_fp, dst_fp, &replacement, 1);
+}
+
+bool BSP::CopyWithReplacedLumps(std::FILE* src_fp, std::FILE* dst_fp, const LumpReplacement* replacements,
+                                u32 num_replacements)
+{
+  BSP_HEADER header;
+  if (std::fseek(src_fp, 0, SEEK_SET) != 0 || std::fread(&header, sizeof(header), 1, src_fp) != 1)
   {
-    std::fprintf(stderr, "Failed to load BSP file\n");
-    return nullptr;
+    std::fprintf(stderr, "Failed to read BSP header\n");
+    return false;
   }
 
-  bsp->TesselatePatches();
+  // Lumps are written back to back after the header in index order, each aligned to four bytes.
+  BSP_HEADER out_header = header;
+  std::vector<std::vector<u8>> lump_data(NUM_LUMPS);
+  u32 offset = sizeof(BSP_HEADER);
+  for (u32 i = 0; i < NUM_LUMPS; i++)
+  {
+    const LumpReplacement* replacement =
+      std::find_if(replacements, replacements + num_replacements,
+                   [i](const LumpReplacement& candidate) { return u32(candidate.lump) == i; });
+    if (replacement != (replacements + num_replacements))
+    {
+      const u8* data = static_cast<const u8*>(replacement->data);
+      lump_data[i].assign(data, data + replacement->size);
+    }
+    else
+    {
+      lump_data[i].resize(u32(header.lumps[i].length));
+      if (!lump_data[i].empty() && (std::fseek(src_fp, header.lumps[i].offset, SEEK_SET) != 0 ||
+                                    std::fread(lump_data[i].data(), lump_data[i].size(), 1, src_fp) != 1))
+      {
+        std::fprintf(stderr, "Failed to read lump %u\n", i);
+        return false;
+      }
+    }
 
-  return std::move(bsp);
+    out_header.lumps[i].offset = int(offset);
+    out_header.lumps[i].length = int(lump_data[i].size());
+    offset += (u32(lump_data[i].size()) + 3) & ~3u;
+  }
+
+  static const u8 padding[3] = {};
+  if (std::fwrite(&out_header, sizeof(out_header), 1, dst_fp) != 1)
+    return false;
+  for (u32 i = 0; i < NUM_LUMPS; i++)
+  {
+    const size_t pad = ((lump_data[i].size() + 3) & ~size_t(3)) - lump_data[i].size();
+    if ((!lump_data[i].empty() && std::fwrite(lump_data[i].data(), lump_data[i].size(), 1, dst_fp) != 1) ||
+        (pad > 0 && std::fwrite(padding, pad, 1, dst_fp) != 1))
+    {
+      std::fprintf(stderr, "Failed to write lump %u\n", i);
+      return false;
+    }
+  }
+
+  return true;
 }
 
 const BSP::Leaf* BSP::FindLeafForPosition(const glm::vec3& pos) const
@@ -159,7 +185,7 @@ const BSP::Leaf* BSP::FindLeafForPosition(const glm::vec3& pos) const
   while (node_index >= 0)
   {
     const Node& node = m_nodes[node_index];
-    if (glm::dot(node.plane.GetNormal(), pos) >= node.plane.GetDistance())
+    if (node.plane.Distance(pos) >= 0.0f)
       node_index = node.children[0];
     else
       node_index = node.children[1];
@@ -181,17 +207,513 @@ const BSP::Leaf* BSP::FindLeafForPosition(const glm::vec3& pos) const
 #endif
 }
 
+void BSP::FindLeavesInBox(const glm::vec3& bmin, const glm::vec3& bmax, std::vector<u32>* leaves) const
+{
+  if (!m_nodes.empty())
+    FindLeavesInBox(0, bmin, bmax, leaves);
+}
+
+void BSP::FindLeavesInBox(s32 node_or_leaf, const glm::vec3& bmin, const glm::vec3& bmax,
+                          std::vector<u32>* leaves) const
+{
+  while (node_or_leaf >= 0)
+  {
+    const Node& node = m_nodes[node_or_leaf];
+    const glm::vec3& normal = node.plane.GetNormal();
+
+    // Distances of the box corners nearest to and farthest along the plane normal.
+    const glm::vec3 far_corner(normal.x >= 0.0f ? bmax.x : bmin.x, normal.y >= 0.0f ? bmax.y : bmin.y,
+                               normal.z >= 0.0f ? bmax.z : bmin.z);
+    const glm::vec3 near_corner(normal.x >= 0.0f ? bmin.x : bmax.x, normal.y >= 0.0f ? bmin.y : bmax.y,
+                                normal.z >= 0.0f ? bmin.z : bmax.z);
+    const bool in_front = node.plane.Distance(far_corner) >= 0.0f;
+    const bool behind = node.plane.Distance(near_corner) < 0.0f;
+    if (in_front && behind)
+    {
+      FindLeavesInBox(node.children[0], bmin, bmax, leaves);
+      node_or_leaf = node.children[1];
+    }
+    else
+    {
+      node_or_leaf = node.children[in_front ? 0 : 1];
+    }
+  }
+
+  leaves->push_back(u32(~node_or_leaf));
+}
+
 bool BSP::IsClusterVisible(s32 from_cluster, s32 to_cluster) const
 {
-  if (from_cluster < 0 || to_cluster < 0)
+  if (from_cluster < 0 || to_cluster < 0 || m_visdata.data.empty())
     return true;
 
-  u32 byte_index = u32(to_cluster) * m_visdata.bytes_per_cluster + u32(from_cluster / 8);
-  u32 bit_index = u32(from_cluster % 8);
+  u32 byte_index = u32(from_cluster) * m_visdata.bytes_per_cluster + u32(to_cluster / 8);
+  u32 bit_index = u32(to_cluster % 8);
   assert(byte_index < m_visdata.data.size());
   return (m_visdata.data[byte_index] & (1 << bit_index)) != 0;
 }
 
+void BSP::CreateQueryNodes()
+{
+  m_query_nodes.resize(m_nodes.size());
+  for (size_t i = 0; i < m_nodes.size(); i++)
+  {
+    const Node& node = m_nodes[i];
+    QueryNode& qnode = m_query_nodes[i];
+    qnode.normal[0] = node.plane.GetNormal().x;
+    qnode.normal[1] = node.plane.GetNormal().y;
+    qnode.normal[2] = node.plane.GetNormal().z;
+    qnode.distance = node.plane.GetDistance();
+    qnode.children[0] = node.children[0];
+    qnode.children[1] = node.children[1];
+  }
+}
+
+void BSP::FindLeavesForPositions(const glm::vec3* positions, u32 count, u32* leaf_indices) const
+{
+  if (m_query_nodes.empty())
+  {
+    std::fill(leaf_indices, leaf_indices + count, 0u);
+    return;
+  }
+
+  u32 i = 0;
+#ifdef HAS_SSE2
+  for (; (i + 4) <= count; i += 4)
+  {
+    const __m128 px = _mm_setr_ps(positions[i].x, positions[i + 1].x, positions[i + 2].x, positions[i + 3].x);
+    const __m128 py = _mm_setr_ps(positions[i].y, positions[i + 1].y, positions[i + 2].y, positions[i + 3].y);
+    const __m128 pz = _mm_setr_ps(positions[i].z, positions[i + 1].z, positions[i + 2].z, positions[i + 3].z);
+
+    // Lanes which have reached a leaf get a zero plane with both children set to that leaf, so they stay put.
+    alignas(16) s32 current[4] = {0, 0, 0, 0};
+    alignas(16) float nx[4], ny[4], nz[4], nd[4];
+    alignas(16) s32 front[4], back[4];
+    while ((current[0] & current[1] & current[2] & current[3]) >= 0)
+    {
+      for (u32 lane = 0; lane < 4; lane++)
+      {
+        if (current[lane] < 0)
+        {
+          nx[lane] = ny[lane] = nz[lane] = nd[lane] = 0.0f;
+          front[lane] = back[lane] = current[lane];
+          continue;
+        }
+
+        const QueryNode& node = m_query_nodes[current[lane]];
+        nx[lane] = node.normal[0];
+        ny[lane] = node.normal[1];
+        nz[lane] = node.normal[2];
+        nd[lane] = node.distance;
+        front[lane] = node.children[0];
+        back[lane] = node.children[1];
+      }
+
+      // Summed in the same order as the scalar path, so points on a plane go to the same side either way.
+      __m128 dist = _mm_add_ps(_mm_mul_ps(_mm_load_ps(nx), px), _mm_mul_ps(_mm_load_ps(ny), py));
+      dist = _mm_add_ps(dist, _mm_mul_ps(_mm_load_ps(nz), pz));
+      dist = _mm_add_ps(dist, _mm_load_ps(nd));
+      const __m128i in_front = _mm_castps_si128(_mm_cmpge_ps(dist, _mm_setzero_ps()));
+      const __m128i next =
+        _mm_or_si128(_mm_and_si128(in_front, _mm_load_si128(reinterpret_cast<const __m128i*>(front))),
+                     _mm_andnot_si128(in_front, _mm_load_si128(reinterpret_cast<const __m128i*>(back))));
+      _mm_store_si128(reinterpret_cast<__m128i*>(current), next);
+    }
+
+    for (u32 lane = 0; lane < 4; lane++)
+      leaf_indices[i + lane] = u32(~current[lane]);
+  }
+#endif
+
+  for (; i < count; i++)
+  {
+    s32 node_index = 0;
+    while (node_index >= 0)
+    {
+      const QueryNode& node = m_query_nodes[node_index];
+      const float dist = node.normal[0] * positions[i].x + node.normal[1] * positions[i].y +
+                         node.normal[2] * positions[i].z + node.distance;
+      node_index = node.children[(dist >= 0.0f) ? 0 : 1];
+    }
+    leaf_indices[i] = u32(~node_index);
+  }
+}
+
+void BSP::FindClustersForPositions(const glm::vec3* positions, u32 count, s32* clusters) const
+{
+  // The leaf indices are written over the output, then replaced with their clusters.
+  static_assert(sizeof(u32) == sizeof(s32), "leaf index and cluster have the same size");
+  FindLeavesForPositions(positions, count, reinterpret_cast<u32*>(clusters));
+  for (u32 i = 0; i < count; i++)
+    clusters[i] = m_leaves.empty() ? -1 : m_leaves[u32(clusters[i])].cluster;
+}
+
+void BSP::GetPVSRow(s32 cluster, u64* row) const
+{
+  const u32 num_words = GetPVSRowSize();
+  if (cluster < 0 || u32(cluster) >= m_visdata.num_clusters || m_visdata.data.empty())
+  {
+    std::fill(row, row + num_words, ~u64(0));
+    if (m_visdata.num_clusters % 64)
+      row[num_words - 1] = (u64(1) << (m_visdata.num_clusters % 64)) - 1;
+    return;
+  }
+
+  std::fill(row, row + num_words, u64(0));
+  const u8* src = &m_visdata.data[size_t(cluster) * m_visdata.bytes_per_cluster];
+  const u32 num_bytes = (m_visdata.num_clusters + 7) / 8;
+  for (u32 i = 0; i < num_bytes; i++)
+    row[i / 8] |= u64(src[i]) << ((i % 8) * 8);
+
+  // Ignore any padding bits past the last cluster.
+  if (m_visdata.num_clusters % 64)
+    row[num_words - 1] &= (u64(1) << (m_visdata.num_clusters % 64)) - 1;
+}
+
+void BSP::TestClustersInPVSRow(const u64* row, const s32* clusters, u32 count, u8* results)
+{
+  for (u32 i = 0; i < count; i++)
+  {
+    const s32 cluster = clusters[i];
+    results[i] = (cluster < 0) ? 1 : u8((row[u32(cluster) / 64] >> (u32(cluster) % 64)) & 1);
+  }
+}
+
+// Distance kept from surfaces when a trace stops, so the end position is not touching the brush.
+static constexpr float SURFACE_CLIP_EPSILON = 0.125f;
+
+// Patch facets are given some depth behind the surface, so fast moves can't pass between the two sides.
+static constexpr float PATCH_FACET_THICKNESS = 1.0f;
+
+static bool CreatePatchFacet(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, int contents,
+                             int texture_index, BSP::Brush* facet)
+{
+  const glm::vec3 cross = glm::cross(v1 - v0, v2 - v0);
+  const float length = glm::length(cross);
+  if (length < 0.0001f)
+    return false;
+
+  const glm::vec3 normal = cross / length;
+  const float distance = -glm::dot(normal, v0);
+  facet->texture_index = texture_index;
+  facet->contents = contents;
+  facet->sides.clear();
+  facet->sides.push_back({Plane(normal, distance), texture_index});
+  facet->sides.push_back({Plane(-normal, -distance - PATCH_FACET_THICKNESS), texture_index});
+
+  // Edges, facing away from the opposite vertex.
+  const glm::vec3* points[3] = {&v0, &v1, &v2};
+  for (u32 i = 0; i < 3; i++)
+  {
+    const glm::vec3& a = *points[i];
+    const glm::vec3& b = *points[(i + 1) % 3];
+    const glm::vec3 edge_normal = glm::normalize(glm::cross(b - a, normal));
+    facet->sides.push_back({Plane(edge_normal, -glm::dot(edge_normal, a)), texture_index});
+  }
+
+  // Axial bevels, so boxes don't catch on the edges.
+  facet->bbox_min = glm::min(glm::min(v0, v1), v2);
+  facet->bbox_max = glm::max(glm::max(v0, v1), v2);
+  facet->bbox_min = glm::min(facet->bbox_min, facet->bbox_min - normal * PATCH_FACET_THICKNESS);
+  facet->bbox_max = glm::max(facet->bbox_max, facet->bbox_max - normal * PATCH_FACET_THICKNESS);
+  for (u32 axis = 0; axis < 3; axis++)
+  {
+    glm::vec3 axis_normal(0.0f);
+    axis_normal[axis] = 1.0f;
+    facet->sides.push_back({Plane(axis_normal, -facet->bbox_max[axis]), texture_index});
+    facet->sides.push_back({Plane(-axis_normal, facet->bbox_min[axis]), texture_index});
+  }
+
+  return true;
+}
+
+void BSP::CreatePatchCollision() const
+{
+  m_face_patch_collision.assign(m_faces.size(), -1);
+  for (size_t i = 0; i < m_faces.size(); i++)
+  {
+    const Face& face = m_faces[i];
+    if (face.type != FACE_TYPE_PATCH || face.num_indices <= 0 || unsigned(face.texture_index) >= m_textures.size())
+      continue;
+
+    const Texture& texture = m_textures[face.texture_index];
+    if (texture.contents_flags == 0 || (texture.surface_flags & SURF_NONSOLID))
+      continue;
+
+    // Facets are made from the same tessellation that is drawn.
+    PatchCollision pc;
+    pc.contents = texture.contents_flags;
+    pc.bbox_min = glm::vec3(std::numeric_limits<float>::max());
+    pc.bbox_max = glm::vec3(-std::numeric_limits<float>::max());
+    for (int j = 0; (j + 2) < face.num_indices; j += 3)
+    {
+      const glm::vec3& v0 = m_vertices[face.base_vertex + m_indices[face.base_index + j + 0]].position;
+      const glm::vec3& v1 = m_vertices[face.base_vertex + m_indices[face.base_index + j + 1]].position;
+      const glm::vec3& v2 = m_vertices[face.base_vertex + m_indices[face.base_index + j + 2]].position;
+
+      Brush facet;
+      if (!CreatePatchFacet(v0, v1, v2, pc.contents, face.texture_index, &facet))
+        continue;
+
+      pc.bbox_min = glm::min(pc.bbox_min, facet.bbox_min);
+      pc.bbox_max = glm::max(pc.bbox_max, facet.bbox_max);
+      pc.facets.push_back(std::move(facet));
+    }
+
+    if (pc.facets.empty())
+      continue;
+
+    m_face_patch_collision[i] = s32(m_patch_collision.size());
+    m_patch_collision.push_back(std::move(pc));
+  }
+}
+
+BSP::TraceResult BSP::TraceRay(const glm::vec3& start, const glm::vec3& end, int contents_mask) const
+{
+  TraceResult result;
+  TraceBoxes(&start, &end, 1, glm::vec3(0.0f), glm::vec3(0.0f), contents_mask, &result);
+  return result;
+}
+
+BSP::TraceResult BSP::TraceBox(const glm::vec3& start, const glm::vec3& end, const glm::vec3& mins,
+                               const glm::vec3& maxs, int contents_mask) const
+{
+  TraceResult result;
+  TraceBoxes(&start, &end, 1, mins, maxs, contents_mask, &result);
+  return result;
+}
+
+void BSP::TraceBoxes(const glm::vec3* starts, const glm::vec3* ends, u32 count, const glm::vec3& mins,
+                     const glm::vec3& maxs, int contents_mask, TraceResult* results) const
+{
+  std::call_once(m_patch_collision_once, [this]() { CreatePatchCollision(); });
+
+  // Trace the centre of the box, and expand the brushes by its extents.
+  const glm::vec3 offset = (mins + maxs) * 0.5f;
+  TraceWork tw;
+  tw.extents = maxs - offset;
+  tw.is_point = (tw.extents == glm::vec3(0.0f));
+  tw.contents_mask = contents_mask;
+
+  for (u32 i = 0; i < count; i++)
+  {
+    TraceResult& result = results[i];
+    result.fraction = 1.0f;
+    result.plane = Plane(glm::vec3(0.0f), 0.0f);
+    result.texture_index = -1;
+    result.surface_flags = 0;
+    result.contents = 0;
+    result.start_solid = false;
+    result.all_solid = false;
+
+    tw.start = starts[i] + offset;
+    tw.end = ends[i] + offset;
+    tw.bounds_min = glm::min(tw.start, tw.end) - tw.extents - glm::vec3(1.0f);
+    tw.bounds_max = glm::max(tw.start, tw.end) + tw.extents + glm::vec3(1.0f);
+    tw.result = &result;
+    if (!m_nodes.empty())
+      TraceThroughTree(&tw, 0, 0.0f, 1.0f, tw.start, tw.end);
+
+    result.end_position = (result.fraction == 1.0f) ? ends[i] : glm::mix(starts[i], ends[i], result.fraction);
+  }
+}
+
+void BSP::TraceThroughTree(TraceWork* tw, s32 node_or_leaf, float p1f, float p2f, const glm::vec3& p1,
+                           const glm::vec3& p2) const
+{
+  // Already hit something nearer than this part of the move.
+  if (tw->result->fraction <= p1f)
+    return;
+
+  if (node_or_leaf < 0)
+  {
+    TraceThroughLeaf(tw, m_leaves[~node_or_leaf]);
+    return;
+  }
+
+  const Node& node = m_nodes[node_or_leaf];
+  const float t1 = node.plane.Distance(p1);
+  const float t2 = node.plane.Distance(p2);
+  const float offset = tw->is_point ? 0.0f : glm::dot(glm::abs(node.plane.GetNormal()), tw->extents);
+  if (t1 >= (offset + 1.0f) && t2 >= (offset + 1.0f))
+  {
+    TraceThroughTree(tw, node.children[0], p1f, p2f, p1, p2);
+    return;
+  }
+  if (t1 < (-offset - 1.0f) && t2 < (-offset - 1.0f))
+  {
+    TraceThroughTree(tw, node.children[1], p1f, p2f, p1, p2);
+    return;
+  }
+
+  // Crosses the plane. Both halves overlap the split a little, so brushes on the plane are seen from either side.
+  u32 side;
+  float frac, frac2;
+  if (t1 < t2)
+  {
+    const float idist = 1.0f / (t1 - t2);
+    side = 1;
+    frac2 = (t1 + offset + SURFACE_CLIP_EPSILON) * idist;
+    frac = (t1 - offset + SURFACE_CLIP_EPSILON) * idist;
+  }
+  else if (t1 > t2)
+  {
+    const float idist = 1.0f / (t1 - t2);
+    side = 0;
+    frac2 = (t1 - offset - SURFACE_CLIP_EPSILON) * idist;
+    frac = (t1 + offset + SURFACE_CLIP_EPSILON) * idist;
+  }
+  else
+  {
+    side = 0;
+    frac = 1.0f;
+    frac2 = 0.0f;
+  }
+
+  frac = glm::clamp(frac, 0.0f, 1.0f);
+  frac2 = glm::clamp(frac2, 0.0f, 1.0f);
+
+  TraceThroughTree(tw, node.children[side], p1f, p1f + (p2f - p1f) * frac, p1, glm::mix(p1, p2, frac));
+  TraceThroughTree(tw, node.children[side ^ 1], p1f + (p2f - p1f) * frac2, p2f, glm::mix(p1, p2, frac2), p2);
+}
+
+void BSP::TraceThroughLeaf(TraceWork* tw, const Leaf& leaf) const
+{
+  auto Overlaps = [tw](const glm::vec3& bmin, const glm::vec3& bmax) {
+    return (bmin.x <= tw->bounds_max.x && bmin.y <= tw->bounds_max.y && bmin.z <= tw->bounds_max.z &&
+            bmax.x >= tw->bounds_min.x && bmax.y >= tw->bounds_min.y && bmax.z >= tw->bounds_min.z);
+  };
+
+  // Brushes spanning several leaves are tested once per leaf, the bounds check keeps that cheap.
+  for (u32 brush_index : leaf.brushes)
+  {
+    const Brush& brush = m_brushes[brush_index];
+    if (!(brush.contents & tw->contents_mask) || !Overlaps(brush.bbox_min, brush.bbox_max))
+      continue;
+
+    TraceThroughBrush(tw, brush);
+    if (tw->result->all_solid)
+      return;
+  }
+
+  for (u32 face_index : leaf.faces)
+  {
+    const s32 pc_index = m_face_patch_collision[face_index];
+    if (pc_index < 0)
+      continue;
+
+    const PatchCollision& pc = m_patch_collision[pc_index];
+    if (!(pc.contents & tw->contents_mask) || !Overlaps(pc.bbox_min, pc.bbox_max))
+      continue;
+
+    for (const Brush& facet : pc.facets)
+    {
+      if (Overlaps(facet.bbox_min, facet.bbox_max))
+        TraceThroughBrush(tw, facet);
+    }
+  }
+}
+
+void BSP::TraceThroughBrush(TraceWork* tw, const Brush& brush) const
+{
+  if (brush.sides.empty())
+    return;
+
+  // Find where the move enters and leaves the space behind every side, with the sides pushed out by the box.
+  float enter_frac = -1.0f;
+  float leave_frac = 1.0f;
+  const Brush::Side* enter_side = nullptr;
+  bool get_out = false;
+  bool start_out = false;
+  for (const Brush::Side& side : brush.sides)
+  {
+    const glm::vec3& normal = side.plane.GetNormal();
+    const float offset = tw->is_point ? 0.0f : glm::dot(glm::abs(normal), tw->extents);
+    const float d1 = side.plane.Distance(tw->start) - offset;
+    const float d2 = side.plane.Distance(tw->end) - offset;
+    if (d2 > 0.0f)
+      get_out = true;
+    if (d1 > 0.0f)
+      start_out = true;
+
+    // Completely in front of this side, so it can't touch the brush.
+    if (d1 > 0.0f && (d2 >= SURFACE_CLIP_EPSILON || d2 >= d1))
+      return;
+
+    // Completely behind, the other sides decide.
+    if (d1 <= 0.0f && d2 <= 0.0f)
+      continue;
+
+    if (d1 > d2)
+    {
+      const float f = std::max((d1 - SURFACE_CLIP_EPSILON) / (d1 - d2), 0.0f);
+      if (f > enter_frac)
+      {
+        enter_frac = f;
+        enter_side = &side;
+      }
+    }
+    else
+    {
+      leave_frac = std::min(leave_frac, (d1 + SURFACE_CLIP_EPSILON) / (d1 - d2));
+    }
+  }
+
+  TraceResult* result = tw->result;
+  if (!start_out)
+  {
+    result->start_solid = true;
+    if (!get_out)
+    {
+      result->all_solid = true;
+      result->fraction = 0.0f;
+      result->contents = brush.contents;
+    }
+    return;
+  }
+
+  if (enter_frac < leave_frac && enter_frac > -1.0f && enter_frac < result->fraction && enter_side)
+  {
+    result->fraction = std::max(enter_frac, 0.0f);
+    result->plane = enter_side->plane;
+    result->texture_index = enter_side->texture_index;
+    result->surface_flags = (unsigned(enter_side->texture_index) < m_textures.size()) ?
+                              m_textures[enter_side->texture_index].surface_flags :
+                              0;
+    result->contents = brush.contents;
+  }
+}
+
+int BSP::PointContents(const glm::vec3& pos) const
+{
+  if (m_nodes.empty())
+    return 0;
+
+  const Leaf* leaf = FindLeafForPosition(pos);
+  int contents = 0;
+  for (u32 brush_index : leaf->brushes)
+  {
+    const Brush& brush = m_brushes[brush_index];
+    if (brush.sides.empty() || (contents & brush.contents) == brush.contents)
+      continue;
+
+    bool inside = true;
+    for (const Brush::Side& side : brush.sides)
+    {
+      if (side.plane.Distance(pos) > 0.0f)
+      {
+        inside = false;
+        break;
+      }
+    }
+
+    if (inside)
+      contents |= brush.contents;
+  }
+
+  return contents;
+}
+
 template<typename ElementType>
 std::vector<ElementType> BSP::LoadLump(IntermediateData* idata, LUMP lump)
 {
@@ -229,8 +751,9 @@ bool BSP::LoadIntermediateData(IntermediateData* idata)
   {
     const BSP_PLANE_LUMP& pin = planes[i];
     Plane& pout = idata->planes[i];
+    // The file stores n.p = d, planes are n.p + d = 0.
     pout.SetNormal(glm::vec3(pin.normal[0], pin.normal[1], pin.normal[2]));
-    pout.SetDistance(pin.distance);
+    pout.SetDistance(-pin.distance);
   }
 
   idata->leaf_faces = LoadLump<int>(idata, LUMP_LEAF_FACES);
@@ -351,6 +874,86 @@ void BSP::LoadLeaves(IntermediateData* idata)
 
       lout.faces.push_back(index);
     }
+
+    lout.brushes.reserve(lin.num_leaf_brushes);
+    for (int j = 0; j < lin.num_leaf_brushes; j++)
+    {
+      int index = idata->leaf_brushes[lin.first_leaf_brush + j];
+      if (index < 0 || unsigned(index) >= m_brushes.size())
+      {
+        std::fprintf(stderr, "Leaf %u has out-of-range brush indices\n", u32(i));
+        idata->load_error = true;
+        return;
+      }
+
+      lout.brushes.push_back(u32(index));
+    }
+  }
+}
+
+void BSP::LoadBrushes(IntermediateData* idata)
+{
+  auto brushes = LoadLump<BSP_BRUSH_LUMP>(idata, LUMP_BRUSHES);
+  auto sides = LoadLump<BSP_BRUSH_SIDE_LUMP>(idata, LUMP_BRUSH_SIDES);
+  m_brushes.resize(brushes.size());
+  for (size_t i = 0; i < m_brushes.size(); i++)
+  {
+    const BSP_BRUSH_LUMP& bin = brushes[i];
+    Brush& bout = m_brushes[i];
+
+    if (bin.first_side < 0 || bin.num_sides < 0 || unsigned(bin.first_side + bin.num_sides) > sides.size() ||
+        unsigned(bin.texture_index) >= m_textures.size())
+    {
+      std::fprintf(stderr, "Brush %u has out-of-range indices\n", u32(i));
+      idata->load_error = true;
+      return;
+    }
+
+    bout.texture_index = bin.texture_index;
+    bout.contents = m_textures[bin.texture_index].contents_flags;
+    bout.sides.resize(bin.num_sides);
+    for (int j = 0; j < bin.num_sides; j++)
+    {
+      const BSP_BRUSH_SIDE_LUMP& sin = sides[bin.first_side + j];
+      if (unsigned(sin.plane) >= idata->planes.size() || unsigned(sin.texture_index) >= m_textures.size())
+      {
+        std::fprintf(stderr, "Brush %u has out-of-range side indices\n", u32(i));
+        idata->load_error = true;
+        return;
+      }
+
+      bout.sides[j].plane = idata->planes[sin.plane];
+      bout.sides[j].texture_index = sin.texture_index;
+    }
+
+    CalculateBrushBounds(&bout);
+  }
+}
+
+void BSP::CalculateBrushBounds(Brush* brush) const
+{
+  // The volume is the intersection of the space behind each side, so clip each side's plane by all the others.
+  brush->bbox_min = glm::vec3(std::numeric_limits<float>::max());
+  brush->bbox_max = glm::vec3(-std::numeric_limits<float>::max());
+  for (size_t i = 0; i < brush->sides.size(); i++)
+  {
+    Winding winding = Winding::CreateForPlane(brush->sides[i].plane);
+    for (size_t j = 0; j < brush->sides.size() && !winding.IsEmpty(); j++)
+    {
+      if (j == i)
+        continue;
+
+      const Plane& plane = brush->sides[j].plane;
+      winding.Clip(Plane(-plane.GetNormal(), -plane.GetDistance()), 0.01f);
+    }
+
+    if (winding.IsEmpty())
+      continue;
+
+    glm::vec3 wmin, wmax;
+    winding.GetBounds(&wmin, &wmax);
+    brush->bbox_min = glm::min(brush->bbox_min, wmin);
+    brush->bbox_max = glm::max(brush->bbox_max, wmax);
   }
 }
 
@@ -375,7 +978,7 @@ void BSP::LoadFaces(IntermediateData* idata)
     fout.lightmap_size[0] = fin.lightmap_size[0];
     fout.lightmap_size[1] = fin.lightmap_size[1];
     fout.lightmap_origin = glm::vec3(fin.lightmap_origin[0], fin.lightmap_origin[1], fin.lightmap_origin[2]);
-    for (size_t j = 0; j < 3; j++)
+    for (size_t j = 0; j < 2; j++)
       fout.lightmap_vectors[j] = glm::vec3(fin.lightmap_vecs[j][0], fin.lightmap_vecs[j][1], fin.lightmap_vecs[j][2]);
     fout.normal = glm::vec3(fin.normal[0], fin.normal[1], fin.normal[2]);
     fout.patch_width = fin.patch_size[0];
@@ -522,6 +1125,29 @@ void BSP::TesselatePatches()
   }
 }
 
+void BSP::CalculateFaceBounds()
+{
+  for (Face& face : m_faces)
+  {
+    if (face.num_vertices <= 0 || face.base_vertex < 0 ||
+        size_t(face.base_vertex + face.num_vertices) > m_vertices.size())
+    {
+      face.bbox_min = glm::vec3(0.0f, 0.0f, 0.0f);
+      face.bbox_max = glm::vec3(0.0f, 0.0f, 0.0f);
+      continue;
+    }
+
+    face.bbox_min = m_vertices[face.base_vertex].position;
+    face.bbox_max = face.bbox_min;
+    for (int i = 1; i < face.num_vertices; i++)
+    {
+      const glm::vec3& pos = m_vertices[face.base_vertex + i].position;
+      face.bbox_min = glm::min(face.bbox_min, pos);
+      face.bbox_max = glm::max(face.bbox_max, pos);
+    }
+  }
+}
+
 void BSP::LoadIndices(IntermediateData* idata)
 {
   m_indices = LoadLump<u32>(idata, LUMP_MESH_VERTICES);
@@ -553,11 +1179,21 @@ void BSP::LoadLightMaps(IntermediateData* idata)
 
 void BSP::LoadVisData(IntermediateData* idata)
 {
+  // Maps compiled without vis still have clusters, but no data. The caller can compute it from the portals.
+  s32 max_cluster = -1;
+  for (const Leaf& leaf : m_leaves)
+    max_cluster = std::max(max_cluster, s32(leaf.cluster));
+  m_visdata.num_clusters = u32(max_cluster + 1);
+  m_visdata.bytes_per_cluster = (m_visdata.num_clusters + 7) / 8;
+  m_visdata.data.clear();
+
+  // An empty lump is how those maps come, so not worth a message.
   auto visdata = LoadLump<u8>(idata, LUMP_VISDATA);
+  if (visdata.empty())
+    return;
   if (visdata.size() < 8)
   {
     std::fprintf(stderr, "Visdata missing header.\n");
-    idata->load_error = true;
     return;
   }
 
@@ -565,10 +1201,10 @@ void BSP::LoadVisData(IntermediateData* idata)
   std::memcpy(&cluster_count, &visdata[0], sizeof(cluster_count));
   std::memcpy(&bytes_per_cluster, &visdata[4], sizeof(bytes_per_cluster));
 
-  if (visdata.size() < ((cluster_count * bytes_per_cluster) + 8))
+  if (visdata.size() < ((cluster_count * bytes_per_cluster) + 8) || cluster_count < m_visdata.num_clusters ||
+      bytes_per_cluster < ((cluster_count + 7) / 8))
   {
     std::fprintf(stderr, "Visdata missing data.\n");
-    idata->load_error = true;
     return;
   }
 
@@ -577,3 +1213,238 @@ void BSP::LoadVisData(IntermediateData* idata)
   m_visdata.data.resize(cluster_count * bytes_per_cluster);
   std::memcpy(m_visdata.data.data(), &visdata[8], cluster_count * bytes_per_cluster);
 }
+
+void BSP::GeneratePortals()
+{
+  if (m_portals_generated)
+    return;
+
+  m_portals_generated = true;
+  if (m_nodes.empty())
+    return;
+
+  // Start from the world bounds, facing inwards, so the windings are finite.
+  const glm::vec3 bbox_min = m_nodes[0].bbox_min - glm::vec3(8.0f);
+  const glm::vec3 bbox_max = m_nodes[0].bbox_max + glm::vec3(8.0f);
+  std::vector<Plane> bounds;
+  for (u32 axis = 0; axis < 3; axis++)
+  {
+    glm::vec3 normal(0.0f);
+    normal[axis] = 1.0f;
+    bounds.emplace_back(normal, -bbox_min[axis]);
+    bounds.emplace_back(-normal, bbox_max[axis]);
+  }
+
+  MakeNodePortals(0, &bounds);
+
+  for (size_t i = 0; i < m_portals.size(); i++)
+  {
+    m_leaves[m_portals[i].leaves[0]].portals.push_back(u32(i));
+    m_leaves[m_portals[i].leaves[1]].portals.push_back(u32(i));
+  }
+}
+
+void BSP::MakeNodePortals(s32 node_index, std::vector<Plane>* bounds)
+{
+  const Node& node = m_nodes[node_index];
+
+  // The part of the node plane inside the node's volume is the opening between its two subtrees.
+  Winding winding = Winding::CreateForPlane(node.plane);
+  for (size_t i = 0; i < bounds->size() && !winding.IsEmpty(); i++)
+    winding.Clip((*bounds)[i]);
+
+  if (!winding.IsEmpty())
+  {
+    // Cut it by the leaves on the front side, then cut each of those pieces by the leaves on the back side.
+    const glm::vec3& normal = node.plane.GetNormal();
+    std::vector<std::pair<u32, Winding>> front_fragments, back_fragments;
+    FilterPortalWinding(node.children[0], winding, normal, &front_fragments);
+    for (const auto& front : front_fragments)
+    {
+      back_fragments.clear();
+      FilterPortalWinding(node.children[1], front.second, -normal, &back_fragments);
+      for (auto& back : back_fragments)
+      {
+        if (back.second.GetArea() < 1.0f)
+          continue;
+
+        Portal portal;
+        portal.plane = node.plane;
+        portal.winding = std::move(back.second);
+        portal.leaves[0] = back.first;
+        portal.leaves[1] = front.first;
+        m_portals.push_back(std::move(portal));
+      }
+    }
+  }
+
+  for (u32 i = 0; i < 2; i++)
+  {
+    if (node.children[i] < 0)
+      continue;
+
+    bounds->push_back((i == 0) ? node.plane : Plane(-node.plane.GetNormal(), -node.plane.GetDistance()));
+    MakeNodePortals(node.children[i], bounds);
+    bounds->pop_back();
+  }
+}
+
+void BSP::FilterPortalWinding(s32 node_or_leaf, const Winding& winding, const glm::vec3& toward,
+                              std::vector<std::pair<u32, Winding>>* fragments) const
+{
+  if (node_or_leaf < 0)
+  {
+    // Solid leaves can't be seen through.
+    if (m_leaves[~node_or_leaf].cluster >= 0)
+      fragments->emplace_back(u32(~node_or_leaf), winding);
+    return;
+  }
+
+  const Node& node = m_nodes[node_or_leaf];
+
+  // A winding lying on this plane belongs to the side the leaves we're looking for are on.
+  bool on_plane = true;
+  for (const glm::vec3& point : winding.GetPoints())
+    on_plane &= (std::abs(node.plane.Distance(point)) <= 0.1f);
+  if (on_plane)
+  {
+    FilterPortalWinding(node.children[(glm::dot(toward, node.plane.GetNormal()) > 0.0f) ? 0 : 1], winding, toward,
+                        fragments);
+    return;
+  }
+
+  Winding front, back;
+  winding.Split(node.plane, &front, &back);
+  if (!front.IsEmpty())
+    FilterPortalWinding(node.children[0], front, toward, fragments);
+  if (!back.IsEmpty())
+    FilterPortalWinding(node.children[1], back, toward, fragments);
+}
+
+void BSP::LoadModels(IntermediateData* idata)
+{
+  auto models = LoadLump<BSP_MODEL_LUMP>(idata, LUMP_MODELS);
+  const size_t num_brushes = m_brushes.size();
+  m_models.resize(models.size());
+  for (size_t i = 0; i < m_models.size(); i++)
+  {
+    const BSP_MODEL_LUMP& min = models[i];
+    Model& mout = m_models[i];
+
+    if (min.first_face < 0 || min.num_faces < 0 || unsigned(min.first_face + min.num_faces) > m_faces.size() ||
+        min.first_brush < 0 || min.num_brushes < 0 || unsigned(min.first_brush + min.num_brushes) > num_brushes)
+    {
+      std::fprintf(stderr, "Model %u has out-of-range indices\n", u32(i));
+      idata->load_error = true;
+      return;
+    }
+
+    mout.bbox_min = glm::vec3(min.bbox_min[0], min.bbox_min[1], min.bbox_min[2]);
+    mout.bbox_max = glm::vec3(min.bbox_max[0], min.bbox_max[1], min.bbox_max[2]);
+    for (int j = 0; j < min.num_faces; j++)
+      mout.faces.push_back(u32(min.first_face + j));
+    for (int j = 0; j < min.num_brushes; j++)
+      mout.brushes.push_back(u32(min.first_brush + j));
+  }
+}
+
+void BSP::LoadEntities(IntermediateData* idata)
+{
+  // A list of { "key" "value" ... } blocks.
+  auto text = LoadLump<char>(idata, LUMP_ENTITIES);
+  size_t pos = 0;
+  const auto read_token = [&text, &pos](std::string* token) {
+    while (pos < text.size() && (std::isspace(static_cast<unsigned char>(text[pos])) || text[pos] == '\0'))
+      pos++;
+    if (pos >= text.size())
+      return false;
+
+    token->clear();
+    if (text[pos] != '"')
+    {
+      token->push_back(text[pos++]);
+      return true;
+    }
+
+    for (pos++; pos < text.size() && text[pos] != '"'; pos++)
+      token->push_back(text[pos]);
+    pos++;
+    return true;
+  };
+
+  std::string token, value;
+  while (read_token(&token))
+  {
+    if (token != "{")
+    {
+      std::fprintf(stderr, "Malformed entities lump\n");
+      m_entities.clear();
+      return;
+    }
+
+    Entity entity;
+    while (read_token(&token) && token != "}")
+    {
+      if (!read_token(&value))
+        break;
+      entity.properties.emplace_back(std::move(token), value);
+    }
+    m_entities.push_back(std::move(entity));
+  }
+}
+
+void BSP::FindAreaPortals()
+{
+  m_num_areas = 0;
+  for (const Leaf& leaf : m_leaves)
+    m_num_areas = std::max(m_num_areas, u32(leaf.area + 1));
+
+  // As in the game code, doors connect the (first) two areas their model touches.
+  m_area_portals.clear();
+  std::vector<u32> leaves;
+  for (const Entity& entity : m_entities)
+  {
+    const std::string& classname = entity.GetProperty("classname");
+    const std::string& model = entity.GetProperty("model");
+    if ((classname != "func_door" && classname != "func_door_rotating") || model.size() < 2 || model[0] != '*')
+      continue;
+
+    const u32 model_index = u32(std::strtoul(model.c_str() + 1, nullptr, 10));
+    if (model_index == 0 || model_index >= m_models.size())
+      continue;
+
+    leaves.clear();
+    FindLeavesInBox(m_models[model_index].bbox_min, m_models[model_index].bbox_max, &leaves);
+
+    AreaPortal portal = {{0, 0}, model_index};
+    u32 num_areas = 0;
+    for (u32 leaf_index : leaves)
+    {
+      const int area = m_leaves[leaf_index].area;
+      if (area < 0 || (num_areas > 0 && u32(area) == portal.areas[0]))
+        continue;
+
+      portal.areas[num_areas++] = u32(area);
+      if (num_areas == 2)
+      {
+        m_area_portals.push_back(portal);
+        break;
+      }
+    }
+  }
+
+  if (!m_area_portals.empty())
+    std::fprintf(stdout, "%u areas, %u area portals\n", m_num_areas, u32(m_area_portals.size()));
+}
+
+const std::string& BSP::Entity::GetProperty(const char* key) const
+{
+  static const std::string empty;
+  for (const auto& it : properties)
+  {
+    if (it.first == key)
+      return it.second;
+  }
+
+  return empty;
+}
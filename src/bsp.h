@@ -1,8 +1,10 @@
 #pragma once
 #include "common.h"
 #include "plane.h"
+#include "winding.h"
 #include <glm/glm.hpp>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -22,6 +24,37 @@ public:
     FACE_TYPE_MESH
   };
 
+  // Texture contents flags, as written by q3map.
+  enum CONTENTS : int
+  {
+    CONTENTS_SOLID = 0x1,
+    CONTENTS_LAVA = 0x8,
+    CONTENTS_SLIME = 0x10,
+    CONTENTS_WATER = 0x20,
+    CONTENTS_FOG = 0x40,
+    CONTENTS_PLAYERCLIP = 0x10000,
+    CONTENTS_MONSTERCLIP = 0x20000,
+    CONTENTS_BODY = 0x2000000,
+    CONTENTS_DETAIL = 0x8000000,
+    CONTENTS_TRANSLUCENT = 0x20000000,
+
+    MASK_SOLID = CONTENTS_SOLID,
+    MASK_PLAYERSOLID = CONTENTS_SOLID | CONTENTS_PLAYERCLIP | CONTENTS_BODY,
+    MASK_WATER = CONTENTS_WATER | CONTENTS_LAVA | CONTENTS_SLIME
+  };
+
+  // Texture surface flags.
+  enum SURF : int
+  {
+    SURF_NODAMAGE = 0x1,
+    SURF_SLICK = 0x2,
+    SURF_SKY = 0x4,
+    SURF_LADDER = 0x8,
+    SURF_NOIMPACT = 0x10,
+    SURF_NODRAW = 0x80,
+    SURF_NONSOLID = 0x4000
+  };
+
   enum LUMP
   {
     LUMP_ENTITIES,
@@ -73,6 +106,13 @@ public:
 
     std::vector<Side> sides;
     int texture_index;
+
+    // From the brush's texture. Zero for brushes which don't collide.
+    int contents;
+
+    // Bounds of the convex volume, empty if the sides don't enclose one.
+    glm::vec3 bbox_min;
+    glm::vec3 bbox_max;
   };
 
   struct Face
@@ -97,6 +137,10 @@ public:
 
     int patch_width;
     int patch_height;
+
+    // Bounds of the face's (tessellated) vertices.
+    glm::vec3 bbox_min;
+    glm::vec3 bbox_max;
   };
 
   struct Model
@@ -107,10 +151,26 @@ public:
     glm::vec3 bbox_max;
   };
 
+  struct Entity
+  {
+    std::vector<std::pair<std::string, std::string>> properties;
+
+    // Returns an empty string if the key is not present.
+    const std::string& GetProperty(const char* key) const;
+  };
+
+  // Door between two areas. When closed, neither area can be seen from the other.
+  struct AreaPortal
+  {
+    u32 areas[2];
+    u32 model_index;
+  };
+
   struct Leaf
   {
     std::vector<u32> faces;
     std::vector<u32> brushes;
+    std::vector<u32> portals;
     glm::vec3 bbox_min;
     glm::vec3 bbox_max;
     u32 index;
@@ -118,6 +178,15 @@ public:
     int area;
   };
 
+  // Opening between two non-solid leaves, generated from the tree by GeneratePortals().
+  struct Portal
+  {
+    // Faces from leaves[0] into leaves[1].
+    Plane plane;
+    Winding winding;
+    u32 leaves[2];
+  };
+
   struct Node
   {
     // if children[i] < 0, then is leaf, index=~children[i], else node
@@ -135,6 +204,24 @@ public:
     int unk;
   };
 
+  // Result of sweeping a box through the world brushes.
+  struct TraceResult
+  {
+    // Fraction of the move completed before hitting something, 1 if nothing was hit.
+    float fraction;
+    glm::vec3 end_position;
+
+    // Surface that was hit. Not set if the trace started in solid.
+    Plane plane;
+    int texture_index;
+    int surface_flags;
+    int contents;
+
+    // The start position was inside a brush, and for all_solid, so was the whole move.
+    bool start_solid;
+    bool all_solid;
+  };
+
   struct LightMap
   {
     u8 data[LIGHTMAP_SIZE][LIGHTMAP_SIZE][3];
@@ -147,9 +234,32 @@ public:
     std::vector<u8> data;
   };
 
+  // Wall time of one step of Load().
+  struct LoadPhase
+  {
+    const char* name;
+    float time_ms;
+  };
+
   ~BSP();
 
-  static std::unique_ptr<BSP> Load(std::FILE* fp);
+  // If phases is not null, the time taken by each step is appended to it, in the order they ran.
+  static std::unique_ptr<BSP> Load(std::FILE* fp, std::vector<LoadPhase>* phases = nullptr);
+
+  // New contents for a lump, for CopyWithReplacedLumps().
+  struct LumpReplacement
+  {
+    LUMP lump;
+    const void* data;
+    u32 size;
+  };
+
+  // Copies a BSP file, replacing the contents of one lump. The other lumps are copied unchanged.
+  static bool CopyWithReplacedLump(std::FILE* src_fp, std::FILE* dst_fp, LUMP lump, const void* data, u32 size);
+
+  // As above, replacing any number of lumps.
+  static bool CopyWithReplacedLumps(std::FILE* src_fp, std::FILE* dst_fp, const LumpReplacement* replacements,
+                                    u32 num_replacements);
 
   size_t GetTextureCount() const { return m_textures.size(); }
   const Texture* GetTexture(size_t i) const { return &m_textures[i]; }
@@ -172,6 +282,10 @@ public:
   const Leaf* GetLeaf(size_t i) const { return &m_leaves[i]; }
   const std::vector<Leaf>& GetLeaves() const { return m_leaves; }
 
+  size_t GetBrushCount() const { return m_brushes.size(); }
+  const Brush* GetBrush(size_t i) const { return &m_brushes[i]; }
+  const std::vector<Brush>& GetBrushes() const { return m_brushes; }
+
   size_t GetFaceCount() const { return m_faces.size(); }
   const Face* GetFace(size_t i) const { return &m_faces[i]; }
   const std::vector<Face>& GetFaces() const { return m_faces; }
@@ -180,11 +294,101 @@ public:
   const LightMap* GetLightMap(size_t i) const { return &m_lightmaps[i]; }
   const std::vector<LightMap>& GetLightMaps() const { return m_lightmaps; }
 
+  size_t GetModelCount() const { return m_models.size(); }
+  const Model* GetModel(size_t i) const { return &m_models[i]; }
+  const std::vector<Model>& GetModels() const { return m_models; }
+
+  size_t GetEntityCount() const { return m_entities.size(); }
+  const Entity* GetEntity(size_t i) const { return &m_entities[i]; }
+  const std::vector<Entity>& GetEntities() const { return m_entities; }
+
+  u32 GetAreaCount() const { return m_num_areas; }
+  size_t GetAreaPortalCount() const { return m_area_portals.size(); }
+  const AreaPortal* GetAreaPortal(size_t i) const { return &m_area_portals[i]; }
+  const std::vector<AreaPortal>& GetAreaPortals() const { return m_area_portals; }
+
+  // Portals are only needed for portal culling and computing vis, so Load() leaves them out and they are generated on
+  // request. Does nothing if they already have been.
+  void GeneratePortals();
+
+  size_t GetPortalCount() const { return m_portals.size(); }
+  const Portal* GetPortal(size_t i) const { return &m_portals[i]; }
+  const std::vector<Portal>& GetPortals() const { return m_portals; }
+
+  u32 GetClusterCount() const { return m_visdata.num_clusters; }
+
+  // Maps compiled without vis have no cluster visibility, in which case every cluster is treated as visible.
+  bool HasVisData() const { return !m_visdata.data.empty(); }
+  void SetVisData(VisData visdata) { m_visdata = std::move(visdata); }
+
   const BSP::Leaf* FindLeafForPosition(const glm::vec3& pos) const;
 
+  // Appends the indices of the leaves the box touches.
+  void FindLeavesInBox(const glm::vec3& bmin, const glm::vec3& bmax, std::vector<u32>* leaves) const;
+
   bool IsClusterVisible(s32 from_cluster, s32 to_cluster) const;
 
+  // Batched queries. None of these modify the BSP, so any number of threads can query one instance concurrently.
+
+  // Leaf index and cluster for each position. Descends four positions at a time with SSE2.
+  void FindLeavesForPositions(const glm::vec3* positions, u32 count, u32* leaf_indices) const;
+  void FindClustersForPositions(const glm::vec3* positions, u32 count, s32* clusters) const;
+
+  // Clusters potentially visible from a cluster, as a bitset of GetPVSRowSize() words. Negative clusters, and maps
+  // without visdata, see everything.
+  u32 GetPVSRowSize() const { return (m_visdata.num_clusters + 63) / 64; }
+  void GetPVSRow(s32 cluster, u64* row) const;
+
+  // results[i] is non-zero if clusters[i] is set in the row. Negative clusters are visible, as in IsClusterVisible().
+  static void TestClustersInPVSRow(const u64* row, const s32* clusters, u32 count, u8* results);
+
+  // Collision against the world brushes and patches, ignoring anything without contents in contents_mask.
+  // Like the queries above, these are safe to call from any number of threads.
+  TraceResult TraceRay(const glm::vec3& start, const glm::vec3& end, int contents_mask) const;
+  TraceResult TraceBox(const glm::vec3& start, const glm::vec3& end, const glm::vec3& mins, const glm::vec3& maxs,
+                       int contents_mask) const;
+
+  // Traces the same box along many moves. Cheaper than individual calls, as the setup is shared.
+  void TraceBoxes(const glm::vec3* starts, const glm::vec3* ends, u32 count, const glm::vec3& mins,
+                  const glm::vec3& maxs, int contents_mask, TraceResult* results) const;
+
+  // Contents flags of every brush containing the point.
+  int PointContents(const glm::vec3& pos) const;
+
 private:
+  // The microbenchmarks time the individual load steps.
+  friend class KernelBenchmarks;
+
+  // Node planes and children packed together for the batched descent.
+  struct QueryNode
+  {
+    float normal[3];
+    float distance;
+    s32 children[2];
+  };
+
+  // Facets approximating the surface of a patch, as thin brushes.
+  struct PatchCollision
+  {
+    std::vector<Brush> facets;
+    glm::vec3 bbox_min;
+    glm::vec3 bbox_max;
+    int contents;
+  };
+
+  // State for one trace, with the box reduced to extents about its centre.
+  struct TraceWork
+  {
+    glm::vec3 start;
+    glm::vec3 end;
+    glm::vec3 extents;
+    glm::vec3 bounds_min;
+    glm::vec3 bounds_max;
+    int contents_mask;
+    bool is_point;
+    TraceResult* result;
+  };
+
   struct IntermediateData
   {
     struct Lump
@@ -200,8 +404,21 @@ private:
     bool load_error = false;
   };
 
+  // One step of Load(), with a bit set in lump_mask for each lump it reads. Later steps depend on earlier ones, so
+  // they always run in this order.
+  struct LoadStep
+  {
+    const char* name;
+    u32 lump_mask;
+    void (*func)(BSP* bsp, IntermediateData* idata);
+  };
+  static constexpr u32 NUM_LOAD_STEPS = 16;
+  static const LoadStep s_load_steps[NUM_LOAD_STEPS];
+
   BSP();
 
+  static bool ReadHeader(std::FILE* fp, IntermediateData* idata);
+
   template<typename ElementType>
   std::vector<ElementType> LoadLump(IntermediateData* idata, LUMP lump);
 
@@ -211,19 +428,53 @@ private:
   void LoadVertices(IntermediateData* idata);
   void LoadIndices(IntermediateData* idata);
   void LoadNodes(IntermediateData* idata);
+  void LoadBrushes(IntermediateData* idata);
   void LoadLeaves(IntermediateData* idata);
   void LoadFaces(IntermediateData* idata);
   void LoadLightMaps(IntermediateData* idata);
   void LoadVisData(IntermediateData* idata);
+  void LoadModels(IntermediateData* idata);
+  void LoadEntities(IntermediateData* idata);
+
+  void FindAreaPortals();
+  void FindLeavesInBox(s32 node_or_leaf, const glm::vec3& bmin, const glm::vec3& bmax, std::vector<u32>* leaves) const;
 
   void TesselatePatches();
+  void CalculateFaceBounds();
+
+  void CreateQueryNodes();
+
+  void CalculateBrushBounds(Brush* brush) const;
+
+  // Only traces need patch collision, so the first one builds it rather than Load().
+  void CreatePatchCollision() const;
+
+  void TraceThroughTree(TraceWork* tw, s32 node_or_leaf, float p1f, float p2f, const glm::vec3& p1,
+                        const glm::vec3& p2) const;
+  void TraceThroughLeaf(TraceWork* tw, const Leaf& leaf) const;
+  void TraceThroughBrush(TraceWork* tw, const Brush& brush) const;
+
+  void MakeNodePortals(s32 node_index, std::vector<Plane>* bounds);
+  void FilterPortalWinding(s32 node_or_leaf, const Winding& winding, const glm::vec3& toward,
+                           std::vector<std::pair<u32, Winding>>* fragments) const;
 
   std::vector<Texture> m_textures;
   std::vector<Vertex> m_vertices;
   std::vector<u32> m_indices;
   std::vector<Node> m_nodes;
+  std::vector<QueryNode> m_query_nodes;
   std::vector<Leaf> m_leaves;
   std::vector<Face> m_faces;
+  std::vector<Brush> m_brushes;
+  mutable std::vector<PatchCollision> m_patch_collision;
+  mutable std::vector<s32> m_face_patch_collision;
+  mutable std::once_flag m_patch_collision_once;
   std::vector<LightMap> m_lightmaps;
+  std::vector<Portal> m_portals;
+  bool m_portals_generated = false;
+  std::vector<Model> m_models;
+  std::vector<Entity> m_entities;
+  std::vector<AreaPortal> m_area_portals;
+  u32 m_num_areas = 0;
   VisData m_visdata;
 };
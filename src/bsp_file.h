@@ -0,0 +1,105 @@
+#pragma once
+
+// On-disk layout of IBSP version 46 (Quake 3) files.
+
+#pragma pack(push, 1)
+struct BSP_LUMP
+{
+  int offset;
+  int length;
+};
+
+struct BSP_HEADER
+{
+  char magic[4];
+  int version;
+  BSP_LUMP lumps[17];
+};
+
+struct BSP_TEXTURE_LUMP
+{
+  char name[64];
+  int surface_flags;
+  int contents_flags;
+};
+
+struct BSP_PLANE_LUMP
+{
+  float normal[3];
+  float distance;
+};
+
+struct BSP_NODE_LUMP
+{
+  int plane;
+  int children[2];
+  int bbox_min[3];
+  int bbox_max[3];
+};
+
+struct BSP_LEAF_LUMP
+{
+  int cluster;
+  int area;
+  int bbox_min[3];
+  int bbox_max[3];
+  int first_leaf_face;
+  int num_leaf_faces;
+  int first_leaf_brush;
+  int num_leaf_brushes;
+};
+
+struct BSP_VERTEX_LUMP
+{
+  float position[3];
+  float texcoords[2][2];
+  float normal[3];
+  unsigned char color[4];
+};
+
+struct BSP_FACE_LUMP
+{
+  int texture_index;
+  int effect_index;
+  int type;
+  int first_vertex;
+  int num_vertices;
+  int first_mesh_vertex;
+  int num_mesh_vertices;
+  int lightmap_index;
+  int lightmap_corner[2];
+  int lightmap_size[2];
+  float lightmap_origin[3];
+  float lightmap_vecs[2][3];
+  float normal[3];
+  int patch_size[2];
+};
+
+struct BSP_MODEL_LUMP
+{
+  float bbox_min[3];
+  float bbox_max[3];
+  int first_face;
+  int num_faces;
+  int first_brush;
+  int num_brushes;
+};
+
+struct BSP_BRUSH_LUMP
+{
+  int first_side;
+  int num_sides;
+  int texture_index;
+};
+
+struct BSP_BRUSH_SIDE_LUMP
+{
+  int plane;
+  int texture_index;
+};
+
+struct BSP_LIGHTMAP_LUMP
+{
+  unsigned char data[128][128][3];
+};
+#pragma pack(pop)
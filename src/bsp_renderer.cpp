@@ -4,12 +4,18 @@
 #include "buffer.h"
 #include "camera.h"
 #include "colors.h"
+#include "hiz_culler.h"
 #include "hud.h"
 #include "resource_manager.h"
 #include "shader.h"
 #include "statistics.h"
 #include "texture.h"
+#include "thread_pool.h"
 #include "vertex_array.h"
+#include <limits>
+#ifdef HAS_SSE2
+#include <emmintrin.h>
+#endif
 
 #pragma pack(push, 1)
 struct BSPVertex
@@ -28,13 +34,77 @@ static const VertexAttribute s_bsp_vertex_attributes[] = {
   {"in_normal", GL_FLOAT, 3, 0, offsetof(BSPVertex, normal), sizeof(BSPVertex), false},
   {"in_color", GL_UNSIGNED_BYTE, 4, 0, offsetof(BSPVertex, color), sizeof(BSPVertex), true}};
 
-BSPRenderer::BSPRenderer(const BSP* bsp) : m_bsp(bsp) {}
+BSPRenderer::BSPRenderer(const BSP* bsp) : m_bsp(bsp)
+{
+  m_calibration_time[0].store(0);
+  m_calibration_time[1].store(0);
+  m_area_portal_open.assign(m_bsp->GetAreaPortalCount(), 1);
+}
 
-BSPRenderer::~BSPRenderer() {}
+BSPRenderer::~BSPRenderer()
+{
+  for (GLsync& fence : m_dynamic_index_fences)
+  {
+    if (fence)
+      glDeleteSync(fence);
+  }
+}
 
 bool BSPRenderer::Initialize()
 {
-  return LoadTextures() && CreateLightmaps() && CreateShaders() && UploadVertices() && CreateRenderLeaves();
+  if (!LoadTextures() || !CreateLightmaps() || !CreateShaders() || !UploadVertices() || !CreateRenderLeaves() ||
+      !CreateDynamicIndexBuffer() || !CreateHiZCuller())
+  {
+    return false;
+  }
+
+  FindOccluders();
+  return true;
+}
+
+void BSPRenderer::SetSubmitMode(SubmitMode mode)
+{
+  if (mode != SubmitMode::Static && !m_dynamic_index_buffer)
+  {
+    std::fprintf(stderr, "Persistent buffer mapping is unavailable, using static index buffer.\n");
+    mode = SubmitMode::Static;
+  }
+
+  m_submit_mode = mode;
+  m_calibration_frame = 0;
+  m_calibration_done = false;
+  m_calibration_time[0].store(0);
+  m_calibration_time[1].store(0);
+}
+
+bool BSPRenderer::IsCalibratingSubmitMode() const
+{
+  return !m_hiz_culling_enabled && m_submit_mode == SubmitMode::Auto && !m_calibration_done;
+}
+
+const char* BSPRenderer::GetSubmitPathName() const
+{
+  if (m_hiz_culling_enabled)
+    return "leaves (Hi-Z)";
+  else if (m_submit_mode == SubmitMode::Static)
+    return "static";
+  else if (m_submit_mode == SubmitMode::Dynamic)
+    return "dynamic";
+  else if (!m_calibration_done)
+    return "calibrating";
+  else
+    return (m_auto_contents == RenderList::Contents::Faces) ? "dynamic (auto)" : "static (auto)";
+}
+
+void BSPRenderer::SetHiZCullingEnabled(bool enabled)
+{
+  if (enabled && !m_hiz_culler)
+  {
+    std::fprintf(stderr, "Hi-Z culling is unavailable.\n");
+    enabled = false;
+  }
+
+  m_hiz_culling_enabled = enabled;
 }
 
 const VertexAttribute* BSPRenderer::GetBSPVertexAttributes()
@@ -59,44 +129,46 @@ bool BSPRenderer::LoadTextures()
   return true;
 }
 
-bool BSPRenderer::CreateLightmaps()
+void BSPRenderer::BrightenLightMap(const BSP::LightMap* lightmap, BSP::LightMap* out)
 {
-  m_lightmap_textures.resize(m_bsp->GetLightMapCount());
-  for (size_t i = 0; i < m_lightmap_textures.size(); i++)
+  const u32 gamma_shift = 2;
+  for (u32 y = 0; y < BSP::LIGHTMAP_SIZE; y++)
   {
-    u8 lightmap_data[BSP::LIGHTMAP_SIZE][BSP::LIGHTMAP_SIZE][3];
-    std::memcpy(lightmap_data, m_bsp->GetLightMap(i)->data, sizeof(lightmap_data));
-
-    const u32 gamma_shift = 2;
-    for (u32 y = 0; y < BSP::LIGHTMAP_SIZE; y++)
+    for (u32 x = 0; x < BSP::LIGHTMAP_SIZE; x++)
     {
-      for (u32 x = 0; x < BSP::LIGHTMAP_SIZE; x++)
-      {
-        u32 r = u32(lightmap_data[y][x][0]);
-        u32 g = u32(lightmap_data[y][x][1]);
-        u32 b = u32(lightmap_data[y][x][2]);
+      u32 r = u32(lightmap->data[y][x][0]);
+      u32 g = u32(lightmap->data[y][x][1]);
+      u32 b = u32(lightmap->data[y][x][2]);
 
-        r <<= gamma_shift;
-        g <<= gamma_shift;
-        b <<= gamma_shift;
+      r <<= gamma_shift;
+      g <<= gamma_shift;
+      b <<= gamma_shift;
 
-        u32 max = std::max(r, std::max(g, b));
-        if (max > 255)
-        {
-          float f = 255.0f / static_cast<float>(max);
-          r = static_cast<u32>(f * static_cast<float>(r));
-          g = static_cast<u32>(f * static_cast<float>(g));
-          b = static_cast<u32>(f * static_cast<float>(b));
-        }
-
-        lightmap_data[y][x][0] = u8(r);
-        lightmap_data[y][x][1] = u8(g);
-        lightmap_data[y][x][2] = u8(b);
+      u32 max = std::max(r, std::max(g, b));
+      if (max > 255)
+      {
+        float f = 255.0f / static_cast<float>(max);
+        r = static_cast<u32>(f * static_cast<float>(r));
+        g = static_cast<u32>(f * static_cast<float>(g));
+        b = static_cast<u32>(f * static_cast<float>(b));
       }
+
+      out->data[y][x][0] = u8(r);
+      out->data[y][x][1] = u8(g);
+      out->data[y][x][2] = u8(b);
     }
+  }
+}
 
+bool BSPRenderer::CreateLightmaps()
+{
+  m_lightmap_textures.resize(m_bsp->GetLightMapCount());
+  for (size_t i = 0; i < m_lightmap_textures.size(); i++)
+  {
+    BSP::LightMap lightmap;
+    BrightenLightMap(m_bsp->GetLightMap(i), &lightmap);
     m_lightmap_textures[i] = Texture::Create(Texture::Format::FORMAT_RGB8, BSP::LIGHTMAP_SIZE, BSP::LIGHTMAP_SIZE, 1,
-                                             lightmap_data, true, false, false);
+                                             lightmap.data, true, false, false);
     if (!m_lightmap_textures[i])
       return false;
   }
@@ -140,19 +212,40 @@ bool BSPRenderer::UploadVertices()
 
 bool BSPRenderer::CreateRenderLeaves()
 {
+  // Indices only live on the GPU once uploaded.
   std::vector<u32> indices;
+  BuildRenderLeaves(indices);
 
+  m_index_buffer = Buffer::Create(Buffer::Type::IndexBuffer, sizeof(u32) * indices.size(), indices.data(), false);
+  if (!m_index_buffer)
+    return false;
+
+  return true;
+}
+
+void BSPRenderer::BuildRenderLeaves(std::vector<u32>& indices)
+{
+  m_render_leaves.clear();
   for (size_t i = 0; i < m_bsp->GetLeafCount(); i++)
   {
     const BSP::Leaf* leaf = m_bsp->GetLeaf(i);
     m_render_leaves.push_back(CreateRenderLeaf(leaf, indices));
   }
 
-  m_index_buffer = Buffer::Create(Buffer::Type::IndexBuffer, sizeof(u32) * indices.size(), indices.data(), false);
-  if (!m_index_buffer)
-    return false;
+  m_node_leaf_counts.assign(m_bsp->GetNodeCount(), 0);
+  if (m_bsp->GetNodeCount() > 0)
+    CountNodeLeaves(0);
+}
 
-  return true;
+u32 BSPRenderer::CountNodeLeaves(s32 node_or_leaf)
+{
+  if (node_or_leaf < 0)
+    return m_render_leaves[~node_or_leaf].batches.empty() ? 0 : 1;
+
+  const BSP::Node* node = m_bsp->GetNode(node_or_leaf);
+  const u32 count = CountNodeLeaves(node->children[0]) + CountNodeLeaves(node->children[1]);
+  m_node_leaf_counts[node_or_leaf] = count;
+  return count;
 }
 
 static bool CanRenderFace(const BSP::Face* face)
@@ -172,6 +265,7 @@ BSPRenderer::RenderLeaf BSPRenderer::CreateRenderLeaf(const BSP::Leaf* leaf, std
   rleaf.bbox_min = leaf->bbox_min;
   rleaf.bbox_max = leaf->bbox_max;
   rleaf.cluster = leaf->cluster;
+  rleaf.area = leaf->area;
 
   for (size_t i = 0; i < leaf->faces.size(); i++)
   {
@@ -179,6 +273,8 @@ BSPRenderer::RenderLeaf BSPRenderer::CreateRenderLeaf(const BSP::Leaf* leaf, std
     if (!CanRenderFace(face))
       continue;
 
+    rleaf.faces.push_back(leaf->faces[i]);
+
     // Skip those which have already been processed.
     bool done = false;
     for (size_t j = 0; j < i; j++)
@@ -200,6 +296,7 @@ BSPRenderer::RenderLeaf BSPRenderer::CreateRenderLeaf(const BSP::Leaf* leaf, std
     batch.lightmap_index = face->lightmap_index;
     batch.start_index = u32(indices.size());
     batch.num_indices = 0;
+    batch.detail = true;
 
     for (int offset = 0; offset < face->num_indices; offset++)
     {
@@ -214,6 +311,7 @@ BSPRenderer::RenderLeaf BSPRenderer::CreateRenderLeaf(const BSP::Leaf* leaf, std
       if (!CanRenderFace(other_face) || !CanMergeFaces(face, other_face))
         continue;
 
+      batch.detail &= IsDetailFace(other_face);
       for (int offset = 0; offset < other_face->num_indices; offset++)
       {
         indices.push_back(u32(other_face->base_vertex) + m_bsp->GetIndex(other_face->base_index + offset));
@@ -227,6 +325,210 @@ BSPRenderer::RenderLeaf BSPRenderer::CreateRenderLeaf(const BSP::Leaf* leaf, std
   return rleaf;
 }
 
+bool BSPRenderer::BuildClusterDrawLists(size_t memory_budget)
+{
+  struct FaceGroup
+  {
+    const BSP::Face* first_face;
+    std::vector<u32> faces;
+  };
+
+  const u32 num_clusters = m_bsp->GetClusterCount();
+  m_cluster_draw_lists.clear();
+  m_cluster_draw_lists.resize(num_clusters, ClusterDrawList{0, 0, 0});
+  m_cluster_batches.clear();
+  m_num_cluster_draw_lists = 0;
+  if (num_clusters == 0)
+    return true;
+
+  // Clusters which see the most leaves cost the most to traverse, so they get lists first.
+  std::vector<u32> leaves_visible(num_clusters);
+  g_thread_pool->ParallelFor(num_clusters, [this, &leaves_visible](u32 cluster) {
+    u32 count = 0;
+    for (const RenderLeaf& leaf : m_render_leaves)
+    {
+      if (!leaf.batches.empty() && m_bsp->IsClusterVisible(s32(cluster), leaf.cluster))
+        count++;
+    }
+    leaves_visible[cluster] = count;
+  });
+
+  std::vector<u32> cluster_order(num_clusters);
+  for (u32 i = 0; i < num_clusters; i++)
+    cluster_order[i] = i;
+  std::stable_sort(cluster_order.begin(), cluster_order.end(),
+                   [&leaves_visible](u32 lhs, u32 rhs) { return leaves_visible[lhs] > leaves_visible[rhs]; });
+
+  // Groups every renderable face visible from a cluster by material. Faces are sorted so identical groups in
+  // different clusters compare equal and can share index data.
+  auto GatherFaceGroups = [this](u32 cluster, std::vector<FaceGroup>* groups) {
+    std::vector<bool> face_added(m_bsp->GetFaceCount(), false);
+    for (size_t leaf_index = 0; leaf_index < m_bsp->GetLeafCount(); leaf_index++)
+    {
+      const BSP::Leaf* leaf = m_bsp->GetLeaf(leaf_index);
+      if (m_render_leaves[leaf_index].batches.empty() || !m_bsp->IsClusterVisible(s32(cluster), leaf->cluster))
+        continue;
+
+      for (u32 face_index : leaf->faces)
+      {
+        const BSP::Face* face = m_bsp->GetFace(face_index);
+        if (face_added[face_index] || !CanRenderFace(face))
+          continue;
+
+        face_added[face_index] = true;
+        auto iter = std::find_if(groups->begin(), groups->end(),
+                                 [face](const FaceGroup& group) { return CanMergeFaces(group.first_face, face); });
+        if (iter != groups->end())
+          iter->faces.push_back(face_index);
+        else
+          groups->push_back({face, {face_index}});
+      }
+    }
+
+    for (FaceGroup& group : *groups)
+      std::sort(group.faces.begin(), group.faces.end());
+  };
+
+  // Existing batches by hash of their face list, for deduplication across clusters.
+  std::unordered_multimap<u64, std::pair<u32, std::vector<u32>>> batch_lookup;
+  auto HashFaceGroup = [](const FaceGroup& group) {
+    u64 hash = 14695981039346656037ull;
+    for (u32 face_index : group.faces)
+      hash = (hash ^ u64(face_index)) * 1099511628211ull;
+    return hash;
+  };
+
+  // Cluster batches are appended after the leaf batches already in the index buffer.
+  const u32 base_index = u32(m_index_buffer->GetSize() / sizeof(u32));
+  std::vector<u32> indices;
+
+  const u32 chunk_size = g_thread_pool->GetThreadCount() * 4;
+  std::vector<std::vector<FaceGroup>> chunk_groups(chunk_size);
+  size_t memory_used = 0;
+  size_t indices_saved = 0;
+  bool budget_exhausted = false;
+  for (u32 chunk_start = 0; chunk_start < num_clusters && !budget_exhausted; chunk_start += chunk_size)
+  {
+    const u32 chunk_count = std::min(chunk_size, num_clusters - chunk_start);
+    g_thread_pool->ParallelFor(chunk_count, [&](u32 i) {
+      chunk_groups[i].clear();
+      GatherFaceGroups(cluster_order[chunk_start + i], &chunk_groups[i]);
+    });
+
+    for (u32 i = 0; i < chunk_count; i++)
+    {
+      const u32 cluster = cluster_order[chunk_start + i];
+      const std::vector<FaceGroup>& groups = chunk_groups[i];
+      if (groups.empty())
+        continue;
+
+      // Work out what this cluster would add before committing to it.
+      size_t new_indices = 0;
+      for (const FaceGroup& group : groups)
+      {
+        auto range = batch_lookup.equal_range(HashFaceGroup(group));
+        if (std::none_of(range.first, range.second,
+                         [&group](const auto& it) { return it.second.second == group.faces; }))
+        {
+          for (u32 face_index : group.faces)
+            new_indices += size_t(m_bsp->GetFace(face_index)->num_indices);
+        }
+      }
+
+      const size_t cluster_memory = new_indices * sizeof(u32) + groups.size() * sizeof(ClusterBatch);
+      if ((memory_used + cluster_memory) > memory_budget)
+      {
+        budget_exhausted = true;
+        break;
+      }
+
+      memory_used += cluster_memory;
+
+      ClusterDrawList& cdl = m_cluster_draw_lists[cluster];
+      cdl.first_batch = u32(m_cluster_batches.size());
+      cdl.num_batches = u32(groups.size());
+      cdl.num_leaves = leaves_visible[cluster];
+      m_num_cluster_draw_lists++;
+
+      for (const FaceGroup& group : groups)
+      {
+        const u64 hash = HashFaceGroup(group);
+        auto range = batch_lookup.equal_range(hash);
+        auto existing = std::find_if(range.first, range.second,
+                                     [&group](const auto& it) { return it.second.second == group.faces; });
+        if (existing != range.second)
+        {
+          const ClusterBatch& batch = m_cluster_batches[existing->second.first];
+          m_cluster_batches.push_back(batch);
+          indices_saved += batch.num_indices;
+          continue;
+        }
+
+        ClusterBatch batch;
+        batch.material_index = group.first_face->texture_index;
+        batch.lightmap_index = group.first_face->lightmap_index;
+        batch.start_index = base_index + u32(indices.size());
+        batch.num_indices = 0;
+        batch.bbox_min = group.first_face->bbox_min;
+        batch.bbox_max = group.first_face->bbox_max;
+        for (u32 face_index : group.faces)
+        {
+          const BSP::Face* face = m_bsp->GetFace(face_index);
+          for (int offset = 0; offset < face->num_indices; offset++)
+            indices.push_back(u32(face->base_vertex) + m_bsp->GetIndex(face->base_index + offset));
+          batch.num_indices += u32(face->num_indices);
+          batch.bbox_min = glm::min(batch.bbox_min, face->bbox_min);
+          batch.bbox_max = glm::max(batch.bbox_max, face->bbox_max);
+        }
+
+        batch_lookup.emplace(hash, std::make_pair(u32(m_cluster_batches.size()), group.faces));
+        m_cluster_batches.push_back(batch);
+      }
+    }
+  }
+
+  std::fprintf(stdout, "Precomputed draw lists for %u of %u clusters (%u batches, %.2f MB, %u indices shared)\n",
+               u32(m_num_cluster_draw_lists), num_clusters, u32(m_cluster_batches.size()),
+               float(memory_used) / 1048576.0f, u32(indices_saved));
+
+  if (indices.empty())
+    return true;
+
+  const size_t base_size = m_index_buffer->GetSize();
+  std::unique_ptr<Buffer> index_buffer =
+    Buffer::Create(Buffer::Type::IndexBuffer, base_size + sizeof(u32) * indices.size(), nullptr, false);
+  if (!index_buffer)
+    return false;
+
+  index_buffer->Copy(0, *m_index_buffer, 0, base_size);
+  index_buffer->Update(base_size, sizeof(u32) * indices.size(), indices.data());
+  m_index_buffer = std::move(index_buffer);
+  return true;
+}
+
+bool BSPRenderer::CreateDynamicIndexBuffer()
+{
+  // Faces are deduplicated when gathered, so a segment never needs more than every renderable index once.
+  size_t segment_size = 0;
+  for (const BSP::Face& face : m_bsp->GetFaces())
+  {
+    if (CanRenderFace(&face))
+      segment_size += size_t(face.num_indices);
+  }
+
+  m_dynamic_index_segment_size = u32(segment_size);
+  m_dynamic_index_buffer = Buffer::CreatePersistentMapped(
+    Buffer::Type::IndexBuffer, sizeof(u32) * std::max<size_t>(segment_size, 1) * NUM_DYNAMIC_INDEX_SEGMENTS);
+  if (!m_dynamic_index_buffer)
+  {
+    std::fprintf(stderr, "Failed to create persistently-mapped index buffer, dynamic path disabled.\n");
+    m_submit_mode = SubmitMode::Static;
+  }
+
+  // Not fatal, the static path is always available.
+  return true;
+}
+
 std::unique_ptr<ShaderProgram> CreateProgram()
 {
   const char* vs = R"(
@@ -334,13 +636,192 @@ static void DrawNodeBounds(const Camera& camera, s32 camera_cluster, const BSP*
   }
 }
 
-void BSPRenderer::Render(const Camera& camera) const
+void BSPRenderer::Render(const Camera& camera)
+{
+  using ClockSource = std::chrono::steady_clock;
+
+  auto start_time = ClockSource::now();
+  BuildRenderList(camera, &m_render_list);
+  auto cull_end_time = ClockSource::now();
+  m_render_list.Sort();
+  auto sort_end_time = ClockSource::now();
+  SubmitRenderList(camera, m_render_list);
+  auto submit_end_time = ClockSource::now();
+
+  g_statistics->AddVisibleLeaves(m_render_list.GetVisibleLeafCount());
+  g_statistics->AddOccludedLeaves(m_render_list.GetOccludedLeafCount());
+  g_statistics->AddPortalRejectedLeaves(m_render_list.GetPortalRejectedLeafCount());
+  g_statistics->AddCullTime(std::chrono::duration<float>(cull_end_time - start_time).count());
+  g_statistics->AddSortTime(std::chrono::duration<float>(sort_end_time - cull_end_time).count());
+  g_statistics->AddSubmitTime(std::chrono::duration<float>(submit_end_time - sort_end_time).count());
+}
+
+void BSPRenderer::BuildRenderList(const Camera& camera, RenderList* list)
+{
+  auto start_time = std::chrono::steady_clock::now();
+
+  const RenderList::Contents contents = GetContentsForNextList();
+  list->Clear(contents);
+  CullWorld(camera, list);
+
+  AddCalibrationTime(contents, std::chrono::steady_clock::now() - start_time);
+}
+
+RenderList::Contents BSPRenderer::GetContentsForNextList()
+{
+  if (m_hiz_culling_enabled)
+    return RenderList::Contents::Leaves;
+  else if (m_submit_mode == SubmitMode::Static)
+    return RenderList::Contents::IndexRanges;
+  else if (m_submit_mode == SubmitMode::Dynamic)
+    return RenderList::Contents::Faces;
+  else if (m_calibration_done)
+    return m_auto_contents;
+
+  const u32 frame = m_calibration_frame++;
+  if (frame < (SUBMIT_MODE_WARMUP_FRAMES + SUBMIT_MODE_CALIBRATION_FRAMES))
+    return (frame & 1) ? RenderList::Contents::Faces : RenderList::Contents::IndexRanges;
+
+  const double static_time = double(m_calibration_time[0].load()) * 1e-6 / (SUBMIT_MODE_CALIBRATION_FRAMES / 2);
+  const double dynamic_time = double(m_calibration_time[1].load()) * 1e-6 / (SUBMIT_MODE_CALIBRATION_FRAMES / 2);
+  m_auto_contents = (dynamic_time < static_time) ? RenderList::Contents::Faces : RenderList::Contents::IndexRanges;
+  m_calibration_done = true;
+  std::fprintf(stdout, "Submit path: static %.3f ms, dynamic %.3f ms per frame, using %s\n", static_time,
+               dynamic_time, (m_auto_contents == RenderList::Contents::Faces) ? "dynamic" : "static");
+  return m_auto_contents;
+}
+
+void BSPRenderer::AddCalibrationTime(RenderList::Contents contents, std::chrono::steady_clock::duration time)
+{
+  if (m_submit_mode != SubmitMode::Auto || m_calibration_done || m_calibration_frame <= SUBMIT_MODE_WARMUP_FRAMES ||
+      contents == RenderList::Contents::Leaves)
+  {
+    return;
+  }
+
+  const u64 ns = u64(std::chrono::duration_cast<std::chrono::nanoseconds>(time).count());
+  m_calibration_time[(contents == RenderList::Contents::Faces) ? 1 : 0].fetch_add(ns);
+}
+
+void BSPRenderer::CullWorld(const Camera& camera, RenderList* list)
+{
+  const BSP::Leaf* leaf_for_camera = m_bsp->FindLeafForPosition(camera.GetPosition());
+  const s32 cluster_for_camera = leaf_for_camera ? leaf_for_camera->cluster : -1;
+  if (!m_temporal_coherence_enabled)
+  {
+    CullVisibleSet(camera, leaf_for_camera, list);
+    return;
+  }
+
+  // Nothing to do if neither the view nor anything else affecting the result has changed.
+  CullSettings settings = GetCullSettings(camera, list->GetContents(), cluster_for_camera);
+  if (m_last_list_valid && m_last_view_projection == camera.GetViewProjectionMatrix() &&
+      settings.contents == m_last_settings.contents && settings.camera_cluster == m_last_settings.camera_cluster &&
+      settings.occlusion_culling == m_last_settings.occlusion_culling &&
+      settings.portal_culling == m_last_settings.portal_culling &&
+      settings.min_projected_area == m_last_settings.min_projected_area &&
+      settings.detail_distance == m_last_settings.detail_distance &&
+      settings.viewport_height == m_last_settings.viewport_height &&
+      settings.area_portal_generation == m_last_settings.area_portal_generation)
+  {
+    *list = m_last_list;
+    return;
+  }
+
+  CullVisibleSet(camera, leaf_for_camera, list);
+
+  m_last_list = *list;
+  m_last_settings = settings;
+  m_last_view_projection = camera.GetViewProjectionMatrix();
+  m_last_list_valid = true;
+}
+
+BSPRenderer::CullSettings BSPRenderer::GetCullSettings(const Camera& camera, RenderList::Contents contents,
+                                                       s32 camera_cluster) const
+{
+  CullSettings settings;
+  settings.contents = contents;
+  settings.camera_cluster = camera_cluster;
+  settings.occlusion_culling = m_occlusion_culling_enabled;
+  settings.portal_culling = m_portal_culling_enabled;
+  settings.min_projected_area = m_min_projected_area;
+  settings.detail_distance = m_detail_distance;
+  settings.viewport_height = camera.GetViewportHeight();
+  settings.area_portal_generation = m_area_portal_generation;
+  return settings;
+}
+
+void BSPRenderer::CullVisibleSet(const Camera& camera, const BSP::Leaf* leaf_for_camera, RenderList* list)
+{
+  const s32 cluster_for_camera = leaf_for_camera ? leaf_for_camera->cluster : -1;
+
+  m_occlusion_buffer_valid = false;
+  if (m_occlusion_culling_enabled)
+    RasterizeOccluders(camera);
+
+  if (cluster_for_camera < 0)
+    UpdateFallbackClusters(camera.GetPosition());
+
+  m_projection_scale =
+    float(camera.GetViewportHeight()) * 0.5f / std::tan(glm::radians(camera.GetFieldOfView()) * 0.5f);
+
+  FloodAreas(leaf_for_camera);
+
+  m_portal_flood_valid = false;
+  if (m_portal_culling_enabled)
+    FloodPortals(camera, leaf_for_camera);
+
+#if 1
+  // The precomputed lists cover the whole PVS, so they're only of use when nothing is narrowing it.
+  if (list->GetContents() == RenderList::Contents::IndexRanges && !m_portal_flood_valid && !m_area_mask_valid &&
+      m_detail_distance <= 0.0f && CullClusterDrawList(camera, cluster_for_camera, list))
+  {
+    return;
+  }
+
+  if (UpdateCoherentLeaves(camera, cluster_for_camera))
+  {
+    CullCoherentLeaves(camera, list);
+    return;
+  }
+
+  if (m_parallel_cull_depth == 0 || g_thread_pool->GetThreadCount() == 1)
+  {
+    CullNode(camera, cluster_for_camera, m_bsp->GetRootNode(), list);
+    return;
+  }
+
+  m_cull_jobs.clear();
+  GatherCullJobs(camera, 0, 0);
+  if (m_cull_job_lists.size() < m_cull_jobs.size())
+    m_cull_job_lists.resize(m_cull_jobs.size());
+
+  g_thread_pool->ParallelFor(u32(m_cull_jobs.size()), [this, &camera, cluster_for_camera, list](u32 i) {
+    RenderList& job_list = m_cull_job_lists[i];
+    job_list.Clear(list->GetContents());
+    if (m_cull_jobs[i] < 0)
+      CullLeaf(camera, cluster_for_camera, m_render_leaves[~m_cull_jobs[i]], &job_list);
+    else
+      CullNode(camera, cluster_for_camera, m_bsp->GetNode(m_cull_jobs[i]), &job_list);
+  });
+
+  // Merging in job order keeps the result identical to a serial traversal.
+  for (size_t i = 0; i < m_cull_jobs.size(); i++)
+    list->Append(m_cull_job_lists[i]);
+#else
+  for (const RenderLeaf& leaf : m_render_leaves)
+    CullLeaf(camera, cluster_for_camera, leaf, list);
+#endif
+}
+
+void BSPRenderer::SubmitRenderList(const Camera& camera, const RenderList& list)
 {
+  auto start_time = std::chrono::steady_clock::now();
+
   m_lightmap_shader_program->Bind();
   m_lightmap_shader_program->SetUniform(0, camera.GetViewProjectionMatrix());
 
   m_vertex_array->Bind();
-  m_index_buffer->Bind();
 
   glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
   // glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
@@ -353,63 +834,851 @@ void BSPRenderer::Render(const Camera& camera) const
   glDepthMask(GL_TRUE);
   glDepthFunc(GL_LESS);
 
-  const BSP::Leaf* leaf_for_camera = m_bsp->FindLeafForPosition(camera.GetPosition());
-  s32 cluster_for_camera = leaf_for_camera ? leaf_for_camera->cluster : -1;
+  if (list.GetContents() == RenderList::Contents::Leaves)
+    SubmitLeaves(camera, list);
+  else if (list.GetContents() == RenderList::Contents::Faces)
+    SubmitFaces(list);
+  else
+    SubmitIndexRanges(list);
+
+  AddCalibrationTime(list.GetContents(), std::chrono::steady_clock::now() - start_time);
 
-#if 1
-  DrawNode(camera, cluster_for_camera, m_bsp->GetRootNode());
 #if 0
+  const BSP::Leaf* leaf_for_camera = m_bsp->FindLeafForPosition(camera.GetPosition());
+  s32 cluster_for_camera = leaf_for_camera ? leaf_for_camera->cluster : -1;
   glDisable(GL_DEPTH_TEST);
   DrawNodeBounds(camera, cluster_for_camera, m_bsp, m_bsp->GetRootNode());
 #endif
-#else
-  for (const RenderLeaf& leaf : m_render_leaves)
-    DrawLeaf(camera, leaf);
-#endif
 }
 
-void BSPRenderer::DrawNode(const Camera& camera, s32 camera_cluster, const BSP::Node* node) const
+void BSPRenderer::SubmitIndexRanges(const RenderList& list)
 {
-  if (!camera.GetFrustum().IntersectsAABox(node->bbox_min, node->bbox_max))
-    return;
+  m_index_buffer->Bind();
 
-  // order of traversal is reversed for solid vs transparent
-  const Plane::Side side = node->plane.ClassifyPoint(camera.GetPosition());
-  const u32 first_child = (side == Plane::Side::BehindPlane) ? 1 : 0;
-  const u32 second_child = first_child ^ 1u;
-  if (node->children[first_child] < 0)
-    DrawLeaf(camera, camera_cluster, m_render_leaves[~node->children[first_child]]);
-  else
-    DrawNode(camera, camera_cluster, m_bsp->GetNode(node->children[first_child]));
+  const size_t num_commands = list.GetCommandCount();
+  u32 last_state = 0;
+  bool has_state = false;
+  for (size_t i = 0; i < num_commands;)
+  {
+    const RenderList::Command& cmd = list.GetCommand(i++);
+    const u32 state = RenderList::GetStateBits(cmd.sort_key);
+    if (!has_state || state != last_state)
+    {
+      const s32 material_index = RenderList::GetMaterialIndex(cmd.sort_key);
+      const s32 lightmap_index = RenderList::GetLightmapIndex(cmd.sort_key);
+      if (material_index >= 0 && m_textures[material_index])
+        m_textures[material_index]->Bind(0);
+      else
+        g_resource_manager->GetDefaultTexture()->Bind(0);
+
+      if (lightmap_index >= 0)
+        m_lightmap_textures[lightmap_index]->Bind(1);
+      else
+        m_default_lightmap_texture->Bind(1);
+
+      last_state = state;
+      has_state = true;
+    }
 
-  if (node->children[second_child] < 0)
-    DrawLeaf(camera, camera_cluster, m_render_leaves[~node->children[second_child]]);
-  else
-    DrawNode(camera, camera_cluster, m_bsp->GetNode(node->children[second_child]));
+    // Coalesce following commands which share state and are adjacent in the index buffer.
+    u32 num_indices = cmd.num_indices;
+    while (i < num_commands)
+    {
+      const RenderList::Command& next_cmd = list.GetCommand(i);
+      if (RenderList::GetStateBits(next_cmd.sort_key) != state ||
+          next_cmd.start_index != (cmd.start_index + num_indices))
+      {
+        break;
+      }
+
+      num_indices += next_cmd.num_indices;
+      i++;
+    }
+
+    glDrawElements(GL_TRIANGLES, num_indices, GL_UNSIGNED_INT, reinterpret_cast<void*>(cmd.start_index * sizeof(u32)));
+    g_statistics->AddDraw();
+    g_statistics->AddTriangles(num_indices / 3);
+  }
 }
 
-void BSPRenderer::DrawLeaf(const Camera& camera, s32 camera_cluster, const RenderLeaf& leaf) const
+// Copies a face's indices, rebasing them to its first vertex.
+static void CopyFaceIndices(u32* dst, const u32* src, u32 count, u32 base_vertex)
 {
-  if (leaf.batches.empty() || !m_bsp->IsClusterVisible(camera_cluster, leaf.cluster) ||
-      !camera.GetFrustum().IntersectsAABox(leaf.bbox_min, leaf.bbox_max))
+  u32 i = 0;
+#ifdef HAS_SSE2
+  const __m128i base = _mm_set1_epi32(s32(base_vertex));
+  for (; (i + 4) <= count; i += 4)
   {
-    return;
+    const __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_add_epi32(values, base));
   }
+#endif
+  for (; i < count; i++)
+    dst[i] = src[i] + base_vertex;
+}
 
-  for (const RenderLeaf::Batch& batch : leaf.batches)
+void BSPRenderer::SubmitFaces(const RenderList& list)
+{
+  // Wait until the GPU is done with the segment we're about to overwrite (from three frames ago).
+  const u32 segment = m_dynamic_index_segment;
+  m_dynamic_index_segment = (m_dynamic_index_segment + 1) % NUM_DYNAMIC_INDEX_SEGMENTS;
+  if (m_dynamic_index_fences[segment])
   {
-    if (batch.material_index >= 0 && m_textures[batch.material_index])
-      m_textures[batch.material_index]->Bind(0);
-    else
-      g_resource_manager->GetDefaultTexture()->Bind(0);
+    for (;;)
+    {
+      const GLenum result =
+        glClientWaitSync(m_dynamic_index_fences[segment], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+      if (result != GL_TIMEOUT_EXPIRED)
+        break;
+    }
 
-    if (batch.lightmap_index >= 0)
-      m_lightmap_textures[batch.lightmap_index]->Bind(1);
-    else
-      m_default_lightmap_texture->Bind(1);
+    glDeleteSync(m_dynamic_index_fences[segment]);
+    m_dynamic_index_fences[segment] = nullptr;
+  }
+
+  m_dynamic_index_buffer->Bind();
+
+  const u32 segment_start = segment * m_dynamic_index_segment_size;
+  u32* const segment_ptr = static_cast<u32*>(m_dynamic_index_buffer->GetPersistentMapping()) + segment_start;
+  const u32* const bsp_indices = m_bsp->GetIndices().data();
+  u32 write_pos = 0;
+  u32 batch_start = 0;
+
+  auto FlushBatch = [&]() {
+    if (write_pos == batch_start)
+      return;
 
-    glDrawElements(GL_TRIANGLES, batch.num_indices, GL_UNSIGNED_INT,
-                   reinterpret_cast<void*>(batch.start_index * sizeof(u32)));
+    glDrawElements(GL_TRIANGLES, write_pos - batch_start, GL_UNSIGNED_INT,
+                   reinterpret_cast<void*>((segment_start + batch_start) * sizeof(u32)));
     g_statistics->AddDraw();
+    g_statistics->AddTriangles((write_pos - batch_start) / 3);
+    batch_start = write_pos;
+  };
+
+  const size_t num_commands = list.GetCommandCount();
+  u32 last_state = 0;
+  u64 last_key = 0;
+  for (size_t i = 0; i < num_commands; i++)
+  {
+    const RenderList::Command& cmd = list.GetCommand(i);
+    const u32 state = RenderList::GetStateBits(cmd.sort_key);
+    if (i == 0 || state != last_state)
+    {
+      FlushBatch();
+
+      const s32 material_index = RenderList::GetMaterialIndex(cmd.sort_key);
+      const s32 lightmap_index = RenderList::GetLightmapIndex(cmd.sort_key);
+      if (material_index >= 0 && m_textures[material_index])
+        m_textures[material_index]->Bind(0);
+      else
+        g_resource_manager->GetDefaultTexture()->Bind(0);
+
+      if (lightmap_index >= 0)
+        m_lightmap_textures[lightmap_index]->Bind(1);
+      else
+        m_default_lightmap_texture->Bind(1);
+
+      last_state = state;
+    }
+    else if (cmd.sort_key == last_key)
+    {
+      // Same face referenced from more than one visible leaf.
+      continue;
+    }
+
+    const BSP::Face* face = m_bsp->GetFace(cmd.start_index);
+    CopyFaceIndices(segment_ptr + write_pos, bsp_indices + face->base_index, cmd.num_indices, u32(face->base_vertex));
+    write_pos += cmd.num_indices;
+    last_key = cmd.sort_key;
   }
+
+  FlushBatch();
+
+  m_dynamic_index_fences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+bool BSPRenderer::CreateHiZCuller()
+{
+  std::vector<HiZCuller::Bounds> bounds;
+  bounds.reserve(m_render_leaves.size());
+  for (const RenderLeaf& leaf : m_render_leaves)
+    bounds.push_back({glm::vec4(leaf.bbox_min, 1.0f), glm::vec4(leaf.bbox_max, 1.0f)});
+
+  m_hiz_culler = HiZCuller::Create(bounds.data(), u32(bounds.size()));
+  if (!m_hiz_culler)
+    std::fprintf(stderr, "Failed to create Hi-Z culler, GPU occlusion culling disabled.\n");
+
+  // Start with nothing visible, so the first frame draws everything in the second phase.
+  m_hiz_leaf_visible.assign(m_render_leaves.size(), 0);
+
+  // Not fatal.
+  return true;
+}
+
+void BSPRenderer::AddLeafBatches(const Camera& camera, u32 leaf_index, RenderList* list) const
+{
+  const RenderLeaf& leaf = m_render_leaves[leaf_index];
+  const bool include_detail = !IsBoxBeyondDetailDistance(camera, leaf.bbox_min, leaf.bbox_max);
+  for (const RenderLeaf::Batch& batch : leaf.batches)
+  {
+    if (include_detail || !batch.detail)
+      list->AddCommand(batch.material_index, batch.lightmap_index, batch.start_index, batch.num_indices);
+  }
+}
+
+bool BSPRenderer::IsDetailFace(const BSP::Face* face) const
+{
+  return face->type == BSP::FACE_TYPE_MESH ||
+         (face->texture_index >= 0 &&
+          (m_bsp->GetTexture(size_t(face->texture_index))->contents_flags & BSP::CONTENTS_DETAIL) != 0);
+}
+
+bool BSPRenderer::IsBoxTooSmall(const Camera& camera, const glm::vec3& bmin, const glm::vec3& bmax) const
+{
+  if (m_min_projected_area <= 0.0f)
+    return false;
+
+  // Area of the bounding sphere's projection, pi * (r * scale / d)^2, compared without the divide.
+  const glm::vec3 center = (bmin + bmax) * 0.5f;
+  const glm::vec3 to_center = center - camera.GetPosition();
+  const float radius_sq = glm::dot(bmax - center, bmax - center);
+  const float distance_sq = glm::dot(to_center, to_center);
+  if (distance_sq <= radius_sq)
+    return false;
+
+  return (3.14159265f * radius_sq * m_projection_scale * m_projection_scale) < (m_min_projected_area * distance_sq);
+}
+
+bool BSPRenderer::IsBoxBeyondDetailDistance(const Camera& camera, const glm::vec3& bmin, const glm::vec3& bmax) const
+{
+  if (m_detail_distance <= 0.0f)
+    return false;
+
+  const glm::vec3 nearest = glm::clamp(camera.GetPosition(), bmin, bmax);
+  const glm::vec3 offset = nearest - camera.GetPosition();
+  return glm::dot(offset, offset) > (m_detail_distance * m_detail_distance);
+}
+
+void BSPRenderer::SubmitLeaves(const Camera& camera, const RenderList& list)
+{
+  const std::vector<u32>& leaves = list.GetLeaves();
+
+  // Feedback on the leaves drawn in an earlier phase 1, collected once the GPU has finished the test so it doesn't
+  // stall. A leaf which turned out hidden is left to the second phase.
+  if (m_hiz_culler->ReadResults(&m_hiz_tested_leaves, &m_hiz_results))
+  {
+    for (size_t i = 0; i < m_hiz_tested_leaves.size(); i++)
+      m_hiz_leaf_visible[m_hiz_tested_leaves[i]] = (m_hiz_results[i] != 0) ? 1 : 0;
+  }
+
+  // Phase 1: candidates which were visible last frame. Their depth stands in for the previous frame's, reprojected.
+  m_hiz_phase_list.Clear();
+  m_hiz_drawn_leaves.clear();
+  m_hiz_hidden_leaves.clear();
+  for (u32 leaf_index : leaves)
+  {
+    if (m_hiz_leaf_visible[leaf_index])
+    {
+      AddLeafBatches(camera, leaf_index, &m_hiz_phase_list);
+      m_hiz_drawn_leaves.push_back(leaf_index);
+    }
+    else
+    {
+      m_hiz_hidden_leaves.push_back(leaf_index);
+    }
+  }
+  m_hiz_phase_list.Sort();
+  SubmitIndexRanges(m_hiz_phase_list);
+
+  // Phase 2: test the remaining candidates against what was drawn, and draw the newly disoccluded ones. These are
+  // needed in this frame, so the test waits for the GPU.
+  m_hiz_culler->BuildDepthPyramid();
+  m_hiz_culler->TestBoundsAndWait(camera.GetViewProjectionMatrix(), m_hiz_hidden_leaves.data(),
+                                  u32(m_hiz_hidden_leaves.size()), &m_hiz_results);
+
+  // The leaves drawn in phase 1 are tested against the same pyramid, for the next frame to pick up.
+  m_hiz_culler->TestBounds(camera.GetViewProjectionMatrix(), m_hiz_drawn_leaves.data(),
+                           u32(m_hiz_drawn_leaves.size()));
+
+  m_hiz_phase_list.Clear();
+  u32 num_occluded = 0;
+  for (size_t i = 0; i < m_hiz_hidden_leaves.size(); i++)
+  {
+    const u32 leaf_index = m_hiz_hidden_leaves[i];
+    if (m_hiz_results[i] != 0)
+    {
+      AddLeafBatches(camera, leaf_index, &m_hiz_phase_list);
+      m_hiz_leaf_visible[leaf_index] = 1;
+    }
+    else
+    {
+      num_occluded++;
+    }
+  }
+  m_hiz_phase_list.Sort();
+
+  m_lightmap_shader_program->Bind();
+  m_vertex_array->Bind();
+  SubmitIndexRanges(m_hiz_phase_list);
+
+  g_statistics->AddOccludedLeaves(num_occluded);
+}
+
+void BSPRenderer::UpdateFallbackClusters(const glm::vec3& position)
+{
+  if (m_fallback_computed && glm::all(glm::lessThanEqual(glm::abs(position - m_fallback_position),
+                                                          glm::vec3(FALLBACK_UPDATE_DISTANCE))))
+  {
+    return;
+  }
+
+  m_fallback_position = position;
+  m_fallback_computed = true;
+  m_fallback_valid = false;
+  if (!m_bsp->HasVisData())
+    return;
+
+  const u32 num_clusters = m_bsp->GetClusterCount();
+  m_fallback_cluster_visible.assign(num_clusters, 0);
+  for (float radius = FALLBACK_MIN_RADIUS; radius <= FALLBACK_MAX_RADIUS && !m_fallback_valid; radius *= 2.0f)
+  {
+    m_fallback_leaves.clear();
+    m_bsp->FindLeavesInBox(position - glm::vec3(radius), position + glm::vec3(radius), &m_fallback_leaves);
+    for (u32 leaf_index : m_fallback_leaves)
+    {
+      const s32 cluster = m_bsp->GetLeaf(leaf_index)->cluster;
+      if (cluster < 0 || u32(cluster) >= num_clusters || m_fallback_cluster_visible[cluster] == 2)
+        continue;
+
+      // 2 marks clusters whose PVS has already been merged.
+      for (u32 other = 0; other < num_clusters; other++)
+      {
+        if (m_fallback_cluster_visible[other] == 0 && m_bsp->IsClusterVisible(cluster, s32(other)))
+          m_fallback_cluster_visible[other] = 1;
+      }
+      m_fallback_cluster_visible[cluster] = 2;
+      m_fallback_valid = true;
+    }
+  }
+}
+
+void BSPRenderer::SetTemporalCoherenceEnabled(bool enabled)
+{
+  m_temporal_coherence_enabled = enabled;
+  m_last_list_valid = false;
+  m_coherent_valid = false;
+}
+
+// Angle of the rotation between two orientations.
+static float GetRotationAngle(const glm::quat& a, const glm::quat& b)
+{
+  return 2.0f * std::acos(std::min(std::abs(glm::dot(a, b)), 1.0f));
+}
+
+// Signed distance of the box inside (positive) or outside (negative) of the normalized frustum planes; zero if it
+// crosses a plane. Also returns the distance from the eye to the farthest corner.
+static float GetBoxFrustumSlack(const glm::vec4* planes, const glm::vec3& eye, const glm::vec3& bmin,
+                                const glm::vec3& bmax, float* distance)
+{
+  float inside = std::numeric_limits<float>::max();
+  float outside = 0.0f;
+  for (u32 i = 0; i < Frustum::NUM_PLANES; i++)
+  {
+    const glm::vec3 normal(planes[i]);
+    const glm::vec3 positive(normal.x >= 0.0f ? bmax.x : bmin.x, normal.y >= 0.0f ? bmax.y : bmin.y,
+                             normal.z >= 0.0f ? bmax.z : bmin.z);
+    const glm::vec3 negative(normal.x >= 0.0f ? bmin.x : bmax.x, normal.y >= 0.0f ? bmin.y : bmax.y,
+                             normal.z >= 0.0f ? bmin.z : bmax.z);
+    const float max_distance = glm::dot(normal, positive) + planes[i].w;
+    const float min_distance = glm::dot(normal, negative) + planes[i].w;
+    outside = std::max(outside, -max_distance);
+    inside = std::min(inside, min_distance);
+  }
+
+  const glm::vec3 farthest = glm::max(glm::abs(bmin - eye), glm::abs(bmax - eye));
+  *distance = glm::length(farthest);
+  return (outside > 0.0f) ? -outside : std::max(inside, 0.0f);
+}
+
+bool BSPRenderer::UpdateCoherentLeaves(const Camera& camera, s32 camera_cluster)
+{
+  // Only the frustum test is incremental, so anything else depending on the exact view rules it out.
+  if (!m_temporal_coherence_enabled || camera_cluster < 0 || m_occlusion_culling_enabled || m_portal_flood_valid ||
+      m_min_projected_area > 0.0f || m_detail_distance > 0.0f)
+  {
+    m_coherent_valid = false;
+    return false;
+  }
+
+  if (m_coherent_valid && m_coherent_cluster == camera_cluster &&
+      m_coherent_projection == camera.GetProjectionMatrix() &&
+      m_coherent_area_portal_generation == m_area_portal_generation &&
+      glm::length(camera.GetPosition() - m_coherent_position) <= COHERENCE_MAX_MOVEMENT &&
+      GetRotationAngle(camera.GetRotation(), m_coherent_rotation) <= COHERENCE_MAX_ROTATION)
+  {
+    return true;
+  }
+
+  glm::vec4 planes[Frustum::NUM_PLANES];
+  for (u32 i = 0; i < Frustum::NUM_PLANES; i++)
+  {
+    const glm::vec4& plane = camera.GetFrustum().GetPlane(Frustum::PLANE(i));
+    planes[i] = plane / glm::length(glm::vec3(plane));
+  }
+
+  m_coherent_leaves.clear();
+  CollectCoherentLeaves(camera, camera_cluster, planes, 0);
+  m_coherent_position = camera.GetPosition();
+  m_coherent_rotation = camera.GetRotation();
+  m_coherent_projection = camera.GetProjectionMatrix();
+  m_coherent_cluster = camera_cluster;
+  m_coherent_area_portal_generation = m_area_portal_generation;
+  m_coherent_valid = true;
+  return true;
+}
+
+void BSPRenderer::CollectCoherentLeaves(const Camera& camera, s32 camera_cluster, const glm::vec4* planes,
+                                        s32 node_or_leaf)
+{
+  // Planes move relative to a point by at most the camera movement plus its distance times the rotation angle.
+  // Anything further outside than that within the limits can be left out.
+  const glm::vec3& eye = camera.GetPosition();
+  float slack, distance;
+  if (node_or_leaf < 0)
+  {
+    const RenderLeaf& leaf = m_render_leaves[~node_or_leaf];
+    if (leaf.batches.empty() || !IsLeafClusterVisible(camera_cluster, leaf.cluster) || !IsAreaVisible(leaf.area))
+      return;
+
+    slack = GetBoxFrustumSlack(planes, eye, leaf.bbox_min, leaf.bbox_max, &distance);
+    if (-slack <= (distance * COHERENCE_MAX_ROTATION + COHERENCE_MAX_MOVEMENT))
+      m_coherent_leaves.push_back({u32(~node_or_leaf), slack, distance});
+    return;
+  }
+
+  const BSP::Node* node = m_bsp->GetNode(node_or_leaf);
+  slack = GetBoxFrustumSlack(planes, eye, node->bbox_min, node->bbox_max, &distance);
+  if (-slack > (distance * COHERENCE_MAX_ROTATION + COHERENCE_MAX_MOVEMENT))
+    return;
+
+  const u32 first_child = (node->plane.ClassifyPoint(eye) == Plane::Side::BehindPlane) ? 1 : 0;
+  CollectCoherentLeaves(camera, camera_cluster, planes, node->children[first_child]);
+  CollectCoherentLeaves(camera, camera_cluster, planes, node->children[first_child ^ 1u]);
+}
+
+void BSPRenderer::CullCoherentLeaves(const Camera& camera, RenderList* list) const
+{
+  // Leaves further inside or outside than the view could have moved keep their state, the rest are re-tested.
+  const float movement = glm::length(camera.GetPosition() - m_coherent_position);
+  const float rotation = GetRotationAngle(camera.GetRotation(), m_coherent_rotation);
+  for (const CoherentLeaf& cl : m_coherent_leaves)
+  {
+    const RenderLeaf& leaf = m_render_leaves[cl.leaf_index];
+    const bool visible = (std::abs(cl.slack) > (cl.distance * rotation + movement)) ?
+                           (cl.slack > 0.0f) :
+                           camera.GetFrustum().IntersectsAABox(leaf.bbox_min, leaf.bbox_max);
+    if (visible)
+      EmitLeaf(camera, leaf, list);
+  }
+}
+
+void BSPRenderer::SetAreaPortalOpen(u32 index, bool open)
+{
+  const u8 value = open ? 1 : 0;
+  if (m_area_portal_open[index] == value)
+    return;
+
+  m_area_portal_open[index] = value;
+  m_area_portal_generation++;
+}
+
+void BSPRenderer::SetAllAreaPortalsOpen(bool open)
+{
+  for (u32 i = 0; i < u32(m_area_portal_open.size()); i++)
+    SetAreaPortalOpen(i, open);
+}
+
+void BSPRenderer::FloodAreas(const BSP::Leaf* camera_leaf)
+{
+  // Nothing to do until a door is closed, or when outside the world.
+  m_area_mask_valid = false;
+  if (!camera_leaf || camera_leaf->area < 0 ||
+      std::all_of(m_area_portal_open.begin(), m_area_portal_open.end(), [](u8 open) { return open != 0; }))
+  {
+    return;
+  }
+
+  m_area_visible.assign(m_bsp->GetAreaCount(), 0);
+  m_area_visible[camera_leaf->area] = 1;
+  m_area_stack.clear();
+  m_area_stack.push_back(u32(camera_leaf->area));
+  while (!m_area_stack.empty())
+  {
+    const u32 area = m_area_stack.back();
+    m_area_stack.pop_back();
+    for (size_t i = 0; i < m_bsp->GetAreaPortalCount(); i++)
+    {
+      const BSP::AreaPortal* portal = m_bsp->GetAreaPortal(i);
+      if (!m_area_portal_open[i] || (portal->areas[0] != area && portal->areas[1] != area))
+        continue;
+
+      const u32 other_area = portal->areas[(portal->areas[0] == area) ? 1 : 0];
+      if (!m_area_visible[other_area])
+      {
+        m_area_visible[other_area] = 1;
+        m_area_stack.push_back(other_area);
+      }
+    }
+  }
+
+  m_area_mask_valid = true;
+}
+
+void BSPRenderer::FloodPortals(const Camera& camera, const BSP::Leaf* camera_leaf)
+{
+  // Outside the world there's nothing to flood from.
+  if (!camera_leaf || camera_leaf->cluster < 0 || m_bsp->GetPortalCount() == 0)
+    return;
+
+  if (m_portal_leaf_frame.size() != m_bsp->GetLeafCount())
+    m_portal_leaf_frame.assign(m_bsp->GetLeafCount(), 0);
+  if (m_portal_visit_frame.size() != m_bsp->GetPortalCount())
+  {
+    m_portal_visit_frame.assign(m_bsp->GetPortalCount(), 0);
+    m_portal_visit_windings.resize(m_bsp->GetPortalCount());
+  }
+
+  // Stamps only need to differ from the last frame's; on wrap-around, clear them so old ones can't match.
+  if (++m_portal_frame == 0)
+  {
+    std::fill(m_portal_leaf_frame.begin(), m_portal_leaf_frame.end(), 0);
+    std::fill(m_portal_visit_frame.begin(), m_portal_visit_frame.end(), 0);
+    m_portal_frame = 1;
+  }
+
+  // The side planes of the view frustum. The near and far planes are left to the regular frustum test, so portals
+  // close to the eye aren't clipped away.
+  std::vector<Plane> planes;
+  const Frustum& frustum = camera.GetFrustum();
+  for (u32 i = Frustum::PLANE_LEFT; i <= Frustum::PLANE_BOTTOM; i++)
+  {
+    const glm::vec4& plane = frustum.GetPlane(Frustum::PLANE(i));
+    const float length = glm::length(glm::vec3(plane));
+    planes.emplace_back(glm::vec3(plane) / length, plane.w / length);
+  }
+
+  m_portal_path.clear();
+  m_portal_flood_steps = 0;
+  FloodPortalLeaf(camera.GetPosition(), camera_leaf->index, planes);
+  m_portal_flood_valid = (m_portal_flood_steps <= MAX_PORTAL_FLOOD_STEPS);
+}
+
+void BSPRenderer::FloodPortalLeaf(const glm::vec3& eye, u32 leaf_index, const std::vector<Plane>& planes)
+{
+  // Distance within which the eye counts as in the portal, where the planes through its edges are degenerate.
+  static constexpr float PORTAL_NEAR_DISTANCE = 1.0f;
+
+  m_portal_leaf_frame[leaf_index] = m_portal_frame;
+  m_portal_path.push_back(leaf_index);
+
+  std::vector<Plane> portal_planes;
+  for (u32 portal_index : m_bsp->GetLeaf(leaf_index)->portals)
+  {
+    if (++m_portal_flood_steps > MAX_PORTAL_FLOOD_STEPS)
+      break;
+
+    const BSP::Portal* portal = m_bsp->GetPortal(portal_index);
+    const bool forward = (portal->leaves[0] == leaf_index);
+    const u32 other_leaf = portal->leaves[forward ? 1 : 0];
+
+    // Don't go back through leaves already on the path.
+    if (std::find(m_portal_path.begin(), m_portal_path.end(), other_leaf) != m_portal_path.end())
+      continue;
+
+    // Orient the portal plane to face into the next leaf; it can only be seen through from behind.
+    const Plane portal_plane = forward ? portal->plane :
+                                         Plane(-portal->plane.GetNormal(), -portal->plane.GetDistance());
+    const float eye_distance = portal_plane.Distance(eye);
+    if (eye_distance > PORTAL_NEAR_DISTANCE)
+      continue;
+
+    if (eye_distance > -PORTAL_NEAR_DISTANCE)
+    {
+      FloodPortalLeaf(eye, other_leaf, planes);
+      continue;
+    }
+
+    Winding winding = portal->winding;
+    for (size_t i = 0; i < planes.size() && !winding.IsEmpty(); i++)
+      winding.Clip(planes[i]);
+    if (winding.IsEmpty())
+      continue;
+
+    // Skip paths which can't see anything through the portal that an earlier one didn't. After a few different
+    // paths, go through the whole portal, which every later path is inside of.
+    std::vector<Winding>& visits = m_portal_visit_windings[portal_index];
+    if (m_portal_visit_frame[portal_index] != m_portal_frame)
+    {
+      m_portal_visit_frame[portal_index] = m_portal_frame;
+      visits.clear();
+    }
+    if (std::any_of(visits.begin(), visits.end(), [&winding](const Winding& seen) { return seen.Contains(winding); }))
+      continue;
+    if (visits.size() == MAX_PORTAL_VISITS)
+      winding = portal->winding;
+    visits.push_back(winding);
+
+    // Narrow the frustum to the planes through the eye and each edge of what is left of the portal.
+    const glm::vec3 center = winding.GetCenter();
+    portal_planes.clear();
+    for (size_t i = 0; i < winding.GetPointCount(); i++)
+    {
+      const glm::vec3& p0 = winding.GetPoint(i);
+      const glm::vec3& p1 = winding.GetPoint((i + 1) % winding.GetPointCount());
+      glm::vec3 normal = glm::cross(p0 - eye, p1 - eye);
+      const float length = glm::length(normal);
+      if (length < 0.001f)
+        continue;
+
+      normal /= length;
+      if (glm::dot(normal, center - eye) < 0.0f)
+        normal = -normal;
+      portal_planes.emplace_back(normal, -glm::dot(normal, eye));
+    }
+
+    // Only what is beyond the portal can be seen through it.
+    portal_planes.push_back(portal_plane);
+    FloodPortalLeaf(eye, other_leaf, portal_planes);
+  }
+
+  m_portal_path.pop_back();
+}
+
+bool BSPRenderer::CullClusterDrawList(const Camera& camera, s32 camera_cluster, RenderList* list) const
+{
+  if (camera_cluster < 0 || u32(camera_cluster) >= m_cluster_draw_lists.size() ||
+      m_cluster_draw_lists[camera_cluster].num_batches == 0)
+  {
+    return false;
+  }
+
+  // Batches span many leaves, so the count is of every leaf in the cluster's PVS rather than those in the frustum.
+  const ClusterDrawList& cdl = m_cluster_draw_lists[camera_cluster];
+  list->AddVisibleLeaves(cdl.num_leaves);
+  for (u32 i = 0; i < cdl.num_batches; i++)
+  {
+    const ClusterBatch& batch = m_cluster_batches[cdl.first_batch + i];
+    if (camera.GetFrustum().IntersectsAABox(batch.bbox_min, batch.bbox_max) &&
+        !IsBoxTooSmall(camera, batch.bbox_min, batch.bbox_max) && !IsBoxOccluded(batch.bbox_min, batch.bbox_max))
+    {
+      list->AddCommand(batch.material_index, batch.lightmap_index, batch.start_index, batch.num_indices);
+    }
+  }
+
+  return true;
+}
+
+void BSPRenderer::GatherCullJobs(const Camera& camera, s32 node_or_leaf, u32 depth)
+{
+  if (node_or_leaf < 0 || depth == m_parallel_cull_depth)
+  {
+    m_cull_jobs.push_back(node_or_leaf);
+    return;
+  }
+
+  const BSP::Node* node = m_bsp->GetNode(node_or_leaf);
+  if (!camera.GetFrustum().IntersectsAABox(node->bbox_min, node->bbox_max))
+    return;
+
+  const Plane::Side side = node->plane.ClassifyPoint(camera.GetPosition());
+  const u32 first_child = (side == Plane::Side::BehindPlane) ? 1 : 0;
+  GatherCullJobs(camera, node->children[first_child], depth + 1);
+  GatherCullJobs(camera, node->children[first_child ^ 1u], depth + 1);
+}
+
+void BSPRenderer::CullNode(const Camera& camera, s32 camera_cluster, const BSP::Node* node, RenderList* list) const
+{
+  if (!camera.GetFrustum().IntersectsAABox(node->bbox_min, node->bbox_max) ||
+      IsBoxTooSmall(camera, node->bbox_min, node->bbox_max))
+  {
+    return;
+  }
+
+  if (IsBoxOccluded(node->bbox_min, node->bbox_max))
+  {
+    CountOccludedLeaves(camera, camera_cluster, s32(node - m_bsp->GetRootNode()), list);
+    return;
+  }
+
+  // order of traversal is reversed for solid vs transparent
+  const Plane::Side side = node->plane.ClassifyPoint(camera.GetPosition());
+  const u32 first_child = (side == Plane::Side::BehindPlane) ? 1 : 0;
+  const u32 second_child = first_child ^ 1u;
+  if (node->children[first_child] < 0)
+    CullLeaf(camera, camera_cluster, m_render_leaves[~node->children[first_child]], list);
+  else
+    CullNode(camera, camera_cluster, m_bsp->GetNode(node->children[first_child]), list);
+
+  if (node->children[second_child] < 0)
+    CullLeaf(camera, camera_cluster, m_render_leaves[~node->children[second_child]], list);
+  else
+    CullNode(camera, camera_cluster, m_bsp->GetNode(node->children[second_child]), list);
+}
+
+void BSPRenderer::CullLeaf(const Camera& camera, s32 camera_cluster, const RenderLeaf& leaf, RenderList* list) const
+{
+  if (leaf.batches.empty() || !IsLeafClusterVisible(camera_cluster, leaf.cluster) || !IsAreaVisible(leaf.area) ||
+      !camera.GetFrustum().IntersectsAABox(leaf.bbox_min, leaf.bbox_max) ||
+      IsBoxTooSmall(camera, leaf.bbox_min, leaf.bbox_max))
+  {
+    return;
+  }
+
+  if (!IsLeafPortalVisible(u32(&leaf - m_render_leaves.data())))
+  {
+    list->AddPortalRejectedLeaves(1);
+    return;
+  }
+
+  if (IsBoxOccluded(leaf.bbox_min, leaf.bbox_max))
+  {
+    list->AddOccludedLeaves(1);
+    return;
+  }
+
+  EmitLeaf(camera, leaf, list);
+}
+
+void BSPRenderer::EmitLeaf(const Camera& camera, const RenderLeaf& leaf, RenderList* list) const
+{
+  if (list->GetContents() == RenderList::Contents::Leaves)
+  {
+    list->AddLeaf(u32(&leaf - m_render_leaves.data()));
+  }
+  else if (list->GetContents() == RenderList::Contents::Faces)
+  {
+    const bool include_detail = !IsBoxBeyondDetailDistance(camera, leaf.bbox_min, leaf.bbox_max);
+    for (u32 face_index : leaf.faces)
+    {
+      const BSP::Face* face = m_bsp->GetFace(face_index);
+      if (!include_detail && IsDetailFace(face))
+        continue;
+
+      list->AddFaceCommand(face->texture_index, face->lightmap_index, face_index, u32(face->num_indices));
+    }
+  }
+  else
+  {
+    AddLeafBatches(camera, u32(&leaf - m_render_leaves.data()), list);
+  }
+
+  list->AddVisibleLeaf();
+}
+
+void BSPRenderer::FindOccluders()
+{
+  m_occluders.clear();
+  for (size_t i = 0; i < m_bsp->GetFaceCount(); i++)
+  {
+    const BSP::Face* face = m_bsp->GetFace(i);
+    if (face->type != BSP::FACE_TYPE_BRUSH || !CanRenderFace(face) || face->texture_index < 0)
+      continue;
+
+    const BSP::Texture* tex = m_bsp->GetTexture(size_t(face->texture_index));
+    if (!(tex->contents_flags & BSP::CONTENTS_SOLID) || (tex->contents_flags & BSP::CONTENTS_TRANSLUCENT) ||
+        (tex->surface_flags & (BSP::SURF_SKY | BSP::SURF_NODRAW)))
+    {
+      continue;
+    }
+
+    float area = 0.0f;
+    for (int j = 0; j < face->num_indices; j += 3)
+    {
+      const glm::vec3& v0 = m_bsp->GetVertex(face->base_vertex + m_bsp->GetIndex(face->base_index + j))->position;
+      const glm::vec3& v1 = m_bsp->GetVertex(face->base_vertex + m_bsp->GetIndex(face->base_index + j + 1))->position;
+      const glm::vec3& v2 = m_bsp->GetVertex(face->base_vertex + m_bsp->GetIndex(face->base_index + j + 2))->position;
+      area += glm::length(glm::cross(v1 - v0, v2 - v0)) * 0.5f;
+    }
+
+    if (area >= MIN_OCCLUDER_AREA)
+      m_occluders.push_back({(face->bbox_min + face->bbox_max) * 0.5f, area, u32(i)});
+  }
+}
+
+void BSPRenderer::RasterizeOccluders(const Camera& camera)
+{
+  // Score candidates by approximate solid angle, and keep the best few.
+  m_frame_occluders.clear();
+  for (u32 i = 0; i < u32(m_occluders.size()); i++)
+  {
+    const Occluder& occluder = m_occluders[i];
+    const float distance = glm::distance(camera.GetPosition(), occluder.center);
+    if (distance > MAX_OCCLUDER_DISTANCE)
+      continue;
+
+    const BSP::Face* face = m_bsp->GetFace(occluder.face_index);
+    if (!camera.GetFrustum().IntersectsAABox(face->bbox_min, face->bbox_max))
+      continue;
+
+    m_frame_occluders.emplace_back(occluder.area / std::max(distance * distance, 1.0f), occluder.face_index);
+  }
+
+  if (m_frame_occluders.size() > MAX_OCCLUDERS_PER_FRAME)
+  {
+    std::partial_sort(m_frame_occluders.begin(), m_frame_occluders.begin() + MAX_OCCLUDERS_PER_FRAME,
+                      m_frame_occluders.end(), [](const auto& lhs, const auto& rhs) { return lhs.first > rhs.first; });
+    m_frame_occluders.resize(MAX_OCCLUDERS_PER_FRAME);
+  }
+
+  m_occlusion_buffer.Clear(camera.GetViewProjectionMatrix());
+  for (const auto& it : m_frame_occluders)
+  {
+    const BSP::Face* face = m_bsp->GetFace(it.second);
+    for (int j = 0; j < face->num_indices; j += 3)
+    {
+      m_occlusion_buffer.RasterizeTriangle(
+        m_bsp->GetVertex(face->base_vertex + m_bsp->GetIndex(face->base_index + j))->position,
+        m_bsp->GetVertex(face->base_vertex + m_bsp->GetIndex(face->base_index + j + 1))->position,
+        m_bsp->GetVertex(face->base_vertex + m_bsp->GetIndex(face->base_index + j + 2))->position);
+    }
+  }
+
+  m_occlusion_buffer.UpdateTiles();
+  m_occlusion_buffer_valid = true;
+}
+
+bool BSPRenderer::IsBoxOccluded(const glm::vec3& bmin, const glm::vec3& bmax) const
+{
+  return m_occlusion_buffer_valid && m_occlusion_buffer.IsBoxOccluded(bmin, bmax);
+}
+
+void BSPRenderer::CountOccludedLeaves(const Camera& camera, s32 camera_cluster, s32 node_or_leaf,
+                                      RenderList* list) const
+{
+  // Applies the tests CullLeaf() would have, short of the occlusion test, so the counts match culling the subtree.
+  if (node_or_leaf < 0)
+  {
+    const RenderLeaf& leaf = m_render_leaves[~node_or_leaf];
+    if (leaf.batches.empty() || !IsLeafClusterVisible(camera_cluster, leaf.cluster) || !IsAreaVisible(leaf.area) ||
+        !camera.GetFrustum().IntersectsAABox(leaf.bbox_min, leaf.bbox_max) ||
+        IsBoxTooSmall(camera, leaf.bbox_min, leaf.bbox_max))
+    {
+      return;
+    }
+
+    if (!IsLeafPortalVisible(u32(~node_or_leaf)))
+      list->AddPortalRejectedLeaves(1);
+    else
+      list->AddOccludedLeaves(1);
+
+    return;
+  }
+
+  // Subtrees without renderable leaves or outside the frustum can't contain any, so they aren't walked.
+  const BSP::Node* node = m_bsp->GetNode(node_or_leaf);
+  if (m_node_leaf_counts[node_or_leaf] == 0 || !camera.GetFrustum().IntersectsAABox(node->bbox_min, node->bbox_max))
+    return;
+
+  CountOccludedLeaves(camera, camera_cluster, node->children[0], list);
+  CountOccludedLeaves(camera, camera_cluster, node->children[1], list);
 }
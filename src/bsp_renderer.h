@@ -1,10 +1,16 @@
 #pragma once
 #include "bsp.h"
+#include "occlusion_buffer.h"
+#include "render_list.h"
+#include <atomic>
+#include <glad.h>
+#include <glm/gtc/quaternion.hpp>
 #include <memory>
 #include <vector>
 
 class Buffer;
 class Camera;
+class HiZCuller;
 class ShaderProgram;
 struct VertexAttribute;
 class VertexArray;
@@ -13,17 +19,96 @@ class Texture;
 class BSPRenderer
 {
 public:
+  enum class SubmitMode
+  {
+    // Draws the per-leaf ranges of the static index buffer.
+    Static,
+
+    // Gathers visible faces each frame and compacts their indices into a streamed buffer, one draw per material.
+    Dynamic,
+
+    // Times both paths over the first frames, then sticks with the faster one for this map.
+    Auto
+  };
+
   BSPRenderer(const BSP* bsp);
   ~BSPRenderer();
 
   bool Initialize();
 
-  void Render(const Camera& camera) const;
+  // Culls, sorts and submits the world in one go, recording the time taken by each stage.
+  void Render(const Camera& camera);
+
+  // Visibility stage: fills the list with the batches visible from the camera, front-to-back. No GL calls are made.
+  void BuildRenderList(const Camera& camera, RenderList* list);
+
+  // Submission stage: executes a (sorted) render list.
+  void SubmitRenderList(const Camera& camera, const RenderList& list);
+
+  SubmitMode GetSubmitMode() const { return m_submit_mode; }
+  void SetSubmitMode(SubmitMode mode);
+
+  // True while Auto mode is still alternating between the paths. Benchmarks should render until this is over.
+  bool IsCalibratingSubmitMode() const;
+
+  // Name of the path frames are currently submitted with, for reports.
+  const char* GetSubmitPathName() const;
+
+  // Subtrees at this depth are culled in parallel on the thread pool. Zero culls everything on the calling thread.
+  u32 GetParallelCullDepth() const { return m_parallel_cull_depth; }
+  void SetParallelCullDepth(u32 depth) { m_parallel_cull_depth = depth; }
+
+  // Rasterizes large world faces near the camera into a software depth buffer, and rejects nodes and leaves which
+  // are hidden behind them.
+  bool IsOcclusionCullingEnabled() const { return m_occlusion_culling_enabled; }
+  void SetOcclusionCullingEnabled(bool enabled) { m_occlusion_culling_enabled = enabled; }
+
+  // Two-phase GPU occlusion culling: leaves visible last frame are drawn first, then a depth pyramid is built from
+  // the result and the remaining candidates are tested against it, drawing those which turned visible. Whether the
+  // first phase's leaves are still visible is read back a frame or more later. Requires compute shaders.
+  bool IsHiZCullingEnabled() const { return m_hiz_culling_enabled; }
+  void SetHiZCullingEnabled(bool enabled);
+
+  // Floods from the camera leaf through the portals generated by the BSP, narrowing the frustum to each portal, and
+  // rejects leaves which are not reached. Tighter than the PVS, at the cost of a per-frame traversal.
+  bool IsPortalCullingEnabled() const { return m_portal_culling_enabled; }
+  void SetPortalCullingEnabled(bool enabled) { m_portal_culling_enabled = enabled; }
+
+  // Contribution culling: nodes and leaves whose bounding sphere would cover fewer pixels than this are skipped.
+  // Zero disables it.
+  float GetMinProjectedArea() const { return m_min_projected_area; }
+  void SetMinProjectedArea(float pixels) { m_min_projected_area = pixels; }
+
+  // Detail surfaces (detail brushes and model meshes) are skipped in leaves farther away than this. Zero disables it.
+  float GetDetailDistance() const { return m_detail_distance; }
+  void SetDetailDistance(float distance) { m_detail_distance = distance; }
+
+  // Temporal coherence: an unchanged view reuses the previous list, and while the camera moves slowly within a
+  // cluster, only the leaves close enough to the frustum boundary to have crossed it are re-tested.
+  bool IsTemporalCoherenceEnabled() const { return m_temporal_coherence_enabled; }
+  void SetTemporalCoherenceEnabled(bool enabled);
+
+  // Area portals (doors) open and closed at runtime. Leaves in areas which can't be reached from the camera's area
+  // through open portals are rejected along with the PVS test. All portals start open.
+  bool IsAreaPortalOpen(u32 index) const { return m_area_portal_open[index] != 0; }
+  void SetAreaPortalOpen(u32 index, bool open);
+  void SetAllAreaPortalsOpen(bool open);
+
+  // Precomputes a material-merged draw list for each cluster, covering every surface in its PVS. Clusters are
+  // processed most-visible first, until the index and batch data would exceed memory_budget bytes.
+  bool BuildClusterDrawLists(size_t memory_budget);
+  size_t GetClusterDrawListCount() const { return m_num_cluster_draw_lists; }
+
+  // Applies the overbright shift used for rendering, scaling down texels which would saturate to keep their hue.
+  static void BrightenLightMap(const BSP::LightMap* lightmap, BSP::LightMap* out);
 
   static const VertexAttribute* GetBSPVertexAttributes();
   static const size_t GetBSPVertexAttributeCount();
 
 private:
+  // The microbenchmarks time render leaf creation and culling without a GL context.
+  friend class KernelBenchmarks;
+
   struct RenderLeaf
   {
     glm::vec3 bbox_min;
@@ -35,10 +120,59 @@ private:
       s32 lightmap_index;
       u32 start_index;
       u32 num_indices;
+      bool detail;
     };
 
     std::vector<Batch> batches;
+    std::vector<u32> faces;
     s32 cluster;
+    s32 area;
+  };
+
+  struct ClusterBatch
+  {
+    glm::vec3 bbox_min;
+    glm::vec3 bbox_max;
+    s32 material_index;
+    s32 lightmap_index;
+    u32 start_index;
+    u32 num_indices;
+  };
+
+  struct ClusterDrawList
+  {
+    u32 first_batch;
+    u32 num_batches;
+    u32 num_leaves;
+  };
+
+  // Leaf which may enter the frustum while the camera stays within the coherence limits. slack is how far inside
+  // (positive) or outside (negative) the frustum the box was, distance how far its farthest corner was from the eye.
+  struct CoherentLeaf
+  {
+    u32 leaf_index;
+    float slack;
+    float distance;
+  };
+
+  // Everything besides the view which affects the list.
+  struct CullSettings
+  {
+    RenderList::Contents contents;
+    s32 camera_cluster;
+    bool occlusion_culling;
+    bool portal_culling;
+    float min_projected_area;
+    float detail_distance;
+    u32 viewport_height;
+    u32 area_portal_generation;
+  };
+
+  struct Occluder
+  {
+    glm::vec3 center;
+    float area;
+    u32 face_index;
   };
 
   bool LoadTextures();
@@ -49,10 +183,70 @@ private:
   bool UploadVertices();
 
   bool CreateRenderLeaves();
+
+  // CPU half of CreateRenderLeaves(): fills the render leaves and appends their indices, without touching GL.
+  void BuildRenderLeaves(std::vector<u32>& indices);
   RenderLeaf CreateRenderLeaf(const BSP::Leaf* leaf, std::vector<u32>& indices) const;
+  u32 CountNodeLeaves(s32 node_or_leaf);
+
+  bool CreateDynamicIndexBuffer();
+
+  void FindOccluders();
+  void RasterizeOccluders(const Camera& camera);
+  bool IsBoxOccluded(const glm::vec3& bmin, const glm::vec3& bmax) const;
+
+  // Adds the leaves below an occluded node which passed the PVS and frustum tests to the list's statistics.
+  void CountOccludedLeaves(const Camera& camera, s32 camera_cluster, s32 node_or_leaf, RenderList* list) const;
+
+  RenderList::Contents GetContentsForNextList();
+  void AddCalibrationTime(RenderList::Contents contents, std::chrono::steady_clock::duration time);
+
+  void SubmitIndexRanges(const RenderList& list);
+  void SubmitFaces(const RenderList& list);
+
+  bool CreateHiZCuller();
+  void SubmitLeaves(const Camera& camera, const RenderList& list);
+  void AddLeafBatches(const Camera& camera, u32 leaf_index, RenderList* list) const;
+
+  bool IsDetailFace(const BSP::Face* face) const;
+  bool IsBoxTooSmall(const Camera& camera, const glm::vec3& bmin, const glm::vec3& bmax) const;
+  bool IsBoxBeyondDetailDistance(const Camera& camera, const glm::vec3& bmin, const glm::vec3& bmax) const;
+
+  // When the camera is in a solid leaf, visibility is taken from the union of the PVS of the clusters nearby.
+  void UpdateFallbackClusters(const glm::vec3& position);
+  bool IsLeafClusterVisible(s32 camera_cluster, s32 leaf_cluster) const
+  {
+    if (camera_cluster < 0 && m_fallback_valid)
+      return leaf_cluster < 0 || m_fallback_cluster_visible[leaf_cluster] != 0;
+    return m_bsp->IsClusterVisible(camera_cluster, leaf_cluster);
+  }
+
+  void FloodAreas(const BSP::Leaf* camera_leaf);
+  bool IsAreaVisible(s32 area) const { return !m_area_mask_valid || area < 0 || m_area_visible[area] != 0; }
+
+  void FloodPortals(const Camera& camera, const BSP::Leaf* camera_leaf);
+  void FloodPortalLeaf(const glm::vec3& eye, u32 leaf_index, const std::vector<Plane>& planes);
+  bool IsLeafPortalVisible(u32 leaf_index) const
+  {
+    return !m_portal_flood_valid || m_portal_leaf_frame[leaf_index] == m_portal_frame;
+  }
+
+  void CullWorld(const Camera& camera, RenderList* list);
+  void CullVisibleSet(const Camera& camera, const BSP::Leaf* camera_leaf, RenderList* list);
+
+  CullSettings GetCullSettings(const Camera& camera, RenderList::Contents contents, s32 camera_cluster) const;
+  bool UpdateCoherentLeaves(const Camera& camera, s32 camera_cluster);
+  void CollectCoherentLeaves(const Camera& camera, s32 camera_cluster, const glm::vec4* planes, s32 node_or_leaf);
+  void CullCoherentLeaves(const Camera& camera, RenderList* list) const;
 
-  void DrawNode(const Camera& camera, s32 camera_cluster, const BSP::Node* node) const;
-  void DrawLeaf(const Camera& camera, s32 camera_cluster, const RenderLeaf& leaf) const;
+  // Collects the subtrees at the split depth in front-to-back order.
+  void GatherCullJobs(const Camera& camera, s32 node_or_leaf, u32 depth);
+
+  bool CullClusterDrawList(const Camera& camera, s32 camera_cluster, RenderList* list) const;
+
+  void CullNode(const Camera& camera, s32 camera_cluster, const BSP::Node* node, RenderList* list) const;
+  void CullLeaf(const Camera& camera, s32 camera_cluster, const RenderLeaf& leaf, RenderList* list) const;
+  void EmitLeaf(const Camera& camera, const RenderLeaf& leaf, RenderList* list) const;
 
   const BSP* m_bsp;
 
@@ -67,4 +261,118 @@ private:
   std::unique_ptr<ShaderProgram> m_lightmap_shader_program;
 
   std::vector<RenderLeaf> m_render_leaves;
+
+  // Renderable leaves below each node, so counting the leaves hidden by an occluded node skips empty subtrees.
+  std::vector<u32> m_node_leaf_counts;
+
+  // Indexed by cluster; clusters without a precomputed list have num_batches == 0.
+  std::vector<ClusterDrawList> m_cluster_draw_lists;
+  std::vector<ClusterBatch> m_cluster_batches;
+  size_t m_num_cluster_draw_lists = 0;
+
+  RenderList m_render_list;
+
+  // Triple-buffered, persistently mapped ring for the dynamic path. Each segment holds every renderable index once.
+  static constexpr u32 NUM_DYNAMIC_INDEX_SEGMENTS = 3;
+  std::unique_ptr<Buffer> m_dynamic_index_buffer;
+  GLsync m_dynamic_index_fences[NUM_DYNAMIC_INDEX_SEGMENTS] = {};
+  u32 m_dynamic_index_segment_size = 0;
+  u32 m_dynamic_index_segment = 0;
+
+  // Auto mode alternates the paths for a number of frames, accumulating cull + submit time of each.
+  // In pipelined mode, submission runs on the render thread while the main thread picks the next list's contents,
+  // so everything both sides read is atomic.
+  static constexpr u32 SUBMIT_MODE_WARMUP_FRAMES = 16;
+  static constexpr u32 SUBMIT_MODE_CALIBRATION_FRAMES = 128;
+  std::atomic<SubmitMode> m_submit_mode{SubmitMode::Auto};
+  RenderList::Contents m_auto_contents = RenderList::Contents::IndexRanges;
+  std::atomic<u32> m_calibration_frame{0};
+  std::atomic<bool> m_calibration_done{false};
+  std::atomic<u64> m_calibration_time[2];
+
+  // Faces large and opaque enough to be worth rasterizing; the best few near the camera are used each frame.
+  static constexpr u32 MAX_OCCLUDERS_PER_FRAME = 64;
+  static constexpr float MIN_OCCLUDER_AREA = 64.0f * 64.0f;
+  static constexpr float MAX_OCCLUDER_DISTANCE = 2048.0f;
+  std::vector<Occluder> m_occluders;
+  std::vector<std::pair<float, u32>> m_frame_occluders;
+  OcclusionBuffer m_occlusion_buffer;
+  bool m_occlusion_culling_enabled = false;
+  bool m_occlusion_buffer_valid = false;
+
+  // Per-leaf visibility from the latest Hi-Z results, the candidates drawn and left over by the first phase, and the
+  // list used to draw each phase.
+  std::unique_ptr<HiZCuller> m_hiz_culler;
+  std::vector<u8> m_hiz_leaf_visible;
+  std::vector<u32> m_hiz_drawn_leaves;
+  std::vector<u32> m_hiz_hidden_leaves;
+  std::vector<u32> m_hiz_tested_leaves;
+  std::vector<u32> m_hiz_results;
+  RenderList m_hiz_phase_list;
+  bool m_hiz_culling_enabled = false;
+
+  // The search doubles the radius up to the maximum, stopping at the first which reaches any cluster. The result is
+  // reused until the camera moves further than the update distance.
+  static constexpr float FALLBACK_MIN_RADIUS = 128.0f;
+  static constexpr float FALLBACK_MAX_RADIUS = 2048.0f;
+  static constexpr float FALLBACK_UPDATE_DISTANCE = 16.0f;
+  std::vector<u8> m_fallback_cluster_visible;
+  std::vector<u32> m_fallback_leaves;
+  glm::vec3 m_fallback_position = {};
+  bool m_fallback_valid = false;
+  bool m_fallback_computed = false;
+
+  // Contribution culling thresholds, and pixels per unit at unit distance for the current frame.
+  float m_min_projected_area = 0.0f;
+  float m_detail_distance = 0.0f;
+  float m_projection_scale = 1.0f;
+
+  // The previous list, and the settings and view it was built with.
+  bool m_temporal_coherence_enabled = true;
+  bool m_last_list_valid = false;
+  RenderList m_last_list;
+  CullSettings m_last_settings;
+  glm::mat4 m_last_view_projection;
+
+  // Leaves near or inside the frustum when the set was built, in front-to-back order. The set stays valid until the
+  // camera has moved or turned further than these limits from where it was built.
+  static constexpr float COHERENCE_MAX_MOVEMENT = 64.0f;
+  static constexpr float COHERENCE_MAX_ROTATION = 0.05f;
+  std::vector<CoherentLeaf> m_coherent_leaves;
+  glm::vec3 m_coherent_position;
+  glm::quat m_coherent_rotation;
+  glm::mat4 m_coherent_projection;
+  s32 m_coherent_cluster = -1;
+  u32 m_coherent_area_portal_generation = 0;
+  bool m_coherent_valid = false;
+
+  // Open state of each BSP area portal, and the areas connected to the camera's area this frame. The generation is
+  // bumped whenever a portal opens or closes, so cached results can tell whether they are stale.
+  std::vector<u8> m_area_portal_open;
+  u32 m_area_portal_generation = 0;
+  std::vector<u8> m_area_visible;
+  std::vector<u32> m_area_stack;
+  bool m_area_mask_valid = false;
+
+  // Leaves reached by the last flood are stamped with its frame number. If the flood runs out of steps, culling falls
+  // back to the PVS alone for that frame.
+  static constexpr u32 MAX_PORTAL_FLOOD_STEPS = 65536;
+  std::vector<u32> m_portal_leaf_frame;
+  std::vector<u32> m_portal_path;
+
+  // What was left of each portal after clipping, for every time the flood went through it this frame. The frustum
+  // beyond a portal only depends on the eye and that winding, so a path arriving with a winding inside one of these
+  // can't reach anything new. Bounds the passes through each portal, so the flood is linear in the portal count.
+  static constexpr u32 MAX_PORTAL_VISITS = 4;
+  std::vector<u32> m_portal_visit_frame;
+  std::vector<std::vector<Winding>> m_portal_visit_windings;
+  u32 m_portal_frame = 0;
+  u32 m_portal_flood_steps = 0;
+  bool m_portal_culling_enabled = false;
+  bool m_portal_flood_valid = false;
+
+  // Node index, or ~leaf index, of each subtree to be culled in parallel, and the list each one produces.
+  std::vector<s32> m_cull_jobs;
+  std::vector<RenderList> m_cull_job_lists;
+  u32 m_parallel_cull_depth = 0;
 };
@@ -9,7 +9,7 @@ static constexpr size_t BufferTypeIndex(Buffer::Type type)
 }
 
 static const GLenum s_gl_types[BufferTypeIndex(Buffer::Type::Count)] = {GL_ARRAY_BUFFER, GL_ELEMENT_ARRAY_BUFFER,
-                                                                        GL_UNIFORM_BUFFER};
+                                                                        GL_UNIFORM_BUFFER, GL_SHADER_STORAGE_BUFFER};
 static GLuint s_last_buffer[BufferTypeIndex(Buffer::Type::Count)];
 
 Buffer::Buffer(Type type, size_t size, u32 id, bool dynamic) : m_type(type), m_size(size), m_id(id), m_dynamic(dynamic)
@@ -47,6 +47,14 @@ void Buffer::Bind()
   s_last_buffer[index] = m_id;
 }
 
+void Buffer::BindBase(u32 binding)
+{
+  // Also binds to the generic binding point.
+  const size_t index = BufferTypeIndex(m_type);
+  glBindBufferBase(s_gl_types[index], binding, m_id);
+  s_last_buffer[index] = m_id;
+}
+
 void Buffer::Unbind()
 {
   Unbind(m_type);
@@ -74,7 +82,7 @@ void Buffer::Update(size_t offset, size_t count, const void* data)
     s_last_buffer[index] = m_id;
   }
 
-  if (offset == 0 && count == count)
+  if (offset == 0 && count == m_size)
     glBufferData(s_gl_types[index], count, data, m_dynamic ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW);
   else
     glBufferSubData(s_gl_types[index], offset, count, data);
@@ -83,6 +91,16 @@ void Buffer::Update(size_t offset, size_t count, const void* data)
     VertexArray::TemporaryRebind();
 }
 
+void Buffer::Copy(size_t offset, const Buffer& src, size_t src_offset, size_t count)
+{
+  // The copy targets leave the per-type bindings alone.
+  glBindBuffer(GL_COPY_READ_BUFFER, src.m_id);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, m_id);
+  glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, src_offset, offset, count);
+  glBindBuffer(GL_COPY_READ_BUFFER, 0);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
 void* Buffer::Map(bool read /* = false */, bool write /* = true */)
 {
   if (m_type == Type::VertexBuffer)
@@ -150,3 +168,38 @@ std::unique_ptr<Buffer> Buffer::Create(Type type, size_t size, const void* data,
 
   return std::unique_ptr<Buffer>(new Buffer(type, size, id, dynamic));
 }
+
+std::unique_ptr<Buffer> Buffer::CreatePersistentMapped(Type type, size_t size)
+{
+  if (!glBufferStorage)
+    return nullptr;
+
+  if (type == Type::VertexBuffer)
+    VertexArray::TemporaryUnbind();
+
+  const size_t index = BufferTypeIndex(type);
+
+  GLuint id;
+  glGenBuffers(1, &id);
+
+  glBindBuffer(s_gl_types[index], id);
+
+  const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  glBufferStorage(s_gl_types[index], size, nullptr, flags);
+  void* mapping = glMapBufferRange(s_gl_types[index], 0, size, flags);
+
+  glBindBuffer(s_gl_types[index], s_last_buffer[index]);
+
+  if (type == Type::VertexBuffer)
+    VertexArray::TemporaryRebind();
+
+  if (!mapping)
+  {
+    glDeleteBuffers(1, &id);
+    return nullptr;
+  }
+
+  std::unique_ptr<Buffer> buffer(new Buffer(type, size, id, true));
+  buffer->m_persistent_mapping = mapping;
+  return buffer;
+}
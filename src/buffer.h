@@ -10,6 +10,7 @@ public:
     VertexBuffer,
     IndexBuffer,
     UniformBuffer,
+    ShaderStorageBuffer,
     Count
   };
 
@@ -22,13 +23,25 @@ public:
   void Bind();
   void Unbind();
 
+  // Binds to an indexed binding point (uniform or shader storage buffers).
+  void BindBase(u32 binding);
+
   void Update(size_t offset, size_t count, const void* data);
 
+  // Copies count bytes from another buffer without a round trip through the CPU.
+  void Copy(size_t offset, const Buffer& src, size_t src_offset, size_t count);
+
   void* Map(bool read = false, bool write = true);
   void Unmap();
 
+  // Pointer to the buffer's storage, valid for the lifetime of persistently-mapped buffers.
+  void* GetPersistentMapping() const { return m_persistent_mapping; }
+
   static std::unique_ptr<Buffer> Create(Type type, size_t size, const void* data, bool dynamic = false);
 
+  // Creates an immutable buffer which stays mapped for writing (coherent). Requires GL 4.4/ARB_buffer_storage.
+  static std::unique_ptr<Buffer> CreatePersistentMapped(Type type, size_t size);
+
   static void Unbind(Type type);
 
 private:
@@ -38,4 +51,5 @@ private:
   Type m_type;
   u32 m_id;
   bool m_dynamic;
+  void* m_persistent_mapping = nullptr;
 };
\ No newline at end of file
@@ -52,6 +52,8 @@ void Camera::SetAspectRatio(u32 viewport_width, u32 viewport_height)
 {
   u32 width = std::max(viewport_width, 1u);
   u32 height = std::max(viewport_height, 1u);
+  m_viewport_width = width;
+  m_viewport_height = height;
   SetAspectRatio(float(width) / float(height));
 }
 
@@ -67,6 +69,18 @@ void Camera::SetFieldOfView(float value)
   UpdateProjectionMatrix();
 }
 
+void Camera::SetNearPlane(float value)
+{
+  m_near_plane = value;
+  UpdateProjectionMatrix();
+}
+
+void Camera::SetFarPlane(float value)
+{
+  m_far_plane = value;
+  UpdateProjectionMatrix();
+}
+
 void Camera::UpdateViewMatrix()
 {
   static const glm::mat4 camera_zup_to_yup(1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
@@ -80,8 +94,7 @@ void Camera::UpdateViewMatrix()
 
 void Camera::UpdateProjectionMatrix()
 {
-  // TODO: Customizable znear/far
-  m_projection_matrix = glm::perspective(glm::radians(m_field_of_view), m_aspect_ratio, 1.0f, 10000.0f);
+  m_projection_matrix = glm::perspective(glm::radians(m_field_of_view), m_aspect_ratio, m_near_plane, m_far_plane);
   UpdateViewProjectionMatrix();
 }
 
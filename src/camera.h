@@ -1,4 +1,5 @@
 #pragma once
+#include "common.h"
 #include "frustum.h"
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
@@ -14,6 +15,9 @@ public:
   const float GetPitch() const { return m_pitch; }
   const float GetYaw() const { return m_yaw; }
 
+  // Direction the camera is looking in, in world space.
+  glm::vec3 GetViewDirection() const { return m_rotation * m_forward_vector; }
+
   void SetPosition(const glm::vec3& pos);
   void SetRotation(const glm::quat& rotation);
   void SetPitch(float pitch);
@@ -35,6 +39,15 @@ public:
   void SetAspectRatio(float value);
   void SetFieldOfView(float value);
 
+  // Size last passed to SetAspectRatio(), for converting to pixels.
+  u32 GetViewportWidth() const { return m_viewport_width; }
+  u32 GetViewportHeight() const { return m_viewport_height; }
+
+  float GetNearPlane() const { return m_near_plane; }
+  float GetFarPlane() const { return m_far_plane; }
+  void SetNearPlane(float value);
+  void SetFarPlane(float value);
+
   const glm::mat4& GetViewMatrix() const { return m_view_matrix; }
   const glm::mat4& GetProjectionMatrix() const { return m_projection_matrix; }
   const glm::mat4& GetViewProjectionMatrix() const { return m_view_projection_matrix; }
@@ -65,6 +78,10 @@ private:
 
   float m_aspect_ratio = 640.0f / 480.0f;
   float m_field_of_view = 55.0f;
+  float m_near_plane = 1.0f;
+  float m_far_plane = 10000.0f;
+  u32 m_viewport_width = 640;
+  u32 m_viewport_height = 480;
 
   glm::mat4 m_view_matrix;
   glm::mat4 m_projection_matrix;
@@ -0,0 +1,113 @@
+#include "pch.h"
+#include "camera_path.h"
+#include "camera.h"
+#include "util.h"
+
+CameraPath::CameraPath() = default;
+
+CameraPath::~CameraPath() = default;
+
+void CameraPath::AddKeyframe(float time, const Camera& camera)
+{
+  m_keyframes.push_back(Keyframe{time, camera.GetPosition(), camera.GetYaw(), camera.GetPitch()});
+}
+
+void CameraPath::Sample(float time, Camera* camera) const
+{
+  if (m_keyframes.empty())
+    return;
+
+  // First keyframe after the time.
+  auto next = std::upper_bound(m_keyframes.begin(), m_keyframes.end(), time,
+                               [](float t, const Keyframe& keyframe) { return t < keyframe.time; });
+  if (next == m_keyframes.begin() || next == m_keyframes.end())
+  {
+    const Keyframe& keyframe = (next == m_keyframes.end()) ? m_keyframes.back() : m_keyframes.front();
+    camera->SetPosition(keyframe.position);
+    camera->SetYaw(keyframe.yaw);
+    camera->SetPitch(keyframe.pitch);
+    return;
+  }
+
+  const Keyframe& a = *(next - 1);
+  const Keyframe& b = *next;
+  const float t = (b.time > a.time) ? ((time - a.time) / (b.time - a.time)) : 1.0f;
+
+  // Yaw wraps at 360, so turn the short way round.
+  float yaw_delta = b.yaw - a.yaw;
+  if (yaw_delta > 180.0f)
+    yaw_delta -= 360.0f;
+  else if (yaw_delta < -180.0f)
+    yaw_delta += 360.0f;
+
+  camera->SetPosition(glm::mix(a.position, b.position, t));
+  camera->SetYaw(a.yaw + yaw_delta * t);
+  camera->SetPitch(a.pitch + (b.pitch - a.pitch) * t);
+}
+
+bool CameraPath::Load(const char* filename)
+{
+  auto fp = Util::FOpenUniquePtr(filename, "r");
+  if (!fp)
+  {
+    std::fprintf(stderr, "Failed to open camera path '%s'\n", filename);
+    return false;
+  }
+
+  m_keyframes.clear();
+  char line[256];
+  u32 line_number = 0;
+  while (std::fgets(line, sizeof(line), fp.get()))
+  {
+    line_number++;
+    const char* start = line;
+    while (*start == ' ' || *start == '\t')
+      start++;
+    if (*start == '#' || *start == '\n' || *start == '\r' || *start == '\0')
+      continue;
+
+    Keyframe keyframe;
+    if (std::sscanf(start, "%f %f %f %f %f %f", &keyframe.time, &keyframe.position.x, &keyframe.position.y,
+                    &keyframe.position.z, &keyframe.yaw, &keyframe.pitch) != 6 ||
+        (!m_keyframes.empty() && keyframe.time < m_keyframes.back().time))
+    {
+      std::fprintf(stderr, "%s:%u: invalid keyframe\n", filename, line_number);
+      return false;
+    }
+
+    m_keyframes.push_back(keyframe);
+  }
+
+  if (m_keyframes.empty())
+  {
+    std::fprintf(stderr, "Camera path '%s' has no keyframes\n", filename);
+    return false;
+  }
+
+  return true;
+}
+
+bool CameraPath::Save(const char* filename) const
+{
+  auto fp = Util::FOpenUniquePtr(filename, "w");
+  if (!fp)
+  {
+    std::fprintf(stderr, "Failed to open '%s' for writing\n", filename);
+    return false;
+  }
+
+  std::fprintf(fp.get(), "# time x y z yaw pitch\n");
+  for (const Keyframe& keyframe : m_keyframes)
+  {
+    std::fprintf(fp.get(), "%.4f %.3f %.3f %.3f %.3f %.3f\n", keyframe.time, keyframe.position.x, keyframe.position.y,
+                 keyframe.position.z, keyframe.yaw, keyframe.pitch);
+  }
+
+  if (std::ferror(fp.get()))
+  {
+    std::fprintf(stderr, "Failed to write '%s'\n", filename);
+    return false;
+  }
+
+  return true;
+}
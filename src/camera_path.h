@@ -0,0 +1,39 @@
+#pragma once
+#include "common.h"
+#include <glm/glm.hpp>
+#include <vector>
+
+class Camera;
+
+// Timed camera keyframes, recorded from an interactive session and replayed for benchmarking.
+// Stored as text, one "time x y z yaw pitch" line per keyframe, with # starting a comment.
+class CameraPath
+{
+public:
+  struct Keyframe
+  {
+    float time;
+    glm::vec3 position;
+    float yaw;
+    float pitch;
+  };
+
+  CameraPath();
+  ~CameraPath();
+
+  const std::vector<Keyframe>& GetKeyframes() const { return m_keyframes; }
+  bool IsEmpty() const { return m_keyframes.empty(); }
+  float GetDuration() const { return m_keyframes.empty() ? 0.0f : m_keyframes.back().time; }
+
+  // Keyframes must be added in time order.
+  void AddKeyframe(float time, const Camera& camera);
+
+  // Places the camera at the given time, interpolating between keyframes. Times past either end are clamped.
+  void Sample(float time, Camera* camera) const;
+
+  bool Load(const char* filename);
+  bool Save(const char* filename) const;
+
+private:
+  std::vector<Keyframe> m_keyframes;
+};
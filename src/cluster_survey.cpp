@@ -0,0 +1,242 @@
+#include "pch.h"
+#include "cluster_survey.h"
+#include "bsp.h"
+#include "camera.h"
+#include "util.h"
+
+ClusterSurvey::ClusterSurvey(const BSP* bsp) : m_bsp(bsp) {}
+
+ClusterSurvey::~ClusterSurvey() = default;
+
+std::vector<std::vector<u32>> ClusterSurvey::GetClusterLeaves() const
+{
+  std::vector<std::vector<u32>> cluster_leaves(m_bsp->GetClusterCount());
+  for (const BSP::Leaf& leaf : m_bsp->GetLeaves())
+  {
+    if (leaf.cluster >= 0 && u32(leaf.cluster) < cluster_leaves.size())
+      cluster_leaves[leaf.cluster].push_back(leaf.index);
+  }
+
+  return cluster_leaves;
+}
+
+bool ClusterSurvey::FindViewpoint(const std::vector<u32>& leaves, u32* leaf_index, glm::vec3* position) const
+{
+  // Leaves are convex, so the centre of the bounds is usually inside. Larger leaves are more representative.
+  std::vector<std::pair<float, u32>> candidates;
+  candidates.reserve(leaves.size());
+  for (u32 index : leaves)
+  {
+    const BSP::Leaf* leaf = m_bsp->GetLeaf(index);
+    const glm::vec3 size = leaf->bbox_max - leaf->bbox_min;
+    candidates.emplace_back(size.x * size.y * size.z, index);
+  }
+  std::sort(candidates.begin(), candidates.end(), std::greater<std::pair<float, u32>>());
+
+  for (const auto& [volume, index] : candidates)
+  {
+    const BSP::Leaf* leaf = m_bsp->GetLeaf(index);
+    const glm::vec3 center = (leaf->bbox_min + leaf->bbox_max) * 0.5f;
+    const BSP::Leaf* found = m_bsp->FindLeafForPosition(center);
+    if (!found || found->cluster != leaf->cluster || (m_bsp->PointContents(center) & BSP::CONTENTS_SOLID) != 0)
+      continue;
+
+    *leaf_index = index;
+    *position = center;
+    return true;
+  }
+
+  return false;
+}
+
+bool ClusterSurvey::Run(const Camera& camera, const MeasureFunction& measure)
+{
+  const u32 num_clusters = m_bsp->GetClusterCount();
+  if (num_clusters == 0)
+  {
+    std::fprintf(stderr, "Map has no clusters to survey\n");
+    return false;
+  }
+
+  const std::vector<std::vector<u32>> cluster_leaves = GetClusterLeaves();
+  m_results.clear();
+  u32 num_skipped = 0;
+  const auto start_time = std::chrono::steady_clock::now();
+  for (u32 cluster = 0; cluster < num_clusters; cluster++)
+  {
+    ClusterResult result = {};
+    result.cluster = s32(cluster);
+    if (!FindViewpoint(cluster_leaves[cluster], &result.leaf_index, &result.position))
+    {
+      num_skipped++;
+      continue;
+    }
+
+    Camera view = camera;
+    view.SetPosition(result.position);
+    view.SetPitch(0.0f);
+
+    float total_frame_ms = 0.0f;
+    for (u32 i = 0; i < NUM_YAW_ANGLES; i++)
+    {
+      const float yaw = 360.0f * float(i) / float(NUM_YAW_ANGLES);
+      view.SetYaw(yaw);
+
+      const Measurement measurement = measure(view);
+      total_frame_ms += measurement.frame_ms;
+      if (i == 0 || measurement.frame_ms > result.worst.frame_ms)
+      {
+        result.worst_yaw = yaw;
+        result.worst = measurement;
+      }
+    }
+
+    result.avg_frame_ms = total_frame_ms / float(NUM_YAW_ANGLES);
+    m_results.push_back(result);
+
+    if (((cluster + 1) % 100) == 0)
+      std::printf("Surveyed %u/%u clusters\n", cluster + 1, num_clusters);
+  }
+
+  std::printf("Surveyed %u clusters (%u without a viewpoint) in %.2f seconds\n", u32(m_results.size()), num_skipped,
+              std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count());
+  return !m_results.empty();
+}
+
+void ClusterSurvey::PrintWorstClusters(u32 count) const
+{
+  std::vector<const ClusterResult*> sorted;
+  sorted.reserve(m_results.size());
+  for (const ClusterResult& result : m_results)
+    sorted.push_back(&result);
+  std::sort(sorted.begin(), sorted.end(), [](const ClusterResult* lhs, const ClusterResult* rhs) {
+    return lhs->worst.frame_ms > rhs->worst.frame_ms;
+  });
+
+  count = std::min(count, u32(sorted.size()));
+  std::printf("Worst %u clusters:\n", count);
+  std::printf("  rank cluster  frame ms   avg ms   cpu ms  leaves   draws  triangles  view (x,y,z,yaw,pitch)\n");
+  for (u32 i = 0; i < count; i++)
+  {
+    const ClusterResult& result = *sorted[i];
+    std::printf("  %4u %7d %9.3f %8.3f %8.3f %7u %7u %10u  %.0f,%.0f,%.0f,%.0f,0\n", i + 1, result.cluster,
+                result.worst.frame_ms, result.avg_frame_ms, result.worst.cpu_ms, result.worst.visible_leaves,
+                result.worst.draws, result.worst.triangles, result.position.x, result.position.y, result.position.z,
+                result.worst_yaw);
+  }
+}
+
+bool ClusterSurvey::WriteCSV(const char* filename) const
+{
+  auto fp = Util::FOpenUniquePtr(filename, "w");
+  if (!fp)
+  {
+    std::fprintf(stderr, "Failed to open '%s' for writing\n", filename);
+    return false;
+  }
+
+  std::fprintf(fp.get(), "cluster,leaf,x,y,z,worst_yaw,worst_frame_ms,avg_frame_ms,cpu_ms,visible_leaves,draws,"
+                         "triangles\n");
+  for (const ClusterResult& result : m_results)
+  {
+    std::fprintf(fp.get(), "%d,%u,%.1f,%.1f,%.1f,%.1f,%.4f,%.4f,%.4f,%u,%u,%u\n", result.cluster, result.leaf_index,
+                 result.position.x, result.position.y, result.position.z, result.worst_yaw, result.worst.frame_ms,
+                 result.avg_frame_ms, result.worst.cpu_ms, result.worst.visible_leaves, result.worst.draws,
+                 result.worst.triangles);
+  }
+
+  if (std::ferror(fp.get()))
+  {
+    std::fprintf(stderr, "Failed to write '%s'\n", filename);
+    return false;
+  }
+
+  return true;
+}
+
+// Blue, cyan, green, yellow, red.
+static u32 HeatColor(float t)
+{
+  static constexpr float stops[5][3] = {{0, 0, 255}, {0, 255, 255}, {0, 255, 0}, {255, 255, 0}, {255, 0, 0}};
+
+  const float scaled = std::clamp(t, 0.0f, 1.0f) * 4.0f;
+  const u32 index = std::min(u32(scaled), 3u);
+  const float frac = scaled - float(index);
+  u32 color = 0xFF000000u;
+  for (u32 i = 0; i < 3; i++)
+  {
+    const float value = stops[index][i] + (stops[index + 1][i] - stops[index][i]) * frac;
+    color |= u32(value + 0.5f) << (i * 8);
+  }
+
+  return color;
+}
+
+bool ClusterSurvey::WriteHeatmap(const char* filename, u32 size) const
+{
+  if (m_results.empty())
+    return false;
+
+  // Bounds of every leaf in a cluster, so the map outline shows around the surveyed parts.
+  glm::vec3 world_min(std::numeric_limits<float>::max());
+  glm::vec3 world_max(std::numeric_limits<float>::lowest());
+  for (const BSP::Leaf& leaf : m_bsp->GetLeaves())
+  {
+    if (leaf.cluster < 0)
+      continue;
+
+    world_min = glm::min(world_min, leaf.bbox_min);
+    world_max = glm::max(world_max, leaf.bbox_max);
+  }
+
+  const glm::vec2 extent = glm::max(glm::vec2(world_max - world_min), glm::vec2(1.0f));
+  const float scale = float(size) / std::max(extent.x, extent.y);
+  const u32 width = std::max(u32(extent.x * scale), 1u);
+  const u32 height = std::max(u32(extent.y * scale), 1u);
+  std::vector<u32> pixels(width * height, 0xFF202020u);
+
+  // Top of the image is +Y.
+  auto FillLeaf = [&](const BSP::Leaf& leaf, u32 color) {
+    const u32 x0 = std::min(u32((leaf.bbox_min.x - world_min.x) * scale), width - 1);
+    const u32 x1 = std::min(u32((leaf.bbox_max.x - world_min.x) * scale), width - 1);
+    const u32 y0 = std::min(u32((world_max.y - leaf.bbox_max.y) * scale), height - 1);
+    const u32 y1 = std::min(u32((world_max.y - leaf.bbox_min.y) * scale), height - 1);
+    for (u32 y = y0; y <= y1; y++)
+      std::fill(pixels.begin() + y * width + x0, pixels.begin() + y * width + x1 + 1, color);
+  };
+
+  for (const BSP::Leaf& leaf : m_bsp->GetLeaves())
+  {
+    if (leaf.cluster >= 0)
+      FillLeaf(leaf, 0xFF505050u);
+  }
+
+  float min_ms = std::numeric_limits<float>::max();
+  float max_ms = 0.0f;
+  for (const ClusterResult& result : m_results)
+  {
+    min_ms = std::min(min_ms, result.worst.frame_ms);
+    max_ms = std::max(max_ms, result.worst.frame_ms);
+  }
+
+  // Clusters overlap when seen from above, paint the expensive ones last so they stay visible.
+  std::vector<const ClusterResult*> sorted;
+  sorted.reserve(m_results.size());
+  for (const ClusterResult& result : m_results)
+    sorted.push_back(&result);
+  std::sort(sorted.begin(), sorted.end(), [](const ClusterResult* lhs, const ClusterResult* rhs) {
+    return lhs->worst.frame_ms < rhs->worst.frame_ms;
+  });
+
+  const std::vector<std::vector<u32>> cluster_leaves = GetClusterLeaves();
+  for (const ClusterResult* result : sorted)
+  {
+    const float t = (max_ms > min_ms) ? ((result->worst.frame_ms - min_ms) / (max_ms - min_ms)) : 0.0f;
+    const u32 color = HeatColor(t);
+    for (u32 leaf_index : cluster_leaves[result->cluster])
+      FillLeaf(*m_bsp->GetLeaf(leaf_index), color);
+  }
+
+  std::printf("Heatmap: blue %.3f ms to red %.3f ms\n", min_ms, max_ms);
+  return Util::WriteTGA(filename, width, height, pixels.data(), width);
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include "common.h"
+#include <functional>
+#include <glm/glm.hpp>
+#include <vector>
+
+class BSP;
+class Camera;
+
+// Finds the expensive spots in a map by measuring a view from every cluster. Each cluster is visited at a point
+// inside its largest leaf, looking horizontally in NUM_YAW_ANGLES directions, and keeps its worst direction.
+class ClusterSurvey
+{
+public:
+  static constexpr u32 NUM_YAW_ANGLES = 8;
+
+  struct Measurement
+  {
+    float frame_ms;
+    float cpu_ms;
+    u32 visible_leaves;
+    u32 draws;
+    u32 triangles;
+  };
+
+  struct ClusterResult
+  {
+    s32 cluster;
+    u32 leaf_index;
+    glm::vec3 position;
+    float avg_frame_ms;
+
+    // Direction with the highest frame time.
+    float worst_yaw;
+    Measurement worst;
+  };
+
+  // Renders (or culls) one view and measures it.
+  using MeasureFunction = std::function<Measurement(const Camera& camera)>;
+
+  ClusterSurvey(const BSP* bsp);
+  ~ClusterSurvey();
+
+  // Results in cluster order. Clusters without a usable viewpoint are left out.
+  const std::vector<ClusterResult>& GetResults() const { return m_results; }
+
+  // The camera supplies the projection, its position and angles are replaced for each view.
+  bool Run(const Camera& camera, const MeasureFunction& measure);
+
+  // Table of the clusters with the highest worst-case frame time.
+  void PrintWorstClusters(u32 count) const;
+
+  // One row per cluster, for spreadsheets or loading back into other tools.
+  bool WriteCSV(const char* filename) const;
+
+  // Top-down image of the map, each cluster's leaves coloured from blue (cheapest) to red (most expensive).
+  bool WriteHeatmap(const char* filename, u32 size) const;
+
+private:
+  std::vector<std::vector<u32>> GetClusterLeaves() const;
+
+  // Picks a point which is in the cluster and not in solid. Returns false if no leaf of the cluster has one.
+  bool FindViewpoint(const std::vector<u32>& leaves, u32* leaf_index, glm::vec3* position) const;
+
+  const BSP* m_bsp;
+  std::vector<ClusterResult> m_results;
+};
@@ -11,6 +11,10 @@ using s32 = int32_t;
 using u64 = uint64_t;
 using s64 = int64_t;
 
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define HAS_SSE2 1
+#endif
+
 // https://www.g-truc.net/post-0708.html
 #ifndef __has_feature
 #define __has_feature(x) 0 // Compatibility with non-clang compilers.
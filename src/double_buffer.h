@@ -0,0 +1,45 @@
+#pragma once
+#include "common.h"
+#include <atomic>
+
+// Lock-free single-producer, single-consumer double buffer.
+// The producer fills one slot while the consumer reads the other. Each slot has a "full" flag which hands ownership
+// from producer to consumer and back, so neither side ever touches a slot the other one owns.
+template<typename T>
+class DoubleBuffer
+{
+public:
+  DoubleBuffer()
+  {
+    m_full[0].store(false);
+    m_full[1].store(false);
+  }
+
+  // Returns the slot to fill, or nullptr if the consumer has not yet finished with it.
+  T* TryBeginWrite()
+  {
+    return m_full[m_write_index].load(std::memory_order_acquire) ? nullptr : &m_slots[m_write_index];
+  }
+  void EndWrite()
+  {
+    m_full[m_write_index].store(true, std::memory_order_release);
+    m_write_index ^= 1;
+  }
+
+  // Returns the oldest filled slot, or nullptr if the producer has not published one yet.
+  T* TryBeginRead()
+  {
+    return m_full[m_read_index].load(std::memory_order_acquire) ? &m_slots[m_read_index] : nullptr;
+  }
+  void EndRead()
+  {
+    m_full[m_read_index].store(false, std::memory_order_release);
+    m_read_index ^= 1;
+  }
+
+private:
+  T m_slots[2];
+  std::atomic<bool> m_full[2];
+  u32 m_write_index = 0;
+  u32 m_read_index = 0;
+};
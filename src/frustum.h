@@ -4,16 +4,6 @@
 class Frustum
 {
 public:
-  Frustum();
-  Frustum(const glm::mat4& view_proj_matrix);
-
-  void Set(const glm::mat4& view_proj_matrix);
-
-  bool Intersects(const glm::vec3& pos) const;
-
-  bool IntersectsAABox(const glm::vec3& bmin, const glm::vec3& bmax) const;
-
-private:
   enum PLANE : unsigned
   {
     PLANE_LEFT,
@@ -24,5 +14,19 @@ private:
     PLANE_FAR,
     NUM_PLANES
   };
+
+  Frustum();
+  Frustum(const glm::mat4& view_proj_matrix);
+
+  void Set(const glm::mat4& view_proj_matrix);
+
+  bool Intersects(const glm::vec3& pos) const;
+
+  bool IntersectsAABox(const glm::vec3& bmin, const glm::vec3& bmax) const;
+
+  // Not normalized; the inside is where dot(xyz, pos) + w >= 0.
+  const glm::vec4& GetPlane(PLANE plane) const { return m_planes[plane]; }
+
+private:
   glm::vec4 m_planes[NUM_PLANES];
 };
@@ -0,0 +1,59 @@
+#include "pch.h"
+#include "gpu_timer.h"
+
+GPUTimer::GPUTimer(const std::array<GLuint, NUM_QUERIES>& queries) : m_queries(queries) {}
+
+GPUTimer::~GPUTimer()
+{
+  glDeleteQueries(NUM_QUERIES, m_queries.data());
+}
+
+std::unique_ptr<GPUTimer> GPUTimer::Create()
+{
+  // Zero bits means the implementation has no timer.
+  GLint counter_bits = 0;
+  glGetQueryiv(GL_TIME_ELAPSED, GL_QUERY_COUNTER_BITS, &counter_bits);
+  if (counter_bits == 0)
+  {
+    std::fprintf(stderr, "GPU timer queries are not supported\n");
+    return nullptr;
+  }
+
+  std::array<GLuint, NUM_QUERIES> queries = {};
+  glGenQueries(NUM_QUERIES, queries.data());
+
+  return std::unique_ptr<GPUTimer>(new GPUTimer(queries));
+}
+
+void GPUTimer::Begin()
+{
+  assert(!IsFull());
+  glBeginQuery(GL_TIME_ELAPSED, m_queries[m_frames_begun % NUM_QUERIES]);
+}
+
+void GPUTimer::End()
+{
+  glEndQuery(GL_TIME_ELAPSED);
+  m_frames_begun++;
+}
+
+bool GPUTimer::GetResult(u32* frame_index, float* gpu_ms, bool wait)
+{
+  if (m_frames_read == m_frames_begun)
+    return false;
+
+  const GLuint query = m_queries[m_frames_read % NUM_QUERIES];
+  if (!wait)
+  {
+    GLuint available = GL_FALSE;
+    glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+      return false;
+  }
+
+  GLuint64 elapsed_ns = 0;
+  glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed_ns);
+  *frame_index = m_frames_read++;
+  *gpu_ms = float(double(elapsed_ns) / 1000000.0);
+  return true;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "common.h"
+#include <glad.h>
+#include <array>
+#include <memory>
+
+// Measures GPU time per frame with GL_TIME_ELAPSED queries. Results arrive a few frames late, so queries are kept
+// in a small ring and read back once available, which avoids stalling the pipeline. Only one frame can be timed at
+// a time, as time elapsed queries do not nest.
+class GPUTimer
+{
+public:
+  static constexpr u32 NUM_QUERIES = 4;
+
+  ~GPUTimer();
+
+  static std::unique_ptr<GPUTimer> Create();
+
+  // True when every query is in flight, in which case a result has to be read before the next Begin().
+  bool IsFull() const { return (m_frames_begun - m_frames_read) == NUM_QUERIES; }
+
+  // Starts timing the next frame. Frames are numbered from zero in the order they were begun.
+  void Begin();
+  void End();
+
+  // Returns the oldest frame whose result has not been read yet, if the GPU has finished it. With wait set, blocks
+  // until it has. Returns false if there is nothing (ready) to read.
+  bool GetResult(u32* frame_index, float* gpu_ms, bool wait);
+
+private:
+  GPUTimer(const std::array<GLuint, NUM_QUERIES>& queries);
+
+  std::array<GLuint, NUM_QUERIES> m_queries;
+
+  // Frames begun, and frames read back. Frame n uses query n % NUM_QUERIES.
+  u32 m_frames_begun = 0;
+  u32 m_frames_read = 0;
+};
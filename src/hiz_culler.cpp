@@ -0,0 +1,335 @@
+#include "pch.h"
+#include "hiz_culler.h"
+#include "buffer.h"
+#include "shader.h"
+#include "texture.h"
+
+static constexpr u32 REDUCE_GROUP_SIZE = 8;
+static constexpr u32 TEST_GROUP_SIZE = 64;
+
+static const char* s_reduce_shader = R"(
+#version 430
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+layout(binding = 0) uniform sampler2D samp0;
+layout(binding = 0, r32f) uniform writeonly image2D dst;
+layout(location = 0) uniform int src_lod;
+
+void main()
+{
+  ivec2 dst_coord = ivec2(gl_GlobalInvocationID.xy);
+  ivec2 dst_size = imageSize(dst);
+  if (any(greaterThanEqual(dst_coord, dst_size)))
+    return;
+
+  // Odd source sizes leave a row/column over, which the last texel of the destination also covers.
+  ivec2 src_size = textureSize(samp0, src_lod);
+  ivec2 extent = ivec2(2) + ivec2(equal(dst_coord, dst_size - 1)) * (src_size & 1);
+  ivec2 base = dst_coord * 2;
+
+  float depth = 0.0;
+  for (int y = 0; y < extent.y; y++)
+  {
+    for (int x = 0; x < extent.x; x++)
+      depth = max(depth, texelFetch(samp0, min(base + ivec2(x, y), src_size - 1), src_lod).r);
+  }
+
+  imageStore(dst, dst_coord, vec4(depth));
+}
+)";
+
+static const char* s_test_shader = R"(
+#version 430
+
+layout(local_size_x = 64) in;
+
+struct Bounds
+{
+  vec4 bmin;
+  vec4 bmax;
+};
+
+layout(binding = 0) uniform sampler2D samp0;
+layout(location = 0) uniform mat4 view_projection;
+layout(location = 1) uniform int count;
+
+layout(std430, binding = 0) readonly buffer BoundsBuffer { Bounds bounds[]; };
+layout(std430, binding = 1) readonly buffer IndexBuffer { uint indices[]; };
+layout(std430, binding = 2) writeonly buffer ResultBuffer { uint results[]; };
+
+// Allows for the precision of the depth buffer, so surfaces are not hidden by themselves.
+const float DEPTH_BIAS = 1.0 / 32768.0;
+
+void main()
+{
+  uint i = gl_GlobalInvocationID.x;
+  if (i >= uint(count))
+    return;
+
+  Bounds b = bounds[indices[i]];
+  vec2 rect_min = vec2(1.0);
+  vec2 rect_max = vec2(0.0);
+  float nearest_depth = 1.0;
+  for (int c = 0; c < 8; c++)
+  {
+    vec3 corner = mix(b.bmin.xyz, b.bmax.xyz, vec3(c & 1, (c >> 1) & 1, (c >> 2) & 1));
+    vec4 clip = view_projection * vec4(corner, 1.0);
+    if (clip.z < -clip.w)
+    {
+      results[i] = 1u;
+      return;
+    }
+
+    vec3 ndc = clip.xyz / clip.w;
+    rect_min = min(rect_min, ndc.xy * 0.5 + 0.5);
+    rect_max = max(rect_max, ndc.xy * 0.5 + 0.5);
+    nearest_depth = min(nearest_depth, ndc.z * 0.5 + 0.5);
+  }
+
+  rect_min = clamp(rect_min, vec2(0.0), vec2(1.0));
+  rect_max = clamp(rect_max, vec2(0.0), vec2(1.0));
+
+  // Pick the level where the rectangle spans at most two texels in each direction.
+  // The level size is derived from the top level, as textureSize() with a varying lod is unreliable on some drivers.
+  ivec2 base_size = textureSize(samp0, 0);
+  vec2 extent = (rect_max - rect_min) * vec2(base_size);
+  int lod = clamp(int(ceil(log2(max(max(extent.x, extent.y), 1.0)))), 0, textureQueryLevels(samp0) - 1);
+  ivec2 size = max(base_size >> lod, ivec2(1));
+  ivec2 t0 = clamp(ivec2(rect_min * vec2(size)), ivec2(0), size - 1);
+  ivec2 t1 = clamp(ivec2(rect_max * vec2(size)), ivec2(0), size - 1);
+
+  float occluder_depth = 0.0;
+  for (int y = t0.y; y <= t1.y; y++)
+  {
+    for (int x = t0.x; x <= t1.x; x++)
+      occluder_depth = max(occluder_depth, texelFetch(samp0, ivec2(x, y), lod).r);
+  }
+
+  results[i] = (nearest_depth <= (occluder_depth + DEPTH_BIAS)) ? 1u : 0u;
+}
+)";
+
+static u32 GetDispatchCount(u32 count, u32 group_size)
+{
+  return (count + group_size - 1) / group_size;
+}
+
+HiZCuller::HiZCuller(std::unique_ptr<ShaderProgram> reduce_program, std::unique_ptr<ShaderProgram> test_program,
+                     std::unique_ptr<Buffer> bounds_buffer, u32 num_bounds)
+  : m_reduce_program(std::move(reduce_program)), m_test_program(std::move(test_program)),
+    m_bounds_buffer(std::move(bounds_buffer)), m_num_bounds(num_bounds)
+{
+}
+
+HiZCuller::~HiZCuller()
+{
+  for (ResultSlot& slot : m_result_slots)
+  {
+    if (slot.fence)
+      glDeleteSync(slot.fence);
+  }
+}
+
+std::unique_ptr<HiZCuller> HiZCuller::Create(const Bounds* bounds, u32 num_bounds)
+{
+  if (!glDispatchCompute)
+  {
+    std::fprintf(stderr, "Compute shaders are not supported.\n");
+    return nullptr;
+  }
+
+  auto reduce_shader = Shader::Create(GL_COMPUTE_SHADER, s_reduce_shader, std::strlen(s_reduce_shader));
+  auto test_shader = Shader::Create(GL_COMPUTE_SHADER, s_test_shader, std::strlen(s_test_shader));
+  if (!reduce_shader || !test_shader)
+    return nullptr;
+
+  static const char* reduce_uniform_names[] = {"src_lod"};
+  static const char* test_uniform_names[] = {"view_projection", "count"};
+  auto reduce_program =
+    ShaderProgram::CreateCompute(reduce_shader.get(), reduce_uniform_names, ARRAY_SIZE(reduce_uniform_names));
+  auto test_program =
+    ShaderProgram::CreateCompute(test_shader.get(), test_uniform_names, ARRAY_SIZE(test_uniform_names));
+  if (!reduce_program || !test_program)
+    return nullptr;
+
+  const size_t buffer_count = std::max(num_bounds, 1u);
+  auto bounds_buffer = Buffer::Create(Buffer::Type::ShaderStorageBuffer, sizeof(Bounds) * buffer_count, nullptr);
+  if (!bounds_buffer)
+    return nullptr;
+
+  if (num_bounds > 0)
+    bounds_buffer->Update(0, sizeof(Bounds) * num_bounds, bounds);
+
+  std::unique_ptr<HiZCuller> culler(
+    new HiZCuller(std::move(reduce_program), std::move(test_program), std::move(bounds_buffer), num_bounds));
+  culler->m_indices_buffer =
+    Buffer::Create(Buffer::Type::ShaderStorageBuffer, sizeof(u32) * buffer_count, nullptr, true);
+  culler->m_results_buffer =
+    Buffer::Create(Buffer::Type::ShaderStorageBuffer, sizeof(u32) * buffer_count, nullptr, true);
+  if (!culler->m_indices_buffer || !culler->m_results_buffer)
+    return nullptr;
+
+  for (ResultSlot& slot : culler->m_result_slots)
+  {
+    slot.indices_buffer = Buffer::Create(Buffer::Type::ShaderStorageBuffer, sizeof(u32) * buffer_count, nullptr, true);
+    slot.results_buffer = Buffer::Create(Buffer::Type::ShaderStorageBuffer, sizeof(u32) * buffer_count, nullptr, true);
+    if (!slot.indices_buffer || !slot.results_buffer)
+      return nullptr;
+  }
+
+  return culler;
+}
+
+bool HiZCuller::ResizeTextures(u32 width, u32 height)
+{
+  if (m_depth_texture && m_width == width && m_height == height)
+    return true;
+
+  m_depth_texture = Texture::Create(Texture::Format::FORMAT_D32F, width, height, 1, nullptr, false, false, false);
+
+  // The pyramid starts at half resolution, down to 1x1.
+  const u32 pyramid_width = std::max(width / 2, 1u);
+  const u32 pyramid_height = std::max(height / 2, 1u);
+  u32 num_levels = 1;
+  while ((pyramid_width >> num_levels) > 0 || (pyramid_height >> num_levels) > 0)
+    num_levels++;
+
+  m_pyramid_texture = Texture::Create(Texture::Format::FORMAT_R32F, pyramid_width, pyramid_height, s32(num_levels),
+                                      nullptr, false, false, false);
+  if (!m_depth_texture || !m_pyramid_texture)
+    return false;
+
+  m_width = width;
+  m_height = height;
+  return true;
+}
+
+void HiZCuller::BuildDepthPyramid()
+{
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  if (!ResizeTextures(u32(std::max(viewport[2], 1)), u32(std::max(viewport[3], 1))))
+    return;
+
+  m_depth_texture->CopyFromFramebuffer(u32(viewport[0]), u32(viewport[1]), m_width, m_height);
+
+  m_reduce_program->Bind();
+  for (u32 level = 0; level < m_pyramid_texture->GetLevels(); level++)
+  {
+    // Level 0 is reduced from the depth copy, the rest from the previous level.
+    if (level == 0)
+      m_depth_texture->Bind(0);
+    else
+      m_pyramid_texture->Bind(0);
+    m_reduce_program->SetUniform(0, s32((level == 0) ? 0 : (level - 1)));
+
+    glBindImageTexture(0, m_pyramid_texture->GetGLID(), GLint(level), GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+    const u32 level_width = std::max(m_pyramid_texture->GetWidth() >> level, 1u);
+    const u32 level_height = std::max(m_pyramid_texture->GetHeight() >> level, 1u);
+    glDispatchCompute(GetDispatchCount(level_width, REDUCE_GROUP_SIZE),
+                      GetDispatchCount(level_height, REDUCE_GROUP_SIZE), 1);
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+  }
+}
+
+void HiZCuller::DispatchTest(const glm::mat4& view_projection_matrix, Buffer* indices_buffer, Buffer* results_buffer,
+                             u32 count)
+{
+  m_test_program->Bind();
+  m_test_program->SetUniform(0, view_projection_matrix);
+  m_test_program->SetUniform(1, s32(count));
+  m_pyramid_texture->Bind(0);
+  m_bounds_buffer->BindBase(0);
+  indices_buffer->BindBase(1);
+  results_buffer->BindBase(2);
+  glDispatchCompute(GetDispatchCount(count, TEST_GROUP_SIZE), 1, 1);
+  glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+void HiZCuller::TestBoundsAndWait(const glm::mat4& view_projection_matrix, const u32* indices, u32 count,
+                                  std::vector<u32>* results)
+{
+  results->resize(count);
+  if (count == 0)
+    return;
+
+  // Nothing to test against yet.
+  if (!m_pyramid_texture)
+  {
+    std::fill(results->begin(), results->end(), 1u);
+    return;
+  }
+
+  assert(count <= m_num_bounds);
+  m_indices_buffer->Update(0, sizeof(u32) * count, indices);
+  DispatchTest(view_projection_matrix, m_indices_buffer.get(), m_results_buffer.get(), count);
+
+  const u32* mapped_results = static_cast<const u32*>(m_results_buffer->Map(true, false));
+  if (mapped_results)
+  {
+    std::memcpy(results->data(), mapped_results, sizeof(u32) * count);
+    m_results_buffer->Unmap();
+  }
+  else
+  {
+    std::fill(results->begin(), results->end(), 1u);
+  }
+}
+
+void HiZCuller::TestBounds(const glm::mat4& view_projection_matrix, const u32* indices, u32 count)
+{
+  // Nothing to test against yet.
+  if (count == 0 || !m_pyramid_texture)
+    return;
+
+  assert(count <= m_num_bounds);
+  ResultSlot& slot = m_result_slots[m_next_result_slot];
+  m_next_result_slot = (m_next_result_slot + 1) % NUM_RESULT_SLOTS;
+
+  // Results which were never collected are superseded by this test.
+  if (slot.fence)
+  {
+    glDeleteSync(slot.fence);
+    slot.fence = nullptr;
+  }
+
+  slot.indices.assign(indices, indices + count);
+  slot.indices_buffer->Update(0, sizeof(u32) * count, indices);
+  DispatchTest(view_projection_matrix, slot.indices_buffer.get(), slot.results_buffer.get(), count);
+  slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+bool HiZCuller::ReadResults(std::vector<u32>* indices, std::vector<u32>* results)
+{
+  // Newest first. Once a test has been read, anything queued before it is stale.
+  bool found = false;
+  for (u32 age = 1; age <= NUM_RESULT_SLOTS; age++)
+  {
+    ResultSlot& slot = m_result_slots[(m_next_result_slot + NUM_RESULT_SLOTS - age) % NUM_RESULT_SLOTS];
+    if (!slot.fence)
+      continue;
+
+    if (!found)
+    {
+      const GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+      if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+        continue;
+
+      const u32 count = u32(slot.indices.size());
+      const u32* mapped_results = static_cast<const u32*>(slot.results_buffer->Map(true, false));
+      if (mapped_results)
+      {
+        *indices = slot.indices;
+        results->assign(mapped_results, mapped_results + count);
+        slot.results_buffer->Unmap();
+        found = true;
+      }
+    }
+
+    glDeleteSync(slot.fence);
+    slot.fence = nullptr;
+  }
+
+  return found;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include "common.h"
+#include <glad.h>
+#include <glm/glm.hpp>
+#include <memory>
+#include <vector>
+
+class Buffer;
+class ShaderProgram;
+class Texture;
+
+// GPU occlusion tests against a hierarchical depth (Hi-Z) pyramid.
+// The pyramid is reduced from the current depth buffer with compute shaders, each texel holding the farthest depth
+// of the area it covers. Boxes are then tested in a compute pass, picking the level at which they cover at most 2x2
+// texels. Only needs GL 4.3 core, so it runs on software implementations such as llvmpipe.
+class HiZCuller
+{
+public:
+  struct Bounds
+  {
+    glm::vec4 bmin;
+    glm::vec4 bmax;
+  };
+
+  ~HiZCuller();
+
+  // The set of boxes is fixed at creation; tests refer to them by index.
+  static std::unique_ptr<HiZCuller> Create(const Bounds* bounds, u32 num_bounds);
+
+  // Copies the depth buffer of the current framebuffer (at the current viewport size) and builds the pyramid.
+  void BuildDepthPyramid();
+
+  // Tests the boxes with the given indices against the pyramid. results[i] is non-zero if indices[i] may be visible.
+  // Boxes crossing the near plane are always visible. Waits for the GPU.
+  void TestBoundsAndWait(const glm::mat4& view_projection_matrix, const u32* indices, u32 count,
+                         std::vector<u32>* results);
+
+  // Queues the same test without waiting for the GPU; the results are collected by a later ReadResults().
+  void TestBounds(const glm::mat4& view_projection_matrix, const u32* indices, u32 count);
+
+  // Fetches the results of the newest test the GPU has finished, if they haven't been read yet. results[i] is
+  // non-zero if indices[i] may be visible. Returns false if no new results are available. Never waits.
+  bool ReadResults(std::vector<u32>* indices, std::vector<u32>* results);
+
+private:
+  // Tests are double-buffered, so one frame's results can be read back while the next frame's test is in flight.
+  static constexpr u32 NUM_RESULT_SLOTS = 2;
+  struct ResultSlot
+  {
+    std::unique_ptr<Buffer> indices_buffer;
+    std::unique_ptr<Buffer> results_buffer;
+    std::vector<u32> indices;
+    GLsync fence = nullptr;
+  };
+
+  HiZCuller(std::unique_ptr<ShaderProgram> reduce_program, std::unique_ptr<ShaderProgram> test_program,
+            std::unique_ptr<Buffer> bounds_buffer, u32 num_bounds);
+
+  bool ResizeTextures(u32 width, u32 height);
+  void DispatchTest(const glm::mat4& view_projection_matrix, Buffer* indices_buffer, Buffer* results_buffer,
+                    u32 count);
+
+  std::unique_ptr<ShaderProgram> m_reduce_program;
+  std::unique_ptr<ShaderProgram> m_test_program;
+
+  std::unique_ptr<Buffer> m_bounds_buffer;
+  u32 m_num_bounds;
+
+  // The test which waits has buffers of its own, so it leaves queued tests alone.
+  std::unique_ptr<Buffer> m_indices_buffer;
+  std::unique_ptr<Buffer> m_results_buffer;
+
+  ResultSlot m_result_slots[NUM_RESULT_SLOTS];
+  u32 m_next_result_slot = 0;
+
+  std::unique_ptr<Texture> m_depth_texture;
+  std::unique_ptr<Texture> m_pyramid_texture;
+  u32 m_width = 0;
+  u32 m_height = 0;
+};
@@ -0,0 +1,297 @@
+#include "pch.h"
+#include "lightmap_baker.h"
+#include "thread_pool.h"
+#include "triangle_bvh.h"
+#include "util.h"
+#include <random>
+
+// Light entity values are scaled by this and divided by the squared distance, as q3map does for point lights.
+static constexpr float POINT_LIGHT_SCALE = 7500.0f;
+
+// The renderer brightens lightmaps by four, so baked values are stored at a quarter.
+static constexpr float LIGHTMAP_STORE_SCALE = 0.25f;
+
+// Rays start this far off the surface, so they don't hit the triangle they start on.
+static constexpr float SURFACE_OFFSET = 0.5f;
+
+// Luxel centres this far outside a triangle in lightmap space still take their position from it.
+static constexpr float RASTER_EPSILON = 0.01f;
+
+static constexpr u32 DILATE_PASSES = 2;
+
+static glm::vec3 ParseVector(const std::string& str, const glm::vec3& default_value)
+{
+  glm::vec3 value;
+  if (std::sscanf(str.c_str(), "%f %f %f", &value.x, &value.y, &value.z) != 3)
+    return default_value;
+
+  return value;
+}
+
+static float ParseFloat(const std::string& str, float default_value)
+{
+  float value;
+  if (std::sscanf(str.c_str(), "%f", &value) != 1)
+    return default_value;
+
+  return value;
+}
+
+LightmapBaker::LightmapBaker(const BSP* bsp, const TriangleBVH* bvh) : m_bsp(bsp), m_bvh(bvh) {}
+
+LightmapBaker::~LightmapBaker() = default;
+
+void LightmapBaker::FindLights()
+{
+  m_lights.clear();
+  m_ambient = glm::vec3(0.0f);
+  for (const BSP::Entity& entity : m_bsp->GetEntities())
+  {
+    const std::string& classname = entity.GetProperty("classname");
+    if (classname == "worldspawn")
+    {
+      const float ambient = ParseFloat(entity.GetProperty("_ambient"), ParseFloat(entity.GetProperty("ambient"), 0.0f));
+      m_ambient = ParseVector(entity.GetProperty("_color"), glm::vec3(1.0f)) * ambient;
+      continue;
+    }
+
+    if (classname != "light")
+      continue;
+
+    Light light;
+    light.origin = ParseVector(entity.GetProperty("origin"), glm::vec3(0.0f));
+    light.intensity = ParseFloat(entity.GetProperty("light"), ParseFloat(entity.GetProperty("_light"), 300.0f));
+    light.color = ParseVector(entity.GetProperty("_color"), glm::vec3(1.0f));
+
+    // Colours are normalized so the brightest component is one, as in q3map.
+    const float max_component = std::max(std::max(light.color.r, light.color.g), light.color.b);
+    light.color = (max_component > 0.0f) ? (light.color / max_component) : glm::vec3(1.0f);
+    m_lights.push_back(light);
+  }
+}
+
+bool LightmapBaker::Bake(const Options& options)
+{
+  if (m_bsp->GetLightMapCount() == 0)
+  {
+    std::fprintf(stderr, "Map has no lightmaps to bake.\n");
+    return false;
+  }
+
+  FindLights();
+  if (options.mode == Mode::Lights)
+    std::printf("Baking lightmaps from %u lights\n", u32(m_lights.size()));
+  else
+    std::printf("Baking ambient occlusion with %u samples\n", options.ao_samples);
+
+  // Faces are baked independently into their own luxel arrays, then copied into the pages, so no two threads
+  // write the same memory even if blocks overlap.
+  const u32 num_faces = u32(m_bsp->GetFaceCount());
+  std::vector<std::vector<Luxel>> face_luxels(num_faces);
+  g_thread_pool->ParallelFor(num_faces, [this, &options, &face_luxels](u32 face_index) {
+    const BSP::Face* face = m_bsp->GetFace(face_index);
+    if (face->lightmap_index < 0 || size_t(face->lightmap_index) >= m_bsp->GetLightMapCount() ||
+        face->lightmap_size[0] <= 0 || face->lightmap_size[1] <= 0)
+    {
+      return;
+    }
+
+    std::vector<Luxel>& luxels = face_luxels[face_index];
+    RasterizeFace(face, &luxels);
+    for (size_t i = 0; i < luxels.size(); i++)
+    {
+      if (luxels[i].covered)
+        luxels[i].color = ComputeLuxel(options, luxels[i], face_index * 65536u + u32(i));
+    }
+
+    DilateLuxels(&luxels, u32(face->lightmap_size[0]), u32(face->lightmap_size[1]));
+  });
+
+  m_lightmaps = m_bsp->GetLightMaps();
+  for (u32 face_index = 0; face_index < num_faces; face_index++)
+  {
+    const std::vector<Luxel>& luxels = face_luxels[face_index];
+    if (luxels.empty())
+      continue;
+
+    const BSP::Face* face = m_bsp->GetFace(face_index);
+    BSP::LightMap& lightmap = m_lightmaps[face->lightmap_index];
+    const u32 width = u32(face->lightmap_size[0]);
+    const u32 height = u32(face->lightmap_size[1]);
+    for (u32 y = 0; y < height; y++)
+    {
+      for (u32 x = 0; x < width; x++)
+      {
+        const Luxel& luxel = luxels[y * width + x];
+        const u32 page_x = u32(face->lightmap_corner[0]) + x;
+        const u32 page_y = u32(face->lightmap_corner[1]) + y;
+        if (!luxel.covered || page_x >= BSP::LIGHTMAP_SIZE || page_y >= BSP::LIGHTMAP_SIZE)
+          continue;
+
+        u8* texel = lightmap.data[page_y][page_x];
+        for (u32 c = 0; c < 3; c++)
+          texel[c] = u8(glm::clamp(luxel.color[c], 0.0f, 255.0f));
+      }
+    }
+  }
+
+  return true;
+}
+
+void LightmapBaker::RasterizeFace(const BSP::Face* face, std::vector<Luxel>* luxels) const
+{
+  // Clamp the block to the page, in case the file is inconsistent.
+  const u32 corner_x = u32(std::min(std::max(face->lightmap_corner[0], 0), s32(BSP::LIGHTMAP_SIZE)));
+  const u32 corner_y = u32(std::min(std::max(face->lightmap_corner[1], 0), s32(BSP::LIGHTMAP_SIZE)));
+  const u32 width = std::min(u32(face->lightmap_size[0]), BSP::LIGHTMAP_SIZE - corner_x);
+  const u32 height = std::min(u32(face->lightmap_size[1]), BSP::LIGHTMAP_SIZE - corner_y);
+  luxels->assign(size_t(face->lightmap_size[0]) * size_t(face->lightmap_size[1]),
+                 Luxel{glm::vec3(0.0f), face->normal, glm::vec3(0.0f), false});
+  if (face->num_indices <= 0 || face->base_vertex < 0)
+    return;
+
+  const BSP::LightMap* lightmap = m_bsp->GetLightMap(size_t(face->lightmap_index));
+  const glm::vec2 corner = glm::vec2(float(corner_x), float(corner_y));
+  for (int i = 0; (i + 2) < face->num_indices; i += 3)
+  {
+    const BSP::Vertex* v[3];
+    glm::vec2 uv[3];
+    for (u32 k = 0; k < 3; k++)
+    {
+      const size_t vertex_index = size_t(face->base_vertex) + m_bsp->GetIndex(size_t(face->base_index + i + k));
+      if (vertex_index >= m_bsp->GetVertexCount())
+        return;
+
+      v[k] = m_bsp->GetVertex(vertex_index);
+      uv[k] = v[k]->texcoords[1] * float(BSP::LIGHTMAP_SIZE) - corner;
+    }
+
+    const float area = (uv[1].x - uv[0].x) * (uv[2].y - uv[0].y) - (uv[2].x - uv[0].x) * (uv[1].y - uv[0].y);
+    if (std::abs(area) < 1e-6f)
+      continue;
+
+    const glm::vec2 uv_min = glm::min(glm::min(uv[0], uv[1]), uv[2]);
+    const glm::vec2 uv_max = glm::max(glm::max(uv[0], uv[1]), uv[2]);
+    const u32 x0 = u32(std::max(std::floor(uv_min.x), 0.0f));
+    const u32 y0 = u32(std::max(std::floor(uv_min.y), 0.0f));
+    const u32 x1 = std::min(u32(std::max(std::ceil(uv_max.x), 0.0f)), width);
+    const u32 y1 = std::min(u32(std::max(std::ceil(uv_max.y), 0.0f)), height);
+    for (u32 y = y0; y < y1; y++)
+    {
+      for (u32 x = x0; x < x1; x++)
+      {
+        const glm::vec2 p(float(x) + 0.5f, float(y) + 0.5f);
+        const float b1 = ((p.x - uv[0].x) * (uv[2].y - uv[0].y) - (uv[2].x - uv[0].x) * (p.y - uv[0].y)) / area;
+        const float b2 = ((uv[1].x - uv[0].x) * (p.y - uv[0].y) - (p.x - uv[0].x) * (uv[1].y - uv[0].y)) / area;
+        const float b0 = 1.0f - b1 - b2;
+        if (b0 < -RASTER_EPSILON || b1 < -RASTER_EPSILON || b2 < -RASTER_EPSILON)
+          continue;
+
+        // The existing texel is kept as the colour, for the ambient occlusion mode to darken.
+        const u8* texel = lightmap->data[corner_y + y][corner_x + x];
+        Luxel& luxel = (*luxels)[y * u32(face->lightmap_size[0]) + x];
+        luxel.color = glm::vec3(float(texel[0]), float(texel[1]), float(texel[2]));
+        luxel.position = v[0]->position * b0 + v[1]->position * b1 + v[2]->position * b2;
+        const glm::vec3 normal = v[0]->normal * b0 + v[1]->normal * b1 + v[2]->normal * b2;
+        if (glm::dot(normal, normal) > 0.0001f)
+          luxel.normal = glm::normalize(normal);
+        luxel.covered = true;
+      }
+    }
+  }
+}
+
+glm::vec3 LightmapBaker::ComputeLuxel(const Options& options, const Luxel& luxel, u32 seed) const
+{
+  const glm::vec3 origin = luxel.position + luxel.normal * SURFACE_OFFSET;
+  const float ao = (options.ao_samples > 0) ? ComputeAmbientOcclusion(options, origin, luxel.normal, seed) : 1.0f;
+  if (options.mode == Mode::AmbientOcclusion)
+    return luxel.color * ao;
+
+  glm::vec3 color = m_ambient * ao;
+  for (const Light& light : m_lights)
+  {
+    const glm::vec3 to_light = light.origin - origin;
+    const float distance = glm::length(to_light);
+    if (distance < 1.0f)
+      continue;
+
+    const glm::vec3 direction = to_light / distance;
+    const float angle = glm::dot(direction, luxel.normal);
+    if (angle <= 0.0f)
+      continue;
+
+    const float add = light.intensity * POINT_LIGHT_SCALE * angle / (distance * distance);
+    if (add < 1.0f || m_bvh->IsOccluded(origin, direction, distance - SURFACE_OFFSET))
+      continue;
+
+    color += light.color * add;
+  }
+
+  return color * LIGHTMAP_STORE_SCALE;
+}
+
+float LightmapBaker::ComputeAmbientOcclusion(const Options& options, const glm::vec3& position,
+                                             const glm::vec3& normal, u32 seed) const
+{
+  // Cosine-weighted directions about the normal. Seeded per luxel, so the result doesn't depend on thread timing.
+  const glm::vec3 up = (std::abs(normal.z) < 0.9f) ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+  const glm::vec3 tangent = glm::normalize(glm::cross(up, normal));
+  const glm::vec3 bitangent = glm::cross(normal, tangent);
+
+  std::minstd_rand rng(seed + 1);
+  std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+  u32 num_occluded = 0;
+  for (u32 i = 0; i < options.ao_samples; i++)
+  {
+    const float r = std::sqrt(dist(rng));
+    const float phi = 2.0f * 3.14159265f * dist(rng);
+    const float x = r * std::cos(phi);
+    const float y = r * std::sin(phi);
+    const float z = std::sqrt(std::max(1.0f - x * x - y * y, 0.0f));
+    const glm::vec3 direction = tangent * x + bitangent * y + normal * z;
+    num_occluded += m_bvh->IsOccluded(position, direction, options.ao_distance) ? 1 : 0;
+  }
+
+  return 1.0f - float(num_occluded) / float(options.ao_samples);
+}
+
+void LightmapBaker::DilateLuxels(std::vector<Luxel>* luxels, u32 width, u32 height)
+{
+  // Luxels around the edge of a face are sampled by bilinear filtering but not covered by its triangles,
+  // so they take the average of their covered neighbours.
+  std::vector<Luxel> source;
+  for (u32 pass = 0; pass < DILATE_PASSES; pass++)
+  {
+    source = *luxels;
+    for (u32 y = 0; y < height; y++)
+    {
+      for (u32 x = 0; x < width; x++)
+      {
+        Luxel& luxel = (*luxels)[y * width + x];
+        if (luxel.covered)
+          continue;
+
+        glm::vec3 sum(0.0f);
+        u32 count = 0;
+        for (u32 ny = (y > 0) ? (y - 1) : 0; ny <= std::min(y + 1, height - 1); ny++)
+        {
+          for (u32 nx = (x > 0) ? (x - 1) : 0; nx <= std::min(x + 1, width - 1); nx++)
+          {
+            if (source[ny * width + nx].covered)
+            {
+              sum += source[ny * width + nx].color;
+              count++;
+            }
+          }
+        }
+
+        if (count > 0)
+        {
+          luxel.color = sum / float(count);
+          luxel.covered = true;
+        }
+      }
+    }
+  }
+}
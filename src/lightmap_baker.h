@@ -0,0 +1,68 @@
+#pragma once
+#include "bsp.h"
+#include "common.h"
+#include <vector>
+
+class TriangleBVH;
+
+// Recomputes the map's lightmaps on the CPU, tracing against a triangle BVH on the thread pool.
+// Each face's luxels are found by rasterizing its triangles in lightmap space, so patches and meshes are covered
+// as well as planar faces.
+class LightmapBaker
+{
+public:
+  enum class Mode : u32
+  {
+    // Darkens the existing lightmaps by an ambient occlusion term.
+    AmbientOcclusion,
+
+    // Replaces the lightmaps with direct lighting from the light entities, plus occluded worldspawn ambient.
+    Lights
+  };
+
+  struct Options
+  {
+    Mode mode = Mode::AmbientOcclusion;
+    u32 ao_samples = 64;
+    float ao_distance = 128.0f;
+  };
+
+  LightmapBaker(const BSP* bsp, const TriangleBVH* bvh);
+  ~LightmapBaker();
+
+  const std::vector<BSP::LightMap>& GetLightMaps() const { return m_lightmaps; }
+
+  // Returns false if the map has no lightmaps.
+  bool Bake(const Options& options);
+
+private:
+  struct Light
+  {
+    glm::vec3 origin;
+    glm::vec3 color;
+    float intensity;
+  };
+
+  struct Luxel
+  {
+    glm::vec3 position;
+    glm::vec3 normal;
+    glm::vec3 color;
+    bool covered;
+  };
+
+  void FindLights();
+  void RasterizeFace(const BSP::Face* face, std::vector<Luxel>* luxels) const;
+  glm::vec3 ComputeLuxel(const Options& options, const Luxel& luxel, u32 seed) const;
+  float ComputeAmbientOcclusion(const Options& options, const glm::vec3& position, const glm::vec3& normal,
+                                u32 seed) const;
+  static void DilateLuxels(std::vector<Luxel>* luxels, u32 width, u32 height);
+
+  const BSP* m_bsp;
+  const TriangleBVH* m_bvh;
+
+  std::vector<Light> m_lights;
+  glm::vec3 m_ambient = glm::vec3(0.0f);
+
+  std::vector<BSP::LightMap> m_lightmaps;
+};
@@ -1,28 +1,93 @@
 #include "pch.h"
+#include "benchmark_report.h"
 #include "bsp.h"
 #include "bsp_renderer.h"
 #include "camera.h"
+#include "camera_path.h"
+#include "cluster_survey.h"
 #include "colors.h"
 #include "common.h"
+#include "double_buffer.h"
 #include "font.h"
 #include "glad.h"
+#include "gpu_timer.h"
 #include "hud.h"
+#include "lightmap_baker.h"
+#include "offscreen_context.h"
+#include "query_benchmark.h"
 #include "resource_manager.h"
+#include "software_renderer.h"
 #include "statistics.h"
+#include "thread_pool.h"
+#include "triangle_bvh.h"
 #include "util.h"
+#include "vis_compiler.h"
 #include <SDL/SDL.h>
+#include <atomic>
 #include <sys/stat.h>
+#include <thread>
 
 u32 g_num_draws = 0;
 
 static std::unique_ptr<BSP> s_bsp;
 static std::unique_ptr<BSPRenderer> s_bsp_renderer;
+static std::unique_ptr<TriangleBVH> s_triangle_bvh;
 static std::unique_ptr<Font> s_font;
 static SDL_Window* s_window;
 static u32 s_window_width, s_window_height;
 static Camera s_camera;
 static bool s_mouse_captured = false;
 static std::chrono::steady_clock::time_point s_last_frame_time;
+static u32 s_parallel_cull_depth = 0;
+static u32 s_cluster_draw_list_budget_mb = 0;
+static BSPRenderer::SubmitMode s_submit_mode = BSPRenderer::SubmitMode::Auto;
+static bool s_occlusion_culling = false;
+static bool s_hiz_culling = false;
+static bool s_portal_culling = false;
+static bool s_area_portals_open = true;
+static float s_near_plane = 1.0f;
+static float s_far_plane = 10000.0f;
+static float s_min_projected_area = 0.0f;
+static float s_detail_distance = 0.0f;
+static bool s_temporal_coherence = true;
+static u32 s_query_benchmark_points = 0;
+static u32 s_trace_benchmark_count = 0;
+static u32 s_ray_benchmark_count = 0;
+static bool s_pick = false;
+static bool s_collision = false;
+static bool s_rebake = false;
+static LightmapBaker::Options s_rebake_options;
+static const char* s_software_render_filename = nullptr;
+static u32 s_software_render_frames = 1;
+static bool s_headless = false;
+static u32 s_headless_frames = 1;
+static const char* s_capture_filename = nullptr;
+static const char* s_benchmark_filename = nullptr;
+static const char* s_report_filename = nullptr;
+static const char* s_record_filename = nullptr;
+static float s_benchmark_timestep = 1.0f / 60.0f;
+static CameraPath s_camera_path;
+static std::chrono::steady_clock::time_point s_record_start_time;
+static std::unique_ptr<GPUTimer> s_gpu_timer;
+static const char* s_survey_filename = nullptr;
+static VisCompiler::Quality s_vis_quality = VisCompiler::Quality::Fast;
+static SDL_GLContext s_gl_context;
+
+struct FrameData
+{
+  Camera camera;
+  RenderList render_list;
+  u32 viewport_width = 1;
+  u32 viewport_height = 1;
+  std::chrono::steady_clock::time_point input_time;
+  float cull_time = 0.0f;
+  float sort_time = 0.0f;
+};
+
+static FrameData s_frame;
+static DoubleBuffer<FrameData> s_frame_buffer;
+static std::atomic<bool> s_render_thread_exit{false};
+static bool s_pipelined = false;
 
 namespace {
 
@@ -39,13 +104,17 @@ void APIENTRY MessageCallback(GLenum source, GLenum type, GLuint id, GLenum seve
 bool Setup()
 {
   std::printf("GL_VERSION: %s\n", glGetString(GL_VERSION));
+  std::printf("GL_RENDERER: %s\n", glGetString(GL_RENDERER));
 
-  int red_size, green_size, blue_size, depth_size;
-  SDL_GL_GetAttribute(SDL_GL_RED_SIZE, &red_size);
-  SDL_GL_GetAttribute(SDL_GL_GREEN_SIZE, &green_size);
-  SDL_GL_GetAttribute(SDL_GL_BLUE_SIZE, &blue_size);
-  SDL_GL_GetAttribute(SDL_GL_DEPTH_SIZE, &depth_size);
-  std::printf("Backbuffer: Red=%d, Green=%d, Blue=%d, Depth=%d\n", red_size, green_size, blue_size, depth_size);
+  if (s_window)
+  {
+    int red_size, green_size, blue_size, depth_size;
+    SDL_GL_GetAttribute(SDL_GL_RED_SIZE, &red_size);
+    SDL_GL_GetAttribute(SDL_GL_GREEN_SIZE, &green_size);
+    SDL_GL_GetAttribute(SDL_GL_BLUE_SIZE, &blue_size);
+    SDL_GL_GetAttribute(SDL_GL_DEPTH_SIZE, &depth_size);
+    std::printf("Backbuffer: Red=%d, Green=%d, Blue=%d, Depth=%d\n", red_size, green_size, blue_size, depth_size);
+  }
 
   if (glDebugMessageCallback)
   {
@@ -61,6 +130,24 @@ bool Setup()
   if (!s_bsp_renderer->Initialize())
     return false;
 
+  s_bsp_renderer->SetParallelCullDepth(s_parallel_cull_depth);
+  s_bsp_renderer->SetSubmitMode(s_submit_mode);
+  s_bsp_renderer->SetOcclusionCullingEnabled(s_occlusion_culling);
+  s_bsp_renderer->SetHiZCullingEnabled(s_hiz_culling);
+  if (s_portal_culling)
+    s_bsp->GeneratePortals();
+  s_bsp_renderer->SetPortalCullingEnabled(s_portal_culling);
+  s_bsp_renderer->SetMinProjectedArea(s_min_projected_area);
+  s_bsp_renderer->SetDetailDistance(s_detail_distance);
+  s_bsp_renderer->SetTemporalCoherenceEnabled(s_temporal_coherence);
+  s_camera.SetNearPlane(s_near_plane);
+  s_camera.SetFarPlane(s_far_plane);
+  if (s_cluster_draw_list_budget_mb > 0 &&
+      !s_bsp_renderer->BuildClusterDrawLists(size_t(s_cluster_draw_list_budget_mb) * 1024 * 1024))
+  {
+    return false;
+  }
+
   s_font = Font::Create();
   if (!s_font)
     return false;
@@ -72,48 +159,173 @@ bool Setup()
   return true;
 }
 
-void Render()
+// Bounds of the camera for collision, relative to the eye.
+static const glm::vec3 s_camera_mins(-15.0f, -15.0f, -24.0f);
+static const glm::vec3 s_camera_maxs(15.0f, 15.0f, 8.0f);
+
+// Moves from start towards end, sliding along anything in the way.
+glm::vec3 ClipCameraMove(const glm::vec3& start, const glm::vec3& end)
 {
-  g_statistics->BeginFrame();
+  static constexpr u32 MAX_CLIP_PLANES = 4;
+  static constexpr float OVERCLIP = 1.001f;
+
+  glm::vec3 position = start;
+  glm::vec3 move = end - start;
+  for (u32 i = 0; i < MAX_CLIP_PLANES && glm::dot(move, move) > 0.0f; i++)
+  {
+    const BSP::TraceResult trace =
+      s_bsp->TraceBox(position, position + move, s_camera_mins, s_camera_maxs, BSP::MASK_PLAYERSOLID);
+
+    // Stuck inside something, let the camera fly out.
+    if (trace.all_solid)
+      return end;
 
+    position = trace.end_position;
+    if (trace.fraction == 1.0f)
+      break;
+
+    const glm::vec3& normal = trace.plane.GetNormal();
+    move *= (1.0f - trace.fraction);
+    move -= normal * (glm::dot(move, normal) * OVERCLIP);
+  }
+
+  return position;
+}
+
+// Appends the camera to the recorded path. Keyframes are thinned out, as replay interpolates between them anyway.
+void RecordCameraKeyframe(std::chrono::steady_clock::time_point time_now)
+{
+  static constexpr float MIN_KEYFRAME_INTERVAL = 1.0f / 30.0f;
+
+  if (s_camera_path.IsEmpty())
+    s_record_start_time = time_now;
+
+  const float time = std::chrono::duration<float>(time_now - s_record_start_time).count();
+  if (!s_camera_path.IsEmpty() && (time - s_camera_path.GetDuration()) < MIN_KEYFRAME_INTERVAL)
+    return;
+
+  s_camera_path.AddKeyframe(time, s_camera);
+}
+
+void UpdateCamera()
+{
   auto time_now = std::chrono::steady_clock::now();
   float time_diff = std::chrono::duration<float>(time_now - s_last_frame_time).count();
   s_last_frame_time = time_now;
-  g_num_draws = 0;
 
   s_camera.SetAspectRatio(s_window_width, s_window_height);
+
+  const glm::vec3 old_position = s_camera.GetPosition();
   s_camera.Update(time_diff);
+  if (s_collision && s_camera.GetPosition() != old_position)
+    s_camera.SetPosition(ClipCameraMove(old_position, s_camera.GetPosition()));
+
+  if (s_record_filename)
+    RecordCameraKeyframe(time_now);
+}
+
+// Snapshots the camera and runs the visibility stage. Does not touch GL, so it can run ahead of the render thread.
+void BuildFrame(FrameData* frame)
+{
+  using ClockSource = std::chrono::steady_clock;
+
+  frame->input_time = ClockSource::now();
+  frame->camera = s_camera;
+  frame->viewport_width = s_window_width;
+  frame->viewport_height = s_window_height;
+
+  auto cull_start_time = ClockSource::now();
+  s_bsp_renderer->BuildRenderList(frame->camera, &frame->render_list);
+  auto sort_start_time = ClockSource::now();
+  frame->render_list.Sort();
+  auto sort_end_time = ClockSource::now();
+
+  frame->cull_time = std::chrono::duration<float>(sort_start_time - cull_start_time).count();
+  frame->sort_time = std::chrono::duration<float>(sort_end_time - sort_start_time).count();
+}
+
+void RenderFrame(const FrameData& frame)
+{
+  using ClockSource = std::chrono::steady_clock;
+
+  g_num_draws = 0;
+
+  if (s_gpu_timer)
+    s_gpu_timer->Begin();
 
   glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
   glClearDepth(1.0f);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-  glViewport(0, 0, s_window_width, s_window_height);
+  glViewport(0, 0, frame.viewport_width, frame.viewport_height);
   glDepthRange(0.0, 1.0);
 
-  g_hud->SetViewportSize(s_window_width, s_window_height);
+  g_hud->SetViewportSize(frame.viewport_width, frame.viewport_height);
 
-  s_bsp_renderer->Render(s_camera);
+  auto submit_start_time = ClockSource::now();
+  s_bsp_renderer->SubmitRenderList(frame.camera, frame.render_list);
+  g_statistics->AddSubmitTime(std::chrono::duration<float>(ClockSource::now() - submit_start_time).count());
+  g_statistics->AddCullTime(frame.cull_time);
+  g_statistics->AddSortTime(frame.sort_time);
+  g_statistics->AddVisibleLeaves(frame.render_list.GetVisibleLeafCount());
+  g_statistics->AddOccludedLeaves(frame.render_list.GetOccludedLeafCount());
+  g_statistics->AddPortalRejectedLeaves(frame.render_list.GetPortalRejectedLeafCount());
 
   {
     s_font->RenderFormattedText(g_hud->GetViewportWidth() - 180, 4, Colors::White, "%.2f fps (%.2f ms)",
                                 g_statistics->GetLastFPS(), g_statistics->GetLastFrameTime() * 1000.0f);
     s_font->RenderFormattedText(g_hud->GetViewportWidth() - 180, 18, Colors::White, "%u draw calls",
                                 g_statistics->GetLastFrameNumDraws());
+    s_font->RenderFormattedText(g_hud->GetViewportWidth() - 180, 32, Colors::White, "%u visible leaves",
+                                g_statistics->GetLastFrameNumVisibleLeaves());
+    s_font->RenderFormattedText(g_hud->GetViewportWidth() - 180, 46, Colors::White, "%u occluded leaves",
+                                g_statistics->GetLastFrameNumOccludedLeaves());
+    s_font->RenderFormattedText(g_hud->GetViewportWidth() - 180, 60, Colors::White, "%u portal rejected",
+                                g_statistics->GetLastFrameNumPortalRejectedLeaves());
+    s_font->RenderFormattedText(g_hud->GetViewportWidth() - 180, 74, Colors::White, "cull: %.3f ms",
+                                g_statistics->GetLastFrameCullTime() * 1000.0f);
+    s_font->RenderFormattedText(g_hud->GetViewportWidth() - 180, 88, Colors::White, "sort: %.3f ms",
+                                g_statistics->GetLastFrameSortTime() * 1000.0f);
+    s_font->RenderFormattedText(g_hud->GetViewportWidth() - 180, 102, Colors::White, "submit: %.3f ms",
+                                g_statistics->GetLastFrameSubmitTime() * 1000.0f);
+    s_font->RenderFormattedText(g_hud->GetViewportWidth() - 180, 116, Colors::White, "latency: %.2f ms",
+                                g_statistics->GetLastFrameLatency() * 1000.0f);
 
-    s_font->RenderFormattedText(4, 4, Colors::White, "Camera Position: %.4f %.4f %.4f", s_camera.GetPosition().x,
-                                s_camera.GetPosition().y, s_camera.GetPosition().z);
-    const BSP::Leaf* camera_leaf = s_bsp->FindLeafForPosition(s_camera.GetPosition());
+    const Camera& camera = frame.camera;
+    s_font->RenderFormattedText(4, 4, Colors::White, "Camera Position: %.4f %.4f %.4f", camera.GetPosition().x,
+                                camera.GetPosition().y, camera.GetPosition().z);
+    const BSP::Leaf* camera_leaf = s_bsp->FindLeafForPosition(camera.GetPosition());
     if (!camera_leaf)
       s_font->RenderText(4, 18, Colors::Red, "Not in a leaf");
     else
       s_font->RenderFormattedText(4, 18, Colors::Green, "Leaf: %u (cluster %d)", camera_leaf->index,
                                   camera_leaf->cluster);
+
+    if (s_triangle_bvh)
+    {
+      TriangleBVH::Hit hit;
+      s_font->RenderText(s32(frame.viewport_width / 2) - 4, s32(frame.viewport_height / 2) - 8, Colors::White, "+");
+      if (s_triangle_bvh->Intersect(camera.GetPosition(), glm::normalize(camera.GetViewDirection()),
+                                    camera.GetFarPlane(), &hit))
+      {
+        const char* texture_name =
+          (hit.texture_index >= 0) ? s_bsp->GetTexture(size_t(hit.texture_index))->name.c_str() : "(none)";
+        s_font->RenderFormattedText(4, 32, Colors::White, "Looking at: face %u, %s, %.1f units", hit.face_index,
+                                    texture_name, hit.distance);
+      }
+    }
   }
 
-  SDL_GL_SwapWindow(s_window);
+  if (s_gpu_timer)
+    s_gpu_timer->End();
+
+  if (s_window)
+    SDL_GL_SwapWindow(s_window);
+  else
+    glFinish();
 
-  g_statistics->EndFrame();
+  // Time from sampling the camera to the frame being handed to the driver.
+  g_statistics->SetLatency(std::chrono::duration<float>(ClockSource::now() - frame.input_time).count());
 }
 
 void CaptureMouse()
@@ -138,83 +350,654 @@ void ReleaseMouse()
   s_mouse_captured = false;
 }
 
-void MainLoop()
+// Returns false when the application should exit.
+bool HandleEvents()
 {
-  SDL_PumpEvents();
-  for (;;)
+  SDL_Event ev;
+  while (SDL_PollEvent(&ev))
   {
-    SDL_Event ev;
-    while (SDL_PollEvent(&ev))
+    if (ev.type == SDL_QUIT)
     {
-      if (ev.type == SDL_QUIT)
-      {
-        return;
-      }
-      else if (ev.type == SDL_WINDOWEVENT)
+      return false;
+    }
+    else if (ev.type == SDL_WINDOWEVENT)
+    {
+      switch (ev.window.event)
       {
-        switch (ev.window.event)
-        {
-          case SDL_WINDOWEVENT_RESIZED:
-            s_window_width = static_cast<u32>(ev.window.data1);
-            s_window_height = static_cast<u32>(ev.window.data2);
-            break;
-
-          case SDL_WINDOWEVENT_FOCUS_GAINED:
-            CaptureMouse();
-            break;
-
-          case SDL_WINDOWEVENT_FOCUS_LOST:
-            ReleaseMouse();
-            break;
-        }
+        case SDL_WINDOWEVENT_RESIZED:
+          s_window_width = static_cast<u32>(ev.window.data1);
+          s_window_height = static_cast<u32>(ev.window.data2);
+          break;
+
+        case SDL_WINDOWEVENT_FOCUS_GAINED:
+          CaptureMouse();
+          break;
+
+        case SDL_WINDOWEVENT_FOCUS_LOST:
+          ReleaseMouse();
+          break;
       }
-      else if (ev.type == SDL_MOUSEMOTION)
+    }
+    else if (ev.type == SDL_MOUSEMOTION)
+    {
+      if (s_mouse_captured)
       {
-        if (s_mouse_captured)
-        {
-          if (ev.motion.xrel != 0)
-            s_camera.ModYaw(float(-ev.motion.xrel) * 0.5f);
-          if (ev.motion.yrel != 0)
-            s_camera.ModPitch(float(-ev.motion.yrel) * 0.5f);
-        }
+        if (ev.motion.xrel != 0)
+          s_camera.ModYaw(float(-ev.motion.xrel) * 0.5f);
+        if (ev.motion.yrel != 0)
+          s_camera.ModPitch(float(-ev.motion.yrel) * 0.5f);
       }
-      else if (ev.type == SDL_KEYDOWN || ev.type == SDL_KEYUP)
+    }
+    else if (ev.type == SDL_KEYDOWN || ev.type == SDL_KEYUP)
+    {
+      const bool down = (ev.type == SDL_KEYDOWN);
+      const float value = (down) ? 1.0f : -1.0f;
+      switch (ev.key.keysym.scancode)
       {
-        const bool down = (ev.type == SDL_KEYDOWN);
-        const float value = (down) ? 1.0f : -1.0f;
-        switch (ev.key.keysym.scancode)
-        {
-          case SDL_SCANCODE_W:
-            s_camera.ModViewVector(glm::vec3(0.0f, value, 0.0f));
-            break;
-          case SDL_SCANCODE_S:
-            s_camera.ModViewVector(glm::vec3(0.0f, -value, 0.0f));
-            break;
-          case SDL_SCANCODE_D:
-            s_camera.ModViewVector(glm::vec3(value, 0.0f, 0.0f));
-            break;
-          case SDL_SCANCODE_A:
-            s_camera.ModViewVector(glm::vec3(-value, 0.0f, 0.0f));
-            break;
-          case SDL_SCANCODE_LSHIFT:
-            s_camera.SetTurboEnabled(down);
-            break;
-        }
+        case SDL_SCANCODE_W:
+          s_camera.ModViewVector(glm::vec3(0.0f, value, 0.0f));
+          break;
+        case SDL_SCANCODE_S:
+          s_camera.ModViewVector(glm::vec3(0.0f, -value, 0.0f));
+          break;
+        case SDL_SCANCODE_D:
+          s_camera.ModViewVector(glm::vec3(value, 0.0f, 0.0f));
+          break;
+        case SDL_SCANCODE_A:
+          s_camera.ModViewVector(glm::vec3(-value, 0.0f, 0.0f));
+          break;
+        case SDL_SCANCODE_LSHIFT:
+          s_camera.SetTurboEnabled(down);
+          break;
+        case SDL_SCANCODE_O:
+          if (down && !ev.key.repeat)
+            s_bsp_renderer->SetOcclusionCullingEnabled(!s_bsp_renderer->IsOcclusionCullingEnabled());
+          break;
+        case SDL_SCANCODE_H:
+          if (down && !ev.key.repeat)
+            s_bsp_renderer->SetHiZCullingEnabled(!s_bsp_renderer->IsHiZCullingEnabled());
+          break;
+        case SDL_SCANCODE_C:
+          if (down && !ev.key.repeat)
+          {
+            s_area_portals_open = !s_area_portals_open;
+            s_bsp_renderer->SetAllAreaPortalsOpen(s_area_portals_open);
+            std::fprintf(stdout, "%s %u area portals\n", s_area_portals_open ? "Opened" : "Closed",
+                         u32(s_bsp->GetAreaPortalCount()));
+          }
+          break;
+        case SDL_SCANCODE_N:
+          if (down && !ev.key.repeat)
+          {
+            s_collision = !s_collision;
+            std::fprintf(stdout, "Collision %s\n", s_collision ? "enabled" : "disabled");
+          }
+          break;
+        case SDL_SCANCODE_P:
+          if (down && !ev.key.repeat)
+          {
+            s_bsp->GeneratePortals();
+            s_bsp_renderer->SetPortalCullingEnabled(!s_bsp_renderer->IsPortalCullingEnabled());
+          }
+          break;
       }
     }
+  }
+
+  return true;
+}
+
+void MainLoop()
+{
+  SDL_PumpEvents();
+  while (HandleEvents())
+  {
+    g_statistics->BeginFrame();
+    UpdateCamera();
+    BuildFrame(&s_frame);
+    RenderFrame(s_frame);
+    g_statistics->EndFrame();
+  }
+}
+
+void RenderThread()
+{
+  SDL_GL_MakeCurrent(s_window, s_gl_context);
+
+  while (!s_render_thread_exit.load())
+  {
+    const FrameData* frame = s_frame_buffer.TryBeginRead();
+    if (!frame)
+    {
+      std::this_thread::yield();
+      continue;
+    }
 
-    Render();
+    g_statistics->BeginFrame();
+    RenderFrame(*frame);
+    s_frame_buffer.EndRead();
+    g_statistics->EndFrame();
   }
+
+  SDL_GL_MakeCurrent(s_window, nullptr);
+}
+
+// The main thread handles input and builds frame N+1 while the render thread owning the GL context submits frame N.
+void PipelinedMainLoop()
+{
+  SDL_GL_MakeCurrent(s_window, nullptr);
+  s_render_thread_exit.store(false);
+  std::thread render_thread(RenderThread);
+
+  SDL_PumpEvents();
+  while (HandleEvents())
+  {
+    UpdateCamera();
+
+    FrameData* frame = s_frame_buffer.TryBeginWrite();
+    if (!frame)
+    {
+      std::this_thread::yield();
+      continue;
+    }
+
+    BuildFrame(frame);
+    s_frame_buffer.EndWrite();
+  }
+
+  s_render_thread_exit.store(true);
+  render_thread.join();
+  SDL_GL_MakeCurrent(s_window, s_gl_context);
+}
+
+void ComputeMissingVisData(const char* map_filename)
+{
+  if (s_bsp->HasVisData())
+    return;
+
+  // Cached next to the map, as this can take a while.
+  VisCompiler compiler(s_bsp.get());
+  const std::string cache_filename = Util::RemoveFilenameExtensions(map_filename, true) + ".vis";
+  if (!compiler.LoadCache(cache_filename.c_str(), s_vis_quality))
+  {
+    s_bsp->GeneratePortals();
+    if (!compiler.Compute(s_vis_quality))
+    {
+      std::fprintf(stderr, "Could not compute visibility, all clusters will be drawn.\n");
+      return;
+    }
+
+    compiler.SaveCache(cache_filename.c_str());
+  }
+
+  s_bsp->SetVisData(compiler.GetVisData());
+}
+
+bool RebakeLightmaps(const char* map_filename)
+{
+  std::unique_ptr<TriangleBVH> bvh = TriangleBVH::Create(s_bsp.get());
+  LightmapBaker baker(s_bsp.get(), bvh.get());
+  const auto start_time = std::chrono::steady_clock::now();
+  if (!baker.Bake(s_rebake_options))
+    return false;
+
+  std::printf("Baked %u lightmaps in %.2f seconds\n", u32(baker.GetLightMaps().size()),
+              std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count());
+
+  // Every other lump is copied from the original file unchanged.
+  const std::string output_filename = Util::RemoveFilenameExtensions(map_filename, true) + "_rebaked.bsp";
+  auto src_fp = Util::FOpenUniquePtr(map_filename, "rb");
+  auto dst_fp = Util::FOpenUniquePtr(output_filename.c_str(), "wb");
+  if (!src_fp || !dst_fp)
+    return false;
+
+  const std::vector<BSP::LightMap>& lightmaps = baker.GetLightMaps();
+  if (!BSP::CopyWithReplacedLump(src_fp.get(), dst_fp.get(), BSP::LUMP_LIGHTMAPS, lightmaps.data(),
+                                 u32(lightmaps.size() * sizeof(BSP::LightMap))))
+  {
+    std::fprintf(stderr, "Failed to write '%s'\n", output_filename.c_str());
+    return false;
+  }
+
+  std::printf("Wrote '%s'\n", output_filename.c_str());
+  return true;
+}
+
+bool RenderSoftware()
+{
+  SoftwareRenderer renderer(s_bsp.get());
+  if (!renderer.Initialize())
+    return false;
+
+  s_camera.SetAspectRatio(s_window_width, s_window_height);
+  s_camera.SetNearPlane(s_near_plane);
+  s_camera.SetFarPlane(s_far_plane);
+
+  double visibility_ms = 0.0, setup_ms = 0.0, raster_ms = 0.0;
+  for (u32 i = 0; i < s_software_render_frames; i++)
+  {
+    renderer.Render(s_camera);
+    visibility_ms += renderer.GetStatistics().visibility_ms;
+    setup_ms += renderer.GetStatistics().setup_ms;
+    raster_ms += renderer.GetStatistics().raster_ms;
+  }
+
+  const SoftwareRenderer::Statistics& stats = renderer.GetStatistics();
+  const double frames = double(s_software_render_frames);
+  std::printf("Software render: %u faces, %u triangles, %u binned\n", stats.visible_faces, stats.triangles,
+              stats.binned_triangles);
+  std::printf("Average over %u frames: visibility %.2f ms, setup %.2f ms, raster %.2f ms, total %.2f ms\n",
+              s_software_render_frames, visibility_ms / frames, setup_ms / frames, raster_ms / frames,
+              (visibility_ms + setup_ms + raster_ms) / frames);
+
+  if (!renderer.SaveImage(s_software_render_filename))
+    return false;
+
+  std::printf("Wrote '%s'\n", s_software_render_filename);
+  return true;
+}
+
+// Replays the camera path, one report entry per frame, until the end of the path or the window is closed.
+// With a fixed timestep every run renders the same views; otherwise the path plays back in real time.
+bool RunBenchmark()
+{
+  using ClockSource = std::chrono::steady_clock;
+
+  // Untimed frames first, so one-off work such as texture uploads and shader compiles stays out of the results. In
+  // auto submit mode, keep going until the path has been picked, as calibration frames alternate between both.
+  s_camera.SetAspectRatio(s_window_width, s_window_height);
+  s_camera_path.Sample(0.0f, &s_camera);
+  do
+  {
+    g_statistics->BeginFrame();
+    BuildFrame(&s_frame);
+    RenderFrame(s_frame);
+    g_statistics->EndFrame();
+  } while (s_bsp_renderer->IsCalibratingSubmitMode() && (!s_window || HandleEvents()));
+
+  s_gpu_timer = GPUTimer::Create();
+  if (!s_gpu_timer)
+    std::fprintf(stderr, "GPU times will not be reported\n");
+
+  auto ReadGPUTimes = [](BenchmarkReport* report, bool wait) {
+    u32 frame_index;
+    float gpu_ms;
+    while (s_gpu_timer && s_gpu_timer->GetResult(&frame_index, &gpu_ms, wait || s_gpu_timer->IsFull()))
+      report->SetGPUTime(frame_index, gpu_ms);
+  };
+
+  BenchmarkReport report;
+  const float duration = s_camera_path.GetDuration();
+  const ClockSource::time_point start_time = ClockSource::now();
+  float path_time = 0.0f;
+  for (u32 frame_number = 0; path_time <= duration && (!s_window || HandleEvents()); frame_number++)
+  {
+    g_statistics->BeginFrame();
+    s_camera.SetAspectRatio(s_window_width, s_window_height);
+    s_camera_path.Sample(path_time, &s_camera);
+    BuildFrame(&s_frame);
+    RenderFrame(s_frame);
+    g_statistics->EndFrame();
+
+    BenchmarkReport::FrameRecord record;
+    record.time = path_time;
+    record.frame_ms = g_statistics->GetLastFrameTime() * 1000.0f;
+    record.cpu_ms = (g_statistics->GetLastFrameCullTime() + g_statistics->GetLastFrameSortTime() +
+                     g_statistics->GetLastFrameSubmitTime()) *
+                    1000.0f;
+    record.gpu_ms = -1.0f;
+    record.draws = g_statistics->GetLastFrameNumDraws();
+    record.visible_leaves = g_statistics->GetLastFrameNumVisibleLeaves();
+    record.triangles = g_statistics->GetLastFrameNumTriangles();
+    report.AddFrame(record);
+    ReadGPUTimes(&report, false);
+
+    if (s_benchmark_timestep > 0.0f)
+      path_time = float(frame_number + 1) * s_benchmark_timestep;
+    else
+      path_time = std::chrono::duration<float>(ClockSource::now() - start_time).count();
+  }
+
+  ReadGPUTimes(&report, true);
+  s_gpu_timer.reset();
+
+  std::printf("Benchmark: %.2f seconds of '%s' at %ux%u, %s submit path\n", duration, s_benchmark_filename,
+              s_window_width, s_window_height, s_bsp_renderer->GetSubmitPathName());
+  report.PrintSummary();
+  if (!s_report_filename)
+    return true;
+
+  if (!report.Write(s_report_filename))
+    return false;
+
+  std::printf("Wrote '%s'\n", s_report_filename);
+  return true;
+}
+
+// Renders the view a few times and keeps the fastest frame, as single frames are noisy.
+ClusterSurvey::Measurement MeasureSurveyView(const Camera& camera)
+{
+  static constexpr u32 NUM_REPEATS = 3;
+
+  ClusterSurvey::Measurement measurement = {};
+  for (u32 i = 0; i < NUM_REPEATS; i++)
+  {
+    s_camera = camera;
+    g_statistics->BeginFrame();
+    BuildFrame(&s_frame);
+    RenderFrame(s_frame);
+    g_statistics->EndFrame();
+
+    const float frame_ms = g_statistics->GetLastFrameTime() * 1000.0f;
+    if (i > 0 && frame_ms >= measurement.frame_ms)
+      continue;
+
+    measurement.frame_ms = frame_ms;
+    measurement.cpu_ms = (g_statistics->GetLastFrameCullTime() + g_statistics->GetLastFrameSortTime() +
+                          g_statistics->GetLastFrameSubmitTime()) *
+                         1000.0f;
+    measurement.visible_leaves = g_statistics->GetLastFrameNumVisibleLeaves();
+    measurement.draws = g_statistics->GetLastFrameNumDraws();
+    measurement.triangles = g_statistics->GetLastFrameNumTriangles();
+  }
+
+  return measurement;
+}
+
+// Writes the table next to the heatmap, <name>.csv and <name>_heatmap.tga.
+bool RunSurvey()
+{
+  static constexpr u32 NUM_WORST_CLUSTERS = 20;
+  static constexpr u32 HEATMAP_SIZE = 1024;
+
+  // Each view is rendered several times from the same spot, which temporal coherence would answer from the list it
+  // cached on the first, so it stays off for the whole survey.
+  const bool temporal_coherence = s_bsp_renderer->IsTemporalCoherenceEnabled();
+  s_bsp_renderer->SetTemporalCoherenceEnabled(false);
+
+  ClusterSurvey survey(s_bsp.get());
+  const bool survey_result = survey.Run(s_camera, MeasureSurveyView);
+  s_bsp_renderer->SetTemporalCoherenceEnabled(temporal_coherence);
+  if (!survey_result)
+    return false;
+
+  survey.PrintWorstClusters(NUM_WORST_CLUSTERS);
+
+  const std::string base_filename = Util::RemoveFilenameExtensions(s_survey_filename, true);
+  const std::string csv_filename = base_filename + ".csv";
+  const std::string heatmap_filename = base_filename + "_heatmap.tga";
+  if (!survey.WriteCSV(csv_filename.c_str()) || !survey.WriteHeatmap(heatmap_filename.c_str(), HEATMAP_SIZE))
+    return false;
+
+  std::printf("Wrote '%s' and '%s'\n", csv_filename.c_str(), heatmap_filename.c_str());
+  return true;
+}
+
+bool RunHeadless()
+{
+  std::unique_ptr<OffscreenContext> context = OffscreenContext::Create(s_window_width, s_window_height);
+  if (!context || !Setup())
+    return false;
+
+  s_camera.SetAspectRatio(s_window_width, s_window_height);
+
+  // Frame times include a glFinish(), as there is no swap to wait on.
+  bool result = true;
+  if (s_benchmark_filename)
+  {
+    result = RunBenchmark();
+  }
+  else if (s_survey_filename)
+  {
+    result = RunSurvey();
+  }
+  else
+  {
+    double total_time = 0.0;
+    for (u32 i = 0; i < s_headless_frames; i++)
+    {
+      g_statistics->BeginFrame();
+      BuildFrame(&s_frame);
+      RenderFrame(s_frame);
+      g_statistics->EndFrame();
+      total_time += g_statistics->GetLastFrameTime();
+    }
+
+    std::printf("Rendered %u frames at %ux%u, average %.3f ms, last frame %u draws, %u visible leaves\n",
+                s_headless_frames, s_window_width, s_window_height, total_time * 1000.0 / double(s_headless_frames),
+                g_statistics->GetLastFrameNumDraws(), g_statistics->GetLastFrameNumVisibleLeaves());
+  }
+
+  if (s_capture_filename)
+  {
+    std::vector<u32> pixels;
+    context->ReadPixels(&pixels);
+    result = Util::WriteTGA(s_capture_filename, s_window_width, s_window_height, pixels.data(), s_window_width);
+    if (result)
+      std::printf("Wrote '%s'\n", s_capture_filename);
+  }
+
+  s_bsp_renderer.reset();
+  s_font.reset();
+  g_hud->Shutdown();
+  g_resource_manager->UnloadAllResources();
+  return result;
+}
+
+void PrintUsage(const char* program_name)
+{
+  std::fprintf(stderr, "Usage: %s [options] <map.bsp>\n", program_name);
+  std::fprintf(stderr, "Options:\n");
+  std::fprintf(stderr, "  --threads <count>              Worker thread count (default: one per core)\n");
+  std::fprintf(stderr, "  --parallel-cull-depth <depth>  Cull subtrees at this depth in parallel\n");
+  std::fprintf(stderr, "  --pipelined                    Submit GL on a separate render thread\n");
+  std::fprintf(stderr, "  --cluster-draw-lists <MB>      Precompute per-cluster draw lists within this budget\n");
+  std::fprintf(stderr, "  --submit-mode <mode>           static, dynamic or auto (default)\n");
+  std::fprintf(stderr, "  --occlusion-culling            Reject leaves hidden behind large faces (toggle with O)\n");
+  std::fprintf(stderr, "  --hiz-culling                  Two-phase GPU occlusion culling (toggle with H)\n");
+  std::fprintf(stderr, "  --near <distance>              Near clip plane (default: 1)\n");
+  std::fprintf(stderr, "  --far <distance>               Far clip plane (default: 10000)\n");
+  std::fprintf(stderr, "  --min-pixels <area>            Skip nodes and leaves covering fewer pixels than this\n");
+  std::fprintf(stderr, "  --detail-distance <distance>   Skip detail surfaces in leaves farther away than this\n");
+  std::fprintf(stderr, "  --no-temporal-coherence        Cull every frame from scratch\n");
+  std::fprintf(stderr, "  --full-vis                     Compute full quality vis for maps without visdata\n");
+  std::fprintf(stderr, "  --query-benchmark <count>      Time point and PVS queries for this many points, then exit\n");
+  std::fprintf(stderr, "  --trace-benchmark <count>      Time this many ray and box traces, then exit\n");
+  std::fprintf(stderr, "  --ray-benchmark <count>        Time this many rays against a triangle BVH, then exit\n");
+  std::fprintf(stderr, "  --rebake <ao|lights>           Rebake lightmaps into <map>_rebaked.bsp, then exit\n");
+  std::fprintf(stderr, "  --ao-samples <count>           AO rays per luxel when rebaking (default: 64)\n");
+  std::fprintf(stderr, "  --headless <width>x<height>    Render offscreen without a window, then exit\n");
+  std::fprintf(stderr, "  --frames <count>               Frames to render with --headless (default: 1)\n");
+  std::fprintf(stderr, "  --capture <file.tga>           Save the last headless frame\n");
+  std::fprintf(stderr, "  --view <x,y,z,yaw,pitch>       Start the camera at this position and angle\n");
+  std::fprintf(stderr, "  --benchmark <path.cam>         Replay a camera path and report frame times, then exit\n");
+  std::fprintf(stderr, "  --timestep <seconds>           Benchmark frame step, 0 for real time (default: 1/60)\n");
+  std::fprintf(stderr, "  --report <file.json|file.csv>  Write per-frame benchmark results\n");
+  std::fprintf(stderr, "  --record <path.cam>            Record the camera path to this file on exit\n");
+  std::fprintf(stderr, "  --survey <name>                Measure views from every cluster offscreen, then exit\n");
+  std::fprintf(stderr, "  --software-render <file.tga>   Render one view on the CPU and save it, then exit\n");
+  std::fprintf(stderr, "  --software-frames <count>      Frames to time with --software-render (default: 1)\n");
+  std::fprintf(stderr, "  --pick                         Show the surface under the crosshair\n");
+  std::fprintf(stderr, "  --collision                    Stop the camera at walls (toggle with N)\n");
+  std::fprintf(stderr, "  --portal-culling               Cull through portals from the camera leaf (toggle with P)\n");
 }
 } // namespace
 
 int main(int argc, char* argv[])
 {
-  if (argc < 2)
+  const char* map_filename = nullptr;
+  u32 num_threads = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    if (std::strcmp(argv[i], "--parallel-cull-depth") == 0 && (i + 1) < argc)
+      s_parallel_cull_depth = u32(std::strtoul(argv[++i], nullptr, 10));
+    else if (std::strcmp(argv[i], "--threads") == 0 && (i + 1) < argc)
+      num_threads = u32(std::strtoul(argv[++i], nullptr, 10));
+    else if (std::strcmp(argv[i], "--pipelined") == 0)
+      s_pipelined = true;
+    else if (std::strcmp(argv[i], "--cluster-draw-lists") == 0 && (i + 1) < argc)
+      s_cluster_draw_list_budget_mb = u32(std::strtoul(argv[++i], nullptr, 10));
+    else if (std::strcmp(argv[i], "--occlusion-culling") == 0)
+      s_occlusion_culling = true;
+    else if (std::strcmp(argv[i], "--hiz-culling") == 0)
+      s_hiz_culling = true;
+    else if (std::strcmp(argv[i], "--portal-culling") == 0)
+      s_portal_culling = true;
+    else if (std::strcmp(argv[i], "--near") == 0 && (i + 1) < argc)
+      s_near_plane = std::strtof(argv[++i], nullptr);
+    else if (std::strcmp(argv[i], "--far") == 0 && (i + 1) < argc)
+      s_far_plane = std::strtof(argv[++i], nullptr);
+    else if (std::strcmp(argv[i], "--min-pixels") == 0 && (i + 1) < argc)
+      s_min_projected_area = std::strtof(argv[++i], nullptr);
+    else if (std::strcmp(argv[i], "--detail-distance") == 0 && (i + 1) < argc)
+      s_detail_distance = std::strtof(argv[++i], nullptr);
+    else if (std::strcmp(argv[i], "--no-temporal-coherence") == 0)
+      s_temporal_coherence = false;
+    else if (std::strcmp(argv[i], "--query-benchmark") == 0 && (i + 1) < argc)
+      s_query_benchmark_points = u32(std::strtoul(argv[++i], nullptr, 10));
+    else if (std::strcmp(argv[i], "--trace-benchmark") == 0 && (i + 1) < argc)
+      s_trace_benchmark_count = u32(std::strtoul(argv[++i], nullptr, 10));
+    else if (std::strcmp(argv[i], "--ray-benchmark") == 0 && (i + 1) < argc)
+      s_ray_benchmark_count = u32(std::strtoul(argv[++i], nullptr, 10));
+    else if (std::strcmp(argv[i], "--pick") == 0)
+      s_pick = true;
+    else if (std::strcmp(argv[i], "--collision") == 0)
+      s_collision = true;
+    else if (std::strcmp(argv[i], "--full-vis") == 0)
+      s_vis_quality = VisCompiler::Quality::Full;
+    else if (std::strcmp(argv[i], "--headless") == 0 && (i + 1) < argc)
+    {
+      if (std::sscanf(argv[++i], "%ux%u", &s_window_width, &s_window_height) != 2 || s_window_width == 0 ||
+          s_window_height == 0)
+      {
+        std::fprintf(stderr, "Invalid size '%s'\n", argv[i]);
+        PrintUsage(argv[0]);
+        return EXIT_FAILURE;
+      }
+
+      s_headless = true;
+    }
+    else if (std::strcmp(argv[i], "--frames") == 0 && (i + 1) < argc)
+      s_headless_frames = std::max(u32(std::strtoul(argv[++i], nullptr, 10)), 1u);
+    else if (std::strcmp(argv[i], "--capture") == 0 && (i + 1) < argc)
+      s_capture_filename = argv[++i];
+    else if (std::strcmp(argv[i], "--benchmark") == 0 && (i + 1) < argc)
+      s_benchmark_filename = argv[++i];
+    else if (std::strcmp(argv[i], "--timestep") == 0 && (i + 1) < argc)
+      s_benchmark_timestep = std::max(std::strtof(argv[++i], nullptr), 0.0f);
+    else if (std::strcmp(argv[i], "--report") == 0 && (i + 1) < argc)
+      s_report_filename = argv[++i];
+    else if (std::strcmp(argv[i], "--record") == 0 && (i + 1) < argc)
+      s_record_filename = argv[++i];
+    else if (std::strcmp(argv[i], "--survey") == 0 && (i + 1) < argc)
+      s_survey_filename = argv[++i];
+    else if (std::strcmp(argv[i], "--view") == 0 && (i + 1) < argc)
+    {
+      glm::vec3 position;
+      float yaw, pitch;
+      if (std::sscanf(argv[++i], "%f,%f,%f,%f,%f", &position.x, &position.y, &position.z, &yaw, &pitch) != 5)
+      {
+        std::fprintf(stderr, "Invalid view '%s'\n", argv[i]);
+        PrintUsage(argv[0]);
+        return EXIT_FAILURE;
+      }
+
+      s_camera.SetPosition(position);
+      s_camera.SetYaw(yaw);
+      s_camera.SetPitch(pitch);
+    }
+    else if (std::strcmp(argv[i], "--software-render") == 0 && (i + 1) < argc)
+      s_software_render_filename = argv[++i];
+    else if (std::strcmp(argv[i], "--software-frames") == 0 && (i + 1) < argc)
+      s_software_render_frames = std::max(u32(std::strtoul(argv[++i], nullptr, 10)), 1u);
+    else if (std::strcmp(argv[i], "--ao-samples") == 0 && (i + 1) < argc)
+      s_rebake_options.ao_samples = u32(std::strtoul(argv[++i], nullptr, 10));
+    else if (std::strcmp(argv[i], "--rebake") == 0 && (i + 1) < argc)
+    {
+      const char* mode = argv[++i];
+      s_rebake = true;
+      if (std::strcmp(mode, "ao") == 0)
+        s_rebake_options.mode = LightmapBaker::Mode::AmbientOcclusion;
+      else if (std::strcmp(mode, "lights") == 0)
+        s_rebake_options.mode = LightmapBaker::Mode::Lights;
+      else
+      {
+        std::fprintf(stderr, "Unknown rebake mode '%s'\n", mode);
+        PrintUsage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (std::strcmp(argv[i], "--submit-mode") == 0 && (i + 1) < argc)
+    {
+      const char* mode = argv[++i];
+      if (std::strcmp(mode, "static") == 0)
+        s_submit_mode = BSPRenderer::SubmitMode::Static;
+      else if (std::strcmp(mode, "dynamic") == 0)
+        s_submit_mode = BSPRenderer::SubmitMode::Dynamic;
+      else if (std::strcmp(mode, "auto") == 0)
+        s_submit_mode = BSPRenderer::SubmitMode::Auto;
+      else
+      {
+        std::fprintf(stderr, "Unknown submit mode '%s'\n", mode);
+        PrintUsage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+    else
+      map_filename = argv[i];
+  }
+
+  if (s_near_plane <= 0.0f || s_far_plane <= s_near_plane)
+  {
+    std::fprintf(stderr, "Invalid clip planes, near must be positive and less than far\n");
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (!map_filename)
+  {
+    PrintUsage(argv[0]);
     return EXIT_FAILURE;
+  }
+
+  // Surveys and software renders always run offscreen, at the window's default size unless --headless says
+  // otherwise.
+  if ((s_survey_filename || s_software_render_filename) && !s_headless)
+  {
+    s_headless = true;
+    s_window_width = 1280;
+    s_window_height = 720;
+  }
+
+  if (s_benchmark_filename)
+  {
+    if (s_record_filename)
+    {
+      std::fprintf(stderr, "Cannot record a camera path while replaying one\n");
+      return EXIT_FAILURE;
+    }
+
+    if (s_survey_filename)
+    {
+      std::fprintf(stderr, "Cannot survey clusters while replaying a camera path, run them separately\n");
+      return EXIT_FAILURE;
+    }
+
+    if (!s_camera_path.Load(s_benchmark_filename))
+      return EXIT_FAILURE;
+
+    // The render thread would time frames against a camera that is already a frame ahead.
+    if (s_pipelined)
+    {
+      std::printf("Benchmarks always run non-pipelined\n");
+      s_pipelined = false;
+    }
+  }
+
+  g_thread_pool->Initialize(num_threads);
 
   {
-    auto fp = Util::FOpenUniquePtr(argv[1], "rb");
+    auto fp = Util::FOpenUniquePtr(map_filename, "rb");
     if (!fp)
       return EXIT_FAILURE;
 
@@ -223,6 +1006,54 @@ int main(int argc, char* argv[])
       return EXIT_FAILURE;
   }
 
+  ComputeMissingVisData(map_filename);
+
+  if (s_software_render_filename)
+  {
+    const bool result = RenderSoftware();
+    s_bsp.reset();
+    g_thread_pool->Shutdown();
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (s_rebake)
+  {
+    const bool result = RebakeLightmaps(map_filename);
+    s_bsp.reset();
+    g_thread_pool->Shutdown();
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (s_query_benchmark_points > 0 || s_trace_benchmark_count > 0 || s_ray_benchmark_count > 0)
+  {
+    bool result = true;
+    if (s_query_benchmark_points > 0)
+      result &= QueryBenchmark::Run(s_bsp.get(), s_query_benchmark_points);
+    if (s_trace_benchmark_count > 0)
+      result &= QueryBenchmark::RunTraces(s_bsp.get(), s_trace_benchmark_count);
+    if (s_ray_benchmark_count > 0)
+      result &= QueryBenchmark::RunRays(s_bsp.get(), s_ray_benchmark_count);
+    s_bsp.reset();
+    g_thread_pool->Shutdown();
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (s_pick)
+  {
+    s_triangle_bvh = TriangleBVH::Create(s_bsp.get());
+    std::printf("Triangle BVH: %u triangles, %u nodes\n", s_triangle_bvh->GetTriangleCount(),
+                s_triangle_bvh->GetNodeCount());
+  }
+
+  if (s_headless)
+  {
+    const bool result = RunHeadless();
+    s_triangle_bvh.reset();
+    s_bsp.reset();
+    g_thread_pool->Shutdown();
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
   if (SDL_Init(SDL_INIT_VIDEO) < 0)
     return EXIT_FAILURE;
 
@@ -243,8 +1074,8 @@ int main(int argc, char* argv[])
   SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
   SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_PROFILE_CORE | SDL_GL_CONTEXT_DEBUG_FLAG);
 
-  SDL_GLContext ctx = SDL_GL_CreateContext(s_window);
-  if (!ctx || SDL_GL_MakeCurrent(s_window, ctx) != 0)
+  s_gl_context = SDL_GL_CreateContext(s_window);
+  if (!s_gl_context || SDL_GL_MakeCurrent(s_window, s_gl_context) != 0)
     return EXIT_FAILURE;
 
   SDL_GL_SetSwapInterval(0);
@@ -255,21 +1086,37 @@ int main(int argc, char* argv[])
   if (!Setup())
   {
     SDL_GL_MakeCurrent(nullptr, nullptr);
-    SDL_GL_DeleteContext(ctx);
+    SDL_GL_DeleteContext(s_gl_context);
     SDL_DestroyWindow(s_window);
     return EXIT_FAILURE;
   }
 
-  MainLoop();
+  bool result = true;
+  if (s_benchmark_filename)
+    result = RunBenchmark();
+  else if (s_pipelined)
+    PipelinedMainLoop();
+  else
+    MainLoop();
+
+  if (s_record_filename && !s_camera_path.IsEmpty())
+  {
+    if (s_camera_path.Save(s_record_filename))
+      std::printf("Wrote %u keyframes to '%s'\n", u32(s_camera_path.GetKeyframes().size()), s_record_filename);
+    else
+      result = false;
+  }
 
   s_bsp_renderer.reset();
+  s_triangle_bvh.reset();
   s_bsp.reset();
 
   g_resource_manager->UnloadAllResources();
 
   SDL_GL_MakeCurrent(nullptr, nullptr);
-  SDL_GL_DeleteContext(ctx);
+  SDL_GL_DeleteContext(s_gl_context);
   SDL_DestroyWindow(s_window);
 
-  return EXIT_SUCCESS;
+  g_thread_pool->Shutdown();
+  return result ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,259 @@
+#include "pch.h"
+#include "occlusion_buffer.h"
+#ifdef HAS_SSE2
+#include <emmintrin.h>
+#endif
+
+// Boxes must be this much farther (relative) than the occluders in front of them to be rejected, which stops a
+// leaf from being hidden by the faces lying on its own boundary.
+static constexpr float DEPTH_BIAS = 1.0f / 1024.0f;
+
+static_assert((OcclusionBuffer::WIDTH % OcclusionBuffer::TILE_SIZE) == 0 &&
+                (OcclusionBuffer::HEIGHT % OcclusionBuffer::TILE_SIZE) == 0 && (OcclusionBuffer::TILE_SIZE % 4) == 0,
+              "buffer must be made of whole tiles, with rows of whole SIMD groups");
+
+OcclusionBuffer::OcclusionBuffer()
+  : m_view_projection_matrix(1.0f), m_depth(WIDTH * HEIGHT, 0.0f), m_tile_depth(TILES_X * TILES_Y, 0.0f)
+{
+}
+
+OcclusionBuffer::~OcclusionBuffer() = default;
+
+void OcclusionBuffer::Clear(const glm::mat4& view_projection_matrix)
+{
+  m_view_projection_matrix = view_projection_matrix;
+  std::fill(m_depth.begin(), m_depth.end(), 0.0f);
+  std::fill(m_tile_depth.begin(), m_tile_depth.end(), 0.0f);
+  m_num_triangles = 0;
+}
+
+void OcclusionBuffer::RasterizeTriangle(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2)
+{
+  const glm::vec4 in_vertices[3] = {m_view_projection_matrix * glm::vec4(v0, 1.0f),
+                                    m_view_projection_matrix * glm::vec4(v1, 1.0f),
+                                    m_view_projection_matrix * glm::vec4(v2, 1.0f)};
+
+  // Clip against the near plane (z >= -w), which can add a vertex. The other planes are handled by the scissor.
+  glm::vec4 clipped[4];
+  u32 num_clipped = 0;
+  for (u32 i = 0; i < 3; i++)
+  {
+    const glm::vec4& current = in_vertices[i];
+    const glm::vec4& next = in_vertices[(i + 1) % 3];
+    const float current_dist = current.z + current.w;
+    const float next_dist = next.z + next.w;
+    if (current_dist >= 0.0f)
+      clipped[num_clipped++] = current;
+    if ((current_dist >= 0.0f) != (next_dist >= 0.0f))
+      clipped[num_clipped++] = glm::mix(current, next, current_dist / (current_dist - next_dist));
+  }
+  if (num_clipped < 3)
+    return;
+
+  ScreenVertex screen[4];
+  for (u32 i = 0; i < num_clipped; i++)
+  {
+    const float inv_w = 1.0f / clipped[i].w;
+    screen[i].x = (clipped[i].x * inv_w * 0.5f + 0.5f) * float(WIDTH);
+    screen[i].y = (0.5f - clipped[i].y * inv_w * 0.5f) * float(HEIGHT);
+    screen[i].inv_w = inv_w;
+  }
+
+  for (u32 i = 2; i < num_clipped; i++)
+    RasterizeClippedTriangle(screen[0], screen[i - 1], screen[i]);
+
+  m_num_triangles++;
+}
+
+void OcclusionBuffer::RasterizeClippedTriangle(const ScreenVertex& v0, const ScreenVertex& in_v1,
+                                               const ScreenVertex& in_v2)
+{
+  float area = (in_v1.x - v0.x) * (in_v2.y - v0.y) - (in_v1.y - v0.y) * (in_v2.x - v0.x);
+  if (std::abs(area) < 1.0e-6f)
+    return;
+
+  // Make the winding consistent so inside is always positive.
+  const bool flip = (area < 0.0f);
+  const ScreenVertex& v1 = flip ? in_v2 : in_v1;
+  const ScreenVertex& v2 = flip ? in_v1 : in_v2;
+  area = std::abs(area);
+
+  const float min_x = std::max(std::floor(std::min(v0.x, std::min(v1.x, v2.x))), 0.0f);
+  const float max_x = std::min(std::ceil(std::max(v0.x, std::max(v1.x, v2.x))), float(WIDTH));
+  const float min_y = std::max(std::floor(std::min(v0.y, std::min(v1.y, v2.y))), 0.0f);
+  const float max_y = std::min(std::ceil(std::max(v0.y, std::max(v1.y, v2.y))), float(HEIGHT));
+  if (min_x >= max_x || min_y >= max_y)
+    return;
+
+  // Edge functions E(x, y) = a * x + b * y + c, positive inside. Each is the barycentric weight of the opposite vertex.
+  const float a12 = v1.y - v2.y, b12 = v2.x - v1.x, c12 = v1.x * v2.y - v1.y * v2.x;
+  const float a20 = v2.y - v0.y, b20 = v0.x - v2.x, c20 = v2.x * v0.y - v2.y * v0.x;
+  const float a01 = v0.y - v1.y, b01 = v1.x - v0.x, c01 = v0.x * v1.y - v0.y * v1.x;
+
+  // 1/w is linear in screen space, so depth is a plane as well.
+  const float inv_area = 1.0f / area;
+  const float za = (a12 * v0.inv_w + a20 * v1.inv_w + a01 * v2.inv_w) * inv_area;
+  const float zb = (b12 * v0.inv_w + b20 * v1.inv_w + b01 * v2.inv_w) * inv_area;
+  const float zc = (c12 * v0.inv_w + c20 * v1.inv_w + c01 * v2.inv_w) * inv_area;
+
+  const u32 start_x = u32(min_x) & ~3u;
+  const u32 end_x = u32(max_x);
+  const u32 start_y = u32(min_y);
+  const u32 end_y = u32(max_y);
+
+#ifdef HAS_SSE2
+  const __m128 lane_offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 range_min = _mm_set1_ps(min_x);
+  const __m128 range_max = _mm_set1_ps(max_x);
+  const __m128 va12 = _mm_set1_ps(a12), va20 = _mm_set1_ps(a20), va01 = _mm_set1_ps(a01), vza = _mm_set1_ps(za);
+  for (u32 y = start_y; y < end_y; y++)
+  {
+    const float py = float(y) + 0.5f;
+    const __m128 row12 = _mm_set1_ps(b12 * py + c12);
+    const __m128 row20 = _mm_set1_ps(b20 * py + c20);
+    const __m128 row01 = _mm_set1_ps(b01 * py + c01);
+    const __m128 row_z = _mm_set1_ps(zb * py + zc);
+    float* row = &m_depth[y * WIDTH];
+    for (u32 x = start_x; x < end_x; x += 4)
+    {
+      const __m128 px = _mm_add_ps(_mm_set1_ps(float(x)), lane_offsets);
+      const __m128 e12 = _mm_add_ps(_mm_mul_ps(va12, px), row12);
+      const __m128 e20 = _mm_add_ps(_mm_mul_ps(va20, px), row20);
+      const __m128 e01 = _mm_add_ps(_mm_mul_ps(va01, px), row01);
+      __m128 mask = _mm_and_ps(_mm_cmpge_ps(e12, zero), _mm_and_ps(_mm_cmpge_ps(e20, zero), _mm_cmpge_ps(e01, zero)));
+      mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpgt_ps(px, range_min), _mm_cmplt_ps(px, range_max)));
+
+      // Depth is always positive, so zeroing the masked-out lanes leaves those pixels unchanged.
+      const __m128 z = _mm_add_ps(_mm_mul_ps(vza, px), row_z);
+      _mm_storeu_ps(row + x, _mm_max_ps(_mm_loadu_ps(row + x), _mm_and_ps(mask, z)));
+    }
+  }
+#else
+  for (u32 y = start_y; y < end_y; y++)
+  {
+    const float py = float(y) + 0.5f;
+    float* row = &m_depth[y * WIDTH];
+    for (u32 x = u32(min_x); x < end_x; x++)
+    {
+      const float px = float(x) + 0.5f;
+      if ((a12 * px + b12 * py + c12) >= 0.0f && (a20 * px + b20 * py + c20) >= 0.0f &&
+          (a01 * px + b01 * py + c01) >= 0.0f)
+      {
+        row[x] = std::max(row[x], za * px + zb * py + zc);
+      }
+    }
+  }
+#endif
+}
+
+void OcclusionBuffer::UpdateTiles()
+{
+  for (u32 ty = 0; ty < TILES_Y; ty++)
+  {
+    for (u32 tx = 0; tx < TILES_X; tx++)
+    {
+      const float* tile = &m_depth[(ty * TILE_SIZE) * WIDTH + tx * TILE_SIZE];
+#ifdef HAS_SSE2
+      __m128 farthest = _mm_loadu_ps(tile);
+      for (u32 y = 0; y < TILE_SIZE; y++)
+      {
+        for (u32 x = 0; x < TILE_SIZE; x += 4)
+          farthest = _mm_min_ps(farthest, _mm_loadu_ps(tile + y * WIDTH + x));
+      }
+      farthest = _mm_min_ps(farthest, _mm_shuffle_ps(farthest, farthest, _MM_SHUFFLE(1, 0, 3, 2)));
+      farthest = _mm_min_ps(farthest, _mm_shuffle_ps(farthest, farthest, _MM_SHUFFLE(2, 3, 0, 1)));
+      m_tile_depth[ty * TILES_X + tx] = _mm_cvtss_f32(farthest);
+#else
+      float farthest = tile[0];
+      for (u32 y = 0; y < TILE_SIZE; y++)
+      {
+        for (u32 x = 0; x < TILE_SIZE; x++)
+          farthest = std::min(farthest, tile[y * WIDTH + x]);
+      }
+      m_tile_depth[ty * TILES_X + tx] = farthest;
+#endif
+    }
+  }
+}
+
+bool OcclusionBuffer::IsBoxOccluded(const glm::vec3& bmin, const glm::vec3& bmax) const
+{
+  if (m_num_triangles == 0)
+    return false;
+
+  float min_x = float(WIDTH), max_x = 0.0f;
+  float min_y = float(HEIGHT), max_y = 0.0f;
+  float nearest_inv_w = 0.0f;
+  for (u32 i = 0; i < 8; i++)
+  {
+    const glm::vec3 corner((i & 1) ? bmax.x : bmin.x, (i & 2) ? bmax.y : bmin.y, (i & 4) ? bmax.z : bmin.z);
+    const glm::vec4 clip = m_view_projection_matrix * glm::vec4(corner, 1.0f);
+    if ((clip.z + clip.w) <= 0.0f)
+      return false;
+
+    const float inv_w = 1.0f / clip.w;
+    const float x = (clip.x * inv_w * 0.5f + 0.5f) * float(WIDTH);
+    const float y = (0.5f - clip.y * inv_w * 0.5f) * float(HEIGHT);
+    min_x = std::min(min_x, x);
+    max_x = std::max(max_x, x);
+    min_y = std::min(min_y, y);
+    max_y = std::max(max_y, y);
+    nearest_inv_w = std::max(nearest_inv_w, inv_w);
+  }
+
+  // Boxes entirely off-screen are the frustum test's business.
+  min_x = std::max(std::floor(min_x), 0.0f);
+  max_x = std::min(std::ceil(max_x), float(WIDTH));
+  min_y = std::max(std::floor(min_y), 0.0f);
+  max_y = std::min(std::ceil(max_y), float(HEIGHT));
+  if (min_x >= max_x || min_y >= max_y)
+    return false;
+
+  return IsRectOccluded(u32(min_x), u32(min_y), u32(max_x), u32(max_y), nearest_inv_w * (1.0f + DEPTH_BIAS));
+}
+
+bool OcclusionBuffer::IsRectOccluded(u32 x0, u32 y0, u32 x1, u32 y1, float inv_w) const
+{
+  const u32 tile_x0 = x0 / TILE_SIZE, tile_x1 = (x1 + TILE_SIZE - 1) / TILE_SIZE;
+  const u32 tile_y0 = y0 / TILE_SIZE, tile_y1 = (y1 + TILE_SIZE - 1) / TILE_SIZE;
+  for (u32 ty = tile_y0; ty < tile_y1; ty++)
+  {
+    for (u32 tx = tile_x0; tx < tile_x1; tx++)
+    {
+      // Everything in this tile is nearer than the box?
+      if (m_tile_depth[ty * TILES_X + tx] > inv_w)
+        continue;
+
+      // Otherwise check the pixels of the tile which the rectangle covers.
+      const u32 px0 = std::max(x0, tx * TILE_SIZE), px1 = std::min(x1, (tx + 1) * TILE_SIZE);
+      const u32 py0 = std::max(y0, ty * TILE_SIZE), py1 = std::min(y1, (ty + 1) * TILE_SIZE);
+      for (u32 y = py0; y < py1; y++)
+      {
+        const float* row = &m_depth[y * WIDTH];
+#ifdef HAS_SSE2
+        const __m128 threshold = _mm_set1_ps(inv_w);
+        const __m128 lane_index = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+        const __m128 range_min = _mm_set1_ps(float(px0));
+        const __m128 range_max = _mm_set1_ps(float(px1));
+        for (u32 x = px0 & ~3u; x < px1; x += 4)
+        {
+          const __m128 px = _mm_add_ps(_mm_set1_ps(float(x)), lane_index);
+          const __m128 in_range = _mm_and_ps(_mm_cmpge_ps(px, range_min), _mm_cmplt_ps(px, range_max));
+          const __m128 visible = _mm_cmple_ps(_mm_loadu_ps(row + x), threshold);
+          if (_mm_movemask_ps(_mm_and_ps(in_range, visible)) != 0)
+            return false;
+        }
+#else
+        for (u32 x = px0; x < px1; x++)
+        {
+          if (row[x] <= inv_w)
+            return false;
+        }
+#endif
+      }
+    }
+  }
+
+  return true;
+}
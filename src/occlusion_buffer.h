@@ -0,0 +1,51 @@
+#pragma once
+#include "common.h"
+#include <glm/glm.hpp>
+#include <vector>
+
+// Low-resolution software depth buffer, used to reject geometry hidden behind large occluders.
+// Each pixel holds 1/w of the nearest occluder (larger is nearer, zero is empty). The farthest value in each tile
+// is kept separately, so most box tests never touch individual pixels. No GPU is involved.
+class OcclusionBuffer
+{
+public:
+  static constexpr u32 WIDTH = 256;
+  static constexpr u32 HEIGHT = 128;
+  static constexpr u32 TILE_SIZE = 8;
+  static constexpr u32 TILES_X = WIDTH / TILE_SIZE;
+  static constexpr u32 TILES_Y = HEIGHT / TILE_SIZE;
+
+  OcclusionBuffer();
+  ~OcclusionBuffer();
+
+  u32 GetOccluderTriangleCount() const { return m_num_triangles; }
+
+  // Empties the buffer and sets the transform used by subsequent calls.
+  void Clear(const glm::mat4& view_projection_matrix);
+
+  // Rasterizes a world-space occluder triangle. Both windings occlude.
+  void RasterizeTriangle(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2);
+
+  // Rebuilds the per-tile farthest depth. Must be called after rasterizing and before testing.
+  void UpdateTiles();
+
+  // Returns true if the box is completely hidden by occluders. Boxes crossing the near plane are never occluded.
+  // Safe to call from multiple threads at once.
+  bool IsBoxOccluded(const glm::vec3& bmin, const glm::vec3& bmax) const;
+
+private:
+  struct ScreenVertex
+  {
+    float x;
+    float y;
+    float inv_w;
+  };
+
+  void RasterizeClippedTriangle(const ScreenVertex& v0, const ScreenVertex& v1, const ScreenVertex& v2);
+  bool IsRectOccluded(u32 x0, u32 y0, u32 x1, u32 y1, float inv_w) const;
+
+  glm::mat4 m_view_projection_matrix;
+  std::vector<float> m_depth;
+  std::vector<float> m_tile_depth;
+  u32 m_num_triangles = 0;
+};
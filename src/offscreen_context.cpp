@@ -0,0 +1,235 @@
+#include "pch.h"
+#include "offscreen_context.h"
+#ifdef _WIN32
+#include <SDL/SDL.h>
+#else
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#ifndef _WIN32
+static bool HasExtension(const char* extensions, const char* name)
+{
+  if (!extensions)
+    return false;
+
+  // Whole words only, as some names are prefixes of others.
+  const size_t length = std::strlen(name);
+  for (const char* pos = std::strstr(extensions, name); pos; pos = std::strstr(pos + length, name))
+  {
+    if ((pos == extensions || pos[-1] == ' ') && (pos[length] == ' ' || pos[length] == '\0'))
+      return true;
+  }
+
+  return false;
+}
+#endif
+
+OffscreenContext::OffscreenContext(u32 width, u32 height) : m_width(width), m_height(height) {}
+
+OffscreenContext::~OffscreenContext()
+{
+  if (m_framebuffer != 0)
+  {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &m_framebuffer);
+    glDeleteRenderbuffers(1, &m_color_renderbuffer);
+    glDeleteRenderbuffers(1, &m_depth_renderbuffer);
+  }
+
+#ifdef _WIN32
+  if (m_gl_context)
+  {
+    SDL_GL_MakeCurrent(nullptr, nullptr);
+    SDL_GL_DeleteContext(m_gl_context);
+  }
+  if (m_window)
+    SDL_DestroyWindow(m_window);
+#else
+  if (m_display)
+  {
+    eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (m_context)
+      eglDestroyContext(m_display, m_context);
+    if (m_surface)
+      eglDestroySurface(m_display, m_surface);
+    eglTerminate(m_display);
+  }
+#endif
+}
+
+std::unique_ptr<OffscreenContext> OffscreenContext::Create(u32 width, u32 height)
+{
+  std::unique_ptr<OffscreenContext> context(new OffscreenContext(width, height));
+  if (!context->CreateContext() || !context->CreateFramebuffer())
+    return nullptr;
+
+  return context;
+}
+
+#ifdef _WIN32
+
+bool OffscreenContext::CreateContext()
+{
+  if (SDL_Init(SDL_INIT_VIDEO) < 0)
+  {
+    std::fprintf(stderr, "SDL_Init failed: %s\n", SDL_GetError());
+    return false;
+  }
+
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+  m_window = SDL_CreateWindow("bspview3", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 1, 1,
+                              SDL_WINDOW_HIDDEN | SDL_WINDOW_OPENGL);
+  if (!m_window)
+  {
+    std::fprintf(stderr, "Failed to create hidden window: %s\n", SDL_GetError());
+    return false;
+  }
+
+  m_gl_context = SDL_GL_CreateContext(m_window);
+  if (!m_gl_context || SDL_GL_MakeCurrent(m_window, m_gl_context) != 0)
+  {
+    std::fprintf(stderr, "Failed to create GL context: %s\n", SDL_GetError());
+    return false;
+  }
+
+  if (!gladLoadGLLoader(SDL_GL_GetProcAddress))
+  {
+    std::fprintf(stderr, "Failed to load GL functions\n");
+    return false;
+  }
+
+  return true;
+}
+
+#else
+
+bool OffscreenContext::CreateContext()
+{
+  // Mesa's surfaceless platform needs neither X11 nor a DRM device. Otherwise take whatever the default is.
+  EGLDisplay display = EGL_NO_DISPLAY;
+  const char* client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  auto get_platform_display =
+    reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+  if (get_platform_display && HasExtension(client_extensions, "EGL_MESA_platform_surfaceless"))
+    display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+  if (display == EGL_NO_DISPLAY)
+    display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+  EGLint major, minor;
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+  {
+    std::fprintf(stderr, "Failed to initialize EGL: 0x%x\n", eglGetError());
+    return false;
+  }
+  m_display = display;
+  std::printf("EGL %d.%d: %s\n", major, minor, eglQueryString(display, EGL_VENDOR));
+
+  if (!eglBindAPI(EGL_OPENGL_API))
+  {
+    std::fprintf(stderr, "EGL does not support desktop GL: 0x%x\n", eglGetError());
+    return false;
+  }
+
+  // Drawing only ever goes to the framebuffer object, so the config just has to allow a GL context.
+  const char* display_extensions = eglQueryString(display, EGL_EXTENSIONS);
+  const bool surfaceless = HasExtension(display_extensions, "EGL_KHR_surfaceless_context");
+  const EGLint config_attribs[] = {EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_SURFACE_TYPE,
+                                   surfaceless ? 0 : EGL_PBUFFER_BIT, EGL_NONE};
+  EGLConfig config = nullptr;
+  EGLint num_configs = 0;
+  if (!eglChooseConfig(display, config_attribs, &config, 1, &num_configs) || num_configs == 0)
+  {
+    if (!surfaceless || !HasExtension(display_extensions, "EGL_KHR_no_config_context"))
+    {
+      std::fprintf(stderr, "No suitable EGL config\n");
+      return false;
+    }
+
+    config = EGL_NO_CONFIG_KHR;
+  }
+
+  const EGLint context_attribs[] = {EGL_CONTEXT_MAJOR_VERSION,
+                                    4,
+                                    EGL_CONTEXT_MINOR_VERSION,
+                                    3,
+                                    EGL_CONTEXT_OPENGL_PROFILE_MASK,
+                                    EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                                    EGL_NONE};
+  m_context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+  if (!m_context)
+  {
+    std::fprintf(stderr, "Failed to create a GL 4.3 core context: 0x%x\n", eglGetError());
+    return false;
+  }
+
+  if (!surfaceless)
+  {
+    const EGLint surface_attribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+    m_surface = eglCreatePbufferSurface(display, config, surface_attribs);
+    if (!m_surface)
+    {
+      std::fprintf(stderr, "Failed to create pbuffer: 0x%x\n", eglGetError());
+      return false;
+    }
+  }
+
+  EGLSurface surface = m_surface ? static_cast<EGLSurface>(m_surface) : EGL_NO_SURFACE;
+  if (!eglMakeCurrent(display, surface, surface, m_context))
+  {
+    std::fprintf(stderr, "eglMakeCurrent failed: 0x%x\n", eglGetError());
+    return false;
+  }
+
+  if (!gladLoadGLLoader(reinterpret_cast<GLADloadproc>(eglGetProcAddress)))
+  {
+    std::fprintf(stderr, "Failed to load GL functions\n");
+    return false;
+  }
+
+  return true;
+}
+
+#endif
+
+bool OffscreenContext::CreateFramebuffer()
+{
+  glGenRenderbuffers(1, &m_color_renderbuffer);
+  glBindRenderbuffer(GL_RENDERBUFFER, m_color_renderbuffer);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, m_width, m_height);
+  glGenRenderbuffers(1, &m_depth_renderbuffer);
+  glBindRenderbuffer(GL_RENDERBUFFER, m_depth_renderbuffer);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, m_width, m_height);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  glGenFramebuffers(1, &m_framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_color_renderbuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_depth_renderbuffer);
+
+  const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  if (status != GL_FRAMEBUFFER_COMPLETE)
+  {
+    std::fprintf(stderr, "Framebuffer is incomplete: 0x%x\n", status);
+    return false;
+  }
+
+  return true;
+}
+
+void OffscreenContext::ReadPixels(std::vector<u32>* pixels) const
+{
+  pixels->resize(m_width * m_height);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, m_framebuffer);
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+  glReadPixels(0, 0, m_width, m_height, GL_RGBA, GL_UNSIGNED_BYTE, pixels->data());
+
+  // GL returns the bottom row first.
+  for (u32 y = 0; y < m_height / 2; y++)
+  {
+    std::swap_ranges(pixels->begin() + y * m_width, pixels->begin() + (y + 1) * m_width,
+                     pixels->begin() + (m_height - 1 - y) * m_width);
+  }
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "common.h"
+#include <glad.h>
+#include <memory>
+#include <vector>
+
+struct SDL_Window;
+
+// GL 4.3 core context without a visible window, rendering into a framebuffer object of a fixed size.
+// Uses EGL, surfaceless where the driver supports it (e.g. Mesa llvmpipe) and a pbuffer otherwise, so no display
+// server is needed. Windows has no EGL, so there a hidden SDL window provides the context.
+class OffscreenContext
+{
+public:
+  ~OffscreenContext();
+
+  // Creates the context, makes it current on the calling thread, loads the GL functions and binds the framebuffer.
+  static std::unique_ptr<OffscreenContext> Create(u32 width, u32 height);
+
+  u32 GetWidth() const { return m_width; }
+  u32 GetHeight() const { return m_height; }
+
+  // Reads back the framebuffer as RGBA8, top row first.
+  void ReadPixels(std::vector<u32>* pixels) const;
+
+private:
+  OffscreenContext(u32 width, u32 height);
+
+  bool CreateContext();
+  bool CreateFramebuffer();
+
+  u32 m_width;
+  u32 m_height;
+
+#ifdef _WIN32
+  SDL_Window* m_window = nullptr;
+  void* m_gl_context = nullptr;
+#else
+  void* m_display = nullptr;
+  void* m_surface = nullptr;
+  void* m_context = nullptr;
+#endif
+
+  GLuint m_framebuffer = 0;
+  GLuint m_color_renderbuffer = 0;
+  GLuint m_depth_renderbuffer = 0;
+};
@@ -11,7 +11,7 @@ public:
   const glm::vec3& GetNormal() const { return m_normal; }
   const float GetDistance() const { return m_distance; }
 
-  void SetNormal(glm::vec3& norm) { m_normal = norm; }
+  void SetNormal(const glm::vec3& norm) { m_normal = norm; }
   void SetDistance(float dist) { m_distance = dist; }
 
   glm::vec4 GetVec4() const;
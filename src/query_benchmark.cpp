@@ -0,0 +1,255 @@
+#include "pch.h"
+#include "query_benchmark.h"
+#include "bsp.h"
+#include "thread_pool.h"
+#include "triangle_bvh.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace QueryBenchmark {
+
+// Queries are split into blocks of this size when spread across the thread pool.
+static constexpr u32 BLOCK_SIZE = 1024;
+
+using ClockSource = std::chrono::steady_clock;
+
+static void PrintResult(const char* name, u64 count, ClockSource::time_point start_time)
+{
+  const float seconds = std::chrono::duration<float>(ClockSource::now() - start_time).count();
+  std::printf("  %-32s %10.3f ms %14.0f queries/sec\n", name, seconds * 1000.0f,
+              (seconds > 0.0f) ? (double(count) / double(seconds)) : 0.0f);
+}
+
+// Fixed seed, so runs are comparable.
+static std::vector<glm::vec3> CreateRandomPositions(const BSP* bsp, u32 count, u32 seed)
+{
+  const BSP::Node* root = bsp->GetNode(0);
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> dist_x(root->bbox_min.x, root->bbox_max.x);
+  std::uniform_real_distribution<float> dist_y(root->bbox_min.y, root->bbox_max.y);
+  std::uniform_real_distribution<float> dist_z(root->bbox_min.z, root->bbox_max.z);
+  std::vector<glm::vec3> positions(count);
+  for (glm::vec3& pos : positions)
+    pos = glm::vec3(dist_x(rng), dist_y(rng), dist_z(rng));
+
+  return positions;
+}
+
+bool Run(const BSP* bsp, u32 num_points)
+{
+  if (bsp->GetNodeCount() == 0 || num_points == 0)
+  {
+    std::fprintf(stderr, "Nothing to benchmark.\n");
+    return false;
+  }
+
+  const std::vector<glm::vec3> positions = CreateRandomPositions(bsp, num_points, 1234);
+
+  std::printf("Query benchmark: %u points, %u threads\n", num_points, g_thread_pool->GetThreadCount());
+
+  std::vector<u32> scalar_leaves(num_points);
+  auto start_time = ClockSource::now();
+  for (u32 i = 0; i < num_points; i++)
+    scalar_leaves[i] = bsp->FindLeafForPosition(positions[i])->index;
+  PrintResult("point location (scalar)", num_points, start_time);
+
+  std::vector<u32> leaves(num_points);
+  start_time = ClockSource::now();
+  bsp->FindLeavesForPositions(positions.data(), num_points, leaves.data());
+  PrintResult("point location (batched)", num_points, start_time);
+
+  if (leaves != scalar_leaves)
+  {
+    std::fprintf(stderr, "Batched point location does not match scalar results.\n");
+    return false;
+  }
+
+  const u32 num_blocks = (num_points + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  start_time = ClockSource::now();
+  g_thread_pool->ParallelFor(num_blocks, [bsp, &positions, &leaves, num_points](u32 block) {
+    const u32 first = block * BLOCK_SIZE;
+    bsp->FindLeavesForPositions(&positions[first], std::min(BLOCK_SIZE, num_points - first), &leaves[first]);
+  });
+  PrintResult("point location (batched, pool)", num_points, start_time);
+
+  // Every point against the PVS of the first point, as a server would when building a snapshot for one client.
+  std::vector<s32> clusters(num_points);
+  bsp->FindClustersForPositions(positions.data(), num_points, clusters.data());
+  const s32 viewer_cluster = clusters[0];
+
+  std::vector<u8> scalar_results(num_points);
+  start_time = ClockSource::now();
+  for (u32 i = 0; i < num_points; i++)
+    scalar_results[i] = bsp->IsClusterVisible(viewer_cluster, clusters[i]) ? 1 : 0;
+  PrintResult("PVS test (scalar)", num_points, start_time);
+
+  std::vector<u64> row(bsp->GetPVSRowSize());
+  std::vector<u8> results(num_points);
+  start_time = ClockSource::now();
+  bsp->GetPVSRow(viewer_cluster, row.data());
+  BSP::TestClustersInPVSRow(row.data(), clusters.data(), num_points, results.data());
+  PrintResult("PVS test (row)", num_points, start_time);
+
+  if (results != scalar_results)
+  {
+    std::fprintf(stderr, "PVS row tests do not match scalar results.\n");
+    return false;
+  }
+
+  // Each point against each other point's PVS, a block at a time, with a row per block of viewers.
+  start_time = ClockSource::now();
+  std::atomic<u64> num_visible{0};
+  g_thread_pool->ParallelFor(num_blocks, [bsp, &clusters, &num_visible, num_points](u32 block) {
+    const u32 first = block * BLOCK_SIZE;
+    const u32 count = std::min(BLOCK_SIZE, num_points - first);
+    std::vector<u64> block_row(bsp->GetPVSRowSize());
+    std::vector<u8> block_results(count);
+    u64 block_visible = 0;
+    for (u32 i = 0; i < count; i++)
+    {
+      bsp->GetPVSRow(clusters[first + i], block_row.data());
+      BSP::TestClustersInPVSRow(block_row.data(), &clusters[first], count, block_results.data());
+      for (u8 result : block_results)
+        block_visible += result;
+    }
+    num_visible.fetch_add(block_visible);
+  });
+  const u32 last_block_size = num_points - (num_blocks - 1) * BLOCK_SIZE;
+  const u64 num_pairs = u64(num_blocks - 1) * BLOCK_SIZE * BLOCK_SIZE + u64(last_block_size) * last_block_size;
+  PrintResult("PVS pairs within blocks (pool)", num_pairs, start_time);
+  std::printf("  %.1f%% of pairs potentially visible\n", 100.0 * double(num_visible.load()) / double(num_pairs));
+
+  return true;
+}
+
+bool RunTraces(const BSP* bsp, u32 num_traces)
+{
+  if (bsp->GetNodeCount() == 0 || num_traces == 0)
+  {
+    std::fprintf(stderr, "Nothing to benchmark.\n");
+    return false;
+  }
+
+  // Roughly the size of a Q3 player.
+  const glm::vec3 box_mins(-15.0f, -15.0f, -24.0f);
+  const glm::vec3 box_maxs(15.0f, 15.0f, 32.0f);
+  const std::vector<glm::vec3> starts = CreateRandomPositions(bsp, num_traces, 1234);
+  const std::vector<glm::vec3> ends = CreateRandomPositions(bsp, num_traces, 5678);
+  std::vector<BSP::TraceResult> results(num_traces);
+
+  std::printf("Trace benchmark: %u traces, %u brushes, %u threads\n", num_traces, u32(bsp->GetBrushCount()),
+              g_thread_pool->GetThreadCount());
+
+  auto start_time = ClockSource::now();
+  for (u32 i = 0; i < num_traces; i++)
+    results[i] = bsp->TraceRay(starts[i], ends[i], BSP::MASK_SOLID);
+  PrintResult("ray trace", num_traces, start_time);
+
+  u32 num_hits = 0;
+  for (const BSP::TraceResult& result : results)
+    num_hits += (result.fraction < 1.0f) ? 1 : 0;
+  std::printf("  %.1f%% of rays hit\n", 100.0 * double(num_hits) / double(num_traces));
+
+  start_time = ClockSource::now();
+  for (u32 i = 0; i < num_traces; i++)
+    results[i] = bsp->TraceBox(starts[i], ends[i], box_mins, box_maxs, BSP::MASK_PLAYERSOLID);
+  PrintResult("box trace", num_traces, start_time);
+
+  std::vector<BSP::TraceResult> batched_results(num_traces);
+  start_time = ClockSource::now();
+  bsp->TraceBoxes(starts.data(), ends.data(), num_traces, box_mins, box_maxs, BSP::MASK_PLAYERSOLID,
+                  batched_results.data());
+  PrintResult("box trace (batched)", num_traces, start_time);
+
+  for (u32 i = 0; i < num_traces; i++)
+  {
+    if (batched_results[i].fraction != results[i].fraction || batched_results[i].all_solid != results[i].all_solid)
+    {
+      std::fprintf(stderr, "Batched trace %u does not match single trace.\n", i);
+      return false;
+    }
+  }
+
+  const u32 num_blocks = (num_traces + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  start_time = ClockSource::now();
+  g_thread_pool->ParallelFor(num_blocks, [&](u32 block) {
+    const u32 first = block * BLOCK_SIZE;
+    bsp->TraceBoxes(&starts[first], &ends[first], std::min(BLOCK_SIZE, num_traces - first), box_mins, box_maxs,
+                    BSP::MASK_PLAYERSOLID, &batched_results[first]);
+  });
+  PrintResult("box trace (batched, pool)", num_traces, start_time);
+
+  u32 num_solid = 0;
+  start_time = ClockSource::now();
+  for (u32 i = 0; i < num_traces; i++)
+    num_solid += (bsp->PointContents(starts[i]) & BSP::MASK_SOLID) ? 1 : 0;
+  PrintResult("point contents", num_traces, start_time);
+  std::printf("  %.1f%% of points in solid\n", 100.0 * double(num_solid) / double(num_traces));
+
+  return true;
+}
+
+bool RunRays(const BSP* bsp, u32 num_rays)
+{
+  if (bsp->GetNodeCount() == 0 || num_rays == 0)
+  {
+    std::fprintf(stderr, "Nothing to benchmark.\n");
+    return false;
+  }
+
+  auto start_time = ClockSource::now();
+  std::unique_ptr<TriangleBVH> bvh = TriangleBVH::Create(bsp);
+  std::printf("Ray benchmark: %u rays, %u triangles, %u BVH nodes, %u threads\n", num_rays, bvh->GetTriangleCount(),
+              bvh->GetNodeCount(), g_thread_pool->GetThreadCount());
+  PrintResult("BVH build", bvh->GetTriangleCount(), start_time);
+
+  const std::vector<glm::vec3> origins = CreateRandomPositions(bsp, num_rays, 1234);
+  std::vector<glm::vec3> directions(num_rays);
+  std::mt19937 rng(5678);
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+  for (glm::vec3& dir : directions)
+  {
+    do
+      dir = glm::vec3(dist(rng), dist(rng), dist(rng));
+    while (glm::dot(dir, dir) < 0.0001f);
+    dir = glm::normalize(dir);
+  }
+
+  static constexpr float MAX_DISTANCE = 65536.0f;
+  static constexpr float OCCLUSION_DISTANCE = 512.0f;
+
+  u32 num_hits = 0;
+  start_time = ClockSource::now();
+  for (u32 i = 0; i < num_rays; i++)
+  {
+    TriangleBVH::Hit hit;
+    num_hits += bvh->Intersect(origins[i], directions[i], MAX_DISTANCE, &hit) ? 1 : 0;
+  }
+  PrintResult("nearest hit", num_rays, start_time);
+  std::printf("  %.1f%% of rays hit\n", 100.0 * double(num_hits) / double(num_rays));
+
+  start_time = ClockSource::now();
+  for (u32 i = 0; i < num_rays; i++)
+    num_hits += bvh->IsOccluded(origins[i], directions[i], OCCLUSION_DISTANCE) ? 1 : 0;
+  PrintResult("occlusion", num_rays, start_time);
+
+  const u32 num_blocks = (num_rays + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  start_time = ClockSource::now();
+  g_thread_pool->ParallelFor(num_blocks, [&](u32 block) {
+    const u32 first = block * BLOCK_SIZE;
+    const u32 last = std::min(first + BLOCK_SIZE, num_rays);
+    for (u32 i = first; i < last; i++)
+    {
+      TriangleBVH::Hit hit;
+      bvh->Intersect(origins[i], directions[i], MAX_DISTANCE, &hit);
+    }
+  });
+  PrintResult("nearest hit (pool)", num_rays, start_time);
+
+  return true;
+}
+
+} // namespace QueryBenchmark
@@ -0,0 +1,19 @@
+#pragma once
+#include "common.h"
+
+class BSP;
+class TriangleBVH;
+
+// Measures query throughput against a map, single-threaded and across the thread pool.
+namespace QueryBenchmark {
+
+// Point location and PVS tests.
+bool Run(const BSP* bsp, u32 num_points);
+
+// Ray and box traces between random points, and point contents.
+bool RunTraces(const BSP* bsp, u32 num_traces);
+
+// Triangle BVH build time, and nearest-hit and occlusion rays from random points in random directions.
+bool RunRays(const BSP* bsp, u32 num_rays);
+
+} // namespace QueryBenchmark
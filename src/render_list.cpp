@@ -0,0 +1,47 @@
+#include "pch.h"
+#include "render_list.h"
+
+RenderList::RenderList() = default;
+
+RenderList::~RenderList() = default;
+
+void RenderList::Clear(Contents contents /* = Contents::IndexRanges */)
+{
+  m_commands.clear();
+  m_leaves.clear();
+  m_contents = contents;
+  m_num_visible_leaves = 0;
+  m_num_occluded_leaves = 0;
+  m_num_portal_rejected_leaves = 0;
+}
+
+void RenderList::Append(const RenderList& list)
+{
+  m_leaves.insert(m_leaves.end(), list.m_leaves.begin(), list.m_leaves.end());
+
+  if (list.m_contents == Contents::Faces)
+  {
+    m_commands.insert(m_commands.end(), list.m_commands.begin(), list.m_commands.end());
+    m_num_visible_leaves += list.m_num_visible_leaves;
+    m_num_occluded_leaves += list.m_num_occluded_leaves;
+    m_num_portal_rejected_leaves += list.m_num_portal_rejected_leaves;
+    return;
+  }
+
+  for (const Command& cmd : list.m_commands)
+  {
+    const u32 sequence = u32(m_commands.size());
+    m_commands.push_back({(cmd.sort_key & ~u64(0xFFFFFFFFu)) | u64(sequence), cmd.start_index, cmd.num_indices});
+  }
+
+  m_num_visible_leaves += list.m_num_visible_leaves;
+  m_num_occluded_leaves += list.m_num_occluded_leaves;
+  m_num_portal_rejected_leaves += list.m_num_portal_rejected_leaves;
+}
+
+void RenderList::Sort()
+{
+  // Keys are unique due to the sequence number (repeated face commands are identical), so the result is deterministic.
+  std::sort(m_commands.begin(), m_commands.end(),
+            [](const Command& lhs, const Command& rhs) { return lhs.sort_key < rhs.sort_key; });
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include "common.h"
+#include <vector>
+
+// Compact list of draw commands produced by the culling stage and executed by the submit stage.
+// Storage is retained between frames, so after the first few frames building a list does not allocate.
+class RenderList
+{
+public:
+  // IndexRanges commands draw a range of the static index buffer.
+  // Faces commands refer to a single BSP face (start_index is the face index), whose indices are copied at submit time.
+  // Leaves lists hold no commands, only the candidate leaves, which are occlusion tested on the GPU at submit time.
+  enum class Contents
+  {
+    IndexRanges,
+    Faces,
+    Leaves
+  };
+
+  struct Command
+  {
+    u64 sort_key;
+    u32 start_index;
+    u32 num_indices;
+  };
+
+  RenderList();
+  ~RenderList();
+
+  size_t GetCommandCount() const { return m_commands.size(); }
+  const Command& GetCommand(size_t i) const { return m_commands[i]; }
+  const std::vector<Command>& GetCommands() const { return m_commands; }
+
+  Contents GetContents() const { return m_contents; }
+
+  const std::vector<u32>& GetLeaves() const { return m_leaves; }
+  void AddLeaf(u32 leaf_index) { m_leaves.push_back(leaf_index); }
+
+  u32 GetVisibleLeafCount() const { return m_num_visible_leaves; }
+  void AddVisibleLeaf() { m_num_visible_leaves++; }
+  void AddVisibleLeaves(u32 count) { m_num_visible_leaves += count; }
+
+  // Leaves which passed the PVS and frustum tests but were hidden by occluders.
+  u32 GetOccludedLeafCount() const { return m_num_occluded_leaves; }
+  void AddOccludedLeaves(u32 count) { m_num_occluded_leaves += count; }
+
+  // Leaves which passed the PVS and frustum tests but could not be seen through any chain of portals.
+  u32 GetPortalRejectedLeafCount() const { return m_num_portal_rejected_leaves; }
+  void AddPortalRejectedLeaves(u32 count) { m_num_portal_rejected_leaves += count; }
+
+  // Resets the list for a new frame without releasing storage.
+  void Clear(Contents contents = Contents::IndexRanges);
+
+  void AddCommand(s32 material_index, s32 lightmap_index, u32 start_index, u32 num_indices)
+  {
+    const u32 sequence = u32(m_commands.size());
+    m_commands.push_back({MakeSortKey(material_index, lightmap_index, sequence), start_index, num_indices});
+  }
+
+  // The face index replaces the sequence number, so duplicate references to a face end up adjacent after sorting.
+  void AddFaceCommand(s32 material_index, s32 lightmap_index, u32 face_index, u32 num_indices)
+  {
+    m_commands.push_back({MakeSortKey(material_index, lightmap_index, face_index), face_index, num_indices});
+  }
+
+  // Appends all commands from another list, renumbering the sequence so the order is preserved.
+  void Append(const RenderList& list);
+
+  // Sorts by material, then lightmap, then traversal order (front-to-back).
+  void Sort();
+
+  // Sort key layout: [63..48] material + 1, [47..32] lightmap + 1, [31..0] sequence.
+  static u64 MakeSortKey(s32 material_index, s32 lightmap_index, u32 sequence)
+  {
+    return (u64(u16(material_index + 1)) << 48) | (u64(u16(lightmap_index + 1)) << 32) | u64(sequence);
+  }
+  static s32 GetMaterialIndex(u64 sort_key) { return s32(u16(sort_key >> 48)) - 1; }
+  static s32 GetLightmapIndex(u64 sort_key) { return s32(u16(sort_key >> 32)) - 1; }
+  static u32 GetStateBits(u64 sort_key) { return u32(sort_key >> 32); }
+
+private:
+  std::vector<Command> m_commands;
+  std::vector<u32> m_leaves;
+  Contents m_contents = Contents::IndexRanges;
+  u32 m_num_visible_leaves = 0;
+  u32 m_num_occluded_leaves = 0;
+  u32 m_num_portal_rejected_leaves = 0;
+};
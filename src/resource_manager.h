@@ -18,9 +18,10 @@ public:
 
   void UnloadAllResources();
 
-private:
+  // Returns an empty string if no image exists for the texture.
   static std::string GetTextureFilename(const std::string& texture_name);
 
+private:
   std::unordered_map<std::string, std::unique_ptr<Texture>> m_textures;
 
   std::unique_ptr<Texture> m_default_texture;
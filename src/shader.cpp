@@ -69,6 +69,12 @@ void ShaderProgram::Bind()
   s_last_program = m_id;
 }
 
+void ShaderProgram::SetUniform(size_t index, const s32 val)
+{
+  if (m_uniform_locations[index] >= 0)
+    glUniform1i(index, val);
+}
+
 void ShaderProgram::SetUniform(size_t index, const float val)
 {
   if (m_uniform_locations[index] >= 0)
@@ -133,6 +139,45 @@ std::unique_ptr<ShaderProgram> ShaderProgram::Create(const VertexAttribute* attr
     glBindFragDataLocation(id, 0, buf);
   }
 
+  if (!LinkProgram(id))
+    return nullptr;
+
+  glUseProgram(id);
+
+  // Bind samples to texture units at create time. Saves doing it later.
+  for (size_t i = 0; i < num_samplers; i++)
+  {
+    char buf[8];
+    std::snprintf(buf, sizeof(buf), "samp%zu", i);
+    GLint loc = glGetUniformLocation(id, buf);
+    if (loc >= 0)
+      glUniform1i(loc, static_cast<GLint>(i));
+  }
+
+  std::vector<GLint> uniform_locations = GetUniformLocations(id, uniform_names, num_uniform_names);
+
+  glUseProgram(s_last_program);
+
+  return std::unique_ptr<ShaderProgram>(new ShaderProgram(id, std::move(uniform_locations)));
+}
+
+std::unique_ptr<ShaderProgram> ShaderProgram::CreateCompute(const Shader* compute_shader,
+                                                            const char** uniform_names /*= nullptr*/,
+                                                            size_t num_uniform_names /*= 0*/)
+{
+  assert(compute_shader->GetType() == GL_COMPUTE_SHADER);
+
+  GLuint id = glCreateProgram();
+  glAttachShader(id, compute_shader->GetGLID());
+  if (!LinkProgram(id))
+    return nullptr;
+
+  std::vector<GLint> uniform_locations = GetUniformLocations(id, uniform_names, num_uniform_names);
+  return std::unique_ptr<ShaderProgram>(new ShaderProgram(id, std::move(uniform_locations)));
+}
+
+bool ShaderProgram::LinkProgram(GLuint id)
+{
   glLinkProgram(id);
 
   GLint status = 0;
@@ -149,28 +194,19 @@ std::unique_ptr<ShaderProgram> ShaderProgram::Create(const VertexAttribute* attr
                  buf.get());
     if (status != GL_TRUE)
     {
-      glDeleteShader(id);
-      return nullptr;
+      glDeleteProgram(id);
+      return false;
     }
   }
 
-  glUseProgram(id);
-
-  // Bind samples to texture units at create time. Saves doing it later.
-  for (size_t i = 0; i < num_samplers; i++)
-  {
-    char buf[8];
-    std::snprintf(buf, sizeof(buf), "samp%zu", i);
-    GLint loc = glGetUniformLocation(id, buf);
-    if (loc >= 0)
-      glUniform1i(loc, static_cast<GLint>(i));
-  }
+  return true;
+}
 
+std::vector<GLint> ShaderProgram::GetUniformLocations(GLuint id, const char** uniform_names, size_t num_uniform_names)
+{
   std::vector<GLint> uniform_locations;
   for (size_t i = 0; i < num_uniform_names; i++)
     uniform_locations.push_back(glGetUniformLocation(id, uniform_names[i]));
 
-  glUseProgram(s_last_program);
-
-  return std::unique_ptr<ShaderProgram>(new ShaderProgram(id, std::move(uniform_locations)));
+  return uniform_locations;
 }
@@ -33,6 +33,7 @@ public:
 
   void Bind();
 
+  void SetUniform(size_t index, const s32 val);
   void SetUniform(size_t index, const float val);
   void SetUniform(size_t index, const glm::vec2& val);
   void SetUniform(size_t index, const glm::vec3& val);
@@ -46,9 +47,17 @@ public:
                                                size_t num_samplers = 0, size_t num_fs_outputs = 1,
                                                const char** uniform_names = nullptr, size_t num_uniform_names = 0);
 
+  // Requires GL 4.3. Samplers should be bound in the shader source, e.g. layout(binding = 0).
+  static std::unique_ptr<ShaderProgram> CreateCompute(const Shader* compute_shader,
+                                                      const char** uniform_names = nullptr,
+                                                      size_t num_uniform_names = 0);
+
 private:
   ShaderProgram(GLuint program_id, std::vector<GLint> uniform_locations);
 
+  static bool LinkProgram(GLuint id);
+  static std::vector<GLint> GetUniformLocations(GLuint id, const char** uniform_names, size_t num_uniform_names);
+
   GLuint m_id;
   std::vector<GLint> m_uniform_locations;
 };
@@ -0,0 +1,674 @@
+#include "pch.h"
+#include "software_renderer.h"
+#include "bsp_renderer.h"
+#include "camera.h"
+#include "resource_manager.h"
+#include "thread_pool.h"
+#include "util.h"
+#include <stb_image.h>
+#ifdef HAS_SSE2
+#include <emmintrin.h>
+#endif
+
+static_assert((SoftwareRenderer::TILE_SIZE % 4) == 0, "tile rows must be whole SIMD groups");
+
+// Triangles are clipped to the near and far planes, and to this multiple of the viewport at the sides. Anything
+// within the guard band is left to the tile scissor, which keeps clipping rare.
+static constexpr float GUARD_BAND = 4.0f;
+
+// Chunks of faces set up per thread. More than one each, so threads finishing early can take another.
+static constexpr u32 CHUNKS_PER_THREAD = 4;
+
+// Clipping can add one vertex per plane.
+static constexpr u32 MAX_CLIPPED_VERTICES = 3 + 6;
+
+static constexpr u32 CLEAR_COLOR = 0xFF000000u;
+
+// Same pattern and colours as the GL default texture.
+static constexpr u32 CHECKERBOARD_COLORS[2] = {0xffcc483f, 0xffffffff};
+static constexpr u32 CHECKERBOARD_SIZE = 8;
+static constexpr u32 CHECKERBOARD_TEXTURE_SIZE = 64;
+
+static const glm::vec4 s_clip_planes[] = {
+  glm::vec4(0.0f, 0.0f, 1.0f, 1.0f),         // near
+  glm::vec4(0.0f, 0.0f, -1.0f, 1.0f),        // far
+  glm::vec4(1.0f, 0.0f, 0.0f, GUARD_BAND),   // left
+  glm::vec4(-1.0f, 0.0f, 0.0f, GUARD_BAND),  // right
+  glm::vec4(0.0f, 1.0f, 0.0f, GUARD_BAND),   // bottom
+  glm::vec4(0.0f, -1.0f, 0.0f, GUARD_BAND)}; // top
+
+SoftwareRenderer::SoftwareRenderer(const BSP* bsp) : m_bsp(bsp) {}
+
+SoftwareRenderer::~SoftwareRenderer() = default;
+
+bool SoftwareRenderer::Initialize()
+{
+  if (!LoadTextures())
+    return false;
+
+  CreateLightmaps();
+  m_face_frame.resize(m_bsp->GetFaceCount(), 0);
+  return true;
+}
+
+bool SoftwareRenderer::LoadTextures()
+{
+  MipLevel checkerboard = {CHECKERBOARD_TEXTURE_SIZE, CHECKERBOARD_TEXTURE_SIZE, {}};
+  checkerboard.pixels.resize(CHECKERBOARD_TEXTURE_SIZE * CHECKERBOARD_TEXTURE_SIZE);
+  for (u32 y = 0; y < CHECKERBOARD_TEXTURE_SIZE; y++)
+  {
+    for (u32 x = 0; x < CHECKERBOARD_TEXTURE_SIZE; x++)
+    {
+      checkerboard.pixels[y * CHECKERBOARD_TEXTURE_SIZE + x] =
+        CHECKERBOARD_COLORS[((x / CHECKERBOARD_SIZE) ^ (y / CHECKERBOARD_SIZE)) & 1];
+    }
+  }
+  m_default_texture.levels.push_back(std::move(checkerboard));
+  CreateMipLevels(&m_default_texture);
+
+  m_textures.resize(m_bsp->GetTextureCount());
+  for (size_t i = 0; i < m_bsp->GetTextureCount(); i++)
+  {
+    const BSP::Texture* tex = m_bsp->GetTexture(i);
+    const std::string filename = ResourceManager::GetTextureFilename(tex->name);
+    if (filename.empty())
+    {
+      std::fprintf(stderr, "Failed to find file for texture '%s'.\n", tex->name.c_str());
+      continue;
+    }
+
+    const std::string safe_filename = Util::CanonicalizePath(filename.c_str());
+    auto fp = Util::FOpenUniquePtr(safe_filename.c_str(), "rb");
+    if (!fp)
+    {
+      std::fprintf(stderr, "Failed to open texture: '%s'\n", safe_filename.c_str());
+      continue;
+    }
+
+    // Always expanded to RGBA, so every texture is sampled the same way.
+    int width, height, components;
+    std::unique_ptr<stbi_uc[], void (*)(stbi_uc*)> data(stbi_load_from_file(fp.get(), &width, &height, &components, 4),
+                                                        [](stbi_uc* ptr) { stbi_image_free(ptr); });
+    if (!data || width <= 0 || height <= 0)
+    {
+      std::fprintf(stderr, "Failed to load texture: '%s': %s\n", safe_filename.c_str(),
+                   stbi_failure_reason() ? stbi_failure_reason() : "unknown error");
+      continue;
+    }
+
+    MipLevel level = {u32(width), u32(height), {}};
+    level.pixels.resize(size_t(width) * size_t(height));
+    std::memcpy(level.pixels.data(), data.get(), level.pixels.size() * sizeof(u32));
+    m_textures[i].levels.push_back(std::move(level));
+    CreateMipLevels(&m_textures[i]);
+  }
+
+  return true;
+}
+
+void SoftwareRenderer::CreateLightmaps()
+{
+  m_lightmaps.resize(m_bsp->GetLightMapCount());
+  for (size_t i = 0; i < m_lightmaps.size(); i++)
+  {
+    BSP::LightMap lightmap;
+    BSPRenderer::BrightenLightMap(m_bsp->GetLightMap(i), &lightmap);
+
+    MipLevel level = {BSP::LIGHTMAP_SIZE, BSP::LIGHTMAP_SIZE, {}};
+    level.pixels.resize(BSP::LIGHTMAP_SIZE * BSP::LIGHTMAP_SIZE);
+    for (u32 y = 0; y < BSP::LIGHTMAP_SIZE; y++)
+    {
+      for (u32 x = 0; x < BSP::LIGHTMAP_SIZE; x++)
+      {
+        const u8* texel = lightmap.data[y][x];
+        level.pixels[y * BSP::LIGHTMAP_SIZE + x] = 0xFF000000u | u32(texel[0]) | (u32(texel[1]) << 8) |
+                                                   (u32(texel[2]) << 16);
+      }
+    }
+
+    m_lightmaps[i].levels.push_back(std::move(level));
+  }
+
+  m_default_lightmap.levels.push_back(MipLevel{1, 1, {0xFFFFFFFFu}});
+}
+
+void SoftwareRenderer::CreateMipLevels(Image* image)
+{
+  // Box filtered. Odd sizes repeat their last row or column.
+  while (image->levels.back().width > 1 || image->levels.back().height > 1)
+  {
+    const MipLevel& src = image->levels.back();
+    MipLevel dst = {std::max(src.width / 2, 1u), std::max(src.height / 2, 1u), {}};
+    dst.pixels.resize(dst.width * dst.height);
+    for (u32 y = 0; y < dst.height; y++)
+    {
+      const u32 y0 = std::min(y * 2, src.height - 1);
+      const u32 y1 = std::min(y * 2 + 1, src.height - 1);
+      for (u32 x = 0; x < dst.width; x++)
+      {
+        const u32 x0 = std::min(x * 2, src.width - 1);
+        const u32 x1 = std::min(x * 2 + 1, src.width - 1);
+        const u32 texels[4] = {src.pixels[y0 * src.width + x0], src.pixels[y0 * src.width + x1],
+                               src.pixels[y1 * src.width + x0], src.pixels[y1 * src.width + x1]};
+        u32 result = 0;
+        for (u32 shift = 0; shift < 32; shift += 8)
+        {
+          u32 sum = 2;
+          for (u32 texel : texels)
+            sum += (texel >> shift) & 0xFF;
+          result |= (sum / 4) << shift;
+        }
+        dst.pixels[y * dst.width + x] = result;
+      }
+    }
+
+    image->levels.push_back(std::move(dst));
+  }
+}
+
+void SoftwareRenderer::ResizeFramebuffer(u32 width, u32 height)
+{
+  if (m_width == width && m_height == height)
+    return;
+
+  // Padded to whole tiles, so tiles never need to check the edges of the buffer.
+  m_width = width;
+  m_height = height;
+  m_tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+  m_tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+  m_stride = m_tiles_x * TILE_SIZE;
+  m_color_buffer.assign(m_stride * m_tiles_y * TILE_SIZE, CLEAR_COLOR);
+  m_depth_buffer.assign(m_stride * m_tiles_y * TILE_SIZE, 0.0f);
+}
+
+void SoftwareRenderer::Render(const Camera& camera)
+{
+  ResizeFramebuffer(camera.GetViewportWidth(), camera.GetViewportHeight());
+
+  const auto start_time = std::chrono::steady_clock::now();
+  FindVisibleFaces(camera);
+  const auto visibility_time = std::chrono::steady_clock::now();
+
+  const u32 num_visible_faces = u32(m_visible_faces.size());
+  const u32 num_chunks = std::max(std::min(g_thread_pool->GetThreadCount() * CHUNKS_PER_THREAD, num_visible_faces), 1u);
+  const u32 num_tiles = m_tiles_x * m_tiles_y;
+  m_chunks.resize(num_chunks);
+  for (u32 i = 0; i < num_chunks; i++)
+  {
+    Chunk& chunk = m_chunks[i];
+    chunk.first_face = u32(u64(num_visible_faces) * i / num_chunks);
+    chunk.num_faces = u32(u64(num_visible_faces) * (i + 1) / num_chunks) - chunk.first_face;
+    chunk.triangles.clear();
+    chunk.bins.resize(num_tiles);
+    for (std::vector<u32>& bin : chunk.bins)
+      bin.clear();
+  }
+
+  const glm::mat4& view_projection = camera.GetViewProjectionMatrix();
+  g_thread_pool->ParallelFor(num_chunks,
+                             [this, &view_projection](u32 i) { SetupChunk(view_projection, &m_chunks[i]); });
+  const auto setup_time = std::chrono::steady_clock::now();
+
+  g_thread_pool->ParallelFor(num_tiles, [this](u32 i) { RasterizeTile(i); });
+  const auto raster_time = std::chrono::steady_clock::now();
+
+  m_statistics.visible_faces = num_visible_faces;
+  m_statistics.triangles = 0;
+  m_statistics.binned_triangles = 0;
+  for (const Chunk& chunk : m_chunks)
+  {
+    m_statistics.triangles += u32(chunk.triangles.size());
+    for (const std::vector<u32>& bin : chunk.bins)
+      m_statistics.binned_triangles += u32(bin.size());
+  }
+  m_statistics.visibility_ms = std::chrono::duration<float, std::milli>(visibility_time - start_time).count();
+  m_statistics.setup_ms = std::chrono::duration<float, std::milli>(setup_time - visibility_time).count();
+  m_statistics.raster_ms = std::chrono::duration<float, std::milli>(raster_time - setup_time).count();
+}
+
+void SoftwareRenderer::FindVisibleFaces(const Camera& camera)
+{
+  m_frame++;
+  m_visible_faces.clear();
+
+  const BSP::Leaf* camera_leaf = m_bsp->FindLeafForPosition(camera.GetPosition());
+  const s32 camera_cluster = camera_leaf ? camera_leaf->cluster : -1;
+  const Frustum& frustum = camera.GetFrustum();
+  for (const BSP::Leaf& leaf : m_bsp->GetLeaves())
+  {
+    if (leaf.faces.empty() || !m_bsp->IsClusterVisible(camera_cluster, leaf.cluster) ||
+        !frustum.IntersectsAABox(leaf.bbox_min, leaf.bbox_max))
+    {
+      continue;
+    }
+
+    for (u32 face_index : leaf.faces)
+    {
+      if (m_face_frame[face_index] == m_frame)
+        continue;
+
+      m_face_frame[face_index] = m_frame;
+      if (m_bsp->GetFace(face_index)->num_indices > 0)
+        m_visible_faces.push_back(face_index);
+    }
+  }
+}
+
+u32 SoftwareRenderer::ClipPolygon(const ClipVertex* in, u32 count, const glm::vec4& plane, ClipVertex* out)
+{
+  u32 num_out = 0;
+  for (u32 i = 0; i < count; i++)
+  {
+    const ClipVertex& current = in[i];
+    const ClipVertex& next = in[(i + 1) % count];
+    const float current_dist = glm::dot(plane, current.position);
+    const float next_dist = glm::dot(plane, next.position);
+    if (current_dist >= 0.0f)
+      out[num_out++] = current;
+    if ((current_dist >= 0.0f) == (next_dist >= 0.0f))
+      continue;
+
+    // Always interpolated from the inside vertex, so an edge shared by two triangles is split at the same point.
+    const ClipVertex& inside = (current_dist >= 0.0f) ? current : next;
+    const ClipVertex& outside = (current_dist >= 0.0f) ? next : current;
+    const float inside_dist = std::max(current_dist, next_dist);
+    const float t = inside_dist / (inside_dist - std::min(current_dist, next_dist));
+    ClipVertex& v = out[num_out++];
+    v.position = glm::mix(inside.position, outside.position, t);
+    v.texcoords[0] = glm::mix(inside.texcoords[0], outside.texcoords[0], t);
+    v.texcoords[1] = glm::mix(inside.texcoords[1], outside.texcoords[1], t);
+  }
+
+  return num_out;
+}
+
+void SoftwareRenderer::SetupChunk(const glm::mat4& view_projection, Chunk* chunk) const
+{
+  for (u32 i = 0; i < chunk->num_faces; i++)
+  {
+    const BSP::Face* face = m_bsp->GetFace(m_visible_faces[chunk->first_face + i]);
+    if (face->base_vertex < 0 || face->num_vertices <= 0 ||
+        size_t(face->base_vertex) + size_t(face->num_vertices) > m_bsp->GetVertexCount())
+    {
+      continue;
+    }
+
+    chunk->vertices.resize(size_t(face->num_vertices));
+    for (int j = 0; j < face->num_vertices; j++)
+    {
+      const BSP::Vertex* vertex = m_bsp->GetVertex(size_t(face->base_vertex + j));
+      ClipVertex& cv = chunk->vertices[j];
+      cv.position = view_projection * glm::vec4(vertex->position, 1.0f);
+      cv.texcoords[0] = vertex->texcoords[0];
+      cv.texcoords[1] = vertex->texcoords[1];
+    }
+
+    for (int j = 0; (j + 2) < face->num_indices; j += 3)
+    {
+      ClipVertex polygon[2][MAX_CLIPPED_VERTICES];
+      u32 outside_all = ~0u;
+      u32 outside_any = 0;
+      bool valid = true;
+      for (u32 k = 0; k < 3; k++)
+      {
+        const u32 index = m_bsp->GetIndex(size_t(face->base_index + j + int(k)));
+        if (index >= u32(face->num_vertices))
+        {
+          valid = false;
+          break;
+        }
+
+        polygon[0][k] = chunk->vertices[index];
+        u32 outside = 0;
+        for (u32 p = 0; p < ARRAY_SIZE(s_clip_planes); p++)
+          outside |= (glm::dot(s_clip_planes[p], polygon[0][k].position) < 0.0f) ? (1u << p) : 0u;
+        outside_all &= outside;
+        outside_any |= outside;
+      }
+      if (!valid || outside_all != 0)
+        continue;
+
+      u32 count = 3;
+      u32 current = 0;
+      for (u32 p = 0; p < ARRAY_SIZE(s_clip_planes) && count >= 3; p++)
+      {
+        if (outside_any & (1u << p))
+        {
+          count = ClipPolygon(polygon[current], count, s_clip_planes[p], polygon[current ^ 1]);
+          current ^= 1;
+        }
+      }
+
+      if (count >= 3)
+        SetupPolygon(polygon[current], count, face, chunk);
+    }
+  }
+}
+
+void SoftwareRenderer::SetupPolygon(const ClipVertex* polygon, u32 count, const BSP::Face* face, Chunk* chunk) const
+{
+  struct ScreenVertex
+  {
+    float x;
+    float y;
+    float inv_w;
+  };
+
+  ScreenVertex screen[MAX_CLIPPED_VERTICES];
+  for (u32 i = 0; i < count; i++)
+  {
+    const float inv_w = 1.0f / polygon[i].position.w;
+    screen[i].x = (polygon[i].position.x * inv_w * 0.5f + 0.5f) * float(m_width);
+    screen[i].y = (0.5f - polygon[i].position.y * inv_w * 0.5f) * float(m_height);
+    screen[i].inv_w = inv_w;
+  }
+
+  const Image& texture = (face->texture_index >= 0 && size_t(face->texture_index) < m_textures.size() &&
+                          !m_textures[face->texture_index].levels.empty()) ?
+                           m_textures[face->texture_index] :
+                           m_default_texture;
+  const Image& lightmap = (face->lightmap_index >= 0 && size_t(face->lightmap_index) < m_lightmaps.size()) ?
+                            m_lightmaps[face->lightmap_index] :
+                            m_default_lightmap;
+
+  for (u32 i = 2; i < count; i++)
+  {
+    const ScreenVertex* v[3] = {&screen[0], &screen[i - 1], &screen[i]};
+    const ClipVertex* cv[3] = {&polygon[0], &polygon[i - 1], &polygon[i]};
+
+    // Front faces are clockwise in GL window coordinates, which is positive area here with y pointing down.
+    // Back faces and degenerate triangles are dropped.
+    const float area = (v[1]->x - v[0]->x) * (v[2]->y - v[0]->y) - (v[1]->y - v[0]->y) * (v[2]->x - v[0]->x);
+    if (!(area > 1.0e-6f))
+      continue;
+
+    const float min_x = std::max(std::floor(std::min(v[0]->x, std::min(v[1]->x, v[2]->x))), 0.0f);
+    const float max_x = std::min(std::ceil(std::max(v[0]->x, std::max(v[1]->x, v[2]->x))), float(m_width));
+    const float min_y = std::max(std::floor(std::min(v[0]->y, std::min(v[1]->y, v[2]->y))), 0.0f);
+    const float max_y = std::min(std::ceil(std::max(v[0]->y, std::max(v[1]->y, v[2]->y))), float(m_height));
+    if (min_x >= max_x || min_y >= max_y)
+      continue;
+
+    Triangle tri;
+    tri.min_x = u32(min_x);
+    tri.max_x = u32(max_x);
+    tri.min_y = u32(min_y);
+    tri.max_y = u32(max_y);
+    for (u32 e = 0; e < 3; e++)
+    {
+      // Edge e runs between the other two vertices. Pixel centres exactly on an edge belong to the triangle if the
+      // edge is a top or left edge, so triangles sharing it don't both draw the pixel.
+      const ScreenVertex& a = *v[(e + 1) % 3];
+      const ScreenVertex& b = *v[(e + 2) % 3];
+      tri.edge_a[e] = a.y - b.y;
+      tri.edge_b[e] = b.x - a.x;
+      tri.edge_c[e] = a.x * b.y - a.y * b.x;
+      tri.top_left[e] = (b.y < a.y) || (b.y == a.y && b.x > a.x);
+    }
+
+    // 1/w and the attributes divided by w are linear in screen space, so each is a plane as well.
+    const float inv_area = 1.0f / area;
+    const float values[5][3] = {
+      {v[0]->inv_w, v[1]->inv_w, v[2]->inv_w},
+      {cv[0]->texcoords[0].x * v[0]->inv_w, cv[1]->texcoords[0].x * v[1]->inv_w, cv[2]->texcoords[0].x * v[2]->inv_w},
+      {cv[0]->texcoords[0].y * v[0]->inv_w, cv[1]->texcoords[0].y * v[1]->inv_w, cv[2]->texcoords[0].y * v[2]->inv_w},
+      {cv[0]->texcoords[1].x * v[0]->inv_w, cv[1]->texcoords[1].x * v[1]->inv_w, cv[2]->texcoords[1].x * v[2]->inv_w},
+      {cv[0]->texcoords[1].y * v[0]->inv_w, cv[1]->texcoords[1].y * v[1]->inv_w, cv[2]->texcoords[1].y * v[2]->inv_w}};
+    float* planes[5] = {tri.inv_w, tri.texcoords[0], tri.texcoords[1], tri.texcoords[2], tri.texcoords[3]};
+    for (u32 p = 0; p < 5; p++)
+    {
+      planes[p][0] = (tri.edge_a[0] * values[p][0] + tri.edge_a[1] * values[p][1] + tri.edge_a[2] * values[p][2]) *
+                     inv_area;
+      planes[p][1] = (tri.edge_b[0] * values[p][0] + tri.edge_b[1] * values[p][1] + tri.edge_b[2] * values[p][2]) *
+                     inv_area;
+      planes[p][2] = (tri.edge_c[0] * values[p][0] + tri.edge_c[1] * values[p][1] + tri.edge_c[2] * values[p][2]) *
+                     inv_area;
+    }
+
+    // One mip level per triangle, from the ratio of texels to pixels covered.
+    const MipLevel& base = texture.levels[0];
+    const glm::vec2 uv1 = cv[1]->texcoords[0] - cv[0]->texcoords[0];
+    const glm::vec2 uv2 = cv[2]->texcoords[0] - cv[0]->texcoords[0];
+    const float texel_area = std::abs(uv1.x * uv2.y - uv1.y * uv2.x) * float(base.width) * float(base.height);
+    u32 level = 0;
+    if (texel_area > area)
+    {
+      const float lod = 0.5f * std::log2(texel_area / area);
+      level = std::min(u32(lod + 0.5f), u32(texture.levels.size() - 1));
+    }
+    tri.texture = &texture.levels[level];
+    tri.lightmap = &lightmap.levels[0];
+
+    chunk->triangles.push_back(tri);
+    BinTriangle(u32(chunk->triangles.size() - 1), chunk);
+  }
+}
+
+void SoftwareRenderer::BinTriangle(u32 triangle_index, Chunk* chunk) const
+{
+  const Triangle& tri = chunk->triangles[triangle_index];
+  const u32 tile_x0 = tri.min_x / TILE_SIZE;
+  const u32 tile_x1 = (tri.max_x - 1) / TILE_SIZE;
+  const u32 tile_y0 = tri.min_y / TILE_SIZE;
+  const u32 tile_y1 = (tri.max_y - 1) / TILE_SIZE;
+  const bool single_tile = (tile_x0 == tile_x1 && tile_y0 == tile_y1);
+  for (u32 ty = tile_y0; ty <= tile_y1; ty++)
+  {
+    for (u32 tx = tile_x0; tx <= tile_x1; tx++)
+    {
+      // Skip tiles entirely outside an edge, testing the pixel centre which is farthest inside it.
+      bool outside = false;
+      if (!single_tile)
+      {
+        const float x0 = float(tx * TILE_SIZE) + 0.5f, x1 = float((tx + 1) * TILE_SIZE) - 0.5f;
+        const float y0 = float(ty * TILE_SIZE) + 0.5f, y1 = float((ty + 1) * TILE_SIZE) - 0.5f;
+        for (u32 e = 0; e < 3 && !outside; e++)
+        {
+          const float x = (tri.edge_a[e] > 0.0f) ? x1 : x0;
+          const float y = (tri.edge_b[e] > 0.0f) ? y1 : y0;
+          outside = (tri.edge_a[e] * x + tri.edge_b[e] * y + tri.edge_c[e]) < 0.0f;
+        }
+      }
+
+      if (!outside)
+        chunk->bins[ty * m_tiles_x + tx].push_back(triangle_index);
+    }
+  }
+}
+
+void SoftwareRenderer::RasterizeTile(u32 tile_index)
+{
+  const u32 tile_x = (tile_index % m_tiles_x) * TILE_SIZE;
+  const u32 tile_y = (tile_index / m_tiles_x) * TILE_SIZE;
+  for (u32 y = 0; y < TILE_SIZE; y++)
+  {
+    const size_t offset = (tile_y + y) * m_stride + tile_x;
+    std::fill_n(&m_color_buffer[offset], TILE_SIZE, CLEAR_COLOR);
+    std::fill_n(&m_depth_buffer[offset], TILE_SIZE, 0.0f);
+  }
+
+  for (const Chunk& chunk : m_chunks)
+  {
+    for (u32 triangle_index : chunk.bins[tile_index])
+      RasterizeTriangle(chunk.triangles[triangle_index], tile_x, tile_y);
+  }
+}
+
+void SoftwareRenderer::RasterizeTriangle(const Triangle& tri, u32 tile_x, u32 tile_y)
+{
+  // Depth is 1/w, larger is nearer, which orders the same as GL's z/w with GL_LESS. The buffer is cleared to zero.
+  const u32 start_x = std::max(tri.min_x, tile_x) & ~3u;
+  const u32 end_x = std::min(tri.max_x, tile_x + TILE_SIZE);
+  const u32 start_y = std::max(tri.min_y, tile_y);
+  const u32 end_y = std::min(tri.max_y, tile_y + TILE_SIZE);
+
+#ifdef HAS_SSE2
+  const __m128 lane_offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  __m128 edge_a[3], top_left[3];
+  for (u32 e = 0; e < 3; e++)
+  {
+    edge_a[e] = _mm_set1_ps(tri.edge_a[e]);
+    top_left[e] = _mm_castsi128_ps(_mm_set1_epi32(tri.top_left[e] ? -1 : 0));
+  }
+  const __m128 inv_w_a = _mm_set1_ps(tri.inv_w[0]);
+  __m128 texcoord_a[4];
+  for (u32 i = 0; i < 4; i++)
+    texcoord_a[i] = _mm_set1_ps(tri.texcoords[i][0]);
+
+  for (u32 y = start_y; y < end_y; y++)
+  {
+    const float py = float(y) + 0.5f;
+    __m128 row_edge[3], row_texcoord[4];
+    for (u32 e = 0; e < 3; e++)
+      row_edge[e] = _mm_set1_ps(tri.edge_b[e] * py + tri.edge_c[e]);
+    for (u32 i = 0; i < 4; i++)
+      row_texcoord[i] = _mm_set1_ps(tri.texcoords[i][1] * py + tri.texcoords[i][2]);
+    const __m128 row_inv_w = _mm_set1_ps(tri.inv_w[1] * py + tri.inv_w[2]);
+
+    u32* color_row = &m_color_buffer[y * m_stride];
+    float* depth_row = &m_depth_buffer[y * m_stride];
+    for (u32 x = start_x; x < end_x; x += 4)
+    {
+      const __m128 px = _mm_add_ps(_mm_set1_ps(float(x)), lane_offsets);
+      __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(-1));
+      for (u32 e = 0; e < 3; e++)
+      {
+        const __m128 edge = _mm_add_ps(_mm_mul_ps(edge_a[e], px), row_edge[e]);
+        mask = _mm_and_ps(mask, _mm_or_ps(_mm_cmpgt_ps(edge, zero),
+                                          _mm_and_ps(_mm_cmpeq_ps(edge, zero), top_left[e])));
+      }
+      if (_mm_movemask_ps(mask) == 0)
+        continue;
+
+      const __m128 inv_w = _mm_add_ps(_mm_mul_ps(inv_w_a, px), row_inv_w);
+      const __m128 depth = _mm_loadu_ps(depth_row + x);
+      mask = _mm_and_ps(mask, _mm_cmpgt_ps(inv_w, depth));
+      const int lanes = _mm_movemask_ps(mask);
+      if (lanes == 0)
+        continue;
+
+      _mm_storeu_ps(depth_row + x, _mm_or_ps(_mm_and_ps(mask, inv_w), _mm_andnot_ps(mask, depth)));
+
+      // Perspective correction for the four lanes at once, then shading per covered pixel.
+      const __m128 w = _mm_div_ps(one, inv_w);
+      alignas(16) float texcoords[4][4];
+      for (u32 i = 0; i < 4; i++)
+        _mm_store_ps(texcoords[i], _mm_mul_ps(_mm_add_ps(_mm_mul_ps(texcoord_a[i], px), row_texcoord[i]), w));
+
+      for (u32 lane = 0; lane < 4; lane++)
+      {
+        if (lanes & (1 << lane))
+        {
+          color_row[x + lane] =
+            Shade(tri, texcoords[0][lane], texcoords[1][lane], texcoords[2][lane], texcoords[3][lane]);
+        }
+      }
+    }
+  }
+#else
+  for (u32 y = start_y; y < end_y; y++)
+  {
+    const float py = float(y) + 0.5f;
+    u32* color_row = &m_color_buffer[y * m_stride];
+    float* depth_row = &m_depth_buffer[y * m_stride];
+    for (u32 x = start_x; x < end_x; x++)
+    {
+      const float px = float(x) + 0.5f;
+      bool inside = true;
+      for (u32 e = 0; e < 3 && inside; e++)
+      {
+        const float edge = tri.edge_a[e] * px + tri.edge_b[e] * py + tri.edge_c[e];
+        inside = (edge > 0.0f) || (edge == 0.0f && tri.top_left[e]);
+      }
+      if (!inside)
+        continue;
+
+      const float inv_w = tri.inv_w[0] * px + tri.inv_w[1] * py + tri.inv_w[2];
+      if (!(inv_w > depth_row[x]))
+        continue;
+
+      depth_row[x] = inv_w;
+      float texcoords[4];
+      for (u32 i = 0; i < 4; i++)
+        texcoords[i] = (tri.texcoords[i][0] * px + tri.texcoords[i][1] * py + tri.texcoords[i][2]) / inv_w;
+      color_row[x] = Shade(tri, texcoords[0], texcoords[1], texcoords[2], texcoords[3]);
+    }
+  }
+#endif
+}
+
+// std::floor() is a library call without SSE4.1, and this is on the per-pixel path. Only valid for |x| < 2^31.
+static s32 FloorToInt(float x)
+{
+  const s32 i = s32(x);
+  return i - s32(float(i) > x);
+}
+
+u32 SoftwareRenderer::SampleBilinear(const MipLevel& level, float u, float v, bool wrap)
+{
+  // Repeating textures wrap, the others read zero outside, like GL_REPEAT and GL_CLAMP_TO_BORDER.
+  if (wrap)
+  {
+    u = glm::clamp(u, -65536.0f, 65536.0f);
+    v = glm::clamp(v, -65536.0f, 65536.0f);
+    u -= float(FloorToInt(u));
+    v -= float(FloorToInt(v));
+  }
+  else
+  {
+    u = glm::clamp(u, -1.0f, 2.0f);
+    v = glm::clamp(v, -1.0f, 2.0f);
+  }
+
+  // Coordinates in 24.8 fixed point, relative to the texel centres.
+  const s32 x = FloorToInt(u * float(level.width * 256) - 128.0f);
+  const s32 y = FloorToInt(v * float(level.height * 256) - 128.0f);
+  const u32 wx = u32(x & 0xFF);
+  const u32 wy = u32(y & 0xFF);
+  s32 x0 = x >> 8, x1 = x0 + 1;
+  s32 y0 = y >> 8, y1 = y0 + 1;
+  const s32 width = s32(level.width), height = s32(level.height);
+  if (wrap)
+  {
+    x0 = (x0 < 0) ? (width - 1) : x0;
+    x1 = (x1 >= width) ? 0 : x1;
+    y0 = (y0 < 0) ? (height - 1) : y0;
+    y1 = (y1 >= height) ? 0 : y1;
+  }
+
+  auto fetch = [&level, width, height](s32 tx, s32 ty) {
+    return (tx >= 0 && tx < width && ty >= 0 && ty < height) ? level.pixels[ty * width + tx] : 0u;
+  };
+
+  // Red/blue and green/alpha are blended as pairs, eight bits of weight fitting in the gaps between them.
+  auto lerp = [](u32 a, u32 b, u32 weight) {
+    const u32 rb = ((((a & 0x00FF00FFu) * (256 - weight)) + ((b & 0x00FF00FFu) * weight)) >> 8) & 0x00FF00FFu;
+    const u32 ga = (((((a >> 8) & 0x00FF00FFu) * (256 - weight)) + (((b >> 8) & 0x00FF00FFu) * weight)) >> 8) &
+                   0x00FF00FFu;
+    return rb | (ga << 8);
+  };
+
+  return lerp(lerp(fetch(x0, y0), fetch(x1, y0), wx), lerp(fetch(x0, y1), fetch(x1, y1), wx), wy);
+}
+
+u32 SoftwareRenderer::Shade(const Triangle& tri, float u, float v, float lightmap_u, float lightmap_v)
+{
+  const u32 texel = SampleBilinear(*tri.texture, u, v, true);
+  const u32 light = SampleBilinear(*tri.lightmap, lightmap_u, lightmap_v, false);
+  u32 result = 0xFF000000u;
+  for (u32 shift = 0; shift < 24; shift += 8)
+  {
+    // Exact rounded (a * b) / 255.
+    const u32 product = ((texel >> shift) & 0xFF) * ((light >> shift) & 0xFF) + 128;
+    result |= (((product + (product >> 8)) >> 8) & 0xFF) << shift;
+  }
+
+  return result;
+}
+
+bool SoftwareRenderer::SaveImage(const char* filename) const
+{
+  return Util::WriteTGA(filename, m_width, m_height, m_color_buffer.data(), m_stride);
+}
@@ -0,0 +1,135 @@
+#pragma once
+#include "bsp.h"
+#include "common.h"
+#include <glm/glm.hpp>
+#include <vector>
+
+class Camera;
+
+// Renders the world on the CPU into an in-memory framebuffer, for machines without a GPU. Matches BSPRenderer's
+// output: texture modulated by the brightened lightmap, depth tested, back faces culled.
+// Triangles are set up and binned into screen tiles in parallel, then each tile is rasterized by one thread, four
+// pixels at a time with SSE2.
+class SoftwareRenderer
+{
+public:
+  static constexpr u32 TILE_SIZE = 64;
+
+  struct Statistics
+  {
+    u32 visible_faces;
+    u32 triangles;
+
+    // Triangle-tile pairs, a triangle is counted once for each tile it was binned to.
+    u32 binned_triangles;
+    float visibility_ms;
+    float setup_ms;
+    float raster_ms;
+  };
+
+  SoftwareRenderer(const BSP* bsp);
+  ~SoftwareRenderer();
+
+  // Loads the textures and lightmaps into system memory.
+  bool Initialize();
+
+  // Renders at the camera's viewport size, resizing the framebuffer if needed.
+  void Render(const Camera& camera);
+
+  u32 GetWidth() const { return m_width; }
+  u32 GetHeight() const { return m_height; }
+
+  // Pixels are RGBA8, rows are GetStride() pixels apart.
+  const u32* GetColorBuffer() const { return m_color_buffer.data(); }
+  u32 GetStride() const { return m_stride; }
+
+  const Statistics& GetStatistics() const { return m_statistics; }
+
+  // Writes the framebuffer as an uncompressed 32-bit TGA.
+  bool SaveImage(const char* filename) const;
+
+private:
+  struct MipLevel
+  {
+    u32 width;
+    u32 height;
+    std::vector<u32> pixels;
+  };
+
+  struct Image
+  {
+    std::vector<MipLevel> levels;
+  };
+
+  struct ClipVertex
+  {
+    glm::vec4 position;
+    glm::vec2 texcoords[2];
+  };
+
+  // Screen-space plane equations, a * x + b * y + c, of the edges and the perspective-divided attributes.
+  // Edge i is positive inside and is the barycentric weight of vertex i.
+  struct Triangle
+  {
+    float edge_a[3];
+    float edge_b[3];
+    float edge_c[3];
+    float inv_w[3];
+    float texcoords[4][3];
+    u32 min_x, min_y, max_x, max_y;
+    bool top_left[3];
+    const MipLevel* texture;
+    const MipLevel* lightmap;
+  };
+
+  // A contiguous range of the visible faces, set up and binned by one thread. Tiles walk the chunks in order,
+  // so the output doesn't depend on scheduling.
+  struct Chunk
+  {
+    u32 first_face;
+    u32 num_faces;
+    std::vector<ClipVertex> vertices;
+    std::vector<Triangle> triangles;
+    std::vector<std::vector<u32>> bins;
+  };
+
+  bool LoadTextures();
+  void CreateLightmaps();
+  static void CreateMipLevels(Image* image);
+
+  void ResizeFramebuffer(u32 width, u32 height);
+  void FindVisibleFaces(const Camera& camera);
+  // Keeps the part of the polygon where dot(plane, position) >= 0. Returns the new vertex count.
+  static u32 ClipPolygon(const ClipVertex* in, u32 count, const glm::vec4& plane, ClipVertex* out);
+  void SetupChunk(const glm::mat4& view_projection, Chunk* chunk) const;
+  void SetupPolygon(const ClipVertex* polygon, u32 count, const BSP::Face* face, Chunk* chunk) const;
+  void BinTriangle(u32 triangle_index, Chunk* chunk) const;
+  void RasterizeTile(u32 tile_index);
+  void RasterizeTriangle(const Triangle& tri, u32 tile_x, u32 tile_y);
+
+  static u32 SampleBilinear(const MipLevel& level, float u, float v, bool wrap);
+  static u32 Shade(const Triangle& tri, float u, float v, float lightmap_u, float lightmap_v);
+
+  const BSP* m_bsp;
+
+  std::vector<Image> m_textures;
+  std::vector<Image> m_lightmaps;
+  Image m_default_texture;
+  Image m_default_lightmap;
+
+  u32 m_width = 0;
+  u32 m_height = 0;
+  u32 m_stride = 0;
+  u32 m_tiles_x = 0;
+  u32 m_tiles_y = 0;
+  std::vector<u32> m_color_buffer;
+  std::vector<float> m_depth_buffer;
+
+  // Visible faces, deduplicated by stamping each with the frame number.
+  std::vector<u32> m_visible_faces;
+  std::vector<u32> m_face_frame;
+  u32 m_frame = 0;
+
+  std::vector<Chunk> m_chunks;
+  Statistics m_statistics = {};
+};
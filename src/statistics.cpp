@@ -30,6 +30,5 @@ void Statistics::EndFrame()
     m_last_fps_time = now;
   }
 
-  m_this_frame.num_draws = 0;
-  m_this_frame.frame_time = 0.0f;
+  m_this_frame = Stats();
 }
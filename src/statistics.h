@@ -9,13 +9,29 @@ public:
   ~Statistics();
 
   u32 GetLastFrameNumDraws() const { return m_last_frame.num_draws; }
+  u32 GetLastFrameNumTriangles() const { return m_last_frame.num_triangles; }
+  u32 GetLastFrameNumVisibleLeaves() const { return m_last_frame.num_visible_leaves; }
+  u32 GetLastFrameNumOccludedLeaves() const { return m_last_frame.num_occluded_leaves; }
+  u32 GetLastFrameNumPortalRejectedLeaves() const { return m_last_frame.num_portal_rejected_leaves; }
   float GetLastFrameTime() const { return m_last_frame.frame_time; }
+  float GetLastFrameCullTime() const { return m_last_frame.cull_time; }
+  float GetLastFrameSortTime() const { return m_last_frame.sort_time; }
+  float GetLastFrameSubmitTime() const { return m_last_frame.submit_time; }
+  float GetLastFrameLatency() const { return m_last_frame.latency; }
   float GetLastFPS() const { return m_last_fps; }
 
   void BeginFrame();
   void EndFrame();
 
   void AddDraw() { m_this_frame.num_draws++; }
+  void AddTriangles(u32 count) { m_this_frame.num_triangles += count; }
+  void AddVisibleLeaves(u32 count) { m_this_frame.num_visible_leaves += count; }
+  void AddOccludedLeaves(u32 count) { m_this_frame.num_occluded_leaves += count; }
+  void AddPortalRejectedLeaves(u32 count) { m_this_frame.num_portal_rejected_leaves += count; }
+  void AddCullTime(float time) { m_this_frame.cull_time += time; }
+  void AddSortTime(float time) { m_this_frame.sort_time += time; }
+  void AddSubmitTime(float time) { m_this_frame.submit_time += time; }
+  void SetLatency(float time) { m_this_frame.latency = time; }
 
 private:
   using ClockSource = std::chrono::steady_clock;
@@ -23,7 +39,15 @@ private:
   struct Stats
   {
     u32 num_draws = 0;
+    u32 num_triangles = 0;
+    u32 num_visible_leaves = 0;
+    u32 num_occluded_leaves = 0;
+    u32 num_portal_rejected_leaves = 0;
     float frame_time = 0.0f;
+    float cull_time = 0.0f;
+    float sort_time = 0.0f;
+    float submit_time = 0.0f;
+    float latency = 0.0f;
   };
 
   Stats m_last_frame;
@@ -46,6 +46,10 @@ static GLenum GetGLInternalFormat(Texture::Format format)
       return GL_RGB8;
     case Texture::Format::FORMAT_RGBA8:
       return GL_RGBA8;
+    case Texture::Format::FORMAT_R32F:
+      return GL_R32F;
+    case Texture::Format::FORMAT_D32F:
+      return GL_DEPTH_COMPONENT32F;
     default:
       return GL_RGBA;
   }
@@ -61,6 +65,10 @@ static GLenum GetGLFormat(Texture::Format format)
       return GL_RGB;
     case Texture::Format::FORMAT_RGBA8:
       return GL_RGBA;
+    case Texture::Format::FORMAT_R32F:
+      return GL_RED;
+    case Texture::Format::FORMAT_D32F:
+      return GL_DEPTH_COMPONENT;
     default:
       return GL_RGBA;
   }
@@ -75,6 +83,9 @@ static GLenum GetGLType(Texture::Format format)
     case Texture::Format::FORMAT_RGB8:
     case Texture::Format::FORMAT_RGBA8:
       return GL_UNSIGNED_BYTE;
+    case Texture::Format::FORMAT_R32F:
+    case Texture::Format::FORMAT_D32F:
+      return GL_FLOAT;
     default:
       return GL_UNSIGNED_BYTE;
   }
@@ -89,6 +100,8 @@ static GLenum GetMipDataSize(Texture::Format format, u32 width, u32 height)
     case Texture::Format::FORMAT_RGB8:
       return width * height * 3;
     case Texture::Format::FORMAT_RGBA8:
+    case Texture::Format::FORMAT_R32F:
+    case Texture::Format::FORMAT_D32F:
       return width * height * 4;
     default:
       return 0;
@@ -111,6 +124,15 @@ Texture::~Texture()
       s_texture_bindings[i] = 0;
     }
   }
+
+  glDeleteTextures(1, &m_id);
+}
+
+void Texture::CopyFromFramebuffer(u32 x, u32 y, u32 width, u32 height)
+{
+  SetActiveTexture(MUTABLE_TEXTURE_UNIT);
+  glBindTexture(GL_TEXTURE_2D, m_id);
+  glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, GLint(x), GLint(y), GLsizei(width), GLsizei(height));
 }
 
 void Texture::Bind(size_t texture_unit) const
@@ -146,7 +168,8 @@ std::unique_ptr<Texture> Texture::Create(Format format, u32 width, u32 height, s
 
   // Always has the first mip level.
   glTexImage2D(GL_TEXTURE_2D, 0, gl_internal_format, width, height, 0, gl_format, gl_type, data_ptr);
-  data_ptr += GetMipDataSize(format, width, height);
+  if (data_ptr)
+    data_ptr += GetMipDataSize(format, width, height);
 
   if (levels > 0)
   {
@@ -156,7 +179,8 @@ std::unique_ptr<Texture> Texture::Create(Format format, u32 width, u32 height, s
       const u32 mip_width = GetMipSize(width, i);
       const u32 mip_height = GetMipSize(height, i);
       glTexImage2D(GL_TEXTURE_2D, i, gl_internal_format, mip_width, mip_height, 0, gl_format, gl_type, data_ptr);
-      data_ptr += GetMipDataSize(format, mip_width, mip_height);
+      if (data_ptr)
+        data_ptr += GetMipDataSize(format, mip_width, mip_height);
     }
   }
   else
@@ -170,7 +194,8 @@ std::unique_ptr<Texture> Texture::Create(Format format, u32 width, u32 height, s
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap_v ? GL_REPEAT : GL_CLAMP_TO_BORDER);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, linear_filtering ? GL_LINEAR : GL_NEAREST);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
-                  linear_filtering ? (mip_levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR) : GL_NEAREST);
+                  linear_filtering ? (mip_levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR) :
+                                     (mip_levels > 1 ? GL_NEAREST_MIPMAP_NEAREST : GL_NEAREST));
 
   return std::unique_ptr<Texture>(new Texture(id, format, width, height, mip_levels));
 }
@@ -11,7 +11,9 @@ public:
   {
     FORMAT_R8,
     FORMAT_RGB8,
-    FORMAT_RGBA8
+    FORMAT_RGBA8,
+    FORMAT_R32F,
+    FORMAT_D32F
   };
 
   // Use num+1 to not disrupt any of the current bindings.
@@ -28,6 +30,9 @@ public:
 
   void Bind(size_t texture_unit) const;
 
+  // Copies from the current read framebuffer into the top level, starting at (0, 0).
+  void CopyFromFramebuffer(u32 x, u32 y, u32 width, u32 height);
+
   // Set levels to -1 for automatic mipmap generation.
   static std::unique_ptr<Texture> Create(Format format, u32 width, u32 height, s32 levels, const void* data,
                                          bool linear_filtering = true, bool wrap_u = true, bool wrap_v = true);
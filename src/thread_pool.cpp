@@ -0,0 +1,117 @@
+#include "pch.h"
+#include "thread_pool.h"
+
+static ThreadPool s_thread_pool;
+ThreadPool* g_thread_pool = &s_thread_pool;
+
+static thread_local bool s_in_parallel_loop = false;
+
+ThreadPool::ThreadPool() = default;
+
+ThreadPool::~ThreadPool()
+{
+  Shutdown();
+}
+
+void ThreadPool::Initialize(u32 num_threads /* = 0 */)
+{
+  Shutdown();
+
+  if (num_threads == 0)
+    num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+  m_shutdown = false;
+  m_workers.reserve(num_threads - 1);
+  for (u32 i = 1; i < num_threads; i++)
+    m_workers.emplace_back(&ThreadPool::WorkerThread, this);
+}
+
+void ThreadPool::Shutdown()
+{
+  if (m_workers.empty())
+    return;
+
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_shutdown = true;
+  }
+  m_work_cv.notify_all();
+
+  for (std::thread& thread : m_workers)
+    thread.join();
+  m_workers.clear();
+}
+
+void ThreadPool::ParallelFor(u32 count, const std::function<void(u32)>& func)
+{
+  if (count == 0)
+    return;
+
+  if (m_workers.empty() || count == 1 || s_in_parallel_loop)
+  {
+    for (u32 i = 0; i < count; i++)
+      func(i);
+    return;
+  }
+
+  // Only one loop can be in flight at once.
+  std::unique_lock<std::mutex> submit_lock(m_submit_mutex);
+
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_job_func = &func;
+    m_job_count = count;
+    m_job_next_index.store(0);
+    m_job_generation++;
+  }
+  m_work_cv.notify_all();
+
+  RunJobItems();
+
+  // Wait for workers which picked up items to finish them before func goes out of scope.
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_done_cv.wait(lock, [this]() { return m_active_workers == 0; });
+  m_job_func = nullptr;
+  m_job_count = 0;
+}
+
+void ThreadPool::RunJobItems()
+{
+  s_in_parallel_loop = true;
+
+  for (;;)
+  {
+    const u32 index = m_job_next_index.fetch_add(1);
+    if (index >= m_job_count)
+      break;
+
+    (*m_job_func)(index);
+  }
+
+  s_in_parallel_loop = false;
+}
+
+void ThreadPool::WorkerThread()
+{
+  u32 last_generation = 0;
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  for (;;)
+  {
+    m_work_cv.wait(lock, [this, last_generation]() {
+      return m_shutdown || (m_job_func && m_job_generation != last_generation);
+    });
+    if (m_shutdown)
+      break;
+
+    last_generation = m_job_generation;
+    m_active_workers++;
+    lock.unlock();
+
+    RunJobItems();
+
+    lock.lock();
+    if (--m_active_workers == 0)
+      m_done_cv.notify_one();
+  }
+}
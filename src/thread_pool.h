@@ -0,0 +1,46 @@
+#pragma once
+#include "common.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+  ThreadPool();
+  ~ThreadPool();
+
+  // Number of threads taking part in parallel loops, including the calling thread.
+  u32 GetThreadCount() const { return u32(m_workers.size()) + 1; }
+
+  // Pass zero to use one thread per hardware thread.
+  void Initialize(u32 num_threads = 0);
+  void Shutdown();
+
+  // Runs func(i) for each i in [0, count), returning once all calls have completed. The calling thread helps out.
+  // Calls made from inside a parallel loop, or before Initialize(), run serially on the calling thread.
+  void ParallelFor(u32 count, const std::function<void(u32)>& func);
+
+private:
+  void WorkerThread();
+  void RunJobItems();
+
+  std::vector<std::thread> m_workers;
+
+  std::mutex m_mutex;
+  std::condition_variable m_work_cv;
+  std::condition_variable m_done_cv;
+  std::mutex m_submit_mutex;
+
+  const std::function<void(u32)>* m_job_func = nullptr;
+  u32 m_job_count = 0;
+  u32 m_job_generation = 0;
+  u32 m_active_workers = 0;
+  std::atomic<u32> m_job_next_index{0};
+  bool m_shutdown = false;
+};
+
+extern ThreadPool* g_thread_pool;
@@ -0,0 +1,579 @@
+#include "pch.h"
+#include "triangle_bvh.h"
+#include "bsp.h"
+#include "thread_pool.h"
+#include <limits>
+#ifdef HAS_SSE2
+#include <emmintrin.h>
+#endif
+
+// Leaves hold one block of triangles.
+static constexpr u32 MAX_LEAF_TRIANGLES = 4;
+
+static constexpr u32 NUM_BINS = 16;
+
+// Subtrees at this depth are handed out to the thread pool, unless they are already small.
+static constexpr u32 PARALLEL_DEPTH = 6;
+static constexpr u32 MIN_PARALLEL_TRIANGLES = 4096;
+
+// Below this depth splits are made at the median instead, so the traversal stack can't overflow.
+static constexpr u32 MAX_SAH_DEPTH = 48;
+static constexpr u32 MAX_STACK_SIZE = 128;
+
+static constexpr u32 INVALID_TRIANGLE = 0xFFFFFFFFu;
+
+struct TriangleBVH::Ray
+{
+  glm::vec3 origin;
+  glm::vec3 direction;
+  glm::vec3 inv_direction;
+#ifdef HAS_SSE2
+  __m128 sse_origin;
+  __m128 sse_inv_direction;
+#endif
+};
+
+static float GetSurfaceArea(const glm::vec3& bmin, const glm::vec3& bmax)
+{
+  const glm::vec3 size = glm::max(bmax - bmin, glm::vec3(0.0f));
+  return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+TriangleBVH::TriangleBVH() = default;
+
+TriangleBVH::~TriangleBVH() = default;
+
+std::unique_ptr<TriangleBVH> TriangleBVH::Create(const BSP* bsp)
+{
+  std::unique_ptr<TriangleBVH> bvh(new TriangleBVH());
+  bvh->Build(bsp);
+  return bvh;
+}
+
+void TriangleBVH::Build(const BSP* bsp)
+{
+  std::vector<TriangleRef> refs;
+  for (size_t i = 0; i < bsp->GetFaceCount(); i++)
+  {
+    const BSP::Face* face = bsp->GetFace(i);
+    if (face->num_indices <= 0 || face->base_vertex < 0 || face->base_index < 0 ||
+        size_t(face->base_index + face->num_indices) > bsp->GetIndexCount())
+    {
+      continue;
+    }
+
+    for (int j = 0; (j + 2) < face->num_indices; j += 3)
+    {
+      TriangleRef ref;
+      ref.bbox_min = glm::vec3(std::numeric_limits<float>::max());
+      ref.bbox_max = glm::vec3(-std::numeric_limits<float>::max());
+      bool valid = true;
+      for (int k = 0; k < 3; k++)
+      {
+        const size_t vertex_index = size_t(face->base_vertex) + bsp->GetIndex(size_t(face->base_index + j + k));
+        if (vertex_index >= bsp->GetVertexCount())
+        {
+          valid = false;
+          break;
+        }
+
+        const glm::vec3& pos = bsp->GetVertex(vertex_index)->position;
+        ref.bbox_min = glm::min(ref.bbox_min, pos);
+        ref.bbox_max = glm::max(ref.bbox_max, pos);
+      }
+      if (!valid)
+        continue;
+
+      ref.centroid = (ref.bbox_min + ref.bbox_max) * 0.5f;
+      ref.id = u32(m_triangle_info.size());
+      refs.push_back(ref);
+      m_triangle_info.push_back({u32(i), u32(face->base_index + j)});
+    }
+  }
+
+  m_face_textures.resize(bsp->GetFaceCount());
+  for (size_t i = 0; i < bsp->GetFaceCount(); i++)
+    m_face_textures[i] = bsp->GetFace(i)->texture_index;
+
+  m_num_triangles = u32(refs.size());
+  if (refs.empty())
+    return;
+
+  Node root = {};
+  glm::vec3 bmin(std::numeric_limits<float>::max()), bmax(-std::numeric_limits<float>::max());
+  for (const TriangleRef& ref : refs)
+  {
+    bmin = glm::min(bmin, ref.bbox_min);
+    bmax = glm::max(bmax, ref.bbox_max);
+  }
+  for (u32 i = 0; i < 3; i++)
+  {
+    root.bbox_min[i] = bmin[i];
+    root.bbox_max[i] = bmax[i];
+  }
+  m_nodes.push_back(root);
+
+  // The top of the tree is split serially, then each large subtree is built into its own array on the pool.
+  // The subtrees work on separate ranges of the triangle references, so they can partition them in place.
+  std::vector<u32> deferred;
+  BuildSubtree(&m_nodes, refs.data(), 0, 0, m_num_triangles, 0, &deferred);
+
+  std::vector<std::vector<Node>> subtrees(deferred.size());
+  g_thread_pool->ParallelFor(u32(deferred.size()), [this, &refs, &deferred, &subtrees](u32 i) {
+    const Node& placeholder = m_nodes[deferred[i]];
+    subtrees[i].push_back(placeholder);
+    BuildSubtree(&subtrees[i], refs.data(), 0, placeholder.left_or_first, placeholder.count, PARALLEL_DEPTH,
+                 nullptr);
+  });
+
+  // The subtree root replaces the placeholder, the rest is appended, and child indices are offset to match.
+  for (size_t i = 0; i < deferred.size(); i++)
+  {
+    const std::vector<Node>& subtree = subtrees[i];
+    const u32 base = u32(m_nodes.size()) - 1;
+    m_nodes[deferred[i]] = subtree[0];
+    if (subtree[0].count == 0)
+      m_nodes[deferred[i]].left_or_first += base;
+
+    for (size_t j = 1; j < subtree.size(); j++)
+    {
+      Node node = subtree[j];
+      if (node.count == 0)
+        node.left_or_first += base;
+      m_nodes.push_back(node);
+    }
+  }
+
+  CreateTriangleBlocks(bsp, refs);
+}
+
+void TriangleBVH::BuildSubtree(std::vector<Node>* nodes, TriangleRef* refs, u32 node_index, u32 first, u32 count,
+                               u32 depth, std::vector<u32>* deferred)
+{
+  // Leaves hold the triangle range until the blocks are created.
+  if (count <= MAX_LEAF_TRIANGLES)
+  {
+    (*nodes)[node_index].left_or_first = first;
+    (*nodes)[node_index].count = count;
+    return;
+  }
+
+  if (deferred && depth >= PARALLEL_DEPTH && count >= MIN_PARALLEL_TRIANGLES)
+  {
+    (*nodes)[node_index].left_or_first = first;
+    (*nodes)[node_index].count = count;
+    deferred->push_back(node_index);
+    return;
+  }
+
+  u32 left_count;
+  if (depth >= MAX_SAH_DEPTH || !SplitNode(refs, first, count, &left_count))
+    SplitNodeAtMedian(refs, first, count, &left_count);
+
+  const u32 left = u32(nodes->size());
+  nodes->resize(nodes->size() + 2);
+  (*nodes)[node_index].left_or_first = left;
+  (*nodes)[node_index].count = 0;
+
+  const u32 child_first[2] = {first, first + left_count};
+  const u32 child_count[2] = {left_count, count - left_count};
+  for (u32 i = 0; i < 2; i++)
+  {
+    Node& child = (*nodes)[left + i];
+    glm::vec3 bmin(std::numeric_limits<float>::max()), bmax(-std::numeric_limits<float>::max());
+    for (u32 j = 0; j < child_count[i]; j++)
+    {
+      bmin = glm::min(bmin, refs[child_first[i] + j].bbox_min);
+      bmax = glm::max(bmax, refs[child_first[i] + j].bbox_max);
+    }
+    for (u32 j = 0; j < 3; j++)
+    {
+      child.bbox_min[j] = bmin[j];
+      child.bbox_max[j] = bmax[j];
+    }
+  }
+
+  for (u32 i = 0; i < 2; i++)
+    BuildSubtree(nodes, refs, left + i, child_first[i], child_count[i], depth + 1, deferred);
+}
+
+bool TriangleBVH::SplitNode(TriangleRef* refs, u32 first, u32 count, u32* split_count)
+{
+  struct Bin
+  {
+    glm::vec3 bbox_min;
+    glm::vec3 bbox_max;
+    u32 count;
+  };
+
+  glm::vec3 cmin(std::numeric_limits<float>::max()), cmax(-std::numeric_limits<float>::max());
+  for (u32 i = 0; i < count; i++)
+  {
+    cmin = glm::min(cmin, refs[first + i].centroid);
+    cmax = glm::max(cmax, refs[first + i].centroid);
+  }
+
+  // Try each axis, and keep the split between bins with the lowest surface area cost.
+  float best_cost = std::numeric_limits<float>::max();
+  u32 best_axis = 0, best_split = 0;
+  for (u32 axis = 0; axis < 3; axis++)
+  {
+    const float extent = cmax[axis] - cmin[axis];
+    if (extent <= 0.0f)
+      continue;
+
+    Bin bins[NUM_BINS];
+    for (Bin& bin : bins)
+    {
+      bin.bbox_min = glm::vec3(std::numeric_limits<float>::max());
+      bin.bbox_max = glm::vec3(-std::numeric_limits<float>::max());
+      bin.count = 0;
+    }
+
+    const float scale = float(NUM_BINS) / extent;
+    for (u32 i = 0; i < count; i++)
+    {
+      const TriangleRef& ref = refs[first + i];
+      Bin& bin = bins[std::min(u32((ref.centroid[axis] - cmin[axis]) * scale), NUM_BINS - 1)];
+      bin.bbox_min = glm::min(bin.bbox_min, ref.bbox_min);
+      bin.bbox_max = glm::max(bin.bbox_max, ref.bbox_max);
+      bin.count++;
+    }
+
+    // Sweep from the right to get the cost of everything above each split, then from the left.
+    float right_cost[NUM_BINS];
+    glm::vec3 bmin(std::numeric_limits<float>::max()), bmax(-std::numeric_limits<float>::max());
+    u32 right_count = 0;
+    for (u32 i = NUM_BINS - 1; i > 0; i--)
+    {
+      bmin = glm::min(bmin, bins[i].bbox_min);
+      bmax = glm::max(bmax, bins[i].bbox_max);
+      right_count += bins[i].count;
+      right_cost[i] = (right_count > 0) ? (GetSurfaceArea(bmin, bmax) * float(right_count)) : 0.0f;
+    }
+
+    bmin = glm::vec3(std::numeric_limits<float>::max());
+    bmax = glm::vec3(-std::numeric_limits<float>::max());
+    u32 left_count = 0;
+    for (u32 i = 0; (i + 1) < NUM_BINS; i++)
+    {
+      bmin = glm::min(bmin, bins[i].bbox_min);
+      bmax = glm::max(bmax, bins[i].bbox_max);
+      left_count += bins[i].count;
+      if (left_count == 0 || left_count == count)
+        continue;
+
+      const float cost = GetSurfaceArea(bmin, bmax) * float(left_count) + right_cost[i + 1];
+      if (cost < best_cost)
+      {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = i + 1;
+      }
+    }
+  }
+
+  if (best_split == 0)
+    return false;
+
+  const float scale = float(NUM_BINS) / (cmax[best_axis] - cmin[best_axis]);
+  TriangleRef* middle = std::partition(refs + first, refs + first + count, [&](const TriangleRef& ref) {
+    return std::min(u32((ref.centroid[best_axis] - cmin[best_axis]) * scale), NUM_BINS - 1) < best_split;
+  });
+
+  *split_count = u32(middle - (refs + first));
+  return (*split_count > 0 && *split_count < count);
+}
+
+void TriangleBVH::SplitNodeAtMedian(TriangleRef* refs, u32 first, u32 count, u32* split_count)
+{
+  glm::vec3 cmin(std::numeric_limits<float>::max()), cmax(-std::numeric_limits<float>::max());
+  for (u32 i = 0; i < count; i++)
+  {
+    cmin = glm::min(cmin, refs[first + i].centroid);
+    cmax = glm::max(cmax, refs[first + i].centroid);
+  }
+
+  const glm::vec3 extent = cmax - cmin;
+  const u32 axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : ((extent.y >= extent.z) ? 1 : 2);
+  std::nth_element(refs + first, refs + first + count / 2, refs + first + count,
+                   [axis](const TriangleRef& lhs, const TriangleRef& rhs) {
+                     return lhs.centroid[axis] < rhs.centroid[axis];
+                   });
+  *split_count = count / 2;
+}
+
+void TriangleBVH::CreateTriangleBlocks(const BSP* bsp, const std::vector<TriangleRef>& refs)
+{
+  for (Node& node : m_nodes)
+  {
+    if (node.count == 0)
+      continue;
+
+    TriangleBlock block = {};
+    for (u32 lane = 0; lane < MAX_LEAF_TRIANGLES; lane++)
+    {
+      if (lane >= node.count)
+      {
+        block.ids[lane] = INVALID_TRIANGLE;
+        continue;
+      }
+
+      const u32 id = refs[node.left_or_first + lane].id;
+      const BSP::Face* face = bsp->GetFace(m_triangle_info[id].face_index);
+      glm::vec3 v[3];
+      for (u32 k = 0; k < 3; k++)
+        v[k] = bsp->GetVertex(size_t(face->base_vertex) + bsp->GetIndex(m_triangle_info[id].first_index + k))->position;
+
+      const glm::vec3 e1 = v[1] - v[0];
+      const glm::vec3 e2 = v[2] - v[0];
+      for (u32 axis = 0; axis < 3; axis++)
+      {
+        block.v0[axis][lane] = v[0][axis];
+        block.e1[axis][lane] = e1[axis];
+        block.e2[axis][lane] = e2[axis];
+      }
+      block.ids[lane] = id;
+    }
+
+    node.left_or_first = u32(m_blocks.size());
+    node.count = 1;
+    m_blocks.push_back(block);
+  }
+}
+
+bool TriangleBVH::Intersect(const glm::vec3& origin, const glm::vec3& direction, float max_distance, Hit* hit) const
+{
+  Ray ray;
+  ray.origin = origin;
+  ray.direction = direction;
+  ray.inv_direction = 1.0f / direction;
+#ifdef HAS_SSE2
+  ray.sse_origin = _mm_setr_ps(origin.x, origin.y, origin.z, 0.0f);
+  ray.sse_inv_direction = _mm_setr_ps(ray.inv_direction.x, ray.inv_direction.y, ray.inv_direction.z, 1.0f);
+#endif
+  return Traverse<false>(ray, max_distance, hit);
+}
+
+bool TriangleBVH::IsOccluded(const glm::vec3& origin, const glm::vec3& direction, float max_distance) const
+{
+  Ray ray;
+  ray.origin = origin;
+  ray.direction = direction;
+  ray.inv_direction = 1.0f / direction;
+#ifdef HAS_SSE2
+  ray.sse_origin = _mm_setr_ps(origin.x, origin.y, origin.z, 0.0f);
+  ray.sse_inv_direction = _mm_setr_ps(ray.inv_direction.x, ray.inv_direction.y, ray.inv_direction.z, 1.0f);
+#endif
+  return Traverse<true>(ray, max_distance, nullptr);
+}
+
+// Slab test. Returns the distance the ray enters the box, which may be negative if the origin is inside.
+bool TriangleBVH::IntersectNodeBox(const Ray& ray, const Node& node, float max_distance, float* near_distance)
+{
+#ifdef HAS_SSE2
+  // The fourth lane of each load is the node's index/count, which is masked off so it can't be a denormal.
+  const __m128 xyz_mask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+  const __m128 bmin = _mm_and_ps(_mm_loadu_ps(node.bbox_min), xyz_mask);
+  const __m128 bmax = _mm_and_ps(_mm_loadu_ps(node.bbox_max), xyz_mask);
+  const __m128 t1 = _mm_mul_ps(_mm_sub_ps(bmin, ray.sse_origin), ray.sse_inv_direction);
+  const __m128 t2 = _mm_mul_ps(_mm_sub_ps(bmax, ray.sse_origin), ray.sse_inv_direction);
+  const __m128 tmin = _mm_min_ps(t1, t2);
+  const __m128 tmax = _mm_max_ps(t1, t2);
+  const float tnear = _mm_cvtss_f32(_mm_max_ss(_mm_max_ss(tmin, _mm_shuffle_ps(tmin, tmin, _MM_SHUFFLE(1, 1, 1, 1))),
+                                               _mm_shuffle_ps(tmin, tmin, _MM_SHUFFLE(2, 2, 2, 2))));
+  const float tfar = _mm_cvtss_f32(_mm_min_ss(_mm_min_ss(tmax, _mm_shuffle_ps(tmax, tmax, _MM_SHUFFLE(1, 1, 1, 1))),
+                                              _mm_shuffle_ps(tmax, tmax, _MM_SHUFFLE(2, 2, 2, 2))));
+#else
+  float tnear = -std::numeric_limits<float>::max();
+  float tfar = std::numeric_limits<float>::max();
+  for (u32 axis = 0; axis < 3; axis++)
+  {
+    const float t1 = (node.bbox_min[axis] - ray.origin[axis]) * ray.inv_direction[axis];
+    const float t2 = (node.bbox_max[axis] - ray.origin[axis]) * ray.inv_direction[axis];
+    tnear = std::max(tnear, std::min(t1, t2));
+    tfar = std::min(tfar, std::max(t1, t2));
+  }
+#endif
+
+  *near_distance = tnear;
+  return (tnear <= tfar && tfar >= 0.0f && tnear <= max_distance);
+}
+
+// Moller-Trumbore against four triangles at once. Updates the hit if any is nearer than *distance.
+bool TriangleBVH::IntersectTriangleBlock(const Ray& ray, const TriangleBlock& block, float* distance, u32* id, float* u,
+                                         float* v)
+{
+  const auto& v0 = block.v0;
+  const auto& e1 = block.e1;
+  const auto& e2 = block.e2;
+  const u32* ids = block.ids;
+  static constexpr float DET_EPSILON = 1e-8f;
+
+#ifdef HAS_SSE2
+  const __m128 dx = _mm_set1_ps(ray.direction.x);
+  const __m128 dy = _mm_set1_ps(ray.direction.y);
+  const __m128 dz = _mm_set1_ps(ray.direction.z);
+  const __m128 e1x = _mm_load_ps(e1[0]), e1y = _mm_load_ps(e1[1]), e1z = _mm_load_ps(e1[2]);
+  const __m128 e2x = _mm_load_ps(e2[0]), e2y = _mm_load_ps(e2[1]), e2z = _mm_load_ps(e2[2]);
+
+  const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+  const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+  const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+  const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+  const __m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+  const __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+  const __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_load_ps(v0[0]));
+  const __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_load_ps(v0[1]));
+  const __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_load_ps(v0[2]));
+  const __m128 bu =
+    _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+
+  const __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+  const __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+  const __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+  const __m128 bv =
+    _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+  const __m128 t =
+    _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+  const __m128 zero = _mm_setzero_ps();
+  __m128 mask = _mm_cmpgt_ps(abs_det, _mm_set1_ps(DET_EPSILON));
+  mask = _mm_and_ps(mask, _mm_cmpge_ps(bu, zero));
+  mask = _mm_and_ps(mask, _mm_cmpge_ps(bv, zero));
+  mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(bu, bv), _mm_set1_ps(1.0f)));
+  mask = _mm_and_ps(mask, _mm_cmpge_ps(t, zero));
+  mask = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_set1_ps(*distance)));
+  int bits = _mm_movemask_ps(mask);
+  if (bits == 0)
+    return false;
+
+  alignas(16) float t_lanes[4], u_lanes[4], v_lanes[4];
+  _mm_store_ps(t_lanes, t);
+  _mm_store_ps(u_lanes, bu);
+  _mm_store_ps(v_lanes, bv);
+  for (u32 lane = 0; lane < 4; lane++)
+  {
+    if ((bits & (1 << lane)) && t_lanes[lane] < *distance)
+    {
+      *distance = t_lanes[lane];
+      *id = ids[lane];
+      *u = u_lanes[lane];
+      *v = v_lanes[lane];
+    }
+  }
+
+  return true;
+#else
+  bool result = false;
+  for (u32 lane = 0; lane < 4; lane++)
+  {
+    const glm::vec3 edge1(e1[0][lane], e1[1][lane], e1[2][lane]);
+    const glm::vec3 edge2(e2[0][lane], e2[1][lane], e2[2][lane]);
+    const glm::vec3 pvec = glm::cross(ray.direction, edge2);
+    const float det = glm::dot(edge1, pvec);
+    if (std::abs(det) <= DET_EPSILON)
+      continue;
+
+    const float inv_det = 1.0f / det;
+    const glm::vec3 tvec = ray.origin - glm::vec3(v0[0][lane], v0[1][lane], v0[2][lane]);
+    const float bu = glm::dot(tvec, pvec) * inv_det;
+    const glm::vec3 qvec = glm::cross(tvec, edge1);
+    const float bv = glm::dot(ray.direction, qvec) * inv_det;
+    const float t = glm::dot(edge2, qvec) * inv_det;
+    if (bu < 0.0f || bv < 0.0f || (bu + bv) > 1.0f || t < 0.0f || t >= *distance)
+      continue;
+
+    *distance = t;
+    *id = ids[lane];
+    *u = bu;
+    *v = bv;
+    result = true;
+  }
+
+  return result;
+#endif
+}
+
+template<bool any_hit>
+bool TriangleBVH::Traverse(const Ray& ray, float max_distance, Hit* hit) const
+{
+  if (m_nodes.empty())
+    return false;
+
+  struct StackEntry
+  {
+    u32 node_index;
+    float near_distance;
+  };
+  StackEntry stack[MAX_STACK_SIZE];
+  u32 stack_size = 0;
+
+  float best_distance = max_distance;
+  u32 best_id = INVALID_TRIANGLE;
+  float best_u = 0.0f, best_v = 0.0f;
+
+  float near_distance;
+  if (!IntersectNodeBox(ray, m_nodes[0], best_distance, &near_distance))
+    return false;
+
+  u32 node_index = 0;
+  for (;;)
+  {
+    const Node& node = m_nodes[node_index];
+    if (node.count > 0)
+    {
+      for (u32 i = 0; i < node.count; i++)
+      {
+        const TriangleBlock& block = m_blocks[node.left_or_first + i];
+        if (IntersectTriangleBlock(ray, block, &best_distance, &best_id, &best_u, &best_v) && any_hit)
+          return true;
+      }
+    }
+    else
+    {
+      // Visit the nearer child first, so the far one can often be skipped once something is hit.
+      const u32 left = node.left_or_first;
+      float left_distance, right_distance;
+      const bool hit_left = IntersectNodeBox(ray, m_nodes[left], best_distance, &left_distance);
+      const bool hit_right = IntersectNodeBox(ray, m_nodes[left + 1], best_distance, &right_distance);
+      if (hit_left && hit_right)
+      {
+        const bool left_first = (left_distance <= right_distance);
+        stack[stack_size++] = {left_first ? (left + 1) : left, left_first ? right_distance : left_distance};
+        node_index = left_first ? left : (left + 1);
+        continue;
+      }
+      else if (hit_left || hit_right)
+      {
+        node_index = hit_left ? left : (left + 1);
+        continue;
+      }
+    }
+
+    // Pop the next node which could still be nearer than the best hit.
+    while (stack_size > 0 && stack[stack_size - 1].near_distance > best_distance)
+      stack_size--;
+    if (stack_size == 0)
+      break;
+
+    node_index = stack[--stack_size].node_index;
+  }
+
+  if (best_id == INVALID_TRIANGLE)
+    return false;
+
+  if (hit)
+  {
+    const TriangleInfo& info = m_triangle_info[best_id];
+    hit->distance = best_distance;
+    hit->face_index = info.face_index;
+    hit->texture_index = m_face_textures[info.face_index];
+    hit->first_index = info.first_index;
+    hit->barycentrics[0] = best_u;
+    hit->barycentrics[1] = best_v;
+  }
+
+  return true;
+}
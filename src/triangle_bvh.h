@@ -0,0 +1,100 @@
+#pragma once
+#include "common.h"
+#include <glm/glm.hpp>
+#include <memory>
+#include <vector>
+
+class BSP;
+
+// Bounding volume hierarchy over the map's triangles, after patch tessellation, for ray queries.
+// Built with binned SAH, subtrees in parallel on the thread pool. Queries are const and can run on any thread.
+class TriangleBVH
+{
+public:
+  struct Hit
+  {
+    float distance;
+    u32 face_index;
+    s32 texture_index;
+
+    // Offset of the triangle's first index in the BSP's index buffer.
+    u32 first_index;
+
+    // Weights of the triangle's second and third vertices at the hit point.
+    float barycentrics[2];
+  };
+
+  ~TriangleBVH();
+
+  static std::unique_ptr<TriangleBVH> Create(const BSP* bsp);
+
+  u32 GetNodeCount() const { return u32(m_nodes.size()); }
+  u32 GetTriangleCount() const { return m_num_triangles; }
+
+  // Nearest hit along the ray within max_distance. Both sides of triangles are hit. The direction must be
+  // normalized for the distance to be in world units.
+  bool Intersect(const glm::vec3& origin, const glm::vec3& direction, float max_distance, Hit* hit) const;
+
+  // Returns true if anything is hit within max_distance. Stops at the first hit, so cheaper than Intersect().
+  bool IsOccluded(const glm::vec3& origin, const glm::vec3& direction, float max_distance) const;
+
+private:
+  // Interior nodes have count zero, and their children at left_or_first and left_or_first + 1.
+  // Leaves have count triangle blocks starting at left_or_first.
+  struct alignas(32) Node
+  {
+    float bbox_min[3];
+    u32 left_or_first;
+    float bbox_max[3];
+    u32 count;
+  };
+  static_assert(sizeof(Node) == 32, "node is 32 bytes");
+
+  // Four triangles in structure-of-arrays layout, as a first vertex and two edges, for testing together.
+  // Unused lanes have zero edges, which never hit.
+  struct alignas(16) TriangleBlock
+  {
+    float v0[3][4];
+    float e1[3][4];
+    float e2[3][4];
+    u32 ids[4];
+  };
+
+  struct TriangleRef
+  {
+    glm::vec3 bbox_min;
+    glm::vec3 bbox_max;
+    glm::vec3 centroid;
+    u32 id;
+  };
+
+  struct TriangleInfo
+  {
+    u32 face_index;
+    u32 first_index;
+  };
+
+  struct Ray;
+
+  TriangleBVH();
+
+  void Build(const BSP* bsp);
+  static void BuildSubtree(std::vector<Node>* nodes, TriangleRef* refs, u32 node_index, u32 first, u32 count,
+                           u32 depth, std::vector<u32>* deferred);
+  static bool SplitNode(TriangleRef* refs, u32 first, u32 count, u32* split_count);
+  static void SplitNodeAtMedian(TriangleRef* refs, u32 first, u32 count, u32* split_count);
+  void CreateTriangleBlocks(const BSP* bsp, const std::vector<TriangleRef>& refs);
+
+  static bool IntersectNodeBox(const Ray& ray, const Node& node, float max_distance, float* near_distance);
+  static bool IntersectTriangleBlock(const Ray& ray, const TriangleBlock& block, float* distance, u32* id, float* u,
+                                     float* v);
+
+  template<bool any_hit>
+  bool Traverse(const Ray& ray, float max_distance, Hit* hit) const;
+
+  std::vector<Node> m_nodes;
+  std::vector<TriangleBlock> m_blocks;
+  std::vector<TriangleInfo> m_triangle_info;
+  std::vector<s32> m_face_textures;
+  u32 m_num_triangles = 0;
+};
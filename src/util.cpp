@@ -14,7 +14,12 @@ std::string StringFromFormat(const char* fmt, ...)
 
 std::string StringFromFormatV(const char* fmt, std::va_list ap)
 {
-  int size = std::vsnprintf(nullptr, 0, fmt, ap);
+  // Measuring the string consumes the arguments, so it works on a copy.
+  std::va_list ap_copy;
+  va_copy(ap_copy, ap);
+  int size = std::vsnprintf(nullptr, 0, fmt, ap_copy);
+  va_end(ap_copy);
+
   std::string ret;
   ret.resize(size);
   std::vsnprintf(&ret[0], size + 1, fmt, ap);
@@ -179,4 +184,44 @@ std::unique_ptr<std::FILE, void (*)(FILE*)> FOpenUniquePtr(const char* filename,
   });
 }
 
+bool WriteTGA(const char* filename, u32 width, u32 height, const u32* pixels, u32 stride)
+{
+  auto fp = FOpenUniquePtr(filename, "wb");
+  if (!fp)
+  {
+    std::fprintf(stderr, "Failed to open '%s' for writing\n", filename);
+    return false;
+  }
+
+  // Uncompressed true-colour, 8 bits of alpha, rows stored top to bottom.
+  u8 header[18] = {};
+  header[2] = 2;
+  header[12] = u8(width);
+  header[13] = u8(width >> 8);
+  header[14] = u8(height);
+  header[15] = u8(height >> 8);
+  header[16] = 32;
+  header[17] = 0x28;
+
+  std::vector<u8> row(width * 4);
+  bool result = (std::fwrite(header, sizeof(header), 1, fp.get()) == 1);
+  for (u32 y = 0; y < height && result; y++)
+  {
+    const u32* row_pixels = &pixels[y * stride];
+    for (u32 x = 0; x < width; x++)
+    {
+      row[x * 4 + 0] = u8(row_pixels[x] >> 16);
+      row[x * 4 + 1] = u8(row_pixels[x] >> 8);
+      row[x * 4 + 2] = u8(row_pixels[x]);
+      row[x * 4 + 3] = u8(row_pixels[x] >> 24);
+    }
+    result = (std::fwrite(row.data(), row.size(), 1, fp.get()) == 1);
+  }
+
+  if (!result)
+    std::fprintf(stderr, "Failed to write '%s'\n", filename);
+
+  return result;
+}
+
 } // namespace Util
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "common.h"
 #include <cstdarg>
 #include <cstdio>
 #include <string>
@@ -26,4 +27,7 @@ std::string CanonicalizePath(const char* path, bool ospath = true);
 // Opens a file, returning a unique_ptr which automatically closes the handle.
 std::unique_ptr<std::FILE, void (*)(FILE*)> FOpenUniquePtr(const char* filename, const char* mode);
 
+// Writes RGBA8 pixels, top row first, as an uncompressed 32-bit TGA. Rows are stride pixels apart.
+bool WriteTGA(const char* filename, u32 width, u32 height, const u32* pixels, u32 stride);
+
 } // namespace Util
\ No newline at end of file
@@ -0,0 +1,418 @@
+#include "pch.h"
+#include "vis_compiler.h"
+#include "thread_pool.h"
+#include "util.h"
+#include <algorithm>
+#include <cstring>
+
+// Points closer than this to a plane count as on it.
+static constexpr float VIS_EPSILON = 0.1f;
+
+// The full pass gives up on a source portal after this many portal visits, keeping the fast result for it.
+static constexpr u32 MAX_FLOW_STEPS = 1 << 20;
+
+static constexpr u32 VIS_CACHE_VERSION = 1;
+
+struct VisCacheHeader
+{
+  char magic[4];
+  u32 version;
+  u32 checksum;
+  u32 quality;
+  u32 num_clusters;
+  u32 bytes_per_cluster;
+};
+
+static Plane FlipPlane(const Plane& plane)
+{
+  return Plane(-plane.GetNormal(), -plane.GetDistance());
+}
+
+// Clips target to the planes through an edge of source and a point of pass which have the two on opposite sides.
+// Anything seen through source and then pass must be on the pass side of all of them. With flip set, source and
+// pass are swapped in the construction, so the target is kept on the side of the second winding.
+static void ClipToSeparators(const Winding& source, const Winding& pass, Winding* target, bool flip)
+{
+  const size_t num_source_points = source.GetPointCount();
+  const size_t num_pass_points = pass.GetPointCount();
+  for (size_t i = 0; i < num_source_points; i++)
+  {
+    const size_t l = (i + 1) % num_source_points;
+    const glm::vec3 v1 = source.GetPoint(l) - source.GetPoint(i);
+    for (size_t j = 0; j < num_pass_points; j++)
+    {
+      glm::vec3 normal = glm::cross(v1, pass.GetPoint(j) - source.GetPoint(i));
+      const float length = glm::length(normal);
+      if (length < VIS_EPSILON)
+        continue;
+
+      normal /= length;
+      float dist = glm::dot(pass.GetPoint(j), normal);
+
+      // Orient the plane so the source is behind it. Skip planes the source lies in.
+      size_t k;
+      bool flip_test = false;
+      for (k = 0; k < num_source_points; k++)
+      {
+        if (k == i || k == l)
+          continue;
+
+        const float d = glm::dot(source.GetPoint(k), normal) - dist;
+        if (d < -VIS_EPSILON)
+          break;
+        if (d > VIS_EPSILON)
+        {
+          flip_test = true;
+          break;
+        }
+      }
+      if (k == num_source_points)
+        continue;
+
+      if (flip_test)
+      {
+        normal = -normal;
+        dist = -dist;
+      }
+
+      // It only separates the two if all of pass is in front, and not all of it on the plane.
+      bool separates = true;
+      bool any_in_front = false;
+      for (k = 0; k < num_pass_points && separates; k++)
+      {
+        if (k == j)
+          continue;
+
+        const float d = glm::dot(pass.GetPoint(k), normal) - dist;
+        separates = (d >= -VIS_EPSILON);
+        any_in_front |= (d > VIS_EPSILON);
+      }
+      if (!separates || !any_in_front)
+        continue;
+
+      if (flip)
+      {
+        normal = -normal;
+        dist = -dist;
+      }
+
+      target->Clip(Plane(normal, -dist), VIS_EPSILON);
+      if (target->IsEmpty())
+        return;
+    }
+  }
+}
+
+VisCompiler::VisCompiler(const BSP* bsp) : m_bsp(bsp) {}
+
+VisCompiler::~VisCompiler() = default;
+
+bool VisCompiler::Compute(Quality quality)
+{
+  const auto start_time = std::chrono::steady_clock::now();
+
+  CreatePortals();
+
+  const u32 num_clusters = m_bsp->GetClusterCount();
+  const u32 num_portals = u32(m_portals.size());
+  if (num_clusters == 0 || num_portals == 0)
+  {
+    std::fprintf(stderr, "No portals to compute visibility from.\n");
+    return false;
+  }
+
+  // Fast pass: flood through the portals in front of each one.
+  const u32 num_words = (num_portals + 63) / 64;
+  m_portal_flood.assign(num_portals, std::vector<u64>(num_words, 0));
+  g_thread_pool->ParallelFor(num_portals, [this, num_words](u32 i) {
+    std::vector<u64> front(num_words, 0);
+    ComputePortalFront(i, &front);
+    FloodPortal(i, front, &m_portal_flood[i]);
+  });
+
+  // Full pass, per source portal.
+  std::vector<std::vector<u64>> portal_flow;
+  std::atomic<u32> num_given_up{0};
+  if (quality == Quality::Full)
+  {
+    portal_flow.resize(num_portals);
+    g_thread_pool->ParallelFor(num_portals, [this, &portal_flow, &num_given_up, num_words](u32 i) {
+      FlowState state;
+      state.portal_visible.assign(num_words, 0);
+      state.source_index = i;
+      state.steps = 0;
+      RecursiveFlow(&state, m_portals[i].to_cluster, m_portals[i].winding, nullptr, m_portal_flood[i]);
+      if (state.steps > MAX_FLOW_STEPS)
+        num_given_up.fetch_add(1);
+      else
+        portal_flow[i] = std::move(state.portal_visible);
+    });
+  }
+
+  // A cluster sees its neighbours, and whatever is seen through the portals leading to them.
+  const u32 bytes_per_cluster = (num_clusters + 7) / 8;
+  std::vector<u8> data(size_t(num_clusters) * bytes_per_cluster, 0);
+  g_thread_pool->ParallelFor(num_clusters, [this, &data, &portal_flow, bytes_per_cluster, num_portals](u32 cluster) {
+    u8* row = &data[size_t(cluster) * bytes_per_cluster];
+    row[cluster / 8] |= u8(1 << (cluster % 8));
+    for (u32 portal_index : m_cluster_portals[cluster])
+    {
+      const u32 to_cluster = m_portals[portal_index].to_cluster;
+      row[to_cluster / 8] |= u8(1 << (to_cluster % 8));
+
+      const std::vector<u64>& seen =
+        portal_flow.empty() || portal_flow[portal_index].empty() ? m_portal_flood[portal_index] :
+                                                                   portal_flow[portal_index];
+      for (u32 i = 0; i < num_portals; i++)
+      {
+        if (TestPortalBit(seen, i))
+          row[m_portals[i].to_cluster / 8] |= u8(1 << (m_portals[i].to_cluster % 8));
+      }
+    }
+  });
+
+  // Visibility goes both ways; keep the data symmetric so the row/column order of lookups doesn't matter.
+  u64 num_visible = 0;
+  for (u32 i = 0; i < num_clusters; i++)
+  {
+    for (u32 j = i + 1; j < num_clusters; j++)
+    {
+      u8& ij = data[size_t(i) * bytes_per_cluster + j / 8];
+      u8& ji = data[size_t(j) * bytes_per_cluster + i / 8];
+      if ((ij & (1 << (j % 8))) || (ji & (1 << (i % 8))))
+      {
+        ij |= u8(1 << (j % 8));
+        ji |= u8(1 << (i % 8));
+        num_visible += 2;
+      }
+    }
+    num_visible++;
+  }
+
+  m_visdata.num_clusters = num_clusters;
+  m_visdata.bytes_per_cluster = bytes_per_cluster;
+  m_visdata.data = std::move(data);
+  m_quality = quality;
+
+  const float elapsed = std::chrono::duration<float>(std::chrono::steady_clock::now() - start_time).count();
+  std::fprintf(stdout, "Computed %s vis for %u clusters (%u portals) in %.2f s, %.1f%% visible on average\n",
+               (quality == Quality::Full) ? "full" : "fast", num_clusters, num_portals, elapsed,
+               double(num_visible) * 100.0 / (double(num_clusters) * double(num_clusters)));
+  if (num_given_up.load() > 0)
+    std::fprintf(stdout, "  %u portals were too complex for the full pass\n", num_given_up.load());
+
+  return true;
+}
+
+void VisCompiler::CreatePortals()
+{
+  m_portals.clear();
+  m_cluster_portals.assign(m_bsp->GetClusterCount(), {});
+
+  // Portals between leaves of the same cluster don't matter, the cluster is visible as a whole.
+  for (const BSP::Portal& portal : m_bsp->GetPortals())
+  {
+    const s32 front_cluster = m_bsp->GetLeaf(portal.leaves[0])->cluster;
+    const s32 back_cluster = m_bsp->GetLeaf(portal.leaves[1])->cluster;
+    if (front_cluster < 0 || back_cluster < 0 || front_cluster == back_cluster ||
+        u32(std::max(front_cluster, back_cluster)) >= m_bsp->GetClusterCount())
+    {
+      continue;
+    }
+
+    m_cluster_portals[front_cluster].push_back(u32(m_portals.size()));
+    m_portals.push_back({portal.plane, portal.winding, u32(front_cluster), u32(back_cluster)});
+    m_cluster_portals[back_cluster].push_back(u32(m_portals.size()));
+    m_portals.push_back({FlipPlane(portal.plane), portal.winding, u32(back_cluster), u32(front_cluster)});
+  }
+}
+
+void VisCompiler::ComputePortalFront(u32 portal_index, std::vector<u64>* front) const
+{
+  // Another portal can only be seen through this one if part of it is beyond this one, and this one is behind it.
+  const VisPortal& portal = m_portals[portal_index];
+  for (u32 i = 0; i < u32(m_portals.size()); i++)
+  {
+    if (i == portal_index)
+      continue;
+
+    const VisPortal& other = m_portals[i];
+    const std::vector<glm::vec3>& other_points = other.winding.GetPoints();
+    const std::vector<glm::vec3>& points = portal.winding.GetPoints();
+    if (std::none_of(other_points.begin(), other_points.end(),
+                     [&portal](const glm::vec3& p) { return portal.plane.Distance(p) > VIS_EPSILON; }) ||
+        std::none_of(points.begin(), points.end(),
+                     [&other](const glm::vec3& p) { return other.plane.Distance(p) < -VIS_EPSILON; }))
+    {
+      continue;
+    }
+
+    SetPortalBit(front, i);
+  }
+}
+
+void VisCompiler::FloodPortal(u32 portal_index, const std::vector<u64>& front, std::vector<u64>* flood) const
+{
+  std::vector<u32> stack;
+  stack.push_back(m_portals[portal_index].to_cluster);
+  while (!stack.empty())
+  {
+    const u32 cluster = stack.back();
+    stack.pop_back();
+    for (u32 i : m_cluster_portals[cluster])
+    {
+      if (!TestPortalBit(front, i) || TestPortalBit(*flood, i))
+        continue;
+
+      SetPortalBit(flood, i);
+      stack.push_back(m_portals[i].to_cluster);
+    }
+  }
+}
+
+void VisCompiler::RecursiveFlow(FlowState* state, u32 cluster, const Winding& source, const Winding* pass,
+                                const std::vector<u64>& might) const
+{
+  const VisPortal& source_portal = m_portals[state->source_index];
+  const VisPortal* pass_portal = state->path.empty() ? nullptr : &m_portals[state->path.back()];
+
+  std::vector<u64> next_might(might.size());
+  for (u32 portal_index : m_cluster_portals[cluster])
+  {
+    if (++state->steps > MAX_FLOW_STEPS)
+      return;
+    if (!TestPortalBit(might, portal_index))
+      continue;
+
+    const VisPortal& portal = m_portals[portal_index];
+    if (portal.to_cluster == source_portal.from_cluster ||
+        std::any_of(state->path.begin(), state->path.end(),
+                    [this, &portal](u32 i) { return m_portals[i].from_cluster == portal.to_cluster; }))
+    {
+      continue;
+    }
+
+    // Skip portals which can't lead to anything not seen already.
+    bool more = false;
+    for (size_t i = 0; i < might.size(); i++)
+    {
+      next_might[i] = might[i] & m_portal_flood[portal_index][i];
+      more |= (next_might[i] & ~state->portal_visible[i]) != 0;
+    }
+    if (!more && TestPortalBit(state->portal_visible, portal_index))
+      continue;
+
+    // The part of the portal beyond the source, seen from the part of the source behind the portal.
+    Winding target = portal.winding;
+    target.Clip(source_portal.plane, VIS_EPSILON);
+    if (target.IsEmpty())
+      continue;
+
+    Winding new_source = source;
+    new_source.Clip(FlipPlane(portal.plane), VIS_EPSILON);
+    if (new_source.IsEmpty())
+      continue;
+
+    // Portals of the cluster next to the source can only be blocked by being coplanar with it.
+    if (pass)
+    {
+      target.Clip(pass_portal->plane, VIS_EPSILON);
+      if (target.IsEmpty())
+        continue;
+
+      ClipToSeparators(new_source, *pass, &target, false);
+      if (target.IsEmpty())
+        continue;
+
+      ClipToSeparators(*pass, new_source, &target, true);
+      if (target.IsEmpty())
+        continue;
+    }
+
+    SetPortalBit(&state->portal_visible, portal_index);
+    state->path.push_back(portal_index);
+    RecursiveFlow(state, portal.to_cluster, new_source, &target, next_might);
+    state->path.pop_back();
+  }
+}
+
+u32 VisCompiler::ComputeTreeChecksum() const
+{
+  // FNV-1a over everything the portals are generated from.
+  u32 hash = 2166136261u;
+  const auto add = [&hash](const void* data, size_t size) {
+    for (size_t i = 0; i < size; i++)
+      hash = (hash ^ static_cast<const u8*>(data)[i]) * 16777619u;
+  };
+
+  for (size_t i = 0; i < m_bsp->GetNodeCount(); i++)
+  {
+    const BSP::Node* node = m_bsp->GetNode(i);
+    const glm::vec4 plane = node->plane.GetVec4();
+    add(&plane, sizeof(plane));
+    add(node->children, sizeof(node->children));
+    add(&node->bbox_min, sizeof(node->bbox_min));
+    add(&node->bbox_max, sizeof(node->bbox_max));
+  }
+  for (size_t i = 0; i < m_bsp->GetLeafCount(); i++)
+  {
+    const s32 cluster = m_bsp->GetLeaf(i)->cluster;
+    add(&cluster, sizeof(cluster));
+  }
+
+  return hash;
+}
+
+bool VisCompiler::LoadCache(const char* filename, Quality quality)
+{
+  auto fp = Util::FOpenUniquePtr(filename, "rb");
+  if (!fp)
+    return false;
+
+  VisCacheHeader header;
+  if (std::fread(&header, sizeof(header), 1, fp.get()) != 1 || std::memcmp(header.magic, "BVIS", 4) != 0 ||
+      header.version != VIS_CACHE_VERSION || header.checksum != ComputeTreeChecksum() ||
+      header.quality < u32(quality) || header.num_clusters != m_bsp->GetClusterCount() ||
+      header.bytes_per_cluster != (header.num_clusters + 7) / 8)
+  {
+    std::fprintf(stderr, "Ignoring out-of-date vis cache '%s'\n", filename);
+    return false;
+  }
+
+  std::vector<u8> data(size_t(header.num_clusters) * header.bytes_per_cluster);
+  if (!data.empty() && std::fread(data.data(), data.size(), 1, fp.get()) != 1)
+  {
+    std::fprintf(stderr, "Failed to read vis cache '%s'\n", filename);
+    return false;
+  }
+
+  m_visdata.num_clusters = header.num_clusters;
+  m_visdata.bytes_per_cluster = header.bytes_per_cluster;
+  m_visdata.data = std::move(data);
+  m_quality = Quality(header.quality);
+  std::fprintf(stdout, "Loaded vis for %u clusters from '%s'\n", header.num_clusters, filename);
+  return true;
+}
+
+bool VisCompiler::SaveCache(const char* filename) const
+{
+  auto fp = Util::FOpenUniquePtr(filename, "wb");
+  if (!fp)
+    return false;
+
+  VisCacheHeader header;
+  std::memcpy(header.magic, "BVIS", 4);
+  header.version = VIS_CACHE_VERSION;
+  header.checksum = ComputeTreeChecksum();
+  header.quality = u32(m_quality);
+  header.num_clusters = m_visdata.num_clusters;
+  header.bytes_per_cluster = m_visdata.bytes_per_cluster;
+  if (std::fwrite(&header, sizeof(header), 1, fp.get()) != 1 ||
+      (!m_visdata.data.empty() && std::fwrite(m_visdata.data.data(), m_visdata.data.size(), 1, fp.get()) != 1))
+  {
+    std::fprintf(stderr, "Failed to write vis cache '%s'\n", filename);
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include "bsp.h"
+#include "common.h"
+#include <vector>
+
+// Computes cluster-to-cluster visibility from the leaf portals, for maps compiled without vis.
+// Works on directed portals between clusters: each one is flooded from independently on the thread pool, and a
+// cluster sees everything seen through any of its portals.
+class VisCompiler
+{
+public:
+  enum class Quality : u32
+  {
+    // Floods through every portal which is in front of the source portal and faces it. Conservative and quick.
+    Fast,
+
+    // Additionally clips each portal along the path to the planes separating the source and the previous portal,
+    // as the Q3 tools do. Much tighter, much slower.
+    Full
+  };
+
+  VisCompiler(const BSP* bsp);
+  ~VisCompiler();
+
+  const BSP::VisData& GetVisData() const { return m_visdata; }
+
+  // Returns false if the map has no portals to work from.
+  bool Compute(Quality quality);
+
+  // The cache is only used if it was computed for the same tree at the same or higher quality.
+  bool LoadCache(const char* filename, Quality quality);
+  bool SaveCache(const char* filename) const;
+
+private:
+  struct VisPortal
+  {
+    // Faces into to_cluster.
+    Plane plane;
+    Winding winding;
+    u32 from_cluster;
+    u32 to_cluster;
+  };
+
+  // State of the full pass for one source portal.
+  struct FlowState
+  {
+    std::vector<u64> portal_visible;
+    std::vector<u32> path;
+    u32 source_index;
+    u32 steps;
+  };
+
+  void CreatePortals();
+  void ComputePortalFront(u32 portal_index, std::vector<u64>* front) const;
+  void FloodPortal(u32 portal_index, const std::vector<u64>& front, std::vector<u64>* flood) const;
+  void RecursiveFlow(FlowState* state, u32 cluster, const Winding& source, const Winding* pass,
+                     const std::vector<u64>& might) const;
+
+  bool TestPortalBit(const std::vector<u64>& bits, u32 portal_index) const
+  {
+    return (bits[portal_index / 64] & (u64(1) << (portal_index % 64))) != 0;
+  }
+  void SetPortalBit(std::vector<u64>* bits, u32 portal_index) const
+  {
+    (*bits)[portal_index / 64] |= (u64(1) << (portal_index % 64));
+  }
+
+  u32 ComputeTreeChecksum() const;
+
+  const BSP* m_bsp;
+
+  std::vector<VisPortal> m_portals;
+  std::vector<std::vector<u32>> m_cluster_portals;
+
+  // Portals which may be seen through each portal, from the fast pass. Bounds the full pass.
+  std::vector<std::vector<u64>> m_portal_flood;
+
+  BSP::VisData m_visdata = {};
+  Quality m_quality = Quality::Fast;
+};
@@ -0,0 +1,149 @@
+#include "pch.h"
+#include "winding.h"
+#include <limits>
+
+Winding::Winding() = default;
+
+Winding::Winding(std::vector<glm::vec3> points) : m_points(std::move(points)) {}
+
+float Winding::GetArea() const
+{
+  float area = 0.0f;
+  for (size_t i = 2; i < m_points.size(); i++)
+    area += glm::length(glm::cross(m_points[i - 1] - m_points[0], m_points[i] - m_points[0])) * 0.5f;
+
+  return area;
+}
+
+glm::vec3 Winding::GetCenter() const
+{
+  glm::vec3 center(0.0f);
+  for (const glm::vec3& point : m_points)
+    center += point;
+
+  return m_points.empty() ? center : (center / float(m_points.size()));
+}
+
+void Winding::GetBounds(glm::vec3* bmin, glm::vec3* bmax) const
+{
+  *bmin = glm::vec3(std::numeric_limits<float>::max());
+  *bmax = glm::vec3(-std::numeric_limits<float>::max());
+  for (const glm::vec3& point : m_points)
+  {
+    *bmin = glm::min(*bmin, point);
+    *bmax = glm::max(*bmax, point);
+  }
+}
+
+bool Winding::Contains(const Winding& other, float epsilon /* = 0.1f */) const
+{
+  if (IsEmpty())
+    return false;
+
+  // Each edge, with the direction within the plane pointing from it towards the inside.
+  const glm::vec3 center = GetCenter();
+  for (size_t i = 0; i < m_points.size(); i++)
+  {
+    const glm::vec3& p0 = m_points[i];
+    const glm::vec3 edge = m_points[(i + 1) % m_points.size()] - p0;
+    const float edge_length_sq = glm::dot(edge, edge);
+    if (edge_length_sq < 0.000001f)
+      continue;
+
+    glm::vec3 inward = (center - p0) - edge * (glm::dot(center - p0, edge) / edge_length_sq);
+    const float inward_length = glm::length(inward);
+    if (inward_length < 0.000001f)
+      continue;
+
+    inward /= inward_length;
+    for (const glm::vec3& point : other.m_points)
+    {
+      if (glm::dot(inward, point - p0) < -epsilon)
+        return false;
+    }
+  }
+
+  return true;
+}
+
+void Winding::Clip(const Plane& plane, float epsilon /* = 0.1f */)
+{
+  Winding front;
+  Split(plane, &front, nullptr, epsilon);
+  m_points = std::move(front.m_points);
+}
+
+void Winding::Split(const Plane& plane, Winding* front, Winding* back, float epsilon /* = 0.1f */) const
+{
+  if (front)
+    front->m_points.clear();
+  if (back)
+    back->m_points.clear();
+
+  const size_t count = m_points.size();
+  if (count < 3)
+    return;
+
+  // Classify every point first, so a winding entirely on one side can be copied as-is.
+  std::vector<float> dists(count);
+  std::vector<s8> sides(count);
+  u32 num_front = 0, num_back = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    dists[i] = plane.Distance(m_points[i]);
+    sides[i] = (dists[i] > epsilon) ? 1 : ((dists[i] < -epsilon) ? -1 : 0);
+    num_front += (sides[i] > 0) ? 1 : 0;
+    num_back += (sides[i] < 0) ? 1 : 0;
+  }
+
+  // Points on the plane go with the rest of the winding. A winding lying on the plane counts as in front.
+  if (num_back == 0)
+  {
+    if (front)
+      front->m_points = m_points;
+    return;
+  }
+  if (num_front == 0)
+  {
+    if (back)
+      back->m_points = m_points;
+    return;
+  }
+
+  for (size_t i = 0; i < count; i++)
+  {
+    const glm::vec3& p0 = m_points[i];
+    if (sides[i] >= 0 && front)
+      front->m_points.push_back(p0);
+    if (sides[i] <= 0 && back)
+      back->m_points.push_back(p0);
+
+    const size_t next = (i + 1) % count;
+    if (sides[i] == 0 || sides[next] == 0 || sides[i] == sides[next])
+      continue;
+
+    const glm::vec3 mid = glm::mix(p0, m_points[next], dists[i] / (dists[i] - dists[next]));
+    if (front)
+      front->m_points.push_back(mid);
+    if (back)
+      back->m_points.push_back(mid);
+  }
+}
+
+Winding Winding::CreateForPlane(const Plane& plane, float size /* = 65536.0f */)
+{
+  const glm::vec3& normal = plane.GetNormal();
+
+  // Pick the major axis to derive an up vector which isn't parallel to the normal.
+  const glm::vec3 abs_normal = glm::abs(normal);
+  glm::vec3 up = (abs_normal.z >= abs_normal.x && abs_normal.z >= abs_normal.y) ? glm::vec3(1.0f, 0.0f, 0.0f) :
+                                                                                 glm::vec3(0.0f, 0.0f, 1.0f);
+  up = glm::normalize(up - normal * glm::dot(up, normal));
+  const glm::vec3 right = glm::cross(up, normal);
+
+  const glm::vec3 origin = normal * -plane.GetDistance();
+  up *= size;
+  const glm::vec3 scaled_right = right * size;
+  return Winding({origin - scaled_right + up, origin + scaled_right + up, origin + scaled_right - up,
+                  origin - scaled_right - up});
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include "common.h"
+#include "plane.h"
+#include <glm/glm.hpp>
+#include <vector>
+
+// Convex polygon, used for clipping portals against planes.
+class Winding
+{
+public:
+  Winding();
+  Winding(std::vector<glm::vec3> points);
+
+  bool IsEmpty() const { return m_points.size() < 3; }
+  size_t GetPointCount() const { return m_points.size(); }
+  const glm::vec3& GetPoint(size_t i) const { return m_points[i]; }
+  const std::vector<glm::vec3>& GetPoints() const { return m_points; }
+
+  float GetArea() const;
+  glm::vec3 GetCenter() const;
+  void GetBounds(glm::vec3* bmin, glm::vec3* bmax) const;
+
+  // Whether every point of another winding on the same plane lies within this one, give or take epsilon.
+  bool Contains(const Winding& other, float epsilon = 0.1f) const;
+
+  // Removes the part of the winding behind the plane. Points within epsilon of the plane are kept.
+  void Clip(const Plane& plane, float epsilon = 0.1f);
+
+  // Splits into the parts in front of and behind the plane. Either part may be empty.
+  void Split(const Plane& plane, Winding* front, Winding* back, float epsilon = 0.1f) const;
+
+  // A large square lying on the plane, facing the same way.
+  static Winding CreateForPlane(const Plane& plane, float size = 65536.0f);
+
+private:
+  std::vector<glm::vec3> m_points;
+};
@@ -0,0 +1,467 @@
+#include "pch.h"
+#include "bsp.h"
+#include "bsp_renderer.h"
+#include "camera.h"
+#include "frustum.h"
+#include "plane.h"
+#include "util.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <glm/gtc/matrix_transform.hpp>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+u32 g_num_draws = 0;
+
+// Every allocation in the process comes through here, so each benchmark can report how many its kernel made.
+static std::atomic<u64> s_num_allocations{0};
+static std::atomic<u64> s_num_allocated_bytes{0};
+
+void* operator new(std::size_t size)
+{
+  s_num_allocations.fetch_add(1, std::memory_order_relaxed);
+  s_num_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  if (void* ptr = std::malloc(size ? size : 1))
+    return ptr;
+
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+  std::free(ptr);
+}
+
+// Results are consumed here so the compiler can't discard the work.
+static volatile u64 s_sink;
+
+// Times the hot paths of loading and querying maps on fixed-seed inputs.
+// Each benchmark runs its kernel for at least the minimum time, with any untimed setup done before every iteration.
+// ns/op is the median over iterations, as the mean is easily skewed by a single preempted iteration.
+class KernelBenchmarks
+{
+public:
+  struct Result
+  {
+    std::string name;
+    u32 iterations;
+    double ns_per_op;
+    double min_ns_per_op;
+    double ops_per_second;
+    double mb_per_second;
+    double allocations_per_op;
+    double allocated_bytes_per_op;
+  };
+
+  KernelBenchmarks(double min_time_ms, const char* filter) : m_min_time_ms(min_time_ms), m_filter(filter) {}
+
+  const std::vector<Result>& GetResults() const { return m_results; }
+
+  // Kernels on synthetic data, which need no map.
+  void RunSynthetic();
+
+  // Loading, point and PVS queries, render setup and culling on a map.
+  bool RunMap(const char* filename);
+
+  void PrintResults() const;
+  bool WriteCSV(const char* filename) const;
+
+private:
+  using ClockSource = std::chrono::steady_clock;
+  using Function = std::function<void()>;
+
+  static constexpr u32 SEED = 1234;
+  static constexpr u32 MIN_ITERATIONS = 5;
+  static constexpr u32 BATCH_SIZE = 4096;
+  static constexpr u32 NUM_CULL_VIEWS = 64;
+  static constexpr u32 CULL_VIEWPORT_WIDTH = 1280;
+  static constexpr u32 CULL_VIEWPORT_HEIGHT = 720;
+
+  // ops_per_iteration operations, touching bytes_per_iteration bytes of input, are performed by each call of body.
+  void Run(const char* name, u32 ops_per_iteration, u64 bytes_per_iteration, const Function& setup,
+           const Function& body);
+
+  void RunLoadSteps(std::FILE* fp);
+
+  double m_min_time_ms;
+  const char* m_filter;
+  std::vector<Result> m_results;
+};
+
+void KernelBenchmarks::Run(const char* name, u32 ops_per_iteration, u64 bytes_per_iteration, const Function& setup,
+                           const Function& body)
+{
+  if (m_filter && !std::strstr(name, m_filter))
+    return;
+
+  // One untimed run to warm up caches and allocator pools.
+  if (setup)
+    setup();
+  body();
+
+  std::vector<double> iteration_ns;
+  u64 num_allocations = 0;
+  u64 num_allocated_bytes = 0;
+  double total_ns = 0.0;
+  while (iteration_ns.size() < MIN_ITERATIONS || total_ns < (m_min_time_ms * 1000000.0))
+  {
+    if (setup)
+      setup();
+
+    const u64 allocations_before = s_num_allocations.load(std::memory_order_relaxed);
+    const u64 allocated_bytes_before = s_num_allocated_bytes.load(std::memory_order_relaxed);
+    const ClockSource::time_point start_time = ClockSource::now();
+    body();
+    const double ns = std::chrono::duration<double, std::nano>(ClockSource::now() - start_time).count();
+    num_allocations += s_num_allocations.load(std::memory_order_relaxed) - allocations_before;
+    num_allocated_bytes += s_num_allocated_bytes.load(std::memory_order_relaxed) - allocated_bytes_before;
+
+    iteration_ns.push_back(ns);
+    total_ns += ns;
+  }
+
+  const u32 iterations = u32(iteration_ns.size());
+  std::sort(iteration_ns.begin(), iteration_ns.end());
+  const double median_ns = iteration_ns[iterations / 2];
+  const double total_ops = double(iterations) * double(ops_per_iteration);
+
+  Result result;
+  result.name = name;
+  result.iterations = iterations;
+  result.ns_per_op = median_ns / double(ops_per_iteration);
+  result.min_ns_per_op = iteration_ns.front() / double(ops_per_iteration);
+  result.ops_per_second = 1000000000.0 / result.ns_per_op;
+  result.mb_per_second = double(bytes_per_iteration) / median_ns * 1000000000.0 / (1024.0 * 1024.0);
+  result.allocations_per_op = double(num_allocations) / total_ops;
+  result.allocated_bytes_per_op = double(num_allocated_bytes) / total_ops;
+  m_results.push_back(std::move(result));
+}
+
+void KernelBenchmarks::RunSynthetic()
+{
+  std::mt19937 rng(SEED);
+  std::uniform_real_distribution<float> coord_dist(-4096.0f, 4096.0f);
+  std::uniform_real_distribution<float> size_dist(8.0f, 512.0f);
+  std::uniform_real_distribution<float> unit_dist(-1.0f, 1.0f);
+
+  std::vector<Plane> planes(BATCH_SIZE);
+  std::vector<glm::vec3> points(BATCH_SIZE);
+  for (u32 i = 0; i < BATCH_SIZE; i++)
+  {
+    glm::vec3 normal(unit_dist(rng), unit_dist(rng), unit_dist(rng));
+    if (glm::dot(normal, normal) < 0.0001f)
+      normal = glm::vec3(0.0f, 0.0f, 1.0f);
+    planes[i] = Plane(glm::normalize(normal), coord_dist(rng));
+    points[i] = glm::vec3(coord_dist(rng), coord_dist(rng), coord_dist(rng));
+  }
+
+  Run("Plane::ClassifyPoint", BATCH_SIZE, BATCH_SIZE * sizeof(glm::vec3), nullptr, [&planes, &points]() {
+    u64 sum = 0;
+    for (u32 i = 0; i < BATCH_SIZE; i++)
+      sum += u64(planes[i].ClassifyPoint(points[i]));
+    s_sink = sum;
+  });
+
+  // Boxes scattered around views from random positions, so some are inside, some outside and some crossing.
+  static constexpr u32 NUM_FRUSTUMS = 16;
+  std::vector<Frustum> frustums(NUM_FRUSTUMS);
+  for (Frustum& frustum : frustums)
+  {
+    const glm::vec3 eye(coord_dist(rng), coord_dist(rng), coord_dist(rng));
+    const glm::vec3 target(coord_dist(rng), coord_dist(rng), coord_dist(rng));
+    const glm::mat4 projection = glm::perspective(glm::radians(75.0f), 16.0f / 9.0f, 1.0f, 8192.0f);
+    frustum.Set(projection * glm::lookAt(eye, target, glm::vec3(0.0f, 0.0f, 1.0f)));
+  }
+
+  std::vector<glm::vec3> box_mins(BATCH_SIZE), box_maxs(BATCH_SIZE);
+  for (u32 i = 0; i < BATCH_SIZE; i++)
+  {
+    box_mins[i] = glm::vec3(coord_dist(rng), coord_dist(rng), coord_dist(rng));
+    box_maxs[i] = box_mins[i] + glm::vec3(size_dist(rng), size_dist(rng), size_dist(rng));
+  }
+
+  Run("Frustum::IntersectsAABox", NUM_FRUSTUMS * BATCH_SIZE, NUM_FRUSTUMS * BATCH_SIZE * sizeof(glm::vec3) * 2,
+      nullptr, [&frustums, &box_mins, &box_maxs]() {
+        u64 count = 0;
+        for (const Frustum& frustum : frustums)
+        {
+          for (u32 i = 0; i < BATCH_SIZE; i++)
+            count += u64(frustum.IntersectsAABox(box_mins[i], box_maxs[i]));
+        }
+        s_sink = count;
+      });
+
+  // Brightening the lightmaps is the CPU side of BSPRenderer::CreateLightmaps(), the rest is the upload.
+  static constexpr u32 NUM_LIGHTMAPS = 64;
+  std::uniform_int_distribution<u32> byte_dist(0, 255);
+  std::vector<BSP::LightMap> lightmaps(NUM_LIGHTMAPS);
+  for (BSP::LightMap& lightmap : lightmaps)
+  {
+    u8* data = &lightmap.data[0][0][0];
+    for (size_t i = 0; i < sizeof(lightmap.data); i++)
+      data[i] = u8(byte_dist(rng));
+  }
+
+  Run("BSPRenderer::BrightenLightMap", NUM_LIGHTMAPS, NUM_LIGHTMAPS * sizeof(BSP::LightMap), nullptr, [&lightmaps]() {
+    BSP::LightMap out;
+    u64 sum = 0;
+    for (const BSP::LightMap& lightmap : lightmaps)
+    {
+      BSPRenderer::BrightenLightMap(&lightmap, &out);
+      sum += out.data[0][0][0];
+    }
+    s_sink = sum;
+  });
+}
+
+void KernelBenchmarks::RunLoadSteps(std::FILE* fp)
+{
+  // Not part of Load(), but built on demand from a loaded map.
+  static const BSP::LoadStep on_demand_steps[] = {
+    {"CreatePatchCollision", 0, [](BSP* bsp, BSP::IntermediateData*) { bsp->CreatePatchCollision(); }},
+    {"GeneratePortals", 0, [](BSP* bsp, BSP::IntermediateData*) { bsp->GeneratePortals(); }},
+  };
+
+  std::vector<const BSP::LoadStep*> steps;
+  for (const BSP::LoadStep& step : BSP::s_load_steps)
+    steps.push_back(&step);
+  for (const BSP::LoadStep& step : on_demand_steps)
+    steps.push_back(&step);
+
+  BSP::IntermediateData header;
+  if (!BSP::ReadHeader(fp, &header))
+    return;
+
+  std::unique_ptr<BSP> bsp;
+  BSP::IntermediateData idata;
+  for (size_t i = 0; i < steps.size(); i++)
+  {
+    // The steps before this one are setup, so each iteration starts from the state BSP::Load() would be in.
+    auto setup = [&steps, &bsp, &idata, fp, i]() {
+      bsp.reset(new BSP());
+      idata = BSP::IntermediateData();
+      BSP::ReadHeader(fp, &idata);
+      for (size_t j = 0; j < i; j++)
+        steps[j]->func(bsp.get(), &idata);
+    };
+
+    // Post-load steps read no lump, so report no throughput for them.
+    u64 bytes = 0;
+    for (u32 lump = 0; lump < BSP::NUM_LUMPS; lump++)
+    {
+      if (steps[i]->lump_mask & (1u << lump))
+        bytes += header.lumps[lump].length;
+    }
+
+    const std::string name = std::string("BSP::") + steps[i]->name;
+    Run(name.c_str(), 1, bytes, setup, [&steps, &bsp, &idata, i]() { steps[i]->func(bsp.get(), &idata); });
+  }
+}
+
+bool KernelBenchmarks::RunMap(const char* filename)
+{
+  auto fp = Util::FOpenUniquePtr(filename, "rb");
+  if (!fp)
+  {
+    std::fprintf(stderr, "Failed to open '%s'\n", filename);
+    return false;
+  }
+
+  std::unique_ptr<BSP> bsp = BSP::Load(fp.get());
+  if (!bsp)
+    return false;
+
+  std::fseek(fp.get(), 0, SEEK_END);
+  const u64 file_size = u64(std::ftell(fp.get()));
+  Run("BSP::Load", 1, file_size, nullptr, [&fp]() { s_sink = BSP::Load(fp.get())->GetFaceCount(); });
+  RunLoadSteps(fp.get());
+
+  // Points scattered through the world bounds, as in the query benchmark.
+  std::mt19937 rng(SEED);
+  const BSP::Node* root = bsp->GetRootNode();
+  std::uniform_real_distribution<float> x_dist(root->bbox_min.x, root->bbox_max.x);
+  std::uniform_real_distribution<float> y_dist(root->bbox_min.y, root->bbox_max.y);
+  std::uniform_real_distribution<float> z_dist(root->bbox_min.z, root->bbox_max.z);
+  std::vector<glm::vec3> positions(BATCH_SIZE);
+  for (glm::vec3& position : positions)
+    position = glm::vec3(x_dist(rng), y_dist(rng), z_dist(rng));
+
+  const BSP* bsp_ptr = bsp.get();
+  Run("BSP::FindLeafForPosition", BATCH_SIZE, BATCH_SIZE * sizeof(glm::vec3), nullptr, [bsp_ptr, &positions]() {
+    u64 sum = 0;
+    for (const glm::vec3& position : positions)
+      sum += bsp_ptr->FindLeafForPosition(position)->index;
+    s_sink = sum;
+  });
+
+  if (bsp->GetClusterCount() > 0)
+  {
+    std::uniform_int_distribution<s32> cluster_dist(0, s32(bsp->GetClusterCount()) - 1);
+    std::vector<std::pair<s32, s32>> cluster_pairs(BATCH_SIZE);
+    for (auto& [from, to] : cluster_pairs)
+    {
+      from = cluster_dist(rng);
+      to = cluster_dist(rng);
+    }
+
+    Run("BSP::IsClusterVisible", BATCH_SIZE, 0, nullptr, [bsp_ptr, &cluster_pairs]() {
+      u64 count = 0;
+      for (const auto& [from, to] : cluster_pairs)
+        count += u64(bsp_ptr->IsClusterVisible(from, to));
+      s_sink = count;
+    });
+  }
+
+  // The index buffer upload at the end of CreateRenderLeaves() needs GL, so only the per-leaf batching is timed.
+  BSPRenderer renderer(bsp_ptr);
+  const u32 num_leaves = u32(bsp->GetLeafCount());
+  Run("BSPRenderer::CreateRenderLeaves", num_leaves, bsp->GetLeafCount() * sizeof(BSP::Leaf), nullptr,
+      [&renderer, bsp_ptr, num_leaves]() {
+        std::vector<BSPRenderer::RenderLeaf> render_leaves;
+        std::vector<u32> indices;
+        for (u32 i = 0; i < num_leaves; i++)
+          render_leaves.push_back(renderer.CreateRenderLeaf(bsp_ptr->GetLeaf(i), indices));
+        s_sink = indices.size();
+      });
+
+  // Culling makes no GL calls either, so the whole visibility stage is timed from views placed in random clusters.
+  // Temporal coherence would hand back the previous list for a repeated view, and the static path needs no
+  // calibration, so each call culls the world from scratch.
+  std::vector<u32> indices;
+  renderer.BuildRenderLeaves(indices);
+  renderer.SetAllAreaPortalsOpen(true);
+  renderer.SetSubmitMode(BSPRenderer::SubmitMode::Static);
+  renderer.SetTemporalCoherenceEnabled(false);
+
+  std::vector<const BSP::Leaf*> view_leaves;
+  for (u32 i = 0; i < num_leaves; i++)
+  {
+    if (bsp->GetLeaf(i)->cluster >= 0)
+      view_leaves.push_back(bsp->GetLeaf(i));
+  }
+
+  if (!view_leaves.empty())
+  {
+    std::uniform_int_distribution<size_t> leaf_dist(0, view_leaves.size() - 1);
+    std::uniform_real_distribution<float> yaw_dist(0.0f, 360.0f);
+    std::vector<Camera> cameras(NUM_CULL_VIEWS);
+    for (Camera& camera : cameras)
+    {
+      const BSP::Leaf* leaf = view_leaves[leaf_dist(rng)];
+      camera.SetAspectRatio(CULL_VIEWPORT_WIDTH, CULL_VIEWPORT_HEIGHT);
+      camera.SetPosition((leaf->bbox_min + leaf->bbox_max) * 0.5f);
+      camera.SetYaw(yaw_dist(rng));
+    }
+
+    RenderList list;
+    Run("BSPRenderer::BuildRenderList", NUM_CULL_VIEWS, 0, nullptr, [&renderer, &cameras, &list]() {
+      u64 count = 0;
+      for (const Camera& camera : cameras)
+      {
+        renderer.BuildRenderList(camera, &list);
+        count += list.GetVisibleLeafCount();
+      }
+      s_sink = count;
+    });
+  }
+
+  return true;
+}
+
+void KernelBenchmarks::PrintResults() const
+{
+  std::printf("%-34s %8s %14s %14s %14s %10s %10s %12s\n", "benchmark", "iters", "ns/op", "min ns/op", "ops/s",
+              "MB/s", "allocs/op", "bytes/op");
+  for (const Result& result : m_results)
+  {
+    std::printf("%-34s %8u %14.2f %14.2f %14.0f %10.1f %10.2f %12.1f\n", result.name.c_str(), result.iterations,
+                result.ns_per_op, result.min_ns_per_op, result.ops_per_second, result.mb_per_second,
+                result.allocations_per_op, result.allocated_bytes_per_op);
+  }
+}
+
+bool KernelBenchmarks::WriteCSV(const char* filename) const
+{
+  auto fp = Util::FOpenUniquePtr(filename, "w");
+  if (!fp)
+  {
+    std::fprintf(stderr, "Failed to open '%s' for writing\n", filename);
+    return false;
+  }
+
+  // Columns are only ever appended, so scripts comparing runs keep working.
+  std::fprintf(fp.get(), "benchmark,iterations,ns_per_op,min_ns_per_op,ops_per_second,mb_per_second,"
+                         "allocations_per_op,allocated_bytes_per_op\n");
+  for (const Result& result : m_results)
+  {
+    std::fprintf(fp.get(), "%s,%u,%.3f,%.3f,%.1f,%.3f,%.4f,%.2f\n", result.name.c_str(), result.iterations,
+                 result.ns_per_op, result.min_ns_per_op, result.ops_per_second, result.mb_per_second,
+                 result.allocations_per_op, result.allocated_bytes_per_op);
+  }
+
+  if (std::ferror(fp.get()))
+  {
+    std::fprintf(stderr, "Failed to write '%s'\n", filename);
+    return false;
+  }
+
+  return true;
+}
+
+static void PrintUsage(const char* program_name)
+{
+  std::fprintf(stderr, "Usage: %s [options] [map.bsp]\n", program_name);
+  std::fprintf(stderr, "Without a map, only the kernels on synthetic data are run.\n");
+  std::fprintf(stderr, "Options:\n");
+  std::fprintf(stderr, "  --min-time <ms>       Minimum time to run each benchmark for (default: 250)\n");
+  std::fprintf(stderr, "  --filter <substring>  Only run benchmarks whose name contains this\n");
+  std::fprintf(stderr, "  --output <file.csv>   Write the results as CSV\n");
+}
+
+int main(int argc, char* argv[])
+{
+  const char* map_filename = nullptr;
+  const char* output_filename = nullptr;
+  const char* filter = nullptr;
+  double min_time_ms = 250.0;
+  for (int i = 1; i < argc; i++)
+  {
+    if (std::strcmp(argv[i], "--min-time") == 0 && (i + 1) < argc)
+      min_time_ms = std::strtod(argv[++i], nullptr);
+    else if (std::strcmp(argv[i], "--filter") == 0 && (i + 1) < argc)
+      filter = argv[++i];
+    else if (std::strcmp(argv[i], "--output") == 0 && (i + 1) < argc)
+      output_filename = argv[++i];
+    else if (argv[i][0] == '-')
+    {
+      PrintUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    else
+      map_filename = argv[i];
+  }
+
+  KernelBenchmarks benchmarks(min_time_ms, filter);
+  benchmarks.RunSynthetic();
+  if (map_filename && !benchmarks.RunMap(map_filename))
+    return EXIT_FAILURE;
+
+  benchmarks.PrintResults();
+  if (output_filename)
+  {
+    if (!benchmarks.WriteCSV(output_filename))
+      return EXIT_FAILURE;
+
+    std::printf("Wrote '%s'\n", output_filename);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,457 @@
+#include "pch.h"
+#include "bsp.h"
+#include "bsp_file.h"
+#include "util.h"
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+// Writes synthetic IBSP v46 maps of any size, for measuring how loading, culling and batching scale.
+// The world is a flat grid of square cells, one leaf each, split by an axis-aligned kd-tree. Each cell is tiled
+// with floor faces, some of which are bezier patches. Clusters are runs of consecutive leaves in tree order, so
+// they are spatially compact, and each cluster sees the clusters nearest to it in that order.
+class MapGenerator
+{
+public:
+  struct Options
+  {
+    u32 num_leaves = 1024;
+    u32 faces_per_leaf = 8;
+    float patch_fraction = 0.1f;
+    u32 num_lightmaps = 16;
+    u32 num_clusters = 256;
+    float pvs_density = 0.25f;
+    u32 num_textures = 16;
+    u32 seed = 1234;
+  };
+
+  MapGenerator(const Options& options);
+
+  void Generate();
+  bool Write(const char* filename) const;
+
+  void PrintSummary() const;
+
+private:
+  static constexpr s32 CELL_SIZE = 512;
+  static constexpr s32 CELL_HEIGHT = 256;
+  static constexpr s32 PATCH_BUMP_HEIGHT = 48;
+
+  // Lightmap pages are divided into square slots, one face per slot.
+  static constexpr u32 LIGHTMAP_SLOT_SIZE = 8;
+  static constexpr u32 LIGHTMAP_SLOTS_PER_ROW = BSP::LIGHTMAP_SIZE / LIGHTMAP_SLOT_SIZE;
+
+  // Returns the node or leaf child value for the cells in [x0, x1) x [y0, y1).
+  s32 BuildTree(u32 x0, u32 y0, u32 x1, u32 y1);
+  void CreateLeaf(u32 cell_x, u32 cell_y);
+  void CreateFace(const glm::ivec2& tile_min, s32 tile_size, bool patch);
+  void CreateLightmaps();
+  void CreateVisData();
+
+  BSP_VERTEX_LUMP MakeVertex(const glm::vec3& position, const glm::vec2& uv, const glm::vec2& lightmap_uv) const;
+
+  Options m_options;
+  std::mt19937 m_rng;
+  u32 m_grid_width = 0;
+  u32 m_grid_height = 0;
+  u32 m_num_patches = 0;
+
+  std::vector<BSP_PLANE_LUMP> m_planes;
+  std::vector<BSP_NODE_LUMP> m_nodes;
+  std::vector<BSP_LEAF_LUMP> m_leaves;
+  std::vector<int> m_leaf_faces;
+  std::vector<BSP_FACE_LUMP> m_faces;
+  std::vector<BSP_VERTEX_LUMP> m_vertices;
+  std::vector<int> m_indices;
+  std::vector<BSP_LIGHTMAP_LUMP> m_lightmaps;
+  std::vector<u8> m_visdata;
+};
+
+MapGenerator::MapGenerator(const Options& options) : m_options(options), m_rng(options.seed) {}
+
+void MapGenerator::Generate()
+{
+  // As square as possible, rounding the leaf count up to fill the grid. The loader expects the tree to have a root
+  // node, so main() asks for at least two leaves.
+  m_grid_width = std::max(u32(std::ceil(std::sqrt(double(m_options.num_leaves)))), 1u);
+  m_grid_height = std::max((m_options.num_leaves + m_grid_width - 1) / m_grid_width, 1u);
+  m_options.num_clusters = std::clamp(m_options.num_clusters, 1u, m_grid_width * m_grid_height);
+
+  CreateLightmaps();
+  BuildTree(0, 0, m_grid_width, m_grid_height);
+  CreateVisData();
+}
+
+s32 MapGenerator::BuildTree(u32 x0, u32 y0, u32 x1, u32 y1)
+{
+  if ((x1 - x0) == 1 && (y1 - y0) == 1)
+  {
+    CreateLeaf(x0, y0);
+    return -s32(m_leaves.size());
+  }
+
+  // Split the longer side in half. Front (children[0]) is the upper half.
+  const bool split_x = (x1 - x0) >= (y1 - y0);
+  const u32 split = split_x ? ((x0 + x1) / 2) : ((y0 + y1) / 2);
+  BSP_PLANE_LUMP plane = {};
+  plane.normal[split_x ? 0 : 1] = 1.0f;
+  plane.distance = float(s32(split) * CELL_SIZE);
+  m_planes.push_back(plane);
+
+  const size_t node_index = m_nodes.size();
+  m_nodes.emplace_back();
+  BSP_NODE_LUMP node = {};
+  node.plane = int(m_planes.size() - 1);
+  node.bbox_min[0] = s32(x0) * CELL_SIZE;
+  node.bbox_min[1] = s32(y0) * CELL_SIZE;
+  node.bbox_min[2] = 0;
+  node.bbox_max[0] = s32(x1) * CELL_SIZE;
+  node.bbox_max[1] = s32(y1) * CELL_SIZE;
+  node.bbox_max[2] = CELL_HEIGHT;
+  if (split_x)
+  {
+    node.children[1] = BuildTree(x0, y0, split, y1);
+    node.children[0] = BuildTree(split, y0, x1, y1);
+  }
+  else
+  {
+    node.children[1] = BuildTree(x0, y0, x1, split);
+    node.children[0] = BuildTree(x0, split, x1, y1);
+  }
+
+  m_nodes[node_index] = node;
+  return s32(node_index);
+}
+
+void MapGenerator::CreateLeaf(u32 cell_x, u32 cell_y)
+{
+  const u32 leaf_index = u32(m_leaves.size());
+  const u32 num_leaves = m_grid_width * m_grid_height;
+
+  BSP_LEAF_LUMP leaf = {};
+  leaf.cluster = int(u64(leaf_index) * m_options.num_clusters / num_leaves);
+  leaf.area = 0;
+  leaf.bbox_min[0] = s32(cell_x) * CELL_SIZE;
+  leaf.bbox_min[1] = s32(cell_y) * CELL_SIZE;
+  leaf.bbox_min[2] = 0;
+  leaf.bbox_max[0] = leaf.bbox_min[0] + CELL_SIZE;
+  leaf.bbox_max[1] = leaf.bbox_min[1] + CELL_SIZE;
+  leaf.bbox_max[2] = CELL_HEIGHT;
+  leaf.first_leaf_face = int(m_leaf_faces.size());
+  leaf.num_leaf_faces = int(m_options.faces_per_leaf);
+
+  // Faces tile the floor of the cell.
+  const u32 tiles_per_side = std::max(u32(std::ceil(std::sqrt(double(m_options.faces_per_leaf)))), 1u);
+  const s32 tile_size = CELL_SIZE / s32(tiles_per_side);
+  std::uniform_real_distribution<float> patch_dist(0.0f, 1.0f);
+  for (u32 i = 0; i < m_options.faces_per_leaf; i++)
+  {
+    const glm::ivec2 tile_min(leaf.bbox_min[0] + s32(i % tiles_per_side) * tile_size,
+                              leaf.bbox_min[1] + s32(i / tiles_per_side) * tile_size);
+    m_leaf_faces.push_back(int(m_faces.size()));
+    CreateFace(tile_min, tile_size, patch_dist(m_rng) < m_options.patch_fraction);
+  }
+
+  m_leaves.push_back(leaf);
+}
+
+BSP_VERTEX_LUMP MapGenerator::MakeVertex(const glm::vec3& position, const glm::vec2& uv,
+                                         const glm::vec2& lightmap_uv) const
+{
+  BSP_VERTEX_LUMP vertex = {};
+  vertex.position[0] = position.x;
+  vertex.position[1] = position.y;
+  vertex.position[2] = position.z;
+  vertex.texcoords[0][0] = uv.x;
+  vertex.texcoords[0][1] = uv.y;
+  vertex.texcoords[1][0] = lightmap_uv.x;
+  vertex.texcoords[1][1] = lightmap_uv.y;
+  vertex.normal[2] = 1.0f;
+  std::memset(vertex.color, 0xFF, sizeof(vertex.color));
+  return vertex;
+}
+
+void MapGenerator::CreateFace(const glm::ivec2& tile_min, s32 tile_size, bool patch)
+{
+  const u32 face_index = u32(m_faces.size());
+
+  // The distribution needs a non-empty range, so maps without textures don't construct it.
+  BSP_FACE_LUMP face = {};
+  face.texture_index = -1;
+  if (m_options.num_textures > 0)
+    face.texture_index = std::uniform_int_distribution<int>(0, int(m_options.num_textures) - 1)(m_rng);
+  face.effect_index = -1;
+  face.first_vertex = int(m_vertices.size());
+  face.normal[2] = 1.0f;
+
+  // Lightmaps are handed out round-robin, so faces next to each other use different pages.
+  face.lightmap_index = -1;
+  glm::vec2 lightmap_min(0.0f), lightmap_extent(0.0f);
+  if (m_options.num_lightmaps > 0)
+  {
+    const u32 slot = (face_index / m_options.num_lightmaps) % (LIGHTMAP_SLOTS_PER_ROW * LIGHTMAP_SLOTS_PER_ROW);
+    face.lightmap_index = int(face_index % m_options.num_lightmaps);
+    face.lightmap_corner[0] = int((slot % LIGHTMAP_SLOTS_PER_ROW) * LIGHTMAP_SLOT_SIZE);
+    face.lightmap_corner[1] = int((slot / LIGHTMAP_SLOTS_PER_ROW) * LIGHTMAP_SLOT_SIZE);
+    face.lightmap_size[0] = int(LIGHTMAP_SLOT_SIZE);
+    face.lightmap_size[1] = int(LIGHTMAP_SLOT_SIZE);
+    face.lightmap_origin[0] = float(tile_min.x);
+    face.lightmap_origin[1] = float(tile_min.y);
+    face.lightmap_vecs[0][0] = float(tile_size) / float(LIGHTMAP_SLOT_SIZE - 1);
+    face.lightmap_vecs[1][1] = float(tile_size) / float(LIGHTMAP_SLOT_SIZE - 1);
+
+    // Texel centres of the slot.
+    lightmap_min = (glm::vec2(float(face.lightmap_corner[0]), float(face.lightmap_corner[1])) + 0.5f) /
+                   float(BSP::LIGHTMAP_SIZE);
+    lightmap_extent = glm::vec2(float(LIGHTMAP_SLOT_SIZE - 1) / float(BSP::LIGHTMAP_SIZE));
+  }
+
+  // Walking +Y then +X is clockwise seen from above, which faces up.
+  const glm::vec2 origin(tile_min);
+  const float size = float(tile_size);
+  if (patch)
+  {
+    // 3x3 control points, rows along +Y and columns along +X, bulging up in the middle.
+    face.type = BSP::FACE_TYPE_PATCH;
+    face.num_vertices = 9;
+    face.patch_size[0] = 3;
+    face.patch_size[1] = 3;
+    for (u32 row = 0; row < 3; row++)
+    {
+      for (u32 column = 0; column < 3; column++)
+      {
+        const glm::vec2 uv(float(column) * 0.5f, float(row) * 0.5f);
+        const float height = (row == 1 && column == 1) ? float(PATCH_BUMP_HEIGHT) : 0.0f;
+        m_vertices.push_back(
+          MakeVertex(glm::vec3(origin + uv * size, height), uv, lightmap_min + uv * lightmap_extent));
+      }
+    }
+
+    m_num_patches++;
+  }
+  else
+  {
+    static constexpr glm::vec2 corners[4] = {{0.0f, 0.0f}, {0.0f, 1.0f}, {1.0f, 1.0f}, {1.0f, 0.0f}};
+    static constexpr int corner_indices[6] = {0, 1, 2, 2, 3, 0};
+
+    face.type = BSP::FACE_TYPE_BRUSH;
+    face.num_vertices = 4;
+    face.first_mesh_vertex = int(m_indices.size());
+    face.num_mesh_vertices = 6;
+    for (const glm::vec2& corner : corners)
+    {
+      m_vertices.push_back(
+        MakeVertex(glm::vec3(origin + corner * size, 0.0f), corner, lightmap_min + corner * lightmap_extent));
+    }
+    m_indices.insert(m_indices.end(), std::begin(corner_indices), std::end(corner_indices));
+  }
+
+  m_faces.push_back(face);
+}
+
+void MapGenerator::CreateLightmaps()
+{
+  // A different smooth gradient per page, so pages are distinguishable when drawn.
+  std::uniform_int_distribution<u32> tint_dist(64, 255);
+  m_lightmaps.resize(m_options.num_lightmaps);
+  for (BSP_LIGHTMAP_LUMP& lightmap : m_lightmaps)
+  {
+    const u32 tint[3] = {tint_dist(m_rng), tint_dist(m_rng), tint_dist(m_rng)};
+    for (u32 y = 0; y < BSP::LIGHTMAP_SIZE; y++)
+    {
+      for (u32 x = 0; x < BSP::LIGHTMAP_SIZE; x++)
+      {
+        const u32 brightness = 96 + (x + y) * 64 / (BSP::LIGHTMAP_SIZE * 2);
+        for (u32 c = 0; c < 3; c++)
+          lightmap.data[y][x][c] = u8(brightness * tint[c] / 255 / 4);
+      }
+    }
+  }
+}
+
+void MapGenerator::CreateVisData()
+{
+  // Each cluster sees a window of clusters around itself, of the size the density asks for. The window is shifted
+  // to stay inside the cluster range, so clusters near either end see as many as those in the middle.
+  const u32 num_clusters = m_options.num_clusters;
+  const u32 bytes_per_cluster = (num_clusters + 7) / 8;
+  const u32 num_visible =
+    std::clamp(u32(std::lround(std::clamp(m_options.pvs_density, 0.0f, 1.0f) * float(num_clusters))), 1u,
+               num_clusters);
+
+  m_visdata.assign(8 + size_t(num_clusters) * bytes_per_cluster, 0);
+  std::memcpy(&m_visdata[0], &num_clusters, sizeof(num_clusters));
+  std::memcpy(&m_visdata[4], &bytes_per_cluster, sizeof(bytes_per_cluster));
+  for (u32 from = 0; from < num_clusters; from++)
+  {
+    u8* row = &m_visdata[8 + size_t(from) * bytes_per_cluster];
+    const u32 before = (num_visible - 1) / 2;
+    const u32 first = std::min((from > before) ? (from - before) : 0, num_clusters - num_visible);
+    for (u32 to = first; to < first + num_visible; to++)
+      row[to / 8] |= u8(1u << (to % 8));
+  }
+}
+
+bool MapGenerator::Write(const char* filename) const
+{
+  std::vector<BSP_TEXTURE_LUMP> textures(m_options.num_textures);
+  for (u32 i = 0; i < m_options.num_textures; i++)
+  {
+    std::snprintf(textures[i].name, sizeof(textures[i].name), "textures/bspgen/texture%u", i);
+    textures[i].contents_flags = BSP::CONTENTS_SOLID;
+  }
+
+  BSP_MODEL_LUMP world = {};
+  world.bbox_max[0] = float(s32(m_grid_width) * CELL_SIZE);
+  world.bbox_max[1] = float(s32(m_grid_height) * CELL_SIZE);
+  world.bbox_max[2] = float(CELL_HEIGHT);
+  world.num_faces = int(m_faces.size());
+
+  // The player starts above the first cell.
+  const std::string entities =
+    Util::StringFromFormat("{\n\"classname\" \"worldspawn\"\n}\n"
+                           "{\n\"classname\" \"info_player_start\"\n\"origin\" \"%d %d %d\"\n}\n",
+                           CELL_SIZE / 2, CELL_SIZE / 2, CELL_HEIGHT / 2);
+
+  struct LumpData
+  {
+    const void* data;
+    size_t size;
+  };
+
+  LumpData lumps[BSP::NUM_LUMPS] = {};
+  lumps[BSP::LUMP_ENTITIES] = {entities.c_str(), entities.size() + 1};
+  lumps[BSP::LUMP_TEXTURES] = {textures.data(), textures.size() * sizeof(BSP_TEXTURE_LUMP)};
+  lumps[BSP::LUMP_PLANES] = {m_planes.data(), m_planes.size() * sizeof(BSP_PLANE_LUMP)};
+  lumps[BSP::LUMP_NODES] = {m_nodes.data(), m_nodes.size() * sizeof(BSP_NODE_LUMP)};
+  lumps[BSP::LUMP_LEAVES] = {m_leaves.data(), m_leaves.size() * sizeof(BSP_LEAF_LUMP)};
+  lumps[BSP::LUMP_LEAF_FACES] = {m_leaf_faces.data(), m_leaf_faces.size() * sizeof(int)};
+  lumps[BSP::LUMP_MODELS] = {&world, sizeof(world)};
+  lumps[BSP::LUMP_VERTICES] = {m_vertices.data(), m_vertices.size() * sizeof(BSP_VERTEX_LUMP)};
+  lumps[BSP::LUMP_MESH_VERTICES] = {m_indices.data(), m_indices.size() * sizeof(int)};
+  lumps[BSP::LUMP_FACES] = {m_faces.data(), m_faces.size() * sizeof(BSP_FACE_LUMP)};
+  lumps[BSP::LUMP_LIGHTMAPS] = {m_lightmaps.data(), m_lightmaps.size() * sizeof(BSP_LIGHTMAP_LUMP)};
+  lumps[BSP::LUMP_VISDATA] = {m_visdata.data(), m_visdata.size()};
+
+  // Lumps follow the header in order, each starting on a 4 byte boundary.
+  BSP_HEADER header = {};
+  std::memcpy(header.magic, "IBSP", sizeof(header.magic));
+  header.version = 46;
+  size_t offset = sizeof(header);
+  for (u32 i = 0; i < BSP::NUM_LUMPS; i++)
+  {
+    if (offset + lumps[i].size > size_t(std::numeric_limits<int>::max()))
+    {
+      std::fprintf(stderr, "Map is too large for the BSP format\n");
+      return false;
+    }
+
+    header.lumps[i].offset = int(offset);
+    header.lumps[i].length = int(lumps[i].size);
+    offset = (offset + lumps[i].size + 3) & ~size_t(3);
+  }
+
+  auto fp = Util::FOpenUniquePtr(filename, "wb");
+  if (!fp)
+  {
+    std::fprintf(stderr, "Failed to open '%s' for writing\n", filename);
+    return false;
+  }
+
+  static constexpr u8 padding[3] = {};
+  bool result = (std::fwrite(&header, sizeof(header), 1, fp.get()) == 1);
+  for (u32 i = 0; i < BSP::NUM_LUMPS && result; i++)
+  {
+    result &= (lumps[i].size == 0 || std::fwrite(lumps[i].data, lumps[i].size, 1, fp.get()) == 1);
+    const size_t padding_size = ((lumps[i].size + 3) & ~size_t(3)) - lumps[i].size;
+    result &= (padding_size == 0 || std::fwrite(padding, padding_size, 1, fp.get()) == 1);
+  }
+
+  if (!result)
+  {
+    std::fprintf(stderr, "Failed to write '%s'\n", filename);
+    return false;
+  }
+
+  return true;
+}
+
+void MapGenerator::PrintSummary() const
+{
+  std::printf("%u leaves (%ux%u), %u nodes, %u faces (%u patches), %u vertices, %u indices\n", u32(m_leaves.size()),
+              m_grid_width, m_grid_height, u32(m_nodes.size()), u32(m_faces.size()), m_num_patches,
+              u32(m_vertices.size()), u32(m_indices.size()));
+  // Count the bits that were set, so the figure includes the rounding to whole clusters.
+  u64 num_visible = 0;
+  for (size_t i = 8; i < m_visdata.size(); i++)
+  {
+    for (u8 bits = m_visdata[i]; bits != 0; bits &= u8(bits - 1))
+      num_visible++;
+  }
+
+  const u64 num_pairs = u64(m_options.num_clusters) * u64(m_options.num_clusters);
+  std::printf("%u textures, %u lightmaps, %u clusters, %.1f%% PVS density\n", m_options.num_textures,
+              m_options.num_lightmaps, m_options.num_clusters, 100.0 * double(num_visible) / double(num_pairs));
+}
+
+static void PrintUsage(const char* program_name)
+{
+  std::fprintf(stderr, "Usage: %s [options] <output.bsp>\n", program_name);
+  std::fprintf(stderr, "Options:\n");
+  std::fprintf(stderr, "  --leaves <count>          Leaves, at least 2, rounded up to a square grid (default: 1024)\n");
+  std::fprintf(stderr, "  --faces-per-leaf <count>  Faces in each leaf (default: 8)\n");
+  std::fprintf(stderr, "  --patches <fraction>      Fraction of faces which are bezier patches (default: 0.1)\n");
+  std::fprintf(stderr, "  --lightmaps <count>       Lightmap pages, 0 for none (default: 16)\n");
+  std::fprintf(stderr, "  --clusters <count>        Vis clusters, at most one per leaf (default: 256)\n");
+  std::fprintf(stderr, "  --pvs-density <fraction>  Fraction of clusters visible from each cluster (default: 0.25)\n");
+  std::fprintf(stderr, "  --textures <count>        Distinct textures (default: 16)\n");
+  std::fprintf(stderr, "  --seed <value>            Random seed for texture and patch assignment (default: 1234)\n");
+}
+
+int main(int argc, char* argv[])
+{
+  const char* output_filename = nullptr;
+  MapGenerator::Options options;
+  for (int i = 1; i < argc; i++)
+  {
+    if (std::strcmp(argv[i], "--leaves") == 0 && (i + 1) < argc)
+      options.num_leaves = std::max(u32(std::strtoul(argv[++i], nullptr, 10)), 2u);
+    else if (std::strcmp(argv[i], "--faces-per-leaf") == 0 && (i + 1) < argc)
+      options.faces_per_leaf = u32(std::strtoul(argv[++i], nullptr, 10));
+    else if (std::strcmp(argv[i], "--patches") == 0 && (i + 1) < argc)
+      options.patch_fraction = std::strtof(argv[++i], nullptr);
+    else if (std::strcmp(argv[i], "--lightmaps") == 0 && (i + 1) < argc)
+      options.num_lightmaps = u32(std::strtoul(argv[++i], nullptr, 10));
+    else if (std::strcmp(argv[i], "--clusters") == 0 && (i + 1) < argc)
+      options.num_clusters = u32(std::strtoul(argv[++i], nullptr, 10));
+    else if (std::strcmp(argv[i], "--pvs-density") == 0 && (i + 1) < argc)
+      options.pvs_density = std::strtof(argv[++i], nullptr);
+    else if (std::strcmp(argv[i], "--textures") == 0 && (i + 1) < argc)
+      options.num_textures = u32(std::strtoul(argv[++i], nullptr, 10));
+    else if (std::strcmp(argv[i], "--seed") == 0 && (i + 1) < argc)
+      options.seed = u32(std::strtoul(argv[++i], nullptr, 10));
+    else if (argv[i][0] == '-')
+    {
+      PrintUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    else
+      output_filename = argv[i];
+  }
+
+  if (!output_filename)
+  {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  MapGenerator generator(options);
+  generator.Generate();
+  generator.PrintSummary();
+  if (!generator.Write(output_filename))
+    return EXIT_FAILURE;
+
+  std::printf("Wrote '%s'\n", output_filename);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,501 @@
+#include "pch.h"
+#include "bsp.h"
+#include "bsp_file.h"
+#include "thread_pool.h"
+#include "util.h"
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Reports the size and shape of BSP files without creating a GL context, to find maps likely to render slowly.
+// Given a single map, prints a detailed report. Given several maps or directories, loads them in parallel and
+// prints one line per map. Either way, --json writes everything to a file.
+
+// Per-vertex size of BSPRenderer's vertex buffer: position, two texture coordinates, normal and RGBA8 colour.
+static constexpr u64 GPU_VERTEX_SIZE = sizeof(float) * 10 + 4;
+
+// Lightmaps are uploaded as RGB8, which drivers generally pad to four bytes per texel.
+static constexpr u64 GPU_LIGHTMAP_SIZE = u64(BSP::LIGHTMAP_SIZE) * BSP::LIGHTMAP_SIZE * 4;
+
+// BSPRenderer's dynamic index buffer holds this many copies of every renderable face's indices.
+static constexpr u64 GPU_DYNAMIC_INDEX_SEGMENTS = 3;
+
+static const char* s_lump_names[BSP::NUM_LUMPS] = {
+  "entities", "textures", "planes",       "nodes",   "leaves",  "leaf_faces", "leaf_brushes", "models",  "brushes",
+  "brush_sides", "vertices", "mesh_vertices", "effects", "faces", "lightmaps", "lightvols",     "visdata"};
+
+struct MapInfo
+{
+  std::string filename;
+  bool loaded = false;
+  u64 file_size = 0;
+  u32 lump_sizes[BSP::NUM_LUMPS] = {};
+
+  std::vector<BSP::LoadPhase> load_phases;
+  float load_ms = 0.0f;
+
+  u32 num_textures = 0;
+  u32 num_lightmaps = 0;
+  u32 num_vertices = 0;
+  u32 num_indices = 0;
+  u32 num_nodes = 0;
+  u32 num_leaves = 0;
+  u32 num_empty_leaves = 0;
+  u32 num_brushes = 0;
+  u32 num_models = 0;
+  u32 num_entities = 0;
+  u32 num_faces_by_type[4] = {};
+
+  // Triangles of renderable faces, counting each face once.
+  u64 num_triangles = 0;
+  u64 num_patch_triangles = 0;
+
+  // Clusters, and the average fraction of them visible from each. 1 for maps without visdata.
+  u32 num_clusters = 0;
+  bool has_visdata = false;
+  float pvs_density = 1.0f;
+
+  // Draws BSPRenderer makes for each leaf, one per texture/effect/lightmap combination.
+  u64 num_leaf_batches = 0;
+  u32 max_leaf_batches = 0;
+
+  // Faces are listed in every leaf they touch, so the same face can be referenced many times.
+  u64 num_leaf_face_refs = 0;
+  u32 num_referenced_faces = 0;
+  u32 num_shared_faces = 0;
+
+  u64 gpu_vertex_bytes = 0;
+  u64 gpu_index_bytes = 0;
+  u64 gpu_dynamic_index_bytes = 0;
+  u64 gpu_lightmap_bytes = 0;
+
+  float GetAverageLeafBatches() const { return num_leaves ? float(num_leaf_batches) / float(num_leaves) : 0.0f; }
+  u64 GetDuplicateFaceRefs() const { return num_leaf_face_refs - num_referenced_faces; }
+  u64 GetGPUBytes() const
+  {
+    return gpu_vertex_bytes + gpu_index_bytes + gpu_dynamic_index_bytes + gpu_lightmap_bytes;
+  }
+};
+
+static bool IsRenderable(const BSP::Face& face)
+{
+  return (face.num_indices > 0);
+}
+
+static bool ReadLumpSizes(std::FILE* fp, MapInfo* info)
+{
+  BSP_HEADER header;
+  if (std::fseek(fp, 0, SEEK_END) != 0)
+    return false;
+
+  info->file_size = u64(std::ftell(fp));
+  if (std::fseek(fp, 0, SEEK_SET) != 0 || std::fread(&header, sizeof(header), 1, fp) != 1)
+    return false;
+
+  for (u32 i = 0; i < BSP::NUM_LUMPS; i++)
+    info->lump_sizes[i] = u32(std::max(header.lumps[i].length, 0));
+
+  return true;
+}
+
+static void AnalyseGeometry(const BSP& bsp, MapInfo* info)
+{
+  info->num_textures = u32(bsp.GetTextureCount());
+  info->num_lightmaps = u32(bsp.GetLightMapCount());
+  info->num_vertices = u32(bsp.GetVertexCount());
+  info->num_indices = u32(bsp.GetIndexCount());
+  info->num_nodes = u32(bsp.GetNodeCount());
+  info->num_leaves = u32(bsp.GetLeafCount());
+  info->num_brushes = u32(bsp.GetBrushCount());
+  info->num_models = u32(bsp.GetModelCount());
+  info->num_entities = u32(bsp.GetEntityCount());
+
+  u64 renderable_indices = 0;
+  for (const BSP::Face& face : bsp.GetFaces())
+  {
+    if (u32(face.type) < ARRAY_SIZE(info->num_faces_by_type))
+      info->num_faces_by_type[face.type]++;
+    if (!IsRenderable(face))
+      continue;
+
+    renderable_indices += u64(face.num_indices);
+    info->num_triangles += u64(face.num_indices / 3);
+    if (face.type == BSP::FACE_TYPE_PATCH)
+      info->num_patch_triangles += u64(face.num_indices / 3);
+  }
+
+  info->gpu_vertex_bytes = u64(info->num_vertices) * GPU_VERTEX_SIZE;
+  info->gpu_dynamic_index_bytes = renderable_indices * sizeof(u32) * GPU_DYNAMIC_INDEX_SEGMENTS;
+  info->gpu_lightmap_bytes = u64(info->num_lightmaps) * GPU_LIGHTMAP_SIZE;
+}
+
+static void AnalyseLeaves(const BSP& bsp, MapInfo* info)
+{
+  struct BatchKey
+  {
+    int texture_index;
+    int effect_index;
+    int lightmap_index;
+  };
+
+  std::vector<u32> face_ref_counts(bsp.GetFaceCount(), 0);
+  std::vector<BatchKey> batches;
+  for (const BSP::Leaf& leaf : bsp.GetLeaves())
+  {
+    if (leaf.faces.empty())
+      info->num_empty_leaves++;
+
+    // Matches the merging in BSPRenderer::CreateRenderLeaf(). Leaves only hold a handful of faces.
+    batches.clear();
+    for (const u32 face_index : leaf.faces)
+    {
+      const BSP::Face& face = *bsp.GetFace(face_index);
+      face_ref_counts[face_index]++;
+      if (!IsRenderable(face))
+        continue;
+
+      info->gpu_index_bytes += u64(face.num_indices) * sizeof(u32);
+      const auto it = std::find_if(batches.begin(), batches.end(), [&face](const BatchKey& key) {
+        return (key.texture_index == face.texture_index && key.effect_index == face.effect_index &&
+                key.lightmap_index == face.lightmap_index);
+      });
+      if (it == batches.end())
+        batches.push_back({face.texture_index, face.effect_index, face.lightmap_index});
+    }
+
+    info->num_leaf_face_refs += u64(leaf.faces.size());
+    info->num_leaf_batches += u64(batches.size());
+    info->max_leaf_batches = std::max(info->max_leaf_batches, u32(batches.size()));
+  }
+
+  for (const u32 count : face_ref_counts)
+  {
+    info->num_referenced_faces += (count > 0) ? 1 : 0;
+    info->num_shared_faces += (count > 1) ? 1 : 0;
+  }
+}
+
+static void AnalyseVisibility(const BSP& bsp, MapInfo* info)
+{
+  info->num_clusters = bsp.GetClusterCount();
+  info->has_visdata = bsp.HasVisData();
+  if (!info->has_visdata || info->num_clusters == 0)
+    return;
+
+  u64 num_visible = 0;
+  std::vector<u64> row(bsp.GetPVSRowSize());
+  for (u32 cluster = 0; cluster < info->num_clusters; cluster++)
+  {
+    bsp.GetPVSRow(s32(cluster), row.data());
+    for (u32 i = 0; i < info->num_clusters; i++)
+      num_visible += (row[i / 64] >> (i % 64)) & 1;
+  }
+
+  info->pvs_density = float(double(num_visible) / (double(info->num_clusters) * double(info->num_clusters)));
+}
+
+static void AnalyseMap(MapInfo* info)
+{
+  auto fp = Util::FOpenUniquePtr(info->filename.c_str(), "rb");
+  if (!fp)
+  {
+    std::fprintf(stderr, "Failed to open '%s'\n", info->filename.c_str());
+    return;
+  }
+
+  if (!ReadLumpSizes(fp.get(), info))
+  {
+    std::fprintf(stderr, "Failed to read header of '%s'\n", info->filename.c_str());
+    return;
+  }
+
+  std::unique_ptr<BSP> bsp = BSP::Load(fp.get(), &info->load_phases);
+  if (!bsp)
+  {
+    std::fprintf(stderr, "Failed to load '%s'\n", info->filename.c_str());
+    return;
+  }
+
+  for (const BSP::LoadPhase& phase : info->load_phases)
+    info->load_ms += phase.time_ms;
+
+  AnalyseGeometry(*bsp, info);
+  AnalyseLeaves(*bsp, info);
+  AnalyseVisibility(*bsp, info);
+  info->loaded = true;
+}
+
+static float ToMB(u64 bytes)
+{
+  return float(double(bytes) / 1048576.0);
+}
+
+static void PrintMapInfo(const MapInfo& info)
+{
+  std::printf("%s: %.2f MB\n", info.filename.c_str(), ToMB(info.file_size));
+  std::printf("\nLumps:\n");
+  for (u32 i = 0; i < BSP::NUM_LUMPS; i++)
+    std::printf("  %-14s %12u bytes\n", s_lump_names[i], info.lump_sizes[i]);
+
+  std::printf("\nLoad phases:\n");
+  for (const BSP::LoadPhase& phase : info.load_phases)
+    std::printf("  %-22s %10.3f ms\n", phase.name, phase.time_ms);
+  std::printf("  %-22s %10.3f ms\n", "total", info.load_ms);
+
+  std::printf("\nGeometry:\n");
+  std::printf("  vertices               %u (including tesselated patches)\n", info.num_vertices);
+  std::printf("  indices                %u\n", info.num_indices);
+  std::printf("  faces                  %u brush, %u patch, %u mesh, %u billboard/other\n",
+              info.num_faces_by_type[BSP::FACE_TYPE_BRUSH], info.num_faces_by_type[BSP::FACE_TYPE_PATCH],
+              info.num_faces_by_type[BSP::FACE_TYPE_MESH], info.num_faces_by_type[BSP::FACE_TYPE_NONE]);
+  std::printf("  triangles              %llu (%llu from patches)\n",
+              static_cast<unsigned long long>(info.num_triangles),
+              static_cast<unsigned long long>(info.num_patch_triangles));
+  std::printf("  textures               %u\n", info.num_textures);
+  std::printf("  lightmaps              %u\n", info.num_lightmaps);
+  std::printf("  brushes                %u\n", info.num_brushes);
+  std::printf("  models                 %u\n", info.num_models);
+  std::printf("  entities               %u\n", info.num_entities);
+
+  std::printf("\nTree and visibility:\n");
+  std::printf("  nodes                  %u\n", info.num_nodes);
+  std::printf("  leaves                 %u (%u without faces)\n", info.num_leaves, info.num_empty_leaves);
+  if (info.has_visdata)
+    std::printf("  clusters               %u, %.1f%% PVS density\n", info.num_clusters, info.pvs_density * 100.0f);
+  else
+    std::printf("  clusters               %u, no visdata\n", info.num_clusters);
+  std::printf("  batches per leaf       %.2f average, %u max\n", info.GetAverageLeafBatches(), info.max_leaf_batches);
+  std::printf("  leaf face references   %llu, %llu duplicates, %u faces in more than one leaf\n",
+              static_cast<unsigned long long>(info.num_leaf_face_refs),
+              static_cast<unsigned long long>(info.GetDuplicateFaceRefs()), info.num_shared_faces);
+
+  std::printf("\nEstimated GPU memory, excluding textures:\n");
+  std::printf("  vertex buffer          %10.2f MB\n", ToMB(info.gpu_vertex_bytes));
+  std::printf("  index buffer           %10.2f MB\n", ToMB(info.gpu_index_bytes));
+  std::printf("  dynamic index buffer   %10.2f MB\n", ToMB(info.gpu_dynamic_index_bytes));
+  std::printf("  lightmaps              %10.2f MB\n", ToMB(info.gpu_lightmap_bytes));
+  std::printf("  total                  %10.2f MB\n", ToMB(info.GetGPUBytes()));
+}
+
+static void PrintSummaryTable(const std::vector<MapInfo>& maps)
+{
+  std::printf("%-32s %9s %9s %10s %8s %8s %7s %9s %9s %8s\n", "map", "load ms", "vertices", "triangles", "leaves",
+              "clusters", "pvs %", "batch/lf", "dup refs", "gpu MB");
+  for (const MapInfo& info : maps)
+  {
+    const std::string name = std::filesystem::path(info.filename).filename().string();
+    if (!info.loaded)
+    {
+      std::printf("%-32s failed to load\n", name.c_str());
+      continue;
+    }
+
+    std::printf("%-32s %9.2f %9u %10llu %8u %8u %7.1f %9.2f %9llu %8.2f\n", name.c_str(), info.load_ms,
+                info.num_vertices, static_cast<unsigned long long>(info.num_triangles), info.num_leaves,
+                info.num_clusters, info.pvs_density * 100.0f, info.GetAverageLeafBatches(),
+                static_cast<unsigned long long>(info.GetDuplicateFaceRefs()), ToMB(info.GetGPUBytes()));
+  }
+}
+
+static std::string EscapeJSON(const std::string& str)
+{
+  std::string ret;
+  ret.reserve(str.size());
+  for (const char ch : str)
+  {
+    if (ch == '"' || ch == '\\')
+    {
+      ret.push_back('\\');
+      ret.push_back(ch);
+    }
+    else if (static_cast<unsigned char>(ch) < 0x20)
+    {
+      ret += Util::StringFromFormat("\\u%04x", unsigned(static_cast<unsigned char>(ch)));
+    }
+    else
+    {
+      ret.push_back(ch);
+    }
+  }
+
+  return ret;
+}
+
+static void WriteMapJSON(std::FILE* fp, const MapInfo& info)
+{
+  std::fprintf(fp, "    {\n      \"file\": \"%s\",\n      \"loaded\": %s,\n      \"file_size\": %llu,\n",
+               EscapeJSON(info.filename).c_str(), info.loaded ? "true" : "false",
+               static_cast<unsigned long long>(info.file_size));
+  if (!info.loaded)
+  {
+    std::fprintf(fp, "      \"load_ms\": null\n    }");
+    return;
+  }
+
+  std::fprintf(fp, "      \"lumps\": {");
+  for (u32 i = 0; i < BSP::NUM_LUMPS; i++)
+    std::fprintf(fp, "%s\"%s\": %u", (i > 0) ? ", " : "", s_lump_names[i], info.lump_sizes[i]);
+  std::fprintf(fp, "},\n      \"load_ms\": %.4f,\n      \"load_phases\": {", info.load_ms);
+  for (size_t i = 0; i < info.load_phases.size(); i++)
+  {
+    std::fprintf(fp, "%s\"%s\": %.4f", (i > 0) ? ", " : "", info.load_phases[i].name, info.load_phases[i].time_ms);
+  }
+  std::fprintf(fp, "},\n");
+
+  std::fprintf(fp, "      \"vertices\": %u, \"indices\": %u, \"textures\": %u, \"lightmaps\": %u,\n",
+               info.num_vertices, info.num_indices, info.num_textures, info.num_lightmaps);
+  std::fprintf(fp, "      \"brush_faces\": %u, \"patch_faces\": %u, \"mesh_faces\": %u, \"other_faces\": %u,\n",
+               info.num_faces_by_type[BSP::FACE_TYPE_BRUSH], info.num_faces_by_type[BSP::FACE_TYPE_PATCH],
+               info.num_faces_by_type[BSP::FACE_TYPE_MESH], info.num_faces_by_type[BSP::FACE_TYPE_NONE]);
+  std::fprintf(fp, "      \"triangles\": %llu, \"patch_triangles\": %llu,\n",
+               static_cast<unsigned long long>(info.num_triangles),
+               static_cast<unsigned long long>(info.num_patch_triangles));
+  std::fprintf(fp, "      \"nodes\": %u, \"leaves\": %u, \"empty_leaves\": %u, \"brushes\": %u, \"models\": %u, "
+               "\"entities\": %u,\n",
+               info.num_nodes, info.num_leaves, info.num_empty_leaves, info.num_brushes, info.num_models,
+               info.num_entities);
+  std::fprintf(fp, "      \"clusters\": %u, \"has_visdata\": %s, \"pvs_density\": %.6f,\n", info.num_clusters,
+               info.has_visdata ? "true" : "false", info.pvs_density);
+  std::fprintf(fp, "      \"avg_leaf_batches\": %.4f, \"max_leaf_batches\": %u,\n", info.GetAverageLeafBatches(),
+               info.max_leaf_batches);
+  std::fprintf(fp, "      \"leaf_face_refs\": %llu, \"duplicate_face_refs\": %llu, \"shared_faces\": %u,\n",
+               static_cast<unsigned long long>(info.num_leaf_face_refs),
+               static_cast<unsigned long long>(info.GetDuplicateFaceRefs()), info.num_shared_faces);
+  std::fprintf(fp, "      \"gpu_bytes\": {\"vertices\": %llu, \"indices\": %llu, \"dynamic_indices\": %llu, "
+               "\"lightmaps\": %llu, \"total\": %llu}\n    }",
+               static_cast<unsigned long long>(info.gpu_vertex_bytes),
+               static_cast<unsigned long long>(info.gpu_index_bytes),
+               static_cast<unsigned long long>(info.gpu_dynamic_index_bytes),
+               static_cast<unsigned long long>(info.gpu_lightmap_bytes),
+               static_cast<unsigned long long>(info.GetGPUBytes()));
+}
+
+static bool WriteJSON(const char* filename, const std::vector<MapInfo>& maps)
+{
+  auto fp = Util::FOpenUniquePtr(filename, "w");
+  if (!fp)
+  {
+    std::fprintf(stderr, "Failed to open '%s' for writing\n", filename);
+    return false;
+  }
+
+  std::fprintf(fp.get(), "{\n  \"maps\": [\n");
+  for (size_t i = 0; i < maps.size(); i++)
+  {
+    WriteMapJSON(fp.get(), maps[i]);
+    std::fprintf(fp.get(), "%s\n", (i + 1) < maps.size() ? "," : "");
+  }
+  std::fprintf(fp.get(), "  ]\n}\n");
+
+  if (std::ferror(fp.get()))
+  {
+    std::fprintf(stderr, "Failed to write '%s'\n", filename);
+    return false;
+  }
+
+  return true;
+}
+
+// Expands directories to the .bsp files anywhere beneath them, in a stable order.
+static bool FindMaps(const char* path, std::vector<MapInfo>* maps)
+{
+  std::error_code ec;
+  if (!std::filesystem::is_directory(path, ec))
+  {
+    maps->emplace_back();
+    maps->back().filename = path;
+    return true;
+  }
+
+  std::vector<std::string> filenames;
+  for (auto it = std::filesystem::recursive_directory_iterator(path, ec);
+       !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec))
+  {
+    std::string extension = it->path().extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](char ch) { return char(std::tolower(static_cast<unsigned char>(ch))); });
+    if (it->is_regular_file(ec) && extension == ".bsp")
+      filenames.push_back(it->path().string());
+  }
+
+  if (ec)
+  {
+    std::fprintf(stderr, "Failed to list '%s': %s\n", path, ec.message().c_str());
+    return false;
+  }
+
+  std::sort(filenames.begin(), filenames.end());
+  for (std::string& filename : filenames)
+  {
+    maps->emplace_back();
+    maps->back().filename = std::move(filename);
+  }
+
+  return true;
+}
+
+static void PrintUsage(const char* program_name)
+{
+  std::fprintf(stderr, "Usage: %s [options] <map.bsp or directory>...\n", program_name);
+  std::fprintf(stderr, "Options:\n");
+  std::fprintf(stderr, "  --json <file>      Also write the results as JSON\n");
+  std::fprintf(stderr, "  --threads <count>  Maps to load at once, 0 for one per hardware thread (default: 0)\n");
+  std::fprintf(stderr, "Directories are searched recursively for .bsp files. With more than one map, load times\n");
+  std::fprintf(stderr, "include contention between the threads; use --threads 1 for comparable timings.\n");
+}
+
+int main(int argc, char* argv[])
+{
+  const char* json_filename = nullptr;
+  u32 num_threads = 0;
+  std::vector<MapInfo> maps;
+  for (int i = 1; i < argc; i++)
+  {
+    if (std::strcmp(argv[i], "--json") == 0 && (i + 1) < argc)
+    {
+      json_filename = argv[++i];
+    }
+    else if (std::strcmp(argv[i], "--threads") == 0 && (i + 1) < argc)
+    {
+      num_threads = u32(std::strtoul(argv[++i], nullptr, 10));
+    }
+    else if (argv[i][0] == '-')
+    {
+      PrintUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    else if (!FindMaps(argv[i], &maps))
+    {
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (maps.empty())
+  {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (maps.size() == 1)
+  {
+    AnalyseMap(&maps[0]);
+    if (maps[0].loaded)
+      PrintMapInfo(maps[0]);
+  }
+  else
+  {
+    // Load's own progress messages interleave between maps, the table at the end is the result.
+    g_thread_pool->Initialize(num_threads);
+    g_thread_pool->ParallelFor(u32(maps.size()), [&maps](u32 i) { AnalyseMap(&maps[i]); });
+    g_thread_pool->Shutdown();
+    std::printf("\n");
+    PrintSummaryTable(maps);
+  }
+
+  if (json_filename && !WriteJSON(json_filename, maps))
+    return EXIT_FAILURE;
+
+  const bool all_loaded =
+    std::all_of(maps.begin(), maps.end(), [](const MapInfo& info) { return info.loaded; });
+  return all_loaded ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,566 @@
+#include "pch.h"
+#include "bsp.h"
+#include "bsp_file.h"
+#include "util.h"
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Rewrites a BSP file with the same content laid out for faster loading and rendering:
+//  - Faces are reordered so each leaf's faces are adjacent, in leaf order, keeping each model's faces contiguous.
+//  - Vertices and mesh vertices are rewritten in face order, dropping any that no face references.
+//  - Identical lightmap pages are merged and unused pages dropped, so more faces share a lightmap and batch.
+//  - Optionally, patches are replaced by their tesselated triangles, removing that work from loading.
+// Lumps which don't reference faces, vertices or lightmaps are copied unchanged.
+class MapOptimizer
+{
+public:
+  struct Options
+  {
+    // Patches become triangle meshes. Engines which collide against patch control points, including the
+    // viewer's own traces, no longer collide with them.
+    bool tesselate_patches = false;
+  };
+
+  MapOptimizer(const BSP* bsp, const Options& options);
+
+  bool ReadLumps(std::FILE* fp);
+  bool Optimize();
+  bool Write(std::FILE* src_fp, std::FILE* dst_fp) const;
+
+  void PrintReport() const;
+
+private:
+  // How scattered each leaf's data is. Lower is better for both.
+  struct Locality
+  {
+    // Distinct 4 KB pages of the vertex lump touched by the faces of a leaf, on average.
+    float vertex_pages_per_leaf;
+
+    // Distance between the first and last face of a leaf, in faces, on average.
+    float face_span_per_leaf;
+  };
+
+  static constexpr u32 PAGE_SIZE = 4096;
+
+  template<typename T>
+  bool ReadLump(std::FILE* fp, const BSP_HEADER& header, BSP::LUMP lump, std::vector<T>* out) const;
+
+  bool OrderFaces();
+  bool CopyFaces();
+  void MergeLightmaps();
+  bool RemapLeafFaces();
+  void RemapModels();
+
+  Locality MeasureLocality(const std::vector<BSP_FACE_LUMP>& faces, const std::vector<u32>& face_remap) const;
+
+  static BSP_VERTEX_LUMP MakeVertex(const BSP::Vertex& vertex);
+
+  const BSP* m_bsp;
+  Options m_options;
+
+  // As read from the file.
+  std::vector<BSP_FACE_LUMP> m_in_faces;
+  std::vector<BSP_VERTEX_LUMP> m_in_vertices;
+  std::vector<int> m_in_mesh_vertices;
+  std::vector<int> m_in_leaf_faces;
+  std::vector<BSP_MODEL_LUMP> m_in_models;
+
+  // Old face index for each new face, and the reverse.
+  std::vector<u32> m_face_order;
+  std::vector<u32> m_face_remap;
+
+  std::vector<BSP_FACE_LUMP> m_faces;
+  std::vector<BSP_VERTEX_LUMP> m_vertices;
+  std::vector<int> m_mesh_vertices;
+  std::vector<BSP::LightMap> m_lightmaps;
+  std::vector<int> m_leaf_faces;
+  std::vector<BSP_MODEL_LUMP> m_models;
+
+  u32 m_num_tesselated_patches = 0;
+  u32 m_num_shared_vertex_ranges = 0;
+  Locality m_locality_before = {};
+  Locality m_locality_after = {};
+};
+
+MapOptimizer::MapOptimizer(const BSP* bsp, const Options& options) : m_bsp(bsp), m_options(options) {}
+
+template<typename T>
+bool MapOptimizer::ReadLump(std::FILE* fp, const BSP_HEADER& header, BSP::LUMP lump, std::vector<T>* out) const
+{
+  const BSP_LUMP& in = header.lumps[lump];
+  if (in.length < 0 || (u32(in.length) % sizeof(T)) != 0)
+  {
+    std::fprintf(stderr, "Lump %u has an invalid size\n", u32(lump));
+    return false;
+  }
+
+  out->resize(u32(in.length) / sizeof(T));
+  if (!out->empty() &&
+      (std::fseek(fp, in.offset, SEEK_SET) != 0 || std::fread(out->data(), sizeof(T), out->size(), fp) != out->size()))
+  {
+    std::fprintf(stderr, "Failed to read lump %u\n", u32(lump));
+    return false;
+  }
+
+  return true;
+}
+
+bool MapOptimizer::ReadLumps(std::FILE* fp)
+{
+  BSP_HEADER header;
+  if (std::fseek(fp, 0, SEEK_SET) != 0 || std::fread(&header, sizeof(header), 1, fp) != 1)
+  {
+    std::fprintf(stderr, "Failed to read BSP header\n");
+    return false;
+  }
+
+  if (!ReadLump(fp, header, BSP::LUMP_FACES, &m_in_faces) ||
+      !ReadLump(fp, header, BSP::LUMP_VERTICES, &m_in_vertices) ||
+      !ReadLump(fp, header, BSP::LUMP_MESH_VERTICES, &m_in_mesh_vertices) ||
+      !ReadLump(fp, header, BSP::LUMP_LEAF_FACES, &m_in_leaf_faces) ||
+      !ReadLump(fp, header, BSP::LUMP_MODELS, &m_in_models))
+  {
+    return false;
+  }
+
+  // Load() has already validated the file, but it doesn't need every face's vertex range to be valid.
+  for (size_t i = 0; i < m_in_faces.size(); i++)
+  {
+    const BSP_FACE_LUMP& face = m_in_faces[i];
+    if (face.first_vertex < 0 || face.num_vertices < 0 ||
+        size_t(face.first_vertex) + size_t(face.num_vertices) > m_in_vertices.size())
+    {
+      std::fprintf(stderr, "Face %u has out-of-range vertices\n", u32(i));
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool MapOptimizer::Optimize()
+{
+  if (!OrderFaces() || !CopyFaces() || !RemapLeafFaces())
+    return false;
+
+  MergeLightmaps();
+  RemapModels();
+
+  std::vector<u32> identity(m_in_faces.size());
+  for (u32 i = 0; i < u32(identity.size()); i++)
+    identity[i] = i;
+  m_locality_before = MeasureLocality(m_in_faces, identity);
+  m_locality_after = MeasureLocality(m_faces, m_face_remap);
+  return true;
+}
+
+bool MapOptimizer::OrderFaces()
+{
+  // Each model's faces must stay contiguous, so a face can only belong to one.
+  const u32 num_faces = u32(m_in_faces.size());
+  std::vector<s32> face_model(num_faces, -1);
+  for (u32 i = 0; i < u32(m_bsp->GetModelCount()); i++)
+  {
+    for (const u32 face_index : m_bsp->GetModel(i)->faces)
+    {
+      if (face_model[face_index] >= 0)
+      {
+        std::fprintf(stderr, "Face %u is in models %d and %u, can't reorder\n", face_index, face_model[face_index], i);
+        return false;
+      }
+
+      face_model[face_index] = s32(i);
+    }
+  }
+
+  static constexpr u32 UNPLACED = 0xFFFFFFFFu;
+  m_face_remap.assign(num_faces, UNPLACED);
+  m_face_order.clear();
+  m_face_order.reserve(num_faces);
+  auto Place = [this](u32 face_index) {
+    if (m_face_remap[face_index] != UNPLACED)
+      return;
+
+    m_face_remap[face_index] = u32(m_face_order.size());
+    m_face_order.push_back(face_index);
+  };
+
+  // World faces go in the order the leaves reference them, which q3map numbers depth first. Faces in several leaves
+  // go with the first. Brush models aren't in the leaves, so keep their own order.
+  for (u32 i = 0; i < u32(m_bsp->GetModelCount()); i++)
+  {
+    if (i == 0)
+    {
+      for (const BSP::Leaf& leaf : m_bsp->GetLeaves())
+      {
+        for (const u32 face_index : leaf.faces)
+        {
+          if (face_model[face_index] == 0)
+            Place(face_index);
+        }
+      }
+    }
+
+    for (const u32 face_index : m_bsp->GetModel(i)->faces)
+      Place(face_index);
+  }
+
+  for (u32 i = 0; i < num_faces; i++)
+    Place(i);
+
+  return true;
+}
+
+BSP_VERTEX_LUMP MapOptimizer::MakeVertex(const BSP::Vertex& vertex)
+{
+  BSP_VERTEX_LUMP out;
+  std::memcpy(out.position, &vertex.position, sizeof(out.position));
+  std::memcpy(out.texcoords[0], &vertex.texcoords[0], sizeof(out.texcoords[0]));
+  std::memcpy(out.texcoords[1], &vertex.texcoords[1], sizeof(out.texcoords[1]));
+  std::memcpy(out.normal, &vertex.normal, sizeof(out.normal));
+  std::memcpy(out.color, vertex.color_components, sizeof(out.color));
+  return out;
+}
+
+bool MapOptimizer::CopyFaces()
+{
+  // Faces with exactly the same range share the copy. Any other overlap is copied per face.
+  auto RangeKey = [](int first, int count) { return (u64(u32(first)) << 32) | u64(u32(count)); };
+  std::unordered_map<u64, int> vertex_ranges;
+  std::unordered_map<u64, int> mesh_vertex_ranges;
+
+  m_faces.reserve(m_face_order.size());
+  for (const u32 old_index : m_face_order)
+  {
+    const BSP_FACE_LUMP& in = m_in_faces[old_index];
+    const BSP::Face* loaded = m_bsp->GetFace(old_index);
+    BSP_FACE_LUMP out = in;
+
+    if (m_options.tesselate_patches && in.type == BSP::FACE_TYPE_PATCH && loaded->num_indices > 0)
+    {
+      out.type = BSP::FACE_TYPE_MESH;
+      out.patch_size[0] = 0;
+      out.patch_size[1] = 0;
+      out.first_vertex = int(m_vertices.size());
+      out.num_vertices = loaded->num_vertices;
+      out.first_mesh_vertex = int(m_mesh_vertices.size());
+      out.num_mesh_vertices = loaded->num_indices;
+      for (int i = 0; i < loaded->num_vertices; i++)
+        m_vertices.push_back(MakeVertex(*m_bsp->GetVertex(size_t(loaded->base_vertex + i))));
+      for (int i = 0; i < loaded->num_indices; i++)
+        m_mesh_vertices.push_back(int(m_bsp->GetIndex(size_t(loaded->base_index + i))));
+
+      m_num_tesselated_patches++;
+      m_faces.push_back(out);
+      continue;
+    }
+
+    auto vit = vertex_ranges.find(RangeKey(in.first_vertex, in.num_vertices));
+    if (vit != vertex_ranges.end())
+    {
+      out.first_vertex = vit->second;
+      m_num_shared_vertex_ranges++;
+    }
+    else
+    {
+      out.first_vertex = int(m_vertices.size());
+      m_vertices.insert(m_vertices.end(), m_in_vertices.begin() + in.first_vertex,
+                        m_in_vertices.begin() + in.first_vertex + in.num_vertices);
+      if (in.num_vertices > 0)
+        vertex_ranges.emplace(RangeKey(in.first_vertex, in.num_vertices), out.first_vertex);
+    }
+
+    // Load() checked the mesh vertex range.
+    auto mit = mesh_vertex_ranges.find(RangeKey(in.first_mesh_vertex, in.num_mesh_vertices));
+    if (mit != mesh_vertex_ranges.end())
+    {
+      out.first_mesh_vertex = mit->second;
+    }
+    else
+    {
+      out.first_mesh_vertex = int(m_mesh_vertices.size());
+      m_mesh_vertices.insert(m_mesh_vertices.end(), m_in_mesh_vertices.begin() + in.first_mesh_vertex,
+                             m_in_mesh_vertices.begin() + in.first_mesh_vertex + in.num_mesh_vertices);
+      if (in.num_mesh_vertices > 0)
+        mesh_vertex_ranges.emplace(RangeKey(in.first_mesh_vertex, in.num_mesh_vertices), out.first_mesh_vertex);
+    }
+
+    m_faces.push_back(out);
+  }
+
+  if (m_vertices.size() > size_t(std::numeric_limits<int>::max() / sizeof(BSP_VERTEX_LUMP)))
+  {
+    std::fprintf(stderr, "Too many vertices after tesselation\n");
+    return false;
+  }
+
+  return true;
+}
+
+void MapOptimizer::MergeLightmaps()
+{
+  // Pages are numbered in order of first use, so faces near each other in the file use pages near each other.
+  auto HashPage = [](const BSP::LightMap& page) {
+    const u8* data = &page.data[0][0][0];
+    u64 hash = 14695981039346656037ull;
+    for (size_t i = 0; i < sizeof(page.data); i++)
+      hash = (hash ^ data[i]) * 1099511628211ull;
+    return hash;
+  };
+
+  static constexpr int UNMAPPED = -1;
+  std::vector<int> page_remap(m_bsp->GetLightMapCount(), UNMAPPED);
+  std::unordered_multimap<u64, int> pages_by_hash;
+  for (BSP_FACE_LUMP& face : m_faces)
+  {
+    if (face.lightmap_index < 0)
+      continue;
+
+    int& new_index = page_remap[face.lightmap_index];
+    if (new_index == UNMAPPED)
+    {
+      const BSP::LightMap& page = *m_bsp->GetLightMap(size_t(face.lightmap_index));
+      const u64 hash = HashPage(page);
+      const auto range = pages_by_hash.equal_range(hash);
+      for (auto it = range.first; it != range.second; ++it)
+      {
+        if (std::memcmp(m_lightmaps[it->second].data, page.data, sizeof(page.data)) == 0)
+        {
+          new_index = it->second;
+          break;
+        }
+      }
+
+      if (new_index == UNMAPPED)
+      {
+        new_index = int(m_lightmaps.size());
+        m_lightmaps.push_back(page);
+        pages_by_hash.emplace(hash, new_index);
+      }
+    }
+
+    face.lightmap_index = new_index;
+  }
+}
+
+bool MapOptimizer::RemapLeafFaces()
+{
+  // The leaves' ranges into the list don't change, only the face indices in it.
+  m_leaf_faces.resize(m_in_leaf_faces.size());
+  for (size_t i = 0; i < m_in_leaf_faces.size(); i++)
+  {
+    const int old_index = m_in_leaf_faces[i];
+    if (old_index < 0 || size_t(old_index) >= m_face_remap.size())
+    {
+      std::fprintf(stderr, "Leaf face %u is out of range\n", u32(i));
+      return false;
+    }
+
+    m_leaf_faces[i] = int(m_face_remap[old_index]);
+  }
+
+  return true;
+}
+
+void MapOptimizer::RemapModels()
+{
+  m_models = m_in_models;
+  for (BSP_MODEL_LUMP& model : m_models)
+  {
+    if (model.num_faces == 0)
+      continue;
+
+    // The faces are still contiguous, but may start elsewhere.
+    u32 first_face = m_face_remap[model.first_face];
+    for (int i = 1; i < model.num_faces; i++)
+      first_face = std::min(first_face, m_face_remap[model.first_face + i]);
+    model.first_face = int(first_face);
+  }
+}
+
+MapOptimizer::Locality MapOptimizer::MeasureLocality(const std::vector<BSP_FACE_LUMP>& faces,
+                                                     const std::vector<u32>& face_remap) const
+{
+  u64 total_pages = 0;
+  u64 total_face_span = 0;
+  u32 num_leaves = 0;
+  std::vector<u32> pages;
+  for (const BSP::Leaf& leaf : m_bsp->GetLeaves())
+  {
+    if (leaf.faces.empty())
+      continue;
+
+    pages.clear();
+    u32 min_face = face_remap[leaf.faces[0]];
+    u32 max_face = min_face;
+    for (const u32 old_index : leaf.faces)
+    {
+      const u32 face_index = face_remap[old_index];
+      min_face = std::min(min_face, face_index);
+      max_face = std::max(max_face, face_index);
+
+      const BSP_FACE_LUMP& face = faces[face_index];
+      if (face.num_vertices <= 0)
+        continue;
+
+      const u64 first_byte = u64(face.first_vertex) * sizeof(BSP_VERTEX_LUMP);
+      const u64 last_byte = first_byte + u64(face.num_vertices) * sizeof(BSP_VERTEX_LUMP) - 1;
+      for (u64 page = first_byte / PAGE_SIZE; page <= last_byte / PAGE_SIZE; page++)
+        pages.push_back(u32(page));
+    }
+
+    std::sort(pages.begin(), pages.end());
+    total_pages += u64(std::unique(pages.begin(), pages.end()) - pages.begin());
+    total_face_span += u64(max_face - min_face + 1);
+    num_leaves++;
+  }
+
+  Locality locality = {};
+  if (num_leaves > 0)
+  {
+    locality.vertex_pages_per_leaf = float(double(total_pages) / double(num_leaves));
+    locality.face_span_per_leaf = float(double(total_face_span) / double(num_leaves));
+  }
+
+  return locality;
+}
+
+bool MapOptimizer::Write(std::FILE* src_fp, std::FILE* dst_fp) const
+{
+  static_assert(sizeof(BSP::LightMap) == sizeof(BSP_LIGHTMAP_LUMP), "lightmap pages are copied directly");
+  const BSP::LumpReplacement replacements[] = {
+    {BSP::LUMP_FACES, m_faces.data(), u32(m_faces.size() * sizeof(BSP_FACE_LUMP))},
+    {BSP::LUMP_VERTICES, m_vertices.data(), u32(m_vertices.size() * sizeof(BSP_VERTEX_LUMP))},
+    {BSP::LUMP_MESH_VERTICES, m_mesh_vertices.data(), u32(m_mesh_vertices.size() * sizeof(int))},
+    {BSP::LUMP_LIGHTMAPS, m_lightmaps.data(), u32(m_lightmaps.size() * sizeof(BSP_LIGHTMAP_LUMP))},
+    {BSP::LUMP_LEAF_FACES, m_leaf_faces.data(), u32(m_leaf_faces.size() * sizeof(int))},
+    {BSP::LUMP_MODELS, m_models.data(), u32(m_models.size() * sizeof(BSP_MODEL_LUMP))}};
+
+  return BSP::CopyWithReplacedLumps(src_fp, dst_fp, replacements, u32(ARRAY_SIZE(replacements)));
+}
+
+void MapOptimizer::PrintReport() const
+{
+  auto PrintCount = [](const char* name, size_t before, size_t after, size_t element_size) {
+    const double change = (before > 0) ? (100.0 * (double(after) - double(before)) / double(before)) : 0.0;
+    std::printf("  %-14s %10u -> %10u  (%+.1f%%, %.2f -> %.2f MB)\n", name, u32(before), u32(after), change,
+                double(before * element_size) / 1048576.0, double(after * element_size) / 1048576.0);
+  };
+
+  std::printf("Contents:\n");
+  PrintCount("vertices", m_in_vertices.size(), m_vertices.size(), sizeof(BSP_VERTEX_LUMP));
+  PrintCount("mesh vertices", m_in_mesh_vertices.size(), m_mesh_vertices.size(), sizeof(int));
+  PrintCount("lightmaps", m_bsp->GetLightMapCount(), m_lightmaps.size(), sizeof(BSP_LIGHTMAP_LUMP));
+  std::printf("  %u faces reordered, %u share another face's vertices, %u patches tesselated\n",
+              u32(m_faces.size()), m_num_shared_vertex_ranges, m_num_tesselated_patches);
+
+  std::printf("Locality, per leaf with faces:\n");
+  std::printf("  vertex pages   %10.2f -> %10.2f\n", m_locality_before.vertex_pages_per_leaf,
+              m_locality_after.vertex_pages_per_leaf);
+  std::printf("  face span      %10.2f -> %10.2f\n", m_locality_before.face_span_per_leaf,
+              m_locality_after.face_span_per_leaf);
+}
+
+static u64 CountTriangles(const BSP& bsp)
+{
+  u64 count = 0;
+  for (const BSP::Face& face : bsp.GetFaces())
+    count += u64(std::max(face.num_indices, 0) / 3);
+  return count;
+}
+
+static void PrintUsage(const char* program_name)
+{
+  std::fprintf(stderr, "Usage: %s [options] <input.bsp> <output.bsp>\n", program_name);
+  std::fprintf(stderr, "Options:\n");
+  std::fprintf(stderr, "  --tesselate  Replace patches with triangle meshes. They will no longer collide.\n");
+}
+
+int main(int argc, char* argv[])
+{
+  MapOptimizer::Options options;
+  const char* filenames[2] = {};
+  u32 num_filenames = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    if (std::strcmp(argv[i], "--tesselate") == 0)
+    {
+      options.tesselate_patches = true;
+    }
+    else if (argv[i][0] == '-' || num_filenames == ARRAY_SIZE(filenames))
+    {
+      PrintUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    else
+    {
+      filenames[num_filenames++] = argv[i];
+    }
+  }
+
+  if (num_filenames != ARRAY_SIZE(filenames))
+  {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  auto src_fp = Util::FOpenUniquePtr(filenames[0], "rb");
+  if (!src_fp)
+  {
+    std::fprintf(stderr, "Failed to open '%s'\n", filenames[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::unique_ptr<BSP> bsp = BSP::Load(src_fp.get());
+  if (!bsp)
+    return EXIT_FAILURE;
+
+  MapOptimizer optimizer(bsp.get(), options);
+  if (!optimizer.ReadLumps(src_fp.get()) || !optimizer.Optimize())
+    return EXIT_FAILURE;
+
+  {
+    auto dst_fp = Util::FOpenUniquePtr(filenames[1], "wb");
+    if (!dst_fp)
+    {
+      std::fprintf(stderr, "Failed to open '%s' for writing\n", filenames[1]);
+      return EXIT_FAILURE;
+    }
+
+    if (!optimizer.Write(src_fp.get(), dst_fp.get()))
+      return EXIT_FAILURE;
+  }
+
+  // Make sure the result loads, and nothing was lost.
+  auto check_fp = Util::FOpenUniquePtr(filenames[1], "rb");
+  std::unique_ptr<BSP> check_bsp = check_fp ? BSP::Load(check_fp.get()) : nullptr;
+  if (!check_bsp)
+  {
+    std::fprintf(stderr, "Failed to reload '%s'\n", filenames[1]);
+    return EXIT_FAILURE;
+  }
+
+  const u64 triangles_before = CountTriangles(*bsp);
+  const u64 triangles_after = CountTriangles(*check_bsp);
+  if (check_bsp->GetFaceCount() != bsp->GetFaceCount() || triangles_after != triangles_before)
+  {
+    std::fprintf(stderr, "'%s' doesn't match the input: %u faces/%llu triangles, expected %u/%llu\n", filenames[1],
+                 u32(check_bsp->GetFaceCount()), static_cast<unsigned long long>(triangles_after),
+                 u32(bsp->GetFaceCount()), static_cast<unsigned long long>(triangles_before));
+    return EXIT_FAILURE;
+  }
+
+  std::fseek(src_fp.get(), 0, SEEK_END);
+  std::fseek(check_fp.get(), 0, SEEK_END);
+  const long size_before = std::ftell(src_fp.get());
+  const long size_after = std::ftell(check_fp.get());
+
+  std::printf("\n");
+  optimizer.PrintReport();
+  std::printf("File size: %.2f -> %.2f MB (%+.1f%%)\n", double(size_before) / 1048576.0,
+              double(size_after) / 1048576.0,
+              (size_before > 0) ? (100.0 * double(size_after - size_before) / double(size_before)) : 0.0);
+  return EXIT_SUCCESS;
+}